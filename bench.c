@@ -0,0 +1,1211 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "bench.h"
+#include "bios.h"
+
+/*
+	The amount of data moved for each measurement is proportional to the
+	write size, but bounded so that small writes finish quickly and large
+	writes still run long enough to be timed.
+ */
+#define BENCH_MIN_BYTES (1u<<20)
+#define BENCH_MAX_BYTES (1u<<26)
+#define BENCH_MAX_WSIZE (1u<<16)
+
+static size_t bench_volume(unsigned int wsize)
+{
+	size_t total = (size_t)wsize << 14;
+	if(total < BENCH_MIN_BYTES) total = BENCH_MIN_BYTES;
+	if(total > BENCH_MAX_BYTES) total = BENCH_MAX_BYTES;
+	return total;
+}
+
+static unsigned int bench_arg(size_t argc, const char** argv, size_t i, unsigned int dflt)
+{
+	if(argc <= i) return dflt;
+	int v = atoi(argv[i]);
+	return (v > 0) ? (unsigned int) v : dflt;
+}
+
+/* The number of context switches since boot, on all cores */
+static unsigned long bench_switches()
+{
+	schedinfo si;
+	Fid_t fid = OpenKernelStats(KSTAT_SCHED);
+	if(fid == NOFILE) return 0;
+	if(Read(fid, (char*)&si, sizeof(si)) != sizeof(si)) si.switches = 0;
+	Close(fid);
+	return si.switches;
+}
+
+static void bench_report(const char* name, unsigned int wsize, size_t bytes, uint64_t ns, unsigned long switches)
+{
+	double mbps = (ns > 0) ? ((double)bytes * 1e3) / ((double)ns * 1.048576) : 0.0;
+	printf("%s wsize=%u bytes=%zu ns=%llu MBps=%.1f switches=%lu\n",
+		name, wsize, bytes, (unsigned long long) ns, mbps, switches);
+}
+
+
+/*
+	Pipe throughput
+ */
+
+struct pipe_writer_args {
+	Fid_t fid;
+	unsigned int wsize;
+	size_t total;
+};
+
+static char bench_wbuf[BENCH_MAX_WSIZE];
+
+static int pipe_bench_writer(int argl, void* args)
+{
+	struct pipe_writer_args* wa = args;
+	size_t sent = 0;
+	while(sent < wa->total) {
+		size_t chunk = wa->total - sent;
+		int rc = Write(wa->fid, bench_wbuf, (chunk < wa->wsize) ? chunk : wa->wsize);
+		if(rc <= 0) break;
+		sent += rc;
+	}
+	Close(wa->fid);
+	return 0;
+}
+
+static int pipe_bench_run(unsigned int wsize, int capacity, unsigned int rcvlowat)
+{
+	static char rbuf[BENCH_MAX_WSIZE];
+	pipe_t pipe;
+
+	if((capacity < 0 ? Pipe(&pipe) : PipeEx(&pipe, capacity)) == -1) return -1;
+	if(rcvlowat && SetStreamOption(pipe.read, STREAM_RCVLOWAT, rcvlowat) == -1) return -1;
+
+	struct pipe_writer_args wa = { pipe.write, wsize, bench_volume(wsize) };
+	size_t received = 0;
+	int rc;
+
+	unsigned long switches = bench_switches();
+	uint64_t start = bios_clock_ns();
+	Tid_t writer = CreateThread(pipe_bench_writer, sizeof(wa), &wa);
+	while((rc = Read(pipe.read, rbuf, sizeof(rbuf))) > 0)
+		received += rc;
+	uint64_t elapsed = bios_clock_ns() - start;
+	switches = bench_switches() - switches;
+
+	ThreadJoin(writer, NULL);
+	Close(pipe.read);
+
+	bench_report("pipe", wsize, received, elapsed, switches);
+	return (received == wa.total) ? 0 : -1;
+}
+
+int PipeBench(size_t argc, const char** argv)
+{
+	unsigned int minsize = bench_arg(argc, argv, 1, 1);
+	unsigned int maxsize = bench_arg(argc, argv, 2, BENCH_MAX_WSIZE);
+	int capacity = (argc > 3) ? atoi(argv[3]) : -1;
+	unsigned int rcvlowat = bench_arg(argc, argv, 4, 0);
+	if(maxsize > BENCH_MAX_WSIZE) maxsize = BENCH_MAX_WSIZE;
+
+	for(unsigned int wsize = minsize; wsize <= maxsize; wsize <<= 1)
+		if(pipe_bench_run(wsize, capacity, rcvlowat) == -1) {
+			printf("pipe wsize=%u failed\n", wsize);
+			return 1;
+		}
+	return 0;
+}
+
+
+/*
+	Relay throughput. A writer thread feeds pipe A, a relay thread forwards
+	A to pipe B, and the calling thread drains B. The relay either copies
+	through a user buffer, with Read and Write, or calls Splice.
+ */
+
+struct relay_args {
+	Fid_t in, out;
+	unsigned int chunk;
+	int splice;
+};
+
+static int relay_bench_relay(int argl, void* args)
+{
+	static char buf[BENCH_MAX_WSIZE];
+	struct relay_args* ra = args;
+	int rc;
+
+	if(ra->splice) {
+		while((rc = Splice(ra->in, ra->out, ra->chunk)) > 0);
+	} else {
+		while((rc = Read(ra->in, buf, ra->chunk)) > 0)
+			for(int done = 0; done < rc; ) {
+				int w = Write(ra->out, buf + done, rc - done);
+				if(w <= 0) break;
+				done += w;
+			}
+	}
+	Close(ra->out);
+	return 0;
+}
+
+static int relay_bench_run(unsigned int chunk, int splice)
+{
+	static char rbuf[BENCH_MAX_WSIZE];
+	pipe_t a, b;
+
+	if(Pipe(&a) == -1) return -1;
+	if(Pipe(&b) == -1) return -1;
+
+	struct pipe_writer_args wa = { a.write, BENCH_MAX_WSIZE, bench_volume(chunk) };
+	struct relay_args ra = { a.read, b.write, chunk, splice };
+	size_t received = 0;
+	int rc;
+
+	unsigned long switches = bench_switches();
+	uint64_t start = bios_clock_ns();
+	Tid_t writer = CreateThread(pipe_bench_writer, sizeof(wa), &wa);
+	Tid_t relay = CreateThread(relay_bench_relay, sizeof(ra), &ra);
+	while((rc = Read(b.read, rbuf, sizeof(rbuf))) > 0)
+		received += rc;
+	uint64_t elapsed = bios_clock_ns() - start;
+	switches = bench_switches() - switches;
+
+	ThreadJoin(writer, NULL);
+	ThreadJoin(relay, NULL);
+	Close(a.read);
+	Close(b.read);
+
+	bench_report(splice ? "relay_splice" : "relay_copy", chunk, received, elapsed, switches);
+	return (received == wa.total) ? 0 : -1;
+}
+
+int RelayBench(size_t argc, const char** argv)
+{
+	unsigned int minsize = bench_arg(argc, argv, 1, 1024);
+	unsigned int maxsize = bench_arg(argc, argv, 2, BENCH_MAX_WSIZE);
+	if(maxsize > BENCH_MAX_WSIZE) maxsize = BENCH_MAX_WSIZE;
+
+	for(unsigned int chunk = minsize; chunk <= maxsize; chunk <<= 1)
+		for(int splice = 0; splice <= 1; splice++)
+			if(relay_bench_run(chunk, splice) == -1) {
+				printf("relay wsize=%u failed\n", chunk);
+				return 1;
+			}
+	return 0;
+}
+
+
+/*
+	Message throughput. A writer thread sends fixed-size messages through
+	a pipe, and the calling thread receives them one by one. In the stream
+	modes each message is framed by a length header, and the receiver 
+	reassembles it with reads of exact size, as in the remote shell protocol.
+	The header and the payload go out in one Write from a copy (stream), in
+	two Writes (split), or in one WriteV of two segments (writev). In 
+	message mode each message is one Write and one Read.
+ */
+
+#define BENCH_MAX_MSG 4096
+
+enum { MSG_STREAM, MSG_SPLIT, MSG_WRITEV, MSG_MESSAGE, MSG_MODES };
+static const char* msg_mode_name[MSG_MODES] = { "stream", "split", "writev", "message" };
+
+struct msg_writer_args {
+	Fid_t fid;
+	unsigned int size;
+	unsigned long count;
+	int mode;
+};
+
+/* Write exactly len bytes to a byte stream */
+static int msg_bench_write_exact(Fid_t fid, const char* buf, unsigned int len)
+{
+	for(unsigned int done = 0; done < len; ) {
+		int rc = Write(fid, buf + done, len - done);
+		if(rc <= 0) return 0;
+		done += rc;
+	}
+	return 1;
+}
+
+static int msg_bench_send(struct msg_writer_args* wa, char* buf)
+{
+	unsigned int hdr = sizeof(unsigned int);
+	switch(wa->mode) {
+		case MSG_MESSAGE:
+			return Write(wa->fid, buf + hdr, wa->size) == (int) wa->size;
+		case MSG_SPLIT:
+			return msg_bench_write_exact(wa->fid, buf, hdr) 
+				&& msg_bench_write_exact(wa->fid, buf + hdr, wa->size);
+		case MSG_WRITEV: {
+			iovec_t iov[2] = { { buf, hdr }, { buf + hdr, wa->size } };
+			int rc = WriteV(wa->fid, iov, 2);
+			return rc > 0 && msg_bench_write_exact(wa->fid, buf + rc, hdr + wa->size - rc);
+		}
+		default:
+			return msg_bench_write_exact(wa->fid, buf, hdr + wa->size);
+	}
+}
+
+static int msg_bench_writer(int argl, void* args)
+{
+	static char buf[sizeof(unsigned int) + BENCH_MAX_MSG];
+	struct msg_writer_args* wa = args;
+
+	/* The header is followed by the payload */
+	memcpy(buf, &wa->size, sizeof(unsigned int));
+
+	for(unsigned long i = 0; i < wa->count; i++)
+		if(! msg_bench_send(wa, buf)) break;
+
+	Close(wa->fid);
+	return 0;
+}
+
+/* Read exactly len bytes from a byte stream */
+static int msg_bench_read_exact(Fid_t fid, char* buf, unsigned int len)
+{
+	for(unsigned int done = 0; done < len; ) {
+		int rc = Read(fid, buf + done, len - done);
+		if(rc <= 0) return 0;
+		done += rc;
+	}
+	return 1;
+}
+
+static int msg_bench_run(unsigned int size, int mode, int capacity)
+{
+	static char buf[BENCH_MAX_MSG];
+	pipe_t pipe;
+
+	if((capacity < 0 ? Pipe(&pipe) : PipeEx(&pipe, capacity)) == -1) return -1;
+	if(mode == MSG_MESSAGE && SetStreamOption(pipe.read, STREAM_MESSAGE, 1) == -1) return -1;
+
+	struct msg_writer_args wa = { pipe.write, size, bench_volume(size) / size, mode };
+	unsigned long received = 0;
+
+	unsigned long switches = bench_switches();
+	uint64_t start = bios_clock_ns();
+	Tid_t writer = CreateThread(msg_bench_writer, sizeof(wa), &wa);
+	if(mode == MSG_MESSAGE) {
+		while(Read(pipe.read, buf, sizeof(buf)) == (int) size)
+			received++;
+	} else {
+		unsigned int len;
+		while(msg_bench_read_exact(pipe.read, (char*) &len, sizeof(len)) 
+				&& len == size && msg_bench_read_exact(pipe.read, buf, len))
+			received++;
+	}
+	uint64_t elapsed = bios_clock_ns() - start;
+	switches = bench_switches() - switches;
+
+	ThreadJoin(writer, NULL);
+	Close(pipe.read);
+
+	double msgps = (elapsed > 0) ? (double) received * 1e9 / (double) elapsed : 0.0;
+	printf("msg mode=%s size=%u msgs=%lu ns=%llu msgps=%.0f switches=%lu\n",
+		msg_mode_name[mode], size, received, 
+		(unsigned long long) elapsed, msgps, switches);
+	return (received == wa.count) ? 0 : -1;
+}
+
+int MsgBench(size_t argc, const char** argv)
+{
+	unsigned int minsize = bench_arg(argc, argv, 1, 16);
+	unsigned int maxsize = bench_arg(argc, argv, 2, BENCH_MAX_MSG);
+	int capacity = (argc > 3) ? atoi(argv[3]) : -1;
+	if(maxsize > BENCH_MAX_MSG) maxsize = BENCH_MAX_MSG;
+
+	for(unsigned int size = minsize; size <= maxsize; size <<= 1)
+		for(int mode = 0; mode < MSG_MODES; mode++)
+			if(msg_bench_run(size, mode, capacity) == -1) {
+				printf("msg size=%u failed\n", size);
+				return 1;
+			}
+	return 0;
+}
+
+
+/*
+	Connection serving. Client processes open connections to a server, and
+	make a number of request/response round trips on each. The server is
+	either a single thread, which multiplexes the listener and all the open
+	connections with a poll set, or a thread per connection, as the remote
+	server of the shell does. Each process has only MAX_FILEID file ids, so 
+	the open connections are bounded by them; the clients are spawned before
+	the server opens any connection, and they close the fids they inherit.
+ */
+
+#define CONN_BENCH_PORT 400
+#define CONN_BENCH_REQSIZE 64
+
+/* Connect may time out, if the server is slow to accept */
+#define CONN_BENCH_TIMEOUT 1000000
+#define CONN_BENCH_RETRIES 100
+
+struct conn_client_args {
+	unsigned int conns;    /* connections to make */
+	unsigned int reqs;     /* round trips per connection */
+	Fid_t lsock, pset;     /* the inherited server fids */
+};
+
+static int conn_bench_client(int argl, void* args)
+{
+	struct conn_client_args* ca = args;
+	char buf[CONN_BENCH_REQSIZE];
+
+	Close(ca->lsock);
+	Close(ca->pset);
+	memset(buf, 'r', sizeof(buf));
+
+	for(unsigned int c = 0; c < ca->conns; c++) {
+		Fid_t sock = Socket(NOPORT);
+		if(sock == NOFILE) return 1;
+
+		int retries = 0;
+		while(Connect(sock, CONN_BENCH_PORT, CONN_BENCH_TIMEOUT) == -1)
+			if(++retries == CONN_BENCH_RETRIES) return 1;
+
+		for(unsigned int r = 0; r < ca->reqs; r++) {
+			if(Write(sock, buf, sizeof(buf)) != sizeof(buf)) return 1;
+			if(! msg_bench_read_exact(sock, buf, sizeof(buf))) return 1;
+		}
+		Close(sock);
+	}
+	return 0;
+}
+
+/* One thread serves all connections */
+static unsigned long conn_bench_poll_server(Fid_t lsock, Fid_t pset, unsigned int conns)
+{
+	char buf[CONN_BENCH_REQSIZE];
+	pollfd ready[MAX_FILEID];
+	unsigned long reqs = 0;
+	unsigned int served = 0;
+
+	SetNonBlocking(lsock, 1);
+	PollSetControl(pset, lsock, POLL_READABLE);
+
+	while(served < conns) {
+		int n = PollSetWait(pset, ready, MAX_FILEID, POLL_FOREVER);
+		if(n <= 0) break;
+
+		for(int i = 0; i < n; i++) {
+			Fid_t fd = ready[i].fd;
+			if(fd == lsock) {
+				Fid_t c[MAX_FILEID];
+				int k;
+				while((k = AcceptMany(lsock, c, MAX_FILEID)) > 0)
+					for(int j = 0; j < k; j++)
+						PollSetControl(pset, c[j], POLL_READABLE);
+				/* Out of fids: stop accepting, until a connection closes */
+				if(k == -1) PollSetControl(pset, lsock, 0);
+				continue;
+			}
+
+			int rc = Read(fd, buf, sizeof(buf));
+			if(rc > 0 && Write(fd, buf, rc) == rc) {
+				reqs++;
+				continue;
+			}
+			Close(fd);
+			served++;
+			PollSetControl(pset, lsock, POLL_READABLE);
+		}
+	}
+	return reqs;
+}
+
+/* A thread per connection */
+static struct {
+	Mutex mx;
+	CondVar done;
+	unsigned int served;
+	unsigned long reqs;
+} conn_threads;
+
+static int conn_bench_handler(int argl, void* args)
+{
+	Fid_t fd = argl;
+	char buf[CONN_BENCH_REQSIZE];
+	unsigned long reqs = 0;
+	int rc;
+
+	while((rc = Read(fd, buf, sizeof(buf))) > 0 && Write(fd, buf, rc) == rc)
+		reqs++;
+	Close(fd);
+
+	Mutex_Lock(&conn_threads.mx);
+	conn_threads.served++;
+	conn_threads.reqs += reqs;
+	Cond_Broadcast(&conn_threads.done);
+	Mutex_Unlock(&conn_threads.mx);
+	return 0;
+}
+
+static unsigned long conn_bench_thread_server(Fid_t lsock, unsigned int conns)
+{
+	conn_threads.mx = MUTEX_INIT;
+	conn_threads.done = COND_INIT;
+	conn_threads.served = 0;
+	conn_threads.reqs = 0;
+
+	for(unsigned int c = 0; c < conns; ) {
+		Fid_t fd = Accept(lsock);
+		if(fd != NOFILE) {
+			ThreadDetach(CreateThread(conn_bench_handler, fd, NULL));
+			c++;
+			continue;
+		}
+
+		/* Out of fids: wait until a handler closes its connection */
+		Mutex_Lock(&conn_threads.mx);
+		unsigned int served = conn_threads.served;
+		while(conn_threads.served == served && served < c)
+			Cond_Wait(&conn_threads.mx, &conn_threads.done);
+		Mutex_Unlock(&conn_threads.mx);
+		if(served == c) return conn_threads.reqs;
+	}
+
+	Mutex_Lock(&conn_threads.mx);
+	while(conn_threads.served < conns)
+		Cond_Wait(&conn_threads.mx, &conn_threads.done);
+	Mutex_Unlock(&conn_threads.mx);
+	return conn_threads.reqs;
+}
+
+static int conn_bench_run(int poll, unsigned int conns, unsigned int clients, unsigned int reqs)
+{
+	Fid_t lsock = Socket(CONN_BENCH_PORT);
+	if(lsock == NOFILE || Listen(lsock) == -1) return -1;
+	Fid_t pset = OpenPollSet();
+	if(pset == NOFILE) return -1;
+
+	unsigned long switches = bench_switches();
+	uint64_t start = bios_clock_ns();
+
+	for(unsigned int i = 0; i < clients; i++) {
+		struct conn_client_args ca = { conns/clients + (i < conns%clients), reqs, lsock, pset };
+		if(Exec(conn_bench_client, sizeof(ca), &ca) == NOPROC) return -1;
+	}
+
+	unsigned long served_reqs = poll 
+		? conn_bench_poll_server(lsock, pset, conns) 
+		: conn_bench_thread_server(lsock, conns);
+
+	int failed = 0, status;
+	for(unsigned int i = 0; i < clients; i++)
+		if(WaitChild(NOPROC, &status) == NOPROC || status != 0) failed = 1;
+
+	uint64_t elapsed = bios_clock_ns() - start;
+	switches = bench_switches() - switches;
+
+	Close(pset);
+	Close(lsock);
+
+	double connps = (elapsed > 0) ? (double) conns * 1e9 / (double) elapsed : 0.0;
+	double reqps = (elapsed > 0) ? (double) served_reqs * 1e9 / (double) elapsed : 0.0;
+	printf("conn mode=%s conns=%u clients=%u reqs=%lu ns=%llu connps=%.0f reqps=%.0f switches=%lu\n",
+		poll ? "poll" : "threads", conns, clients, served_reqs,
+		(unsigned long long) elapsed, connps, reqps, switches);
+	return (!failed && served_reqs == (unsigned long) conns * reqs) ? 0 : -1;
+}
+
+int ConnBench(size_t argc, const char** argv)
+{
+	unsigned int conns = bench_arg(argc, argv, 1, 1000);
+	unsigned int clients = bench_arg(argc, argv, 2, 8);
+	unsigned int reqs = bench_arg(argc, argv, 3, 16);
+
+	/* Leave fids for stdio, the listener and the poll set */
+	if(clients > MAX_FILEID-4) clients = MAX_FILEID-4;
+	if(clients > conns) clients = conns;
+
+	for(int poll = 1; poll >= 0; poll--)
+		if(conn_bench_run(poll, conns, clients, reqs) == -1) {
+			printf("conn mode=%s failed\n", poll ? "poll" : "threads");
+			return 1;
+		}
+	return 0;
+}
+
+
+/*
+	Channel setup. A channel is a pair of connected sockets, made either by
+	a listener, with Socket, Connect and Accept, or by SocketPair. Each
+	channel is closed as soon as it is made, so the measurement includes
+	the teardown of both ends.
+ */
+
+#define CHAN_BENCH_PORT 401
+
+static int chan_bench_acceptor(int argl, void* args)
+{
+	Fid_t lsock = *(Fid_t*) args;
+	for(int c = 0; c < argl; c++) {
+		Fid_t fd = Accept(lsock);
+		if(fd == NOFILE) return 1;
+		Close(fd);
+	}
+	return 0;
+}
+
+static int chan_bench_connect(unsigned int chans)
+{
+	Fid_t lsock = Socket(CHAN_BENCH_PORT);
+	if(lsock == NOFILE || Listen(lsock) == -1) return -1;
+
+	Tid_t acceptor = CreateThread(chan_bench_acceptor, chans, &lsock);
+	int failed = 0;
+	for(unsigned int c = 0; c < chans && !failed; c++) {
+		Fid_t sock = Socket(NOPORT);
+		if(sock == NOFILE || Connect(sock, CHAN_BENCH_PORT, CONN_BENCH_TIMEOUT) == -1)
+			failed = 1;
+		Close(sock);
+	}
+
+	/* On failure, closing the listener releases the acceptor */
+	if(failed) Close(lsock);
+	int status;
+	if(ThreadJoin(acceptor, &status) == -1 || status != 0) failed = 1;
+	if(! failed) Close(lsock);
+	return failed ? -1 : 0;
+}
+
+static int chan_bench_socketpair(unsigned int chans)
+{
+	for(unsigned int c = 0; c < chans; c++) {
+		Fid_t sock[2];
+		if(SocketPair(sock) == -1) return -1;
+		Close(sock[0]);
+		Close(sock[1]);
+	}
+	return 0;
+}
+
+int ChanBench(size_t argc, const char** argv)
+{
+	unsigned int chans = bench_arg(argc, argv, 1, 10000);
+
+	static const char* modes[] = { "connect", "socketpair" };
+	for(int m = 0; m < 2; m++) {
+		unsigned long switches = bench_switches();
+		uint64_t start = bios_clock_ns();
+
+		int rc = (m == 0) ? chan_bench_connect(chans) : chan_bench_socketpair(chans);
+
+		uint64_t elapsed = bios_clock_ns() - start;
+		switches = bench_switches() - switches;
+		if(rc == -1) {
+			printf("chan mode=%s failed\n", modes[m]);
+			return 1;
+		}
+
+		double nsper = (double) elapsed / (double) chans;
+		double chanps = (elapsed > 0) ? (double) chans * 1e9 / (double) elapsed : 0.0;
+		printf("chan mode=%s chans=%u ns=%llu nsper=%.0f chanps=%.0f switches=%lu\n",
+			modes[m], chans, (unsigned long long) elapsed, nsper, chanps, switches);
+	}
+	return 0;
+}
+
+
+/*
+	Loopback sockets. Each benchmark measures one configuration, given by
+	a message size and a number of connections, and reports it in a single
+	line that starts with the number of cores. The connections go through a
+	listener; those within one process are made by an acceptor thread, and 
+	the setup is not part of the measurement (except for the setup rate).
+	A process has MAX_FILEID fids, so the connections are capped: two fids
+	each within a process, and one each at the server of the fan-in.
+ */
+
+#define SOCK_BENCH_PORT 402
+#define SOCK_BENCH_MAX_PAIRS ((MAX_FILEID-3)/2)
+#define SOCK_BENCH_MAX_FANIN (MAX_FILEID-4)
+
+/* Round trips measured in a ping-pong run, unless given */
+#define SOCK_BENCH_ROUNDS 10000
+
+/* Parse the common arguments [<size> [<conns> [<count>]]], over their defaults */
+static void sock_bench_args(size_t argc, const char** argv, unsigned int* size, 
+	unsigned int* conns, unsigned int maxconns, unsigned int* count)
+{
+	*size = bench_arg(argc, argv, 1, *size);
+	if(*size > BENCH_MAX_WSIZE) *size = BENCH_MAX_WSIZE;
+	*conns = bench_arg(argc, argv, 2, *conns);
+	if(*conns > maxconns) *conns = maxconns;
+	*count = bench_arg(argc, argv, 3, *count);
+}
+
+static int sock_bench_acceptor(int argl, void* args)
+{
+	Fid_t* fd = args;
+	for(int c = 1; c <= argl; c++)
+		if((fd[c] = Accept(fd[0])) == NOFILE) return 1;
+	return 0;
+}
+
+/* Make n connections through a listener, storing their two ends */
+static int sock_bench_connect(unsigned int n, Fid_t* cli, Fid_t* srv)
+{
+	Fid_t fd[1+SOCK_BENCH_MAX_PAIRS];
+	if((fd[0] = Socket(SOCK_BENCH_PORT)) == NOFILE) return -1;
+	if(ListenEx(fd[0], n) == -1) { Close(fd[0]); return -1; }
+
+	Tid_t acceptor = CreateThread(sock_bench_acceptor, n, fd);
+	int failed = 0;
+	for(unsigned int c = 0; c < n; c++) {
+		cli[c] = Socket(NOPORT);
+		if(cli[c] == NOFILE || Connect(cli[c], SOCK_BENCH_PORT, CONN_BENCH_TIMEOUT) == -1)
+			failed = 1;
+	}
+	/* On failure, closing the listener releases the acceptor */
+	Close(fd[0]);
+	int status;
+	if(ThreadJoin(acceptor, &status) == -1 || status != 0) failed = 1;
+
+	for(unsigned int c = 0; c < n; c++) srv[c] = fd[1+c];
+	return failed ? -1 : 0;
+}
+
+static void sock_bench_close(unsigned int n, Fid_t* cli, Fid_t* srv)
+{
+	for(unsigned int c = 0; c < n; c++) {
+		Close(cli[c]);
+		Close(srv[c]);
+	}
+}
+
+static int bench_sample_cmp(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+	return (x > y) - (x < y);
+}
+
+/* Print the distribution of n latency samples (sorting them), as key=value pairs */
+static void bench_latencies(uint64_t* samples, size_t n)
+{
+	if(n == 0) return;
+	qsort(samples, n, sizeof(uint64_t), bench_sample_cmp);
+
+	double sum = 0.0;
+	for(size_t i = 0; i < n; i++) sum += samples[i];
+
+	static const unsigned int permille[] = { 500, 900, 990, 999 };
+	static const char* names[] = { "p50", "p90", "p99", "p999" };
+	printf(" mean=%.0f", sum / n);
+	for(int p = 0; p < 4; p++)
+		printf(" %s=%llu", names[p], (unsigned long long) samples[(n * permille[p]) / 1000]);
+	printf(" max=%llu", (unsigned long long) samples[n-1]);
+}
+
+
+/*
+	Ping-pong. A client thread per connection sends a message and waits
+	for the echo, timing each round trip.
+ */
+
+struct ping_args {
+	Fid_t fid;
+	unsigned int size, rounds;
+	uint64_t* samples;
+};
+
+static int ping_bench_echo(int argl, void* args)
+{
+	struct ping_args* pa = args;
+	char* buf = malloc(pa->size);
+	while(msg_bench_read_exact(pa->fid, buf, pa->size)
+		&& msg_bench_write_exact(pa->fid, buf, pa->size));
+	free(buf);
+	return 0;
+}
+
+static int ping_bench_client(int argl, void* args)
+{
+	struct ping_args* pa = args;
+	char* buf = malloc(pa->size);
+	memset(buf, 'p', pa->size);
+	int failed = 0;
+	for(unsigned int r = 0; r < pa->rounds && !failed; r++) {
+		uint64_t start = bios_clock_ns();
+		failed = ! (msg_bench_write_exact(pa->fid, buf, pa->size)
+			&& msg_bench_read_exact(pa->fid, buf, pa->size));
+		pa->samples[r] = bios_clock_ns() - start;
+	}
+	free(buf);
+	return failed;
+}
+
+int PingBench(size_t argc, const char** argv)
+{
+	unsigned int size = 64, conns = 1, rounds = SOCK_BENCH_ROUNDS;
+	sock_bench_args(argc, argv, &size, &conns, SOCK_BENCH_MAX_PAIRS, &rounds);
+
+	Fid_t cli[SOCK_BENCH_MAX_PAIRS], srv[SOCK_BENCH_MAX_PAIRS];
+	if(sock_bench_connect(conns, cli, srv) == -1) {
+		printf("ping failed\n");
+		return 1;
+	}
+
+	struct ping_args echo[SOCK_BENCH_MAX_PAIRS], ping[SOCK_BENCH_MAX_PAIRS];
+	Tid_t echoer[SOCK_BENCH_MAX_PAIRS], pinger[SOCK_BENCH_MAX_PAIRS];
+	uint64_t* samples = malloc((size_t) conns * rounds * sizeof(uint64_t));
+
+	unsigned long switches = bench_switches();
+	uint64_t start = bios_clock_ns();
+
+	for(unsigned int c = 0; c < conns; c++) {
+		echo[c] = (struct ping_args) { srv[c], size, rounds, NULL };
+		ping[c] = (struct ping_args) { cli[c], size, rounds, samples + (size_t) c * rounds };
+		echoer[c] = CreateThread(ping_bench_echo, 0, &echo[c]);
+		pinger[c] = CreateThread(ping_bench_client, 0, &ping[c]);
+	}
+
+	int failed = 0, status;
+	for(unsigned int c = 0; c < conns; c++)
+		if(ThreadJoin(pinger[c], &status) == -1 || status != 0) failed = 1;
+
+	uint64_t elapsed = bios_clock_ns() - start;
+	switches = bench_switches() - switches;
+
+	/* The echo threads see the end of data */
+	for(unsigned int c = 0; c < conns; c++) ShutDown(cli[c], SHUTDOWN_WRITE);
+	for(unsigned int c = 0; c < conns; c++) ThreadJoin(echoer[c], NULL);
+	sock_bench_close(conns, cli, srv);
+
+	if(failed) {
+		printf("ping failed\n");
+		free(samples);
+		return 1;
+	}
+
+	size_t n = (size_t) conns * rounds;
+	double rtps = (elapsed > 0) ? (double) n * 1e9 / (double) elapsed : 0.0;
+	printf("ping cores=%u size=%u conns=%u rounds=%zu ns=%llu rtps=%.0f",
+		cpu_cores(), size, conns, n, (unsigned long long) elapsed, rtps);
+	bench_latencies(samples, n);
+	printf(" switches=%lu\n", switches);
+	free(samples);
+	return 0;
+}
+
+
+/*
+	Bulk throughput. A writer thread per connection streams its data with
+	writes of the message size, and a reader thread drains it with large
+	reads.
+ */
+
+struct stream_args {
+	Fid_t fid;
+	unsigned int size;
+	size_t total;
+};
+
+static int stream_bench_writer(int argl, void* args)
+{
+	struct stream_args* sa = args;
+	for(size_t sent = 0; sent < sa->total; ) {
+		unsigned int n = (sa->total - sent < sa->size) ? sa->total - sent : sa->size;
+		if(! msg_bench_write_exact(sa->fid, bench_wbuf, n)) return 1;
+		sent += n;
+	}
+	ShutDown(sa->fid, SHUTDOWN_WRITE);
+	return 0;
+}
+
+static int stream_bench_reader(int argl, void* args)
+{
+	struct stream_args* sa = args;
+	char* buf = malloc(BENCH_MAX_WSIZE);
+	size_t got = 0;
+	int rc;
+	while((rc = Read(sa->fid, buf, BENCH_MAX_WSIZE)) > 0) got += rc;
+	free(buf);
+	return (rc == 0 && got == sa->total) ? 0 : 1;
+}
+
+int StreamBench(size_t argc, const char** argv)
+{
+	unsigned int size = 4096, conns = 1, mbytes = 0;
+	sock_bench_args(argc, argv, &size, &conns, SOCK_BENCH_MAX_PAIRS, &mbytes);
+	size_t total = mbytes ? ((size_t) mbytes << 20) : bench_volume(size);
+
+	Fid_t cli[SOCK_BENCH_MAX_PAIRS], srv[SOCK_BENCH_MAX_PAIRS];
+	if(sock_bench_connect(conns, cli, srv) == -1) {
+		printf("stream failed\n");
+		return 1;
+	}
+
+	struct stream_args wa[SOCK_BENCH_MAX_PAIRS], ra[SOCK_BENCH_MAX_PAIRS];
+	Tid_t writer[SOCK_BENCH_MAX_PAIRS], reader[SOCK_BENCH_MAX_PAIRS];
+
+	unsigned long switches = bench_switches();
+	uint64_t start = bios_clock_ns();
+
+	for(unsigned int c = 0; c < conns; c++) {
+		wa[c] = (struct stream_args) { cli[c], size, total };
+		ra[c] = (struct stream_args) { srv[c], size, total };
+		reader[c] = CreateThread(stream_bench_reader, 0, &ra[c]);
+		writer[c] = CreateThread(stream_bench_writer, 0, &wa[c]);
+	}
+
+	int failed = 0, status;
+	for(unsigned int c = 0; c < conns; c++) {
+		if(ThreadJoin(writer[c], &status) == -1 || status != 0) failed = 1;
+		if(ThreadJoin(reader[c], &status) == -1 || status != 0) failed = 1;
+	}
+
+	uint64_t elapsed = bios_clock_ns() - start;
+	switches = bench_switches() - switches;
+	sock_bench_close(conns, cli, srv);
+
+	if(failed) {
+		printf("stream failed\n");
+		return 1;
+	}
+
+	size_t bytes = total * conns;
+	double mbps = (elapsed > 0) ? ((double)bytes * 1e3) / ((double)elapsed * 1.048576) : 0.0;
+	printf("stream cores=%u size=%u conns=%u bytes=%zu ns=%llu MBps=%.1f switches=%lu\n",
+		cpu_cores(), size, conns, bytes, (unsigned long long) elapsed, mbps, switches);
+	return 0;
+}
+
+
+/*
+	Connection setup rate. Connector threads, one per concurrent connection,
+	each open a connection, make one request/response round trip of the 
+	message size on it and close it, timing the whole. The calling thread
+	accepts and serves the connections one at a time.
+ */
+
+struct setup_args {
+	unsigned int size, count;
+	uint64_t* samples;
+};
+
+static int setup_bench_connector(int argl, void* args)
+{
+	struct setup_args* sa = args;
+	char* buf = malloc(sa->size);
+	memset(buf, 's', sa->size);
+	int failed = 0;
+
+	for(unsigned int c = 0; c < sa->count && !failed; c++) {
+		uint64_t start = bios_clock_ns();
+		Fid_t sock = Socket(NOPORT);
+		if(sock == NOFILE) { failed = 1; break; }
+
+		int retries = 0;
+		while(Connect(sock, SOCK_BENCH_PORT, CONN_BENCH_TIMEOUT) == -1)
+			if(++retries == CONN_BENCH_RETRIES) { failed = 1; break; }
+
+		if(!failed)
+			failed = ! (msg_bench_write_exact(sock, buf, sa->size)
+				&& msg_bench_read_exact(sock, buf, sa->size));
+		Close(sock);
+		sa->samples[c] = bios_clock_ns() - start;
+	}
+	free(buf);
+	return failed;
+}
+
+int SetupBench(size_t argc, const char** argv)
+{
+	unsigned int size = 64, conns = 4, count = 2000;
+	sock_bench_args(argc, argv, &size, &conns, MAX_FILEID-4, &count);
+	if(count < conns) count = conns;
+
+	Fid_t lsock = Socket(SOCK_BENCH_PORT);
+	if(lsock == NOFILE || ListenEx(lsock, conns) == -1) {
+		printf("setup failed\n");
+		return 1;
+	}
+
+	struct setup_args sa[MAX_FILEID];
+	Tid_t connector[MAX_FILEID];
+	uint64_t* samples = malloc((size_t) count * sizeof(uint64_t));
+	char* buf = malloc(size);
+
+	unsigned long switches = bench_switches();
+	uint64_t start = bios_clock_ns();
+
+	uint64_t* s = samples;
+	for(unsigned int c = 0; c < conns; c++) {
+		sa[c] = (struct setup_args) { size, count/conns + (c < count%conns), s };
+		s += sa[c].count;
+		connector[c] = CreateThread(setup_bench_connector, 0, &sa[c]);
+	}
+
+	int failed = 0;
+	for(unsigned int c = 0; c < count && !failed; c++) {
+		Fid_t fd = Accept(lsock);
+		if(fd == NOFILE) { failed = 1; break; }
+		failed = ! (msg_bench_read_exact(fd, buf, size) 
+			&& msg_bench_write_exact(fd, buf, size));
+		Close(fd);
+	}
+
+	/* On failure, closing the listener releases the connectors */
+	Close(lsock);
+	int status;
+	for(unsigned int c = 0; c < conns; c++)
+		if(ThreadJoin(connector[c], &status) == -1 || status != 0) failed = 1;
+
+	uint64_t elapsed = bios_clock_ns() - start;
+	switches = bench_switches() - switches;
+	free(buf);
+
+	if(failed) {
+		printf("setup failed\n");
+		free(samples);
+		return 1;
+	}
+
+	double connps = (elapsed > 0) ? (double) count * 1e9 / (double) elapsed : 0.0;
+	printf("setup cores=%u size=%u conns=%u count=%u ns=%llu connps=%.0f",
+		cpu_cores(), size, conns, count, (unsigned long long) elapsed, connps);
+	bench_latencies(samples, count);
+	printf(" switches=%lu\n", switches);
+	free(samples);
+	return 0;
+}
+
+
+/*
+	Fan-in. Client processes, one per connection, all stream their data 
+	at the same time to a single server thread, which reads from whichever
+	connection is ready through a poll set. Besides the throughput, the
+	times at which the first and the last connection finish show how evenly
+	the server shares itself among them.
+ */
+
+struct fanin_client_args {
+	unsigned int size;
+	size_t total;
+	Fid_t lsock, pset;     /* the inherited server fids */
+};
+
+static int fanin_bench_client(int argl, void* args)
+{
+	struct fanin_client_args* fa = args;
+	Close(fa->lsock);
+	Close(fa->pset);
+
+	Fid_t sock = Socket(NOPORT);
+	if(sock == NOFILE) return 1;
+	int retries = 0;
+	while(Connect(sock, SOCK_BENCH_PORT, CONN_BENCH_TIMEOUT) == -1)
+		if(++retries == CONN_BENCH_RETRIES) return 1;
+
+	struct stream_args sa = { sock, fa->size, fa->total };
+	int rc = stream_bench_writer(0, &sa);
+	Close(sock);
+	return rc;
+}
+
+static int fanin_bench_server(Fid_t lsock, Fid_t pset, unsigned int conns, size_t* bytes, 
+	uint64_t start, uint64_t* first, uint64_t* last)
+{
+	char* buf = malloc(BENCH_MAX_WSIZE);
+	pollfd ready[MAX_FILEID];
+	unsigned int accepted = 0, finished = 0;
+
+	PollSetControl(pset, lsock, POLL_READABLE);
+	while(finished < conns) {
+		int n = PollSetWait(pset, ready, MAX_FILEID, POLL_FOREVER);
+		if(n <= 0) break;
+
+		for(int i = 0; i < n; i++) {
+			Fid_t fd = ready[i].fd;
+			if(fd == lsock) {
+				Fid_t c = Accept(lsock);
+				if(c == NOFILE) goto done;
+				PollSetControl(pset, c, POLL_READABLE);
+				if(++accepted == conns) PollSetControl(pset, lsock, 0);
+				continue;
+			}
+
+			int rc = Read(fd, buf, BENCH_MAX_WSIZE);
+			if(rc > 0) {
+				*bytes += rc;
+				continue;
+			}
+			Close(fd);
+			*last = bios_clock_ns() - start;
+			if(finished++ == 0) *first = *last;
+		}
+	}
+done:
+	free(buf);
+	return (finished == conns) ? 0 : -1;
+}
+
+int FanInBench(size_t argc, const char** argv)
+{
+	unsigned int size = 4096, conns = SOCK_BENCH_MAX_FANIN, mbytes = 0;
+	sock_bench_args(argc, argv, &size, &conns, SOCK_BENCH_MAX_FANIN, &mbytes);
+	size_t total = mbytes ? ((size_t) mbytes << 20) : bench_volume(size) / conns;
+
+	Fid_t lsock = Socket(SOCK_BENCH_PORT);
+	if(lsock == NOFILE || ListenEx(lsock, conns) == -1) {
+		printf("fanin failed\n");
+		return 1;
+	}
+	Fid_t pset = OpenPollSet();
+	if(pset == NOFILE) {
+		printf("fanin failed\n");
+		return 1;
+	}
+
+	unsigned long switches = bench_switches();
+	uint64_t start = bios_clock_ns();
+
+	int failed = 0, status;
+	unsigned int spawned = 0;
+	for(; spawned < conns; spawned++) {
+		struct fanin_client_args fa = { size, total, lsock, pset };
+		if(Exec(fanin_bench_client, sizeof(fa), &fa) == NOPROC) break;
+	}
+
+	size_t bytes = 0;
+	uint64_t first = 0, last = 0;
+	if(spawned < conns || fanin_bench_server(lsock, pset, conns, &bytes, start, &first, &last) == -1)
+		failed = 1;
+
+	/* On failure, closing the listener releases the clients */
+	Close(pset);
+	Close(lsock);
+	for(unsigned int c = 0; c < spawned; c++)
+		if(WaitChild(NOPROC, &status) == NOPROC || status != 0) failed = 1;
+
+	uint64_t elapsed = bios_clock_ns() - start;
+	switches = bench_switches() - switches;
+
+	if(failed || bytes != total * conns) {
+		printf("fanin failed\n");
+		return 1;
+	}
+
+	double mbps = (elapsed > 0) ? ((double)bytes * 1e3) / ((double)elapsed * 1.048576) : 0.0;
+	printf("fanin cores=%u size=%u conns=%u bytes=%zu ns=%llu MBps=%.1f first=%llu last=%llu switches=%lu\n",
+		cpu_cores(), size, conns, bytes, (unsigned long long) elapsed, mbps, 
+		(unsigned long long) first, (unsigned long long) last, switches);
+	return 0;
+}
+
+
+/*
+	Large responses. A server thread sends responses of a given size over
+	a connected socket, and a client thread reads them in chunks of 64K. 
+	The server sends either by Write, which copies each response into the
+	socket buffer, or by SendZeroCopy, from which the client copies it
+	directly. The server has two response buffers, as a server that 
+	prepares the next response while the last one is sent; a buffer sent
+	without a copy is reused only after its completion.
+ */
+#define ZC_BENCH_BUFFERS 2
+
+struct zc_args {
+	Fid_t fid;
+	unsigned int size, count;
+	int zerocopy;
+};
+
+static int zc_bench_server(int argl, void* args)
+{
+	struct zc_args* za = args;
+	char* buf[ZC_BENCH_BUFFERS];
+	for(int b = 0; b < ZC_BENCH_BUFFERS; b++) {
+		buf[b] = malloc(za->size);
+		memset(buf[b], 'z', za->size);
+	}
+
+	Fid_t cq = za->zerocopy ? OpenCompletionQueue() : NOFILE;
+	int failed = (za->zerocopy && cq == NOFILE);
+	zc_completion comp;
+
+	for(unsigned int i = 0; i < za->count && !failed; i++) {
+		char* resp = buf[i % ZC_BENCH_BUFFERS];
+		if(! za->zerocopy) {
+			failed = ! msg_bench_write_exact(za->fid, resp, za->size);
+			continue;
+		}
+		/* Wait until the buffer is ours again */
+		if(i >= ZC_BENCH_BUFFERS)
+			failed = (Read(cq, (char*)&comp, sizeof(comp)) != sizeof(comp) || comp.status != 0);
+		if(!failed)
+			failed = (SendZeroCopy(za->fid, resp, za->size, cq, i) == -1);
+	}
+
+	/* Drain the completions, before the buffers are freed */
+	unsigned int pending = (za->count < ZC_BENCH_BUFFERS) ? za->count : ZC_BENCH_BUFFERS;
+	for(unsigned int i = 0; za->zerocopy && !failed && i < pending; i++)
+		failed = (Read(cq, (char*)&comp, sizeof(comp)) != sizeof(comp) || comp.status != 0);
+
+	ShutDown(za->fid, SHUTDOWN_WRITE);
+	if(cq != NOFILE) Close(cq);
+	for(int b = 0; b < ZC_BENCH_BUFFERS; b++) free(buf[b]);
+	return failed;
+}
+
+static int zc_bench_client(int argl, void* args)
+{
+	struct zc_args* za = args;
+	char* buf = malloc(BENCH_MAX_WSIZE);
+	size_t got = 0;
+	int rc;
+	while((rc = Read(za->fid, buf, BENCH_MAX_WSIZE)) > 0) got += rc;
+	free(buf);
+	return (rc == 0 && got == (size_t) za->size * za->count) ? 0 : 1;
+}
+
+static int zc_bench_run(unsigned int size, unsigned int count, int zerocopy)
+{
+	Fid_t sock[2];
+	if(SocketPair(sock) == -1) return -1;
+
+	struct zc_args sa = { sock[0], size, count, zerocopy };
+	struct zc_args ca = { sock[1], size, count, zerocopy };
+
+	unsigned long switches = bench_switches();
+	uint64_t start = bios_clock_ns();
+
+	Tid_t client = CreateThread(zc_bench_client, 0, &ca);
+	Tid_t server = CreateThread(zc_bench_server, 0, &sa);
+
+	int failed = 0, status;
+	if(ThreadJoin(server, &status) == -1 || status != 0) failed = 1;
+	if(ThreadJoin(client, &status) == -1 || status != 0) failed = 1;
+
+	uint64_t elapsed = bios_clock_ns() - start;
+	switches = bench_switches() - switches;
+	Close(sock[0]);
+	Close(sock[1]);
+	if(failed) return -1;
+
+	size_t bytes = (size_t) size * count;
+	double mbps = (elapsed > 0) ? ((double)bytes * 1e3) / ((double)elapsed * 1.048576) : 0.0;
+	printf("zcopy cores=%u mode=%s size=%u count=%u bytes=%zu ns=%llu MBps=%.1f nsperresp=%llu switches=%lu\n",
+		cpu_cores(), zerocopy ? "zerocopy" : "copy", size, count, bytes, 
+		(unsigned long long) elapsed, mbps, (unsigned long long) (elapsed / count), switches);
+	return 0;
+}
+
+int ZeroCopyBench(size_t argc, const char** argv)
+{
+	unsigned int size = bench_arg(argc, argv, 1, 1u<<20);
+	unsigned int count = bench_arg(argc, argv, 2, 256);
+
+	for(int zerocopy = 0; zerocopy <= 1; zerocopy++)
+		if(zc_bench_run(size, count, zerocopy) == -1) {
+			printf("zcopy mode=%s failed\n", zerocopy ? "zerocopy" : "copy");
+			return 1;
+		}
+	return 0;
+}
@@ -0,0 +1,190 @@
+#ifndef __BENCH_H
+#define __BENCH_H
+
+/**
+	@file bench.h
+	@brief Benchmarks for the tinyos I/O paths.
+
+	Each benchmark is a @ref Program, so it can be started from the shell
+	or from the standalone @c tinyos_bench driver. A benchmark prints one
+	line per measurement to its standard output, as a sequence of
+	@c key=value pairs, e.g.
+	@verbatim
+	pipe wsize=4096 bytes=67108864 ns=41234567 MBps=1627.5 switches=16390
+	@endverbatim
+	so that the results can be post-processed by scripts. The @c switches
+	field is the number of context switches during the measurement, on all cores.
+  */
+
+#include "tinyoslib.h"
+
+/**
+	@brief Pipe throughput benchmark.
+
+	A writer thread pushes a stream of bytes through a pipe, using writes of a
+	fixed size, while the calling thread drains the pipe with large reads.
+	The write size is swept over the powers of two from @c minsize to @c maxsize
+	(default: 1 byte to 64 kbytes). If @c capacity is given, the pipe is
+	created by @c PipeEx with this capacity (0 for @c PIPE_AUTO), or by 
+	@c Pipe if it is negative. If @c rcvlowat is given, it is set as the
+	@c STREAM_RCVLOWAT of the read end.
+
+	Usage: @c pipebench [<minsize> [<maxsize> [<capacity> [<rcvlowat>]]]]
+  */
+int PipeBench(size_t argc, const char** argv);
+
+/**
+	@brief Relay throughput benchmark.
+
+	A writer thread feeds a pipe, a relay thread forwards it to a second
+	pipe, and the calling thread drains the second pipe. For each relay 
+	request size, from @c minsize to @c maxsize (default: 1 to 64 kbytes), 
+	the relay is measured twice: copying through a user buffer with 
+	@c Read and @c Write (@c relay_copy), and with @c Splice 
+	(@c relay_splice).
+
+	Usage: @c relaybench [<minsize> [<maxsize>]]
+  */
+int RelayBench(size_t argc, const char** argv);
+
+/**
+	@brief Message throughput benchmark.
+
+	A writer thread sends fixed-size messages through a pipe, and the 
+	calling thread receives them. For each message size, from @c minsize 
+	to @c maxsize (default: 16 bytes to 4 kbytes), the pipe is measured in
+	stream mode, with a length header per message, and in message mode
+	(see @c STREAM_MESSAGE). In stream mode, the header and the payload
+	are sent in one @c Write (stream), two @c Write calls (split), or one 
+	@c WriteV (writev). The pipe capacity is as in @c PipeBench.
+	The result lines report messages per second,
+	e.g.
+	@verbatim
+	msg mode=message size=64 msgs=16384 ns=9876543 msgps=1658861 switches=130
+	@endverbatim
+
+	Usage: @c msgbench [<minsize> [<maxsize> [<capacity>]]]
+  */
+int MsgBench(size_t argc, const char** argv);
+
+/**
+	@brief Connection serving benchmark.
+
+	Client processes open @c conns connections in total (default 1000),
+	with @c clients connections open at a time (default 8), and make
+	@c reqs request/response round trips of 64 bytes on each (default 16).
+	The server is measured twice: as a single thread that serves all the 
+	connections with a poll set (see @c OpenPollSet), and with a thread per
+	connection. The open connections are bounded by @c MAX_FILEID, so 
+	@c clients is at most @c MAX_FILEID-4. The result lines report 
+	connections and requests per second, e.g.
+	@verbatim
+	conn mode=poll conns=1000 clients=8 reqs=16000 ns=98765432 connps=10125 reqps=162000 switches=4100
+	@endverbatim
+
+	Usage: @c connbench [<conns> [<clients> [<reqs>]]]
+  */
+int ConnBench(size_t argc, const char** argv);
+
+/**
+	@brief Channel setup benchmark.
+
+	Make @c chans pairs of connected sockets (default 10000), closing each
+	pair as soon as it is made. The pairs are made twice: through a listener,
+	with @c Socket, @c Connect and @c Accept (@c connect), and with 
+	@c SocketPair (@c socketpair). The result lines report the time per 
+	channel and channels per second, e.g.
+	@verbatim
+	chan mode=socketpair chans=10000 ns=12345678 nsper=1235 chanps=809999 switches=2
+	@endverbatim
+
+	Usage: @c chanbench [<chans>]
+  */
+int ChanBench(size_t argc, const char** argv);
+
+/**
+	@brief Socket ping-pong latency benchmark.
+
+	Over each of @c conns connections (default 1, at most 6), a client 
+	thread sends @c rounds messages of @c size bytes (default 10000 of 64
+	bytes), waiting for each to be echoed back, and times each round trip.
+	The result line gives the round trips per second and the distribution
+	of the round trip times, in ns, over all the connections, e.g.
+	@verbatim
+	ping cores=2 size=64 conns=1 rounds=10000 ns=98765432 rtps=101250 mean=9876 p50=9500 p90=11000 p99=25000 p999=60000 max=150000 switches=20010
+	@endverbatim
+
+	Usage: @c pingbench [<size> [<conns> [<rounds>]]]
+  */
+int PingBench(size_t argc, const char** argv);
+
+/**
+	@brief Socket bulk throughput benchmark.
+
+	Over each of @c conns connections (default 1, at most 6), a writer 
+	thread sends @c mbytes megabytes (by default, as much as @c PipeBench 
+	moves for this write size) with writes of @c size bytes (default 4096),
+	and a reader thread receives them. The result line gives the total 
+	throughput, e.g.
+	@verbatim
+	stream cores=2 size=4096 conns=1 bytes=67108864 ns=41234567 MBps=1552.1 switches=16390
+	@endverbatim
+
+	Usage: @c streambench [<size> [<conns> [<mbytes>]]]
+  */
+int StreamBench(size_t argc, const char** argv);
+
+/**
+	@brief Socket connection setup benchmark.
+
+	@c conns connector threads (default 4, at most @c MAX_FILEID-4) open 
+	@c count connections in total (default 2000), and make a round trip of
+	@c size bytes (default 64) on each before closing it, while a single 
+	thread accepts and serves them. Each connection is timed from @c Socket
+	to @c Close. The result line gives the connections per second and the
+	distribution of the connection times, in ns, e.g.
+	@verbatim
+	setup cores=2 size=64 conns=4 count=2000 ns=28765432 connps=69528 mean=57000 p50=52000 p90=80000 p99=120000 p999=200000 max=350000 switches=9000
+	@endverbatim
+
+	Usage: @c setupbench [<size> [<conns> [<count>]]]
+  */
+int SetupBench(size_t argc, const char** argv);
+
+/**
+	@brief Socket fan-in benchmark.
+
+	@c conns client processes (default and at most @c MAX_FILEID-4) each 
+	open a connection and send @c mbytes megabytes over it with writes of 
+	@c size bytes (default 4096), all at the same time, to a single server
+	thread that serves them with a poll set. By default, the clients share 
+	the volume that @c PipeBench moves for this write size. The result line
+	gives the total throughput, and the times (in ns from the start) at 
+	which the first and the last connection were finished, e.g.
+	@verbatim
+	fanin cores=2 size=4096 conns=12 bytes=67108860 ns=51234567 MBps=1249.2 first=45000000 last=51000000 switches=30000
+	@endverbatim
+
+	Usage: @c faninbench [<size> [<conns> [<mbytes>]]]
+  */
+int FanInBench(size_t argc, const char** argv);
+
+/**
+	@brief Zero-copy send benchmark.
+
+	A server thread sends @c count responses of @c size bytes (default 
+	256 responses of 1MB) over a connected socket to a client thread, 
+	which reads them in chunks of 64K. This is measured twice: with the 
+	responses sent by @c Write, and with them sent by @c SendZeroCopy, 
+	which saves the copy into the socket buffer. The result lines give the
+	throughput and the time per response, e.g.
+	@verbatim
+	zcopy cores=2 mode=copy size=1048576 count=256 bytes=268435456 ns=146701339 MBps=1745.0 nsperresp=573052 switches=8208
+	zcopy cores=2 mode=zerocopy size=1048576 count=256 bytes=268435456 ns=37805324 MBps=6771.5 nsperresp=147677 switches=282
+	@endverbatim
+
+	Usage: @c zcbench [<size> [<count>]]
+  */
+int ZeroCopyBench(size_t argc, const char** argv);
+
+#endif
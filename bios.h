@@ -484,6 +484,20 @@ TimerDuration bios_cancel_timer();
 TimerDuration bios_clock();
 
 
+/**
+	@brief Get the current time from a high-resolution monotonic clock.
+
+	This function returns a monotonic clock value, in nanoseconds. 
+	Unlike @c bios_clock(), this clock is fine-grained and cheap to read, 
+	so it can be used to time short intervals (e.g., lock hold times or
+	benchmark iterations). Its value is only meaningful as a difference
+	between two readings.
+
+	@see bios_clock
+ */
+uint64_t bios_clock_ns();
+
+
 
 
 /**
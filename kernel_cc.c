@@ -5,6 +5,7 @@
 #include "kernel_sched.h"
 #include "kernel_proc.h"
 #include "kernel_cc.h"
+#include "kernel_slab.h"
 
 
 /**
@@ -19,6 +20,76 @@
   */
 
 
+/*
+	Lock contention statistics.
+	---------------------------
+
+	When LOCK_STATISTICS is defined, every mutex acquisition is accounted
+	under the lock class of the mutex. The counters of a class are shared 
+	by many mutexes, therefore they are updated atomically.
+ */
+
+/* The class of mutexes initialized by MUTEX_INIT */
+lock_class unclassified_lock_class = LOCK_CLASS("unclassified");
+
+/* The class of the CondVar waitset locks */
+lock_class cv_waitset_lock_class = LOCK_CLASS("cv_waitset");
+
+/* The class of the kernel semaphore queue lock */
+lock_class kernel_lock_class = LOCK_CLASS("kernel_sem");
+
+#if defined(LOCK_STATISTICS)
+
+/* The list of registered lock classes */
+static lock_class* lock_classes = NULL;
+
+static void lock_class_register(lock_class* cls)
+{
+	if(__atomic_exchange_n(&cls->registered, 1, __ATOMIC_ACQ_REL)) return;
+
+	cls->next = __atomic_load_n(&lock_classes, __ATOMIC_RELAXED);
+	while(! __atomic_compare_exchange_n(&lock_classes, &cls->next, cls, 
+		0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static inline lock_class* mutex_class(Mutex* lock)
+{
+	return lock->cls ? lock->cls : &unclassified_lock_class;
+}
+
+#define lockstat_add(field, n) __atomic_fetch_add(&(field), (n), __ATOMIC_RELAXED)
+
+/* Account for a completed acquisition */
+static inline void lock_acquired(Mutex* lock, unsigned long spins, unsigned long yields)
+{
+	lock_class* cls = mutex_class(lock);
+	if(! cls->registered) lock_class_register(cls);
+
+	lockstat_add(cls->acquisitions, 1);
+	if(spins) {
+		lockstat_add(cls->contended, 1);
+		lockstat_add(cls->spins, spins);
+	}
+	if(yields) lockstat_add(cls->yields, yields);
+
+	lock->acquired = bios_clock_ns();
+}
+
+/* Account for the hold time at release */
+static inline void lock_released(Mutex* lock)
+{
+	uint64_t held = (bios_clock_ns() - lock->acquired) >> 8;
+	unsigned int b = 0;
+	while(held && b < LOCKINFO_HOLD_BUCKETS-1) {
+		held >>= 2;
+		b++;
+	}
+	lockstat_add(mutex_class(lock)->hold_hist[b], 1);
+}
+
+#endif
+
+
 /*
  	Pre-emption aware mutex.
  	-------------------------
@@ -35,29 +106,112 @@
 void Mutex_Lock(Mutex* lock)
 {
 #define MUTEX_SPINS (cpu_cores()>1 ?  1000 : 10000)
+#if defined(LOCK_STATISTICS)
+  unsigned long spins = 0, yields = 0;
+#endif
 
-  while(__atomic_test_and_set(lock,__ATOMIC_ACQUIRE)) {
+  while(__atomic_test_and_set(&lock->lock,__ATOMIC_ACQUIRE)) {
     int spin=MUTEX_SPINS;
-    while(__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+    while(__atomic_load_n(&lock->lock, __ATOMIC_RELAXED)) {
 #if defined(__x86__) || defined(__x86_64__)
       __builtin_ia32_pause();
+#endif
+#if defined(LOCK_STATISTICS)
+      spins++;
 #endif
       if(spin>0) 
       	spin--; 
       else { 
       	spin=MUTEX_SPINS; 
-      	if(cpu_interrupts_enabled())
+      	if(cpu_interrupts_enabled()) {
+#if defined(LOCK_STATISTICS)
+      		yields++;
+#endif
+      		/* Let the owner run at our priority, until it unlocks */
+      		sched_priority_inherit(lock, &lock->owner, &lock->pi);
       		yield(SCHED_MUTEX); 
+      	}
       }
     }
+#if defined(LOCK_STATISTICS)
+    if(spins==0) spins = 1;   /* we lost a race, count it as contention */
+#endif
   }
 #undef MUTEX_SPINS
+
+  __atomic_store_n(&lock->owner, cur_thread(), __ATOMIC_RELAXED);
+
+#if defined(LOCK_STATISTICS)
+  lock_acquired(lock, spins, yields);
+#endif
 }
 
 
 void Mutex_Unlock(Mutex* lock)
 {
-  __atomic_clear(lock, __ATOMIC_RELEASE);
+#if defined(LOCK_STATISTICS)
+  lock_released(lock);
+#endif
+  /* Only a waiter that let the owner inherit its priority sets lock->pi,
+     so an uncontended unlock does not look at the scheduler. */
+  char boosted = __atomic_load_n(&lock->pi, __ATOMIC_RELAXED);
+  if(boosted) __atomic_store_n(&lock->pi, 0, __ATOMIC_RELAXED);
+
+  __atomic_store_n(&lock->owner, NULL, __ATOMIC_RELAXED);
+  __atomic_clear(&lock->lock, __ATOMIC_RELEASE);
+
+  if(boosted) sched_priority_restore(lock);
+}
+
+
+size_t lock_statistics_snapshot(void** records)
+{
+	*records = NULL;
+	size_t n = 0;
+
+#if defined(LOCK_STATISTICS)
+	lock_class* head = __atomic_load_n(&lock_classes, __ATOMIC_ACQUIRE);
+	for(lock_class* cls = head; cls != NULL; cls = cls->next) n++;
+	if(n == 0) return 0;
+
+	lockinfo* info = xmalloc(n * sizeof(lockinfo));
+	lockinfo* li = info;
+	for(lock_class* cls = head; cls != NULL; cls = cls->next, li++) {
+		memset(li, 0, sizeof(lockinfo));
+		strncpy(li->name, cls->name, LOCKINFO_NAME_SIZE-1);
+		li->acquisitions = cls->acquisitions;
+		li->contended = cls->contended;
+		li->spins = cls->spins;
+		li->yields = cls->yields;
+		memcpy(li->hold_hist, cls->hold_hist, sizeof(li->hold_hist));
+	}
+	*records = info;
+#endif
+
+	return n;
+}
+
+
+void lock_statistics_print(FILE* fout)
+{
+	lockinfo* info;
+	size_t n = lock_statistics_snapshot((void**) &info);
+	if(n == 0) return;
+
+	fprintf(fout, "%-20s %12s %10s %14s %10s   hold(<256ns*4^i):", 
+		"Lock class", "acquired", "contended", "spins", "yields");
+	for(unsigned int b=0; b<LOCKINFO_HOLD_BUCKETS; b++) fprintf(fout, " %8u", b);
+	fprintf(fout, "\n");
+
+	for(size_t i=0; i<n; i++) {
+		lockinfo* li = &info[i];
+		fprintf(fout, "%-20s %12lu %10lu %14lu %10lu                    ",
+			li->name, li->acquisitions, li->contended, li->spins, li->yields);
+		for(unsigned int b=0; b<LOCKINFO_HOLD_BUCKETS; b++) 
+			fprintf(fout, " %8lu", li->hold_hist[b]);
+		fprintf(fout, "\n");
+	}
+	free(info);
 }
 
 
@@ -73,6 +227,8 @@ typedef struct __cv_waiter {
 	sig_atomic_t signalled;		/* this is set if the thread is signalled */
 	sig_atomic_t removed;		/* this is set if the waiter is removed 
 								   from the ring */
+	sig_atomic_t spinning;		/* this is set while the waiter spins, 
+								   before going to sleep */
 } __cv_waiter;
 /** \endcond */
 
@@ -91,25 +247,86 @@ static inline void remove_from_ring(CondVar* cv, __cv_waiter* w)
 }
 
 
+/*
+	Adaptive spinning.
+
+	A waiter spins for a while on its @c signalled flag before sleeping, 
+	since a signal often arrives a few microseconds later (e.g., in pipe 
+	ping-pong). The spin budget is kept per condition variable, and adapts 
+	to the recent waits: a successful spin raises it to twice the polls it 
+	needed, a failed spin halves it. When the budget drops to zero, waiters
+	sleep immediately, but every CV_SPIN_PROBE waits one of them probes 
+	again with CV_SPIN_MIN polls. 
+
+	Spinning only makes sense if some other core is running a thread that
+	may signal us; this is rechecked every few polls.
+ */
+#define CV_SPIN_MIN 64
+#define CV_SPIN_MAX 8192
+#define CV_SPIN_PROBE 32
+
+/* Returns the spin budget for a new waiter. Call with waitset_lock held. */
+static inline unsigned int cv_spin_budget(CondVar* cv)
+{
+	if(cpu_cores() == 1) return 0;
+	if(cv->spin_budget > 0) return cv->spin_budget;
+	if(++cv->spin_parks < CV_SPIN_PROBE) return 0;
+	cv->spin_parks = 0;
+	return CV_SPIN_MIN;
+}
+
+/* Adapt the spin budget after a spin. Call with waitset_lock held. */
+static inline void cv_spin_adapt(CondVar* cv, unsigned int budget, unsigned int polls, int success)
+{
+	if(success) {
+		unsigned int nb = 2*polls;
+		if(nb < CV_SPIN_MIN) nb = CV_SPIN_MIN;
+		if(nb > CV_SPIN_MAX) nb = CV_SPIN_MAX;
+		cv->spin_budget = (cv->spin_budget + nb) / 2;
+		if(cv->spin_budget < CV_SPIN_MIN) cv->spin_budget = CV_SPIN_MIN;
+	} else {
+		cv->spin_budget = (budget >= 2*CV_SPIN_MIN) ? budget / 2 : 0;
+	}
+	cv->spin_parks = 0;
+}
+
+/* Spin until signalled, for at most budget polls. Returns the polls done. */
+static unsigned int cv_spin(__cv_waiter* w, unsigned int budget)
+{
+	unsigned int polls;
+	for(polls = 1; polls <= budget; polls++) {
+		if(__atomic_load_n(&w->signalled, __ATOMIC_ACQUIRE)) break;
+		if((polls & 63) == 0 && ! sched_others_running()) break;
+#if defined(__x86__) || defined(__x86_64__)
+		__builtin_ia32_pause();
+#endif
+	}
+	return polls;
+}
+
+
 /** 
    @internal
-   @brief Wait on a condition variable, specifying the cause. 
+   @brief Wait on a condition variable, releasing some lock.
 
 	This function is the basic implementation for the 'wait' operation on
-	condition variables. It is used to implement the @c Cond_Wait and @c Cond_TimedWait
-	system calls, as well as internal kernel 'wait' functionality.
+	condition variables. It is used to implement @c cv_wait, as well as
+	@c kernel_wait_wchan, where the lock to release is the kernel semaphore.
 
-  The function must be called only while we have locked the mutex that 
-  is associated with this call. It will put the calling thread to sleep, 
-  unlocking the mutex. These operations happen atomically.  
+  The caller must hold some lock that protects the condition it waits for.
+  The calling thread is added to the waiters of the condition variable, and then 
+  @c release(obj) is called to release the lock. Then, the thread sleeps.
+  Since the thread is already a waiter when the lock is released, no signal 
+  can be lost.
 
   When the thread is woken up later (by another thread that calls @c 
   Cond_Signal or @c Cond_Broadcast, or because the timeout has expired, or
-  because the thread was awoken by another kernel routine), 
-  it first re-locks the mutex and then returns.  
+  because the thread was awoken by another kernel routine), it returns, 
+  without re-acquiring the lock.
 
-  @param mx The mutex to be unlocked as the thread sleeps.
   @param cv The condition variable to sleep on.
+  @param release The function that releases the lock.
+  @param obj The argument passed to @c release.
   @param cause A cause provided to the kernel scheduler.
   @param timeout The time to sleep, or @c NO_TIMEOUT to sleep for ever.
 
@@ -118,10 +335,10 @@ static inline void remove_from_ring(CondVar* cv, __cv_waiter* w)
   @see Cond_Signal
   @see Cond_Broadcast
   */
-static int cv_wait(Mutex* mutex, CondVar* cv, 
+static int cv_wait_releasing(CondVar* cv, void (*release)(void*), void* obj,
 		enum SCHED_CAUSE cause, TimerDuration timeout)
 {
-	__cv_waiter waiter = { .thread=cur_thread(), .signalled = 0, .removed=0 };
+	__cv_waiter waiter = { .thread=cur_thread(), .signalled = 0, .removed=0, .spinning=0 };
 	rlnode_init(& waiter.node, &waiter);
 
 	Mutex_Lock(&(cv->waitset_lock));
@@ -133,8 +350,28 @@ static int cv_wait(Mutex* mutex, CondVar* cv,
 		cv->waitset = &waiter;
 	}
 
-	/* Now atomically release mutex and sleep */
-	Mutex_Unlock(mutex);
+	release(obj);
+
+	/* Spin for a while, if it seems worthwhile */
+	unsigned int budget = cv_spin_budget(cv);
+	if(budget > 0 && sched_others_running()) {
+		waiter.spinning = 1;
+		Mutex_Unlock(&(cv->waitset_lock));
+
+		unsigned int polls = cv_spin(&waiter, budget);
+
+		Mutex_Lock(&(cv->waitset_lock));
+		waiter.spinning = 0;
+		cv_spin_adapt(cv, budget, polls, waiter.removed);
+
+		if(waiter.removed) {
+			/* We were signalled while spinning */
+			Mutex_Unlock(&(cv->waitset_lock));
+			return waiter.signalled;
+		}
+	}
+
+	/* Now atomically release the waitset lock and sleep */
 	sleep_releasing(STOPPED, &(cv->waitset_lock), cause, timeout);
 
 	/* Woke up, we must check wether we were signaled, and tidy up */
@@ -147,11 +384,44 @@ static int cv_wait(Mutex* mutex, CondVar* cv,
 	}
 	Mutex_Unlock(&(cv->waitset_lock));
 
-	Mutex_Lock(mutex);
 	return waiter.signalled;
 }
 
 
+static void cv_release_mutex(void* mutex)
+{
+	Mutex_Unlock((Mutex*) mutex);
+}
+
+/** 
+   @internal
+   @brief Wait on a condition variable, specifying the cause. 
+
+	It is used to implement the @c Cond_Wait and @c Cond_TimedWait
+	system calls.
+
+  The function must be called only while we have locked the mutex that 
+  is associated with this call. It will put the calling thread to sleep, 
+  unlocking the mutex. These operations happen atomically.  
+  When the thread is woken up, it first re-locks the mutex and then returns.  
+
+  @param mx The mutex to be unlocked as the thread sleeps.
+  @param cv The condition variable to sleep on.
+  @param cause A cause provided to the kernel scheduler.
+  @param timeout The time to sleep, or @c NO_TIMEOUT to sleep for ever.
+
+  @returns 1 if this thread was woken up by signal/broadcast, 0 otherwise
+  @see cv_wait_releasing
+  */
+static int cv_wait(Mutex* mutex, CondVar* cv, 
+		enum SCHED_CAUSE cause, TimerDuration timeout)
+{
+	int signalled = cv_wait_releasing(cv, cv_release_mutex, mutex, cause, timeout);
+	Mutex_Lock(mutex);
+	return signalled;
+}
+
+
 /**
   @internal
   Helper for Cond_Signal and Cond_Broadcast. This method 
@@ -165,6 +435,11 @@ static inline void cv_signal(CondVar* cv)
 		__cv_waiter* waiter = cv->waitset;
 		remove_from_ring(cv, waiter);
 		waiter->removed = 1;
+		if(waiter->spinning) {
+			/* The waiter is still running, it will see the flag */
+			__atomic_store_n(&waiter->signalled, 1, __ATOMIC_RELEASE);
+			return;
+		}
 		if(wakeup(waiter->thread)) {
 			waiter->signalled = 1;
 			return;
@@ -214,57 +489,174 @@ void Cond_Broadcast(CondVar* cv)
 /**
  * @brief The kernel lock.
  *
- * Kernel locking is provided by a semaphore, implemented as a monitor.
- * A semaphre for kernel locking has advantages over a simple mutex. 
- * The main advantage is that @c kernel_mutex is held for a very short time
- * regardless of contention. Thus, in multicore machines, it allows for cores
- * to be passed to other threads. 
- * 
+ * Kernel locking is provided by a binary semaphore with direct hand-off.
+ * The semaphore state is a single word. When it is uncontended, locking 
+ * and unlocking is a single atomic operation each. 
+ *
+ * Threads that find the semaphore taken queue up (in FIFO order) and sleep. 
+ * When the holder unlocks the semaphore and there are waiters, ownership is
+ * passed directly to the first waiter, which is woken up already holding
+ * the kernel lock; there is no re-contention. Thus, the semaphore is never 
+ * held by a sleeping thread, and in multicore machines cores can be passed 
+ * to other threads. The queue is protected by @c kernel_sem_lock, which is 
+ * held for a very short time regardless of contention.
+ *
+ * A thread that queues up lets the holder inherit its priority, so that a
+ * low-priority holder is not kept off the cores by the MLFQ while 
+ * higher-priority threads wait for the kernel.
  */
 
-/* This mutex is used to implement the kernel semaphore as a monitor. */
-static Mutex kernel_mutex = MUTEX_INIT;
+/* The semaphore states */
+enum { KSEM_FREE = 0, KSEM_HELD = 1, KSEM_CONTENDED = 2 };
+
+/* Semaphore state; KSEM_CONTENDED means that there may be waiters */
+static int kernel_sem = KSEM_FREE;
+
+/* The thread holding the semaphore. It may be NULL for a short while, 
+   after the semaphore is taken and before it is released. */
+static void* kernel_sem_owner = NULL;
+
+/* A thread waiting for the kernel semaphore */
+typedef struct __ksem_waiter {
+	TCB* thread;				/* the waiting thread */
+	int granted;				/* set when ownership is passed to the thread */
+	struct __ksem_waiter* next;	/* next in the queue */
+} __ksem_waiter;
+
+/* This mutex protects the waiters queue */
+static Mutex kernel_sem_lock = MUTEX_INIT_CLASS(&kernel_lock_class);
 
-/* Semaphore counter */
-static int kernel_sem = 1;
+/* The FIFO queue of waiters */
+static __ksem_waiter* kernel_sem_head = NULL;
+static __ksem_waiter* kernel_sem_tail = NULL;
 
-/* Semaphore condition */
-static CondVar kernel_sem_cv = COND_INIT;
+/* The number of times a thread trying to lock spins before queueing */
+#define KSEM_SPINS 100
+
+static inline int kernel_trylock()
+{
+	int expected = KSEM_FREE;
+	if(! __atomic_compare_exchange_n(&kernel_sem, &expected, KSEM_HELD, 
+		0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) 
+		return 0;
+	__atomic_store_n(&kernel_sem_owner, cur_thread(), __ATOMIC_RELAXED);
+	return 1;
+}
 
 void kernel_lock()
 {
-	Mutex_Lock(& kernel_mutex);
-	while(kernel_sem<=0) {
-		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
+	if(kernel_trylock()) return;
+
+	/* Spin shortly, since the kernel is held briefly */
+	if(cpu_cores() > 1) {
+		for(int spin = 0; spin < KSEM_SPINS; spin++) {
+			if(__atomic_load_n(&kernel_sem, __ATOMIC_RELAXED) == KSEM_FREE 
+				&& kernel_trylock()) 
+				return;
+#if defined(__x86__) || defined(__x86_64__)
+			__builtin_ia32_pause();
+#endif
+		}
+	}
+
+	Mutex_Lock(&kernel_sem_lock);
+
+	/* Mark the semaphore as contended; maybe it was freed meanwhile */
+	TCB* self = cur_thread();
+	if(__atomic_exchange_n(&kernel_sem, KSEM_CONTENDED, __ATOMIC_SEQ_CST) == KSEM_FREE) {
+		__atomic_store_n(&kernel_sem_owner, self, __ATOMIC_RELAXED);
+		Mutex_Unlock(&kernel_sem_lock);
+		return;
+	}
+
+	/* Queue up and sleep, until the semaphore is handed to us */
+	__ksem_waiter waiter = { .thread = self, .granted = 0, .next = NULL };
+	if(kernel_sem_tail) 
+		kernel_sem_tail->next = &waiter;
+	else
+		kernel_sem_head = &waiter;
+	kernel_sem_tail = &waiter;
+
+	/* 
+	  The holder cannot release the semaphore without kernel_sem_lock, 
+	  so it is safe to let it inherit our priority.
+	 */
+	sched_priority_inherit(&kernel_sem, &kernel_sem_owner, NULL);
+
+	while(1) {
+		sleep_releasing(STOPPED, &kernel_sem_lock, SCHED_USER, NO_TIMEOUT);
+		if(__atomic_load_n(&waiter.granted, __ATOMIC_ACQUIRE)) break;
+		Mutex_Lock(&kernel_sem_lock);
+		if(waiter.granted) {
+			Mutex_Unlock(&kernel_sem_lock);
+			break;
+		}
 	}
-	kernel_sem--;
-	Mutex_Unlock(& kernel_mutex);
+}
+
+/* Release the kernel semaphore, with kernel_sem_lock held */
+static void kernel_unlock_queued()
+{
+	/* Drop a priority inherited from the waiters */
+	TCB* self = cur_thread();
+	if(self->pi_priority >= 0)
+		sched_priority_restore(&kernel_sem);
+
+	__ksem_waiter* waiter = kernel_sem_head;
+	if(waiter == NULL) {
+		__atomic_store_n(&kernel_sem_owner, NULL, __ATOMIC_RELAXED);
+		__atomic_store_n(&kernel_sem, KSEM_FREE, __ATOMIC_RELEASE);
+		return;
+	}
+
+	/* Hand ownership to the first waiter; the state remains 'held' */
+	kernel_sem_head = waiter->next;
+	if(kernel_sem_head == NULL) {
+		kernel_sem_tail = NULL;
+		__atomic_store_n(&kernel_sem, KSEM_HELD, __ATOMIC_RELAXED);
+	}
+	TCB* thread = waiter->thread;
+	__atomic_store_n(&kernel_sem_owner, thread, __ATOMIC_RELAXED);
+	__atomic_store_n(&waiter->granted, 1, __ATOMIC_RELEASE);
+	wakeup(thread);
 }
 
 void kernel_unlock()
 {
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);
-	Mutex_Unlock(& kernel_mutex);
+	__atomic_store_n(&kernel_sem_owner, NULL, __ATOMIC_RELAXED);
+	int expected = KSEM_HELD;
+	if(__atomic_compare_exchange_n(&kernel_sem, &expected, KSEM_FREE,
+		0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		return;
+
+	Mutex_Lock(&kernel_sem_lock);
+	kernel_unlock_queued();
+	Mutex_Unlock(&kernel_sem_lock);
+}
+
+static void cv_release_kernel(void* unused)
+{
+	kernel_unlock();
 }
 
 int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
 	const char* wchan_name, TimerDuration timeout)
 {
-	/* Atomically release kernel semaphore */
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);	
-
-	int ret = cv_wait(&kernel_mutex, cv, cause, timeout);
-
-	/* Reacquire kernel semaphore */
-	while(kernel_sem<=0)
-		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
-	kernel_sem--;
-	Mutex_Unlock(& kernel_mutex);		
-
+	/* Atomically release kernel semaphore and wait */
+	int ret = cv_wait_releasing(cv, cv_release_kernel, NULL, cause, timeout);
+
+	/* 
+	  Reacquire kernel semaphore. A thread that waits with preemption off,
+	  so as not to miss an interrupt, turns it on meanwhile: it may have to
+	  spin for kernel_sem_lock, and the holder of the lock may be preempted.
+	 */
+	if(cpu_interrupts_enabled())
+		kernel_lock();
+	else {
+		preempt_on;
+		kernel_lock();
+		preempt_off;
+	}
 	return ret;
 }
 
@@ -280,12 +672,143 @@ void kernel_broadcast(CondVar* cv)
 
 void kernel_sleep(Thread_state newstate, enum SCHED_CAUSE cause)
 {
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);
-	sleep_releasing(newstate, &kernel_mutex, cause, NO_TIMEOUT);
+	Mutex_Lock(&kernel_sem_lock);
+	kernel_unlock_queued();
+	sleep_releasing(newstate, &kernel_sem_lock, cause, NO_TIMEOUT);
+}
+
+
+
+/*
+ *
+ * Epoch-based reclamation
+ *
+ */
+
+/*
+	Readers are counted in per-core shards, with separate counters for 
+	entries and exits, and two sets of counters, selected by the parity of
+	the global epoch. A reader increments the counter of the core it entered
+	on, and on exit it increments the exit counter of the same shard 
+	(it may have been moved to another core meanwhile). Thus, the read 
+	sections do not need to disable preemption.
+
+	The global epoch advances from e to e+1 only when all readers that 
+	counted themselves under the parity of e+1 (that is, readers of epoch e-1)
+	have exited. Objects retired during epoch e are reclaimed when the
+	epoch becomes e+2.
+ */
+typedef struct {
+	unsigned long enter[2];
+	unsigned long exit[2];
+} __attribute__((aligned(64))) epoch_shard;
+
+static epoch_shard epoch_shards[MAX_CORES];
+
+/* The global epoch */
+static unsigned int epoch_current = 0;
+
+/* A retired object */
+typedef struct __epoch_retired {
+	void* obj;
+	void (*reclaim)(void*);
+	struct __epoch_retired* next;
+} __epoch_retired;
+
+/* Each retired object needs a record, so they come from a slab cache */
+static slab_cache epoch_cache = SLAB_CACHE_PERCORE("epoch", sizeof(__epoch_retired));
+
+/* Objects retired in the current and in the previous epoch */
+static __epoch_retired* epoch_retired_cur = NULL;
+static __epoch_retired* epoch_retired_prev = NULL;
+static unsigned int epoch_pending = 0;
+
+lock_class epoch_lock_class = LOCK_CLASS("epoch");
+static Mutex epoch_lock = MUTEX_INIT_CLASS(&epoch_lock_class);
+
+
+epoch_t epoch_enter()
+{
+	uint core = cpu_core_id;
+	uint parity = __atomic_load_n(&epoch_current, __ATOMIC_ACQUIRE) & 1;
+	__atomic_fetch_add(&epoch_shards[core].enter[parity], 1, __ATOMIC_SEQ_CST);
+	return (core << 1) | parity;
+}
+
+void epoch_exit(epoch_t e)
+{
+	__atomic_fetch_add(&epoch_shards[e >> 1].exit[e & 1], 1, __ATOMIC_RELEASE);
+}
+
+/* Check that all readers counted under parity have exited */
+static int epoch_drained(uint parity)
+{
+	unsigned long exits = 0, enters = 0;
+
+	/* Exits are summed first, so that a reader is never counted as exited
+	   but not entered. */
+	for(uint c = 0; c < MAX_CORES; c++)
+		exits += __atomic_load_n(&epoch_shards[c].exit[parity], __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for(uint c = 0; c < MAX_CORES; c++)
+		enters += __atomic_load_n(&epoch_shards[c].enter[parity], __ATOMIC_ACQUIRE);
+
+	return enters == exits;
 }
 
+int epoch_poll()
+{
+	Mutex_Lock(&epoch_lock);
+
+	if(epoch_pending == 0 || ! epoch_drained((epoch_current + 1) & 1)) {
+		Mutex_Unlock(&epoch_lock);
+		return 0;
+	}
+
+	__atomic_store_n(&epoch_current, epoch_current + 1, __ATOMIC_SEQ_CST);
+	__epoch_retired* done = epoch_retired_prev;
+	epoch_retired_prev = epoch_retired_cur;
+	epoch_retired_cur = NULL;
 
+	int count = 0;
+	for(__epoch_retired* r = done; r != NULL; r = r->next) count++;
+	epoch_pending -= count;
 
+	Mutex_Unlock(&epoch_lock);
 
+	/* Reclaim outside the epoch lock */
+	while(done) {
+		__epoch_retired* r = done;
+		done = r->next;
+		r->reclaim(r->obj);
+		slab_free(r);
+	}
+
+	return count;
+}
+
+void epoch_retire(void* obj, void (*reclaim)(void*))
+{
+	__epoch_retired* r = slab_alloc(&epoch_cache);
+	r->obj = obj;
+	r->reclaim = reclaim;
+
+	Mutex_Lock(&epoch_lock);
+	r->next = epoch_retired_cur;
+	epoch_retired_cur = r;
+	epoch_pending++;
+	Mutex_Unlock(&epoch_lock);
+
+	epoch_poll();
+}
+
+void epoch_barrier()
+{
+	while(__atomic_load_n(&epoch_pending, __ATOMIC_RELAXED) > 0) {
+		unsigned int epoch = __atomic_load_n(&epoch_current, __ATOMIC_RELAXED);
+		epoch_poll();
+		/* If some reader held the epoch back, let it run */
+		if(__atomic_load_n(&epoch_current, __ATOMIC_RELAXED) == epoch)
+			yield(SCHED_USER);
+	}
+}
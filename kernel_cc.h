@@ -82,6 +82,135 @@ void kernel_sleep(Thread_state state, enum SCHED_CAUSE cause);
 
 
 
+/*
+ * Lock contention statistics.
+ */
+
+/**
+	@brief A lock class.
+
+	In a @c LOCK_STATISTICS build, every @c Mutex is accounted under a
+	lock class, which accumulates the contention statistics of all the
+	mutexes that belong to it. A mutex is assigned to a class by 
+	initializing it with @c MUTEX_INIT_CLASS. Mutexes initialized by
+	@c MUTEX_INIT are accounted under the "unclassified" class.
+
+	Lock classes are statically allocated and are registered the first
+	time one of their mutexes is acquired.
+	@code
+	lock_class sched_lock_class = LOCK_CLASS("sched");
+	Mutex sched_spinlock = MUTEX_INIT_CLASS(&sched_lock_class);
+	@endcode
+ */
+typedef struct lock_class {
+	const char* name;			/**< @brief The class name */
+	unsigned long acquisitions;	/**< @brief Number of acquisitions */
+	unsigned long contended;	/**< @brief Acquisitions that found the lock held */
+	unsigned long spins;		/**< @brief Total spin iterations */
+	unsigned long yields;		/**< @brief Calls to @c yield(SCHED_MUTEX) */
+	unsigned long hold_hist[LOCKINFO_HOLD_BUCKETS]; /**< @brief Hold-time histogram */
+
+	int registered;				/**< @brief Set when the class is registered */
+	struct lock_class* next;	/**< @brief The list of registered classes */
+} lock_class;
+
+/** @brief Static initializer for a lock class. */
+#define LOCK_CLASS(cname) ((lock_class){ .name = (cname) })
+
+/**
+	@brief Take a snapshot of the lock statistics.
+
+	This function allocates (by @c xmalloc) an array of @c lockinfo 
+	records, one for each registered lock class, and stores it in
+	@c records. In builds without @c LOCK_STATISTICS, no records are 
+	returned.
+
+	@param records location where the array of records is stored 
+	@returns the number of records in the array
+ */
+size_t lock_statistics_snapshot(void** records);
+
+/**
+	@brief Print the lock statistics to a C stream.
+	
+	This is called at the end of @c boot(), right after the core 
+	statistics are printed by the VM.
+ */
+void lock_statistics_print(FILE* fout);
+
+
+
+/*
+ * Epoch-based reclamation.
+ */
+
+/**
+	@brief A token returned by @c epoch_enter.
+	@see epoch_enter
+ */
+typedef unsigned int epoch_t;
+
+/**
+	@brief Enter an epoch read section.
+
+	Inside a read section, a thread can access kernel objects (such as
+	PCBs, FCBs, sockets and pipes) without holding the kernel lock, since
+	objects that are retired by @c epoch_retire are not reclaimed until
+	every read section that might see them has exited.
+
+	Read sections must be short and must not block. They are preemptible,
+	and they may nest. The token returned must be passed to @c epoch_exit.
+	@code
+	epoch_t e = epoch_enter();
+	socket_cb* listener = PORT_MAP[port];
+	int ok = (listener != NULL && listener->type == SOCKET_LISTENER);
+	epoch_exit(e);
+	@endcode
+
+	@returns a token for @c epoch_exit
+ */
+epoch_t epoch_enter(void);
+
+/**
+	@brief Exit an epoch read section.
+	@param e the token returned by the matching @c epoch_enter
+ */
+void epoch_exit(epoch_t e);
+
+/**
+	@brief Retire a kernel object.
+
+	The object must already be unreachable for new readers (e.g., removed
+	from any table). It will be reclaimed by calling @c reclaim(obj) after all 
+	current read sections have exited. 
+
+	This must be called with the kernel lock held. Reclamation functions are
+	also called with the kernel lock held.
+
+	@param obj the object to reclaim
+	@param reclaim the function that reclaims the object (e.g., @c free)
+ */
+void epoch_retire(void* obj, void (*reclaim)(void*));
+
+/**
+	@brief Reclaim retired objects, if possible.
+
+	This must be called with the kernel lock held.
+	@returns the number of objects reclaimed
+ */
+int epoch_poll(void);
+
+/**
+	@brief Reclaim all retired objects.
+
+	This waits (yielding the core) until all objects retired so far have been
+	reclaimed. It is used when a free list runs out, and at shutdown.
+	This must be called with the kernel lock held, and not from inside a read
+	section.
+ */
+void epoch_barrier(void);
+
+
 /** @brief Set the preemption status for the current core.
 
  	Preemption is disabled by disabling interrupts. 
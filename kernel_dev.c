@@ -5,6 +5,7 @@
 #include "kernel_sched.h"
 #include "kernel_streams.h"
 #include "kernel_proc.h"
+#include "kernel_poll.h"
 
 /*************************************
 
@@ -70,10 +71,14 @@ typedef struct serial_device_control_block {
   uint devno;
   Mutex spinlock;
   CondVar rx_ready;
+  int peeked;       /* 1 if a byte was read ahead by serial_poll */
+  char lookahead;   /* the byte read ahead */
 } serial_dcb_t;
 
 serial_dcb_t serial_dcb[MAX_TERMINALS];
 
+lock_class serial_lock_class = LOCK_CLASS("serial");
+
 
 
 /*
@@ -92,9 +97,25 @@ void serial_rx_handler()
     serial_dcb_t* dcb = &serial_dcb[i];
     Cond_Broadcast(&dcb->rx_ready);
   }
+  poll_notify_interrupt();
   if(pre) preempt_on;
 }
 
+/*
+  Get the next byte, if the device has one. The bios cannot check for
+  a byte without consuming it, so serial_poll reads ahead one byte, and
+  it is returned first.
+ */
+static int serial_getc(serial_dcb_t* dcb, char* c)
+{
+  if(dcb->peeked) {
+    *c = dcb->lookahead;
+    dcb->peeked = 0;
+    return 1;
+  }
+  return bios_read_serial(dcb->devno, c);
+}
+
 /*
   Read from the device, sleeping if needed.
  */
@@ -107,12 +128,13 @@ int serial_read(void* dev, char *buf, unsigned int size)
   uint count =  0;
 
   while(count<size) {
-    int valid = bios_read_serial(dcb->devno, &buf[count]);
+    int valid = serial_getc(dcb, &buf[count]);
     
     if (valid) {
       count++;
     }
     else if(count==0) {
+      if(io_nonblocking()) break;
       kernel_wait(&dcb->rx_ready, SCHED_IO);
     }
     else
@@ -121,7 +143,8 @@ int serial_read(void* dev, char *buf, unsigned int size)
 
   preempt_on;           /* Restart preemption */
 
-  return count;
+  /* Only a non-blocking read returns without data */
+  return (count==0 && size>0) ? WOULD_BLOCK : count;
 }
 
 
@@ -152,6 +175,7 @@ int serial_write(void* dev, const char* buf, unsigned int size)
     } 
     else if(count==0)
     {
+      if(io_nonblocking()) return WOULD_BLOCK;
       yield(SCHED_IO);
     }
     else
@@ -162,6 +186,22 @@ int serial_write(void* dev, const char* buf, unsigned int size)
 }
 
 
+/*
+  Readiness, for Poll. The rx interrupt notifies the pollers that wait 
+  for interrupts. Writes are polled, so they are always ready.
+ */
+unsigned int serial_poll(void* dev, unsigned int events, int arm)
+{
+  serial_dcb_t* dcb = (serial_dcb_t*)dev;
+
+  if(arm) poll_arm_interrupt();
+  if(! dcb->peeked)
+    dcb->peeked = bios_read_serial(dcb->devno, &dcb->lookahead);
+
+  return dcb->peeked ? (POLL_READABLE | POLL_WRITABLE) : POLL_WRITABLE;
+}
+
+
 int serial_close(void* dev) 
 {
   return 0;
@@ -180,7 +220,8 @@ file_ops serial_fops = {
   .Open = serial_open,
   .Read = serial_read,
   .Write = serial_write,
-  .Close = serial_close
+  .Close = serial_close,
+  .Poll = serial_poll
 };
 
 
@@ -210,7 +251,8 @@ void initialize_devices()
   for(int i=0; i<bios_serial_ports(); i++) {
     serial_dcb[i].devno = i;
     serial_dcb[i].rx_ready = COND_INIT;
-    serial_dcb[i].spinlock = MUTEX_INIT;
+    serial_dcb[i].peeked = 0;
+    serial_dcb[i].spinlock = MUTEX_INIT_CLASS(&serial_lock_class);
   }
 
   cpu_interrupt_handler(SERIAL_RX_READY, serial_rx_handler);
@@ -9,6 +9,7 @@
 
 #include "util.h"
 #include "bios.h"
+#include "tinyos.h"
 
 /**
   @file kernel_dev.h
@@ -92,9 +93,99 @@ typedef struct file_operations {
     - There was a I/O runtime problem.
      */
     int (*Close)(void* this);
+
+    /** @brief Set a stream option (optional).
+
+      Set option 'opt' of the stream to 'value', returning 0 on success
+      and -1 if the option or the value are not supported. A NULL method 
+      means that the stream has no options.
+     */
+    int (*SetOption)(void* this, stream_option opt, unsigned int value);
+
+    /** @brief Get a stream option (optional).
+
+      Return the value of option 'opt' of the stream, or -1 if the option
+      is not supported.
+     */
+    int (*GetOption)(void* this, stream_option opt);
+
+    /** @brief Read without the kernel lock (optional).
+
+      Like @c Read, but called without the kernel lock, inside an epoch
+      read section (so the stream object is not reclaimed during the call).
+      The method must not block, nor take the kernel lock. If it cannot
+      complete the call without the kernel lock, it returns 
+      @c NOLOCK_FALLBACK, having done nothing, and @c Read is called 
+      instead, with the kernel lock held. If it completes the call, but
+      leaves work that needs the kernel lock (such as waking up blocked
+      threads), it sets '*finish', and @c FinishNoLock is called after 
+      the read section.
+     */
+    int (*ReadNoLock)(void* this, char *buf, unsigned int size, int* finish);
+
+    /** @brief Write without the kernel lock (optional).
+
+      The analog of @c ReadNoLock for @c Write.
+     */
+    int (*WriteNoLock)(void* this, const char* buf, unsigned int size, int* finish);
+
+    /** @brief Finish a lockless call (optional).
+
+      Called with the kernel lock held, after @c ReadNoLock (if 'output' 
+      is 0) or @c WriteNoLock (if 'output' is 1) set '*finish'. The stream
+      is looked up again by its fid, so the call may find the fid closed, 
+      or even reused by another stream; the method must then do no harm.
+     */
+    void (*FinishNoLock)(void* this, int output);
+
+  /** @brief Return the pipe behind the stream (optional).
+
+      Return the pipe that the stream reads from (if 'output' is 0) or
+      writes to (if 'output' is 1), or NULL if there is none. This is
+      used by @c Splice to move data between pipe buffers.
+     */
+    struct pipe_control_block* (*GetPipe)(void* this, int output);
+
+  /** @brief Return the readiness of the stream (optional).
+
+      Return the mask of @c poll_event flags that hold for the stream,
+      where 'events' are the events of interest. This is called with the
+      kernel lock held, and must not block. If none of the events of
+      interest holds and 'arm' is non-zero, the method must make sure
+      that @c poll_notify() is called on the FCB of the stream when the 
+      readiness changes (or, for a change made by an interrupt handler, 
+      call @c poll_arm_interrupt()), and then check again (so that no 
+      change is missed in between). A NULL method means that the stream 
+      is always ready.
+
+      @see Poll
+     */
+    unsigned int (*Poll)(void* this, unsigned int events, int arm);
+
+  /** @brief Vectored read (optional).
+
+      Like @c Read, but into the 'iovcnt' segments of 'iov', in order, as a
+      single operation. A NULL method means that @c ReadV calls @c Read 
+      for each segment in turn.
+     */
+    int (*ReadV)(void* this, const iovec_t* iov, unsigned int iovcnt);
+
+  /** @brief Vectored write (optional).
+
+      The analog of @c ReadV for @c Write.
+     */
+    int (*WriteV)(void* this, const iovec_t* iov, unsigned int iovcnt);
 } file_ops;
 
 
+/**
+  @brief Returned by the lockless stream methods to ask for the locked path.
+
+  @see file_ops
+ */
+#define NOLOCK_FALLBACK (-1000)
+
+
 
 /**
   @brief The device type.
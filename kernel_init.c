@@ -9,6 +9,7 @@
 #include "kernel_proc.h"
 #include "kernel_dev.h"
 #include "kernel_streams.h"
+#include "kernel_cc.h"
 
 
 
@@ -55,6 +56,9 @@ void boot_tinyos_kernel()
 
   if(cpu_core_id==0) {
     /* Here, we could add cleanup after the scheduler has ended. */    
+
+    /* Reclaim all retired kernel objects */
+    epoch_barrier();
   }
 }
 
@@ -66,6 +70,10 @@ void boot(uint ncores, uint nterm, Task boot_task, int argl, void* args)
   boot_rec.args = args;
 
   vm_boot(boot_tinyos_kernel, ncores, nterm);
+
+#if defined(LOCK_STATISTICS)
+  lock_statistics_print(stderr);
+#endif
 }
 
 
@@ -1,3 +1,4 @@
+#include <string.h>
 #include "util.h"
 #include "tinyos.h"
 #include "kernel_streams.h"
@@ -5,6 +6,8 @@
 #include "kernel_dev.h"
 #include "kernel_cc.h"
 #include "kernel_pipe.h"
+#include "kernel_poll.h"
+#include "kernel_slab.h"
 
 
 /*File ops struct for the reader FCB */
@@ -12,7 +15,14 @@ static file_ops reader_file_ops = {
 	.Open  = open_pipe,
 	.Read  = pipe_read,
 	.Write = disable_write,/*Reader end cannot write in the buffer */
-	.Close = pipe_reader_close
+	.Close = pipe_reader_close,
+	.ReadV = pipe_readv,
+	.SetOption = pipe_set_option,
+	.GetOption = pipe_get_option,
+	.ReadNoLock = pipe_read_nolock,
+	.FinishNoLock = pipe_finish_nolock,
+	.GetPipe = pipe_reader_get_pipe,
+	.Poll = pipe_reader_poll
 };
 
 /*FIle ops struct for the Writer FCB */
@@ -20,39 +30,131 @@ static file_ops writer_file_ops = {
 	.Open  = open_pipe,
 	.Read  = disable_read,/*Writer end cannot read from the buffer */
 	.Write = pipe_write,
-	.Close = pipe_writer_close
+	.Close = pipe_writer_close,
+	.WriteV = pipe_writev,
+	.SetOption = pipe_set_option,
+	.GetOption = pipe_get_option,
+	.WriteNoLock = pipe_write_nolock,
+	.FinishNoLock = pipe_finish_nolock,
+	.GetPipe = pipe_writer_get_pipe,
+	.Poll = pipe_writer_poll
 };
 
 
 
-int sys_Pipe(pipe_t* pipe)
+/* Pipe statistics, protected by the kernel lock */
+static pipeinfo pipe_stats;
+
+size_t pipe_statistics_snapshot(void** records)
 {
+	pipeinfo* rec = xmalloc(sizeof(pipeinfo));
+	*rec = pipe_stats;
+	*records = rec;
+	return 1;
+}
 
-	Fid_t fid[2]; //fids
-	FCB* fcb[2]; //fcbs
+/* The pipes made by Pipe, protected by the kernel lock */
+static rlnode pipe_list = { .obj = NULL, .prev = &pipe_list, .next = &pipe_list };
 
-	if(! FCB_reserve( 2, fid, fcb ))
-		return -1; /*No fcbs left */
+void pipe_stream_info(pipe_cb* picb, streaminfo* si)
+{
+	si->bytes_read = picb->bytes_read;
+	si->bytes_written = picb->bytes_written;
+	si->reads = picb->reads;
+	si->writes = picb->writes;
+	si->read_wait_ns = picb->read_wait;
+	si->write_wait_ns = picb->write_wait;
+	si->rxqueued = picb->w_position - picb->r_position;
+	si->rcvbuf = picb->capacity;
+}
 
-	//update the read,write fid of pipe
-	pipe->read = fid[0];
-	pipe->write = fid[1];
+size_t pipe_streams_snapshot(void** records)
+{
+	size_t n = rlist_len(&pipe_list);
+	streaminfo* info = xmalloc((n ? n : 1) * sizeof(streaminfo));
+	memset(info, 0, (n ? n : 1) * sizeof(streaminfo));
+
+	streaminfo* si = info;
+	for(rlnode* p = pipe_list.next; p != &pipe_list; p = p->next, si++) {
+		pipe_cb* picb = p->obj;
+		si->kind = STREAMINFO_PIPE;
+		si->id = picb->id;
+		si->port = NOPORT;
+		pipe_stream_info(picb, si);
+	}
 
+	*records = info;
+	return n;
+}
 
-	pipe_cb* picb = xmalloc(sizeof(pipe_cb));
 
-	/*Initialize pipe control block */
+/* Round a legal capacity up to a power of two, no less than PIPE_MIN_CAPACITY */
+static unsigned int pipe_round_capacity(unsigned int capacity)
+{
+	unsigned int cap = PIPE_MIN_CAPACITY;
+	while(cap < capacity) cap <<= 1;
+	return cap;
+}
+
+
+static slab_cache pipe_cache = SLAB_CACHE_PERCORE("pipe", sizeof(pipe_cb));
+
+pipe_cb* pipe_create(FCB* reader, FCB* writer, unsigned int capacity)
+{
+	pipe_cb* picb = slab_alloc(&pipe_cache);
 
-	picb->reader = fcb[0];
-	picb->writer = fcb[1];  
+	picb->reader = reader;
+	picb->writer = writer;
 
 	picb->has_space = COND_INIT;
 	picb->has_data = COND_INIT;
 
 	picb->w_position = 0;
 	picb->r_position = 0;
+	picb->wtoken = picb->rtoken = 0;
+
+	picb->autotune = (capacity == PIPE_AUTO);
+	picb->capacity = pipe_round_capacity(picb->autotune ? PIPE_AUTO_INITIAL : capacity);
+	picb->BUFFER = NULL;   /* Taken from the pool at the first write */
+	picb->stalls = picb->drains = picb->peak = 0;
+
+	picb->readers_waiting = picb->writers_waiting = 0;
+	picb->rcvlowat = picb->sndlowat = 0;
+	picb->message = 0;
+	picb->msg_need = 0;
+
+	picb->bytes_read = picb->reads = 0;
+	picb->bytes_written = picb->writes = 0;
+	picb->read_wait = picb->write_wait = 0;
+	picb->loan_head = picb->loan_tail = 0;
+	picb->loaned = 0;
+	rlnode_init(&picb->live, picb);
+
+	pipe_stats.created++;
+	pipe_stats.live++;
+	picb->id = pipe_stats.created;
+
+	return picb;
+}
+
 
-	picb->remaining_space = PIPE_BUFFER_SIZE;
+int sys_PipeEx(pipe_t* pipe, unsigned int capacity)
+{
+	if(capacity > PIPE_MAX_CAPACITY)
+		return -1;
+
+	Fid_t fid[2]; //fids
+	FCB* fcb[2]; //fcbs
+
+	if(! FCB_reserve( 2, fid, fcb ))
+		return -1; /*No fcbs left */
+
+	//update the read,write fid of pipe
+	pipe->read = fid[0];
+	pipe->write = fid[1];
+
+	/*Initialize pipe control block */
+	pipe_cb* picb = pipe_create(fcb[0], fcb[1], capacity);
 
 	/*Initialize the fcb's attributes: */
 
@@ -61,6 +163,7 @@ int sys_Pipe(pipe_t* pipe)
 
 	fcb[0]->streamobj = picb;
 	fcb[1]->streamobj = picb;
+	rlist_push_back(&pipe_list, &picb->live);
 	//no need to increase refcounter of the above fcbs , because it is increased in the FCB_reserve function.
 
 
@@ -68,82 +171,1197 @@ int sys_Pipe(pipe_t* pipe)
 }
 
 
-int pipe_write(void* pipecb_t,const char *buf , unsigned int size)
+int sys_Pipe(pipe_t* pipe)
 {
-	pipe_cb* picb = (pipe_cb*) pipecb_t ; // cast to pipe control block
-	if(!picb) return -1;  //pipe control block does not exist.
+	return sys_PipeEx(pipe, PIPE_BUFFER_SIZE);
+}
 
-	//check if writer end is closed!
-	if(!picb->writer) return -1;
 
-	//if reader end is closed, there is no reason to write on the pipe.
-	if(!picb->reader) return -1;
+/*
+	Concurrency. The ring is a single-producer/single-consumer queue: the 
+	write position is only advanced by the thread that holds the write 
+	token, and the read position only by the thread that holds the read 
+	token. A token is held just for the copy, never while blocking. 
+	Therefore, when each end is used by one thread at a time, the ring 
+	operations need no lock at all, and the lockless paths 
+	(pipe_read_nolock, pipe_write_nolock) can run concurrently with each 
+	other and with the kernel-locked paths. A resize takes both tokens.
+ */
+static inline int pipe_token_try(char* token)
+{
+	return __atomic_exchange_n(token, 1, __ATOMIC_ACQUIRE) == 0;
+}
 
-	int written_bytes_counter; // total bytes written on the pipe.
+static inline void pipe_token_acquire(char* token)
+{
+	while(! pipe_token_try(token))
+		while(__atomic_load_n(token, __ATOMIC_RELAXED)) {
+#if defined(__x86__) || defined(__x86_64__)
+			__builtin_ia32_pause();
+#endif
+		}
+}
 
-	/*block in condition variable, until there is at least 1 free space to write or reader end is closed */
-	while(picb->remaining_space == 0 && picb->reader != NULL )
-		kernel_wait( &(picb->has_space),SCHED_PIPE);
+static inline void pipe_token_release(char* token)
+{
+	__atomic_store_n(token, 0, __ATOMIC_RELEASE);
+}
 
-	//check if reader or writer ends are closed.
-	if(!picb->reader || !picb->writer)
-		return -1;
 
-	//to be here, there is free remaining space to write and both ends are open.
-	for( written_bytes_counter = 0 ; written_bytes_counter < picb->remaining_space ; written_bytes_counter++ ){
+/* Number of bytes currently held in the buffer */
+static inline unsigned int pipe_used(pipe_cb* picb)
+{
+	return __atomic_load_n(&picb->w_position, __ATOMIC_ACQUIRE) 
+		- __atomic_load_n(&picb->r_position, __ATOMIC_ACQUIRE);
+}
+
+/*
+	Buffers. A pipe takes its buffer from the buffer pool when data is 
+	written to it, and gives it back when a reader drains it, so that idle
+	pipes hold no memory. Only the token holders access the buffer: it is
+	attached holding the write token, and detached holding both tokens.
+	The buffer statistics are updated atomically, as the lockless paths
+	attach and detach buffers too.
+ */
+static void ring_attach(pipe_cb* picb)
+{
+	if(picb->BUFFER != NULL) return;
+	picb->BUFFER = buffer_alloc(picb->capacity);
+	__atomic_fetch_add(&pipe_stats.buffered, picb->capacity, __ATOMIC_RELAXED);
+}
+
+static void ring_detach(pipe_cb* picb)
+{
+	if(picb->BUFFER == NULL) return;
+	buffer_free(picb->BUFFER, picb->capacity);
+	picb->BUFFER = NULL;
+	__atomic_fetch_sub(&pipe_stats.buffered, picb->capacity, __ATOMIC_RELAXED);
+}
 
-		//check if 'size' amount of bytes have been written.
-		if(written_bytes_counter == size)
+/* 
+	Detach the buffer of an empty pipe, holding the read token. If a writer
+	holds the write token, it is about to fill the buffer, and we keep it.
+ */
+static void ring_release_drained(pipe_cb* picb)
+{
+	if(picb->BUFFER == NULL || pipe_used(picb) != 0) return;
+	if(! pipe_token_try(&picb->wtoken)) return;
+	if(pipe_used(picb) == 0) ring_detach(picb);
+	pipe_token_release(&picb->wtoken);
+}
+
+/*
+	Copy n bytes into, resp. out of, the ring at a position. Since the 
+	capacity is a power of two, the bytes are at most two contiguous 
+	segments: from the offset to the end of the buffer, and from the 
+	start of the buffer onwards.
+ */
+static void ring_copy_in(pipe_cb* picb, unsigned int pos, const char* buf, unsigned int n)
+{
+	unsigned int off = pos & (picb->capacity-1);
+	unsigned int first = picb->capacity - off;
+	if(first > n) first = n;
+
+	memcpy(picb->BUFFER + off, buf, first);
+	memcpy(picb->BUFFER, buf + first, n - first);
+}
+
+static void ring_copy_out(pipe_cb* picb, unsigned int pos, char* buf, unsigned int n)
+{
+	unsigned int off = pos & (picb->capacity-1);
+	unsigned int first = picb->capacity - off;
+	if(first > n) first = n;
+
+	memcpy(buf, picb->BUFFER + off, first);
+	memcpy(buf + first, picb->BUFFER, n - first);
+}
+
+/*
+	Copy n bytes into, resp. out of, the ring at a position, from, resp. to,
+	a sequence of segments. The segments hold at least n bytes.
+ */
+static void ring_copy_in_v(pipe_cb* picb, unsigned int pos, const iovec_t* iov, unsigned int n)
+{
+	for(; n > 0; iov++) {
+		unsigned int k = (iov->len < n) ? iov->len : n;
+		ring_copy_in(picb, pos, iov->base, k);
+		pos += k;
+		n -= k;
+	}
+}
+
+static void ring_copy_out_v(pipe_cb* picb, unsigned int pos, const iovec_t* iov, unsigned int n)
+{
+	for(; n > 0; iov++) {
+		unsigned int k = (iov->len < n) ? iov->len : n;
+		ring_copy_out(picb, pos, iov->base, k);
+		pos += k;
+		n -= k;
+	}
+}
+
+/* Publish a new write position, after the data, and track the peak fill */
+static void ring_publish_write(pipe_cb* picb, unsigned int w)
+{
+	__atomic_store_n(&picb->w_position, w, __ATOMIC_RELEASE);
+
+	unsigned int used = w - __atomic_load_n(&picb->r_position, __ATOMIC_RELAXED);
+	if(used > picb->peak) picb->peak = used;
+}
+
+/* Copy up to n bytes of the segments into the ring, holding the write token. */
+static unsigned int ring_put(pipe_cb* picb, const iovec_t* iov, unsigned int n)
+{
+	unsigned int w = picb->w_position;
+	unsigned int space = picb->capacity - (w - __atomic_load_n(&picb->r_position, __ATOMIC_ACQUIRE));
+	if(n > space) n = space;
+	if(n == 0) return 0;
+
+	ring_attach(picb);
+	ring_copy_in_v(picb, w, iov, n);
+	ring_publish_write(picb, w + n);
+	return n;
+}
+
+/* Copy up to n bytes out of the ring into the segments, holding the read token. */
+static unsigned int ring_get(pipe_cb* picb, const iovec_t* iov, unsigned int n)
+{
+	unsigned int r = picb->r_position;
+	unsigned int used = __atomic_load_n(&picb->w_position, __ATOMIC_ACQUIRE) - r;
+	if(n > used) n = used;
+
+	ring_copy_out_v(picb, r, iov, n);
+	__atomic_store_n(&picb->r_position, r + n, __ATOMIC_RELEASE);
+	return n;
+}
+
+
+/*
+	Message mode. Each message is stored in the ring as a header holding
+	its length, followed by its bytes. A message is published as a whole,
+	so a reader that finds the ring non-empty finds a whole message. 
+	Messages are never empty, and never larger than the capacity minus 
+	the header.
+ */
+typedef unsigned int msg_header;
+
+/* Put a message, holding the write token. Returns 0 if it does not fit yet. */
+static unsigned int msg_put(pipe_cb* picb, const iovec_t* iov, unsigned int n)
+{
+	unsigned int w = picb->w_position;
+	unsigned int space = picb->capacity - (w - __atomic_load_n(&picb->r_position, __ATOMIC_ACQUIRE));
+	if(n + sizeof(msg_header) > space) return 0;
+
+	ring_attach(picb);
+	msg_header h = n;
+	ring_copy_in(picb, w, (const char*) &h, sizeof(h));
+	ring_copy_in_v(picb, w + sizeof(h), iov, n);
+	ring_publish_write(picb, w + sizeof(h) + n);
+	return n;
+}
+
+/* The length of the next message, or 0 if the ring is empty, holding the read token */
+static unsigned int msg_peek(pipe_cb* picb)
+{
+	unsigned int r = picb->r_position;
+	if(__atomic_load_n(&picb->w_position, __ATOMIC_ACQUIRE) == r) return 0;
+
+	msg_header h;
+	ring_copy_out(picb, r, (char*) &h, sizeof(h));
+	return h;
+}
+
+/* 
+	Get a message, holding the read token. Returns 0 if the ring is empty,
+	and -1 if the message does not fit in the buffer, leaving it in place.
+ */
+static int msg_get(pipe_cb* picb, const iovec_t* iov, unsigned int size)
+{
+	unsigned int n = msg_peek(picb);
+	if(n == 0) return 0;
+	if(n > size) return -1;
+
+	unsigned int r = picb->r_position + sizeof(msg_header);
+	ring_copy_out_v(picb, r, iov, n);
+	__atomic_store_n(&picb->r_position, r + n, __ATOMIC_RELEASE);
+	return n;
+}
+
+/* The largest message that a pipe can ever hold */
+#define PIPE_MAX_MESSAGE (PIPE_MAX_CAPACITY - sizeof(msg_header))
+
+
+/*
+	Watermarks. A reader blocks until RCVLOWAT bytes are available (or the 
+	write end closes), and a writer blocks while the buffer is full. Blocked 
+	readers are woken only when the data reaches RCVLOWAT, and blocked 
+	writers only when the free space reaches SNDLOWAT. Both are capped to 
+	half the capacity: then a blocked writer and a blocked reader cannot 
+	coexist, and the wakeup is guaranteed to come. In message mode, a 
+	reader waits for one whole message, and RCVLOWAT does not apply.
+ */
+static inline unsigned int pipe_rcvlowat(pipe_cb* picb)
+{
+	if(picb->message) return 1;
+	unsigned int lowat = picb->rcvlowat ? picb->rcvlowat : 1;
+	return (lowat < picb->capacity/2) ? lowat : picb->capacity/2;
+}
+
+static inline unsigned int pipe_sndlowat(pipe_cb* picb)
+{
+	unsigned int lowat = picb->sndlowat ? picb->sndlowat : picb->capacity/4;
+	return (lowat < picb->capacity/2) ? lowat : picb->capacity/2;
+}
+
+/* 
+	The free space that wakes up blocked writers. In message mode, this
+	may be more than SNDLOWAT, if a blocked message needs more. 
+ */
+static inline unsigned int pipe_wake_space(pipe_cb* picb)
+{
+	unsigned int lowat = pipe_sndlowat(picb);
+	unsigned int need = __atomic_load_n(&picb->msg_need, __ATOMIC_RELAXED);
+	return (need > lowat) ? need : lowat;
+}
+
+/*
+	Wakeups. A thread about to block increments the waiter count, re-checks 
+	its condition and sleeps, all under the kernel lock. The thread that wakes
+	it clears the count and broadcasts, also under the kernel lock. The count
+	is written before the waiter re-checks the positions, and the positions 
+	are written before the waker reads the count, so a lockless waker cannot
+	miss a sleeper: the waiter's increment and the waker's fence order the
+	two. The counts are read without the lock, so that nobody takes the 
+	lock when there are no waiters. Pollers register in the counts too.
+ */
+static void pipe_wake_readers(pipe_cb* picb)
+{
+	if(picb->readers_waiting) { 
+		picb->readers_waiting = 0; 
+		kernel_broadcast(&picb->has_data); 
+		poll_notify(picb->reader);
+	}
+}
+
+static void pipe_wake_writers(pipe_cb* picb)
+{
+	if(picb->writers_waiting) { 
+		picb->writers_waiting = 0; 
+		picb->msg_need = 0;
+		kernel_broadcast(&picb->has_space); 
+		poll_notify(picb->writer);
+	}
+}
+
+static inline int pipe_has_waiters(unsigned int* waiting)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return __atomic_load_n(waiting, __ATOMIC_RELAXED) != 0;
+}
+
+/* 
+	Wake up all waiters, when the conditions they wait for may have changed 
+	in ways that the watermarks do not detect.
+ */
+static void pipe_wake_all(pipe_cb* picb)
+{
+	pipe_wake_readers(picb);
+	pipe_wake_writers(picb);
+}
+
+
+/* Count a read, resp. a write, of n bytes, holding the read, resp. write, token */
+static inline void pipe_count_read(pipe_cb* picb, int n)
+{
+	if(n <= 0) return;
+	picb->bytes_read += n;
+	picb->reads++;
+}
+
+static inline void pipe_count_write(pipe_cb* picb, int n)
+{
+	if(n <= 0) return;
+	picb->bytes_written += n;
+	picb->writes++;
+}
+
+/* Block on a condition of the pipe, adding the time blocked to a wait counter */
+static void pipe_wait(CondVar* cv, uint64_t* waited)
+{
+	uint64_t start = bios_clock_ns();
+	kernel_wait(cv, SCHED_PIPE);
+	*waited += bios_clock_ns() - start;
+}
+
+/*
+	Completion queues. A queue is referenced by its FCB and by each loan
+	that will complete to it, and it is freed with the last reference.
+	The number of outstanding sends is bounded by the size of the ring, 
+	so the ring can never overflow. Completion queues are accessed under 
+	the kernel lock.
+
+	Once the FCB is closed, the sender may be gone, and its buffers with 
+	it, so the loans still queued are copied (see cq_close).
+ */
+struct completion_queue {
+	unsigned int refcount;       /* the FCB, and the loans */
+	unsigned int outstanding;    /* the loans, and the records not read */
+	unsigned int head, tail;     /* the next record to read, and to add */
+	zc_completion ring[COMPLETION_QUEUE_SIZE];
+	CondVar ready;               /* readers wait for a record here */
+	FCB* fcb;                    /* the FCB, for its pollers */
+	rlnode loans;                /* the loans queued in pipes */
+	int closed;                  /* set when the FCB is closed */
+};
+
+static void cq_decref(completion_queue* cq)
+{
+	if(--cq->refcount == 0) free(cq);
+}
+
+static void cq_complete(completion_queue* cq, unsigned long tag, unsigned int len, int status)
+{
+	if(cq->closed)
+		cq->outstanding--;
+	else {
+		cq->ring[cq->tail++ % COMPLETION_QUEUE_SIZE] = (zc_completion) { tag, len, status };
+		kernel_broadcast(&cq->ready);
+		poll_notify(cq->fcb);
+	}
+	cq_decref(cq);
+}
+
+static int cq_read(void* this, char* buf, unsigned int size)
+{
+	completion_queue* cq = (completion_queue*) this;
+	if(cq == NULL || size < sizeof(zc_completion)) return -1;
+
+	while(cq->head == cq->tail) {
+		if(io_nonblocking()) return WOULD_BLOCK;
+		kernel_wait(&cq->ready, SCHED_PIPE);
+	}
+
+	unsigned int n = 0;
+	for(; cq->head != cq->tail && size - n >= sizeof(zc_completion); n += sizeof(zc_completion)) {
+		memcpy(buf + n, &cq->ring[cq->head++ % COMPLETION_QUEUE_SIZE], sizeof(zc_completion));
+		cq->outstanding--;
+	}
+	return n;
+}
+
+static unsigned int cq_poll(void* this, unsigned int events, int arm)
+{
+	completion_queue* cq = (completion_queue*) this;
+	if(cq == NULL) return POLL_HANGUP;
+	return (cq->head != cq->tail) ? POLL_READABLE : 0;
+}
+
+/* 
+	Copy the unread part of each loan, since the sender's buffers may go
+	away with the queue. The readers copy loans under the kernel lock, so 
+	no loan is being read now.
+ */
+static int cq_close(void* this)
+{
+	completion_queue* cq = (completion_queue*) this;
+	if(cq == NULL) return -1;
+	cq->closed = 1;
+
+	for(rlnode* p = cq->loans.next; p != &cq->loans; p = p->next) {
+		pipe_loan* loan = p->obj;
+		unsigned int n = loan->len - loan->off;
+		char* copy = xmalloc(n);
+		memcpy(copy, loan->buf + loan->off, n);
+		loan->buf = copy;
+		loan->len = n;
+		loan->off = 0;
+		loan->copied = 1;
+		pipe_stats.loans_copied++;
+	}
+
+	cq_decref(cq);
+	return 0;
+}
+
+static file_ops cq_file_ops = {
+	.Open = open_pipe,
+	.Read = cq_read,
+	.Write = disable_write,
+	.Close = cq_close,
+	.Poll = cq_poll
+};
+
+Fid_t sys_OpenCompletionQueue()
+{
+	Fid_t fid;
+	FCB* fcb;
+	if(! FCB_reserve(1, &fid, &fcb))
+		return NOFILE;
+
+	completion_queue* cq = xmalloc(sizeof(completion_queue));
+	cq->refcount = 1;
+	cq->outstanding = 0;
+	cq->head = cq->tail = 0;
+	cq->ready = COND_INIT;
+	cq->fcb = fcb;
+	rlnode_new(&cq->loans);
+	cq->closed = 0;
+
+	fcb->streamobj = cq;
+	fcb->streamfunc = &cq_file_ops;
+	return fid;
+}
+
+completion_queue* get_completion_queue(Fid_t fid)
+{
+	FCB* fcb = get_fcb(fid);
+	if(fcb == NULL || fcb->streamfunc != &cq_file_ops) return NULL;
+	return (completion_queue*) fcb->streamobj;
+}
+
+
+/*
+	Zero-copy sends. A loan takes its place in the stream at the write 
+	position when it is queued, ahead of the ring bytes written after it,
+	which are stored from that position onwards. So, a reader copies out
+	of the ring up to the start of the first loan, then out of the loan,
+	and then continues from the same ring position. The loans of a pipe
+	do not take space in the ring, but they count as data for the readers.
+
+	The lockless readers never read a loan, since completing it needs the
+	kernel lock: they stop at the start of the first loan, and fall back.
+	A reader loads the write position before the loan queue, so that it
+	sees every loan queued before the ring bytes that it may read.
+ */
+static inline int pipe_has_loans(pipe_cb* picb)
+{
+	return picb->loan_head != __atomic_load_n(&picb->loan_tail, __ATOMIC_ACQUIRE);
+}
+
+/* The bytes available to readers, in the ring and in the loans */
+static inline unsigned int pipe_avail(pipe_cb* picb)
+{
+	return pipe_used(picb) + __atomic_load_n(&picb->loaned, __ATOMIC_RELAXED);
+}
+
+/* Retire the first loan, holding the read token, under the kernel lock */
+static void pipe_retire_loan(pipe_cb* picb, int status)
+{
+	pipe_loan* loan = &picb->loans[picb->loan_head % PIPE_MAX_LOANS];
+	__atomic_fetch_sub(&picb->loaned, loan->len - loan->off, __ATOMIC_RELAXED);
+	rlist_remove(&loan->node);
+	if(loan->copied) free((char*) loan->buf);
+	cq_complete(loan->cq, loan->tag, loan->len, status);
+	__atomic_store_n(&picb->loan_head, picb->loan_head + 1, __ATOMIC_RELEASE);
+
+	/* A sender may be waiting for the loan's place */
+	pipe_wake_writers(picb);
+}
+
+/* Rebase the loans to a new read position, holding both tokens */
+static void pipe_rebase_loans(pipe_cb* picb, unsigned int old_r, unsigned int new_r)
+{
+	for(unsigned int i = picb->loan_head; i != picb->loan_tail; i++)
+		picb->loans[i % PIPE_MAX_LOANS].start += new_r - old_r;
+}
+
+int pipe_loan_buffer(pipe_cb* picb, const char* buf, unsigned int len, completion_queue* cq, unsigned long tag)
+{
+	if(picb == NULL || buf == NULL || len == 0 || cq == NULL) return -1;
+	if(cq->outstanding == COMPLETION_QUEUE_SIZE) return -1;
+
+	/* Hold a place in the completion queue, while we may block */
+	cq->outstanding++;
+	cq->refcount++;
+
+	while(1) {
+		if(picb->writer == NULL || picb->reader == NULL || picb->message) {
+			cq->outstanding--;
+			cq_decref(cq);
+			return -1;
+		}
+		if(picb->loan_tail - picb->loan_head < PIPE_MAX_LOANS) break;
+
+		if(io_nonblocking()) {
+			cq->outstanding--;
+			cq_decref(cq);
+			return WOULD_BLOCK;
+		}
+		__atomic_fetch_add(&picb->writers_waiting, 1, __ATOMIC_SEQ_CST);
+		if(picb->loan_tail - picb->loan_head == PIPE_MAX_LOANS && picb->reader != NULL)
+			pipe_wait(&picb->has_space, &picb->write_wait);
+	}
+
+	/* The write token fixes the place of the loan among the ring writes */
+	pipe_token_acquire(&picb->wtoken);
+	pipe_loan* loan = &picb->loans[picb->loan_tail % PIPE_MAX_LOANS];
+	*loan = (pipe_loan) { .buf = buf, .len = len, .off = 0, .start = picb->w_position, .cq = cq, .tag = tag };
+	rlist_push_back(&cq->loans, rlnode_init(&loan->node, loan));
+	__atomic_fetch_add(&picb->loaned, len, __ATOMIC_RELAXED);
+	__atomic_store_n(&picb->loan_tail, picb->loan_tail + 1, __ATOMIC_RELEASE);
+	pipe_count_write(picb, len);
+	pipe_token_release(&picb->wtoken);
+
+	pipe_stats.loaned += len;
+
+	if(pipe_has_waiters(&picb->readers_waiting) && pipe_avail(picb) >= pipe_rcvlowat(picb))
+		pipe_wake_readers(picb);
+	return 0;
+}
+
+
+/* A position in a sequence of segments, for copying into them */
+typedef struct iov_cursor {
+	const iovec_t* iov;
+	unsigned int off;
+} iov_cursor;
+
+static void iov_put(iov_cursor* c, const char* src, unsigned int n)
+{
+	while(n > 0) {
+		unsigned int k = c->iov->len - c->off;
+		if(k > n) k = n;
+		memcpy((char*) c->iov->base + c->off, src, k);
+		src += k;
+		n -= k;
+		c->off += k;
+		if(c->off == c->iov->len) { c->iov++; c->off = 0; }
+	}
+}
+
+/*
+	Copy up to n bytes of the stream into the segments, out of the ring
+	and the loans, holding the read token. Loans are read only if lend
+	is set, under the kernel lock; a loan that is read to the end retires.
+ */
+static unsigned int stream_get(pipe_cb* picb, const iovec_t* iov, unsigned int n, int lend)
+{
+	iov_cursor c = { iov, 0 };
+	unsigned int done = 0;
+
+	while(done < n) {
+		unsigned int r = picb->r_position;
+		unsigned int limit = __atomic_load_n(&picb->w_position, __ATOMIC_ACQUIRE);
+
+		if(pipe_has_loans(picb)) {
+			pipe_loan* loan = &picb->loans[picb->loan_head % PIPE_MAX_LOANS];
+			if(loan->start == r) {
+				if(! lend) break;
+				unsigned int k = loan->len - loan->off;
+				if(k > n - done) k = n - done;
+				iov_put(&c, loan->buf + loan->off, k);
+				loan->off += k;
+				__atomic_fetch_sub(&picb->loaned, k, __ATOMIC_RELAXED);
+				done += k;
+				if(loan->off == loan->len) pipe_retire_loan(picb, 0);
+				continue;
+			}
+			limit = loan->start;
+		}
+
+		unsigned int k = limit - r;
+		if(k > n - done) k = n - done;
+		if(k == 0) break;
+
+		unsigned int off = r & (picb->capacity-1);
+		unsigned int first = picb->capacity - off;
+		if(first > k) first = k;
+		iov_put(&c, picb->BUFFER + off, first);
+		iov_put(&c, picb->BUFFER, k - first);
+		__atomic_store_n(&picb->r_position, r + k, __ATOMIC_RELEASE);
+		done += k;
+	}
+	return done;
+}
+
+/* Retire all the loans, when the read end closes */
+static void pipe_cancel_loans(pipe_cb* picb)
+{
+	while(pipe_has_loans(picb))
+		pipe_retire_loan(picb, -1);
+}
+
+
+/* Put, resp. get, n bytes of a sequence of segments in the mode of the pipe */
+static inline unsigned int pipe_put(pipe_cb* picb, const iovec_t* iov, unsigned int n)
+{
+	if(! picb->message) return ring_put(picb, iov, n);
+	return (n > 0) ? msg_put(picb, iov, n) : 0;
+}
+
+static inline int pipe_get(pipe_cb* picb, const iovec_t* iov, unsigned int n, int lend)
+{
+	return picb->message ? msg_get(picb, iov, n) : (int) stream_get(picb, iov, n, lend);
+}
+
+
+/*
+	Move the contents of the pipe to a new buffer of the given capacity,
+	growing it if needed to hold them. An empty pipe just gives back its
+	buffer. The old buffer goes back to the pool at once, since we hold
+	both tokens.
+ */
+static void pipe_resize(pipe_cb* picb, unsigned int capacity)
+{
+	pipe_token_acquire(&picb->wtoken);
+	pipe_token_acquire(&picb->rtoken);
+
+	unsigned int used = pipe_used(picb);
+	while(capacity < used) capacity <<= 1;
+
+	if(capacity != picb->capacity) {
+		unsigned int r = picb->r_position;
+		char* buf = NULL;
+		if(used > 0) {
+			buf = buffer_alloc(capacity);
+			iovec_t v = { buf, used };
+			ring_get(picb, &v, used);
+			__atomic_fetch_add(&pipe_stats.buffered, capacity, __ATOMIC_RELAXED);
+		}
+		ring_detach(picb);
+		pipe_rebase_loans(picb, r, 0);
+
+		picb->BUFFER = buf;
+		picb->capacity = capacity;
+		picb->r_position = 0;
+		picb->w_position = used;
+		picb->peak = used;
+	}
+	picb->stalls = picb->drains = 0;
+
+	pipe_token_release(&picb->rtoken);
+	pipe_token_release(&picb->wtoken);
+
+	/* The watermarks have moved */
+	pipe_wake_all(picb);
+}
+
+
+static int pipe_set_capacity(pipe_cb* picb, unsigned int capacity)
+{
+	if(picb == NULL || capacity > PIPE_MAX_CAPACITY) return -1;
+
+	picb->autotune = (capacity == PIPE_AUTO);
+	if(picb->autotune) return 0;   /* Keep the current capacity as a starting point */
+
+	/* pipe_resize never drops buffered data */
+	pipe_resize(picb, pipe_round_capacity(capacity));
+	pipe_stats.resizes++;
+	return 0;
+}
+
+
+/*
+	Auto-tuning. A writer that finds the buffer full counts a stall, and 
+	after PIPE_GROW_STALLS stalls the buffer doubles. A reader that empties
+	the buffer counts a drain; every PIPE_SHRINK_DRAINS drains, if the buffer
+	was never more than a quarter full, it is halved.
+ */
+static int pipe_autogrow(pipe_cb* picb)
+{
+	if(++picb->stalls < PIPE_GROW_STALLS || picb->capacity >= PIPE_AUTO_MAX)
+		return 0;
+
+	pipe_resize(picb, picb->capacity << 1);
+	pipe_stats.grows++;
+	return 1;
+}
+
+/* Called by the reader, under the kernel lock, after PIPE_SHRINK_DRAINS drains */
+static void pipe_autoshrink(pipe_cb* picb)
+{
+	if(picb->peak <= picb->capacity/4 && picb->capacity > PIPE_MIN_CAPACITY) {
+		pipe_resize(picb, picb->capacity >> 1);
+		pipe_stats.shrinks++;
+	} else {
+		picb->stalls = picb->drains = 0;
+		picb->peak = pipe_used(picb);
+	}
+}
+
+/* Count a drain, holding the read token. Returns 1 if the pipe should be checked for shrinking. */
+static inline int pipe_count_drain(pipe_cb* picb)
+{
+	return picb->autotune && picb->w_position == picb->r_position 
+		&& ++picb->drains >= PIPE_SHRINK_DRAINS;
+}
+
+
+/* The mode can only change while the pipe is empty, since the data formats differ */
+static int pipe_set_message_mode(pipe_cb* picb, unsigned int value)
+{
+	if(value > 1) return -1;
+
+	pipe_token_acquire(&picb->wtoken);
+	pipe_token_acquire(&picb->rtoken);
+	int ok = (picb->message == (int)value || (pipe_used(picb) == 0 && !pipe_has_loans(picb)));
+	if(ok) picb->message = value;
+	pipe_token_release(&picb->rtoken);
+	pipe_token_release(&picb->wtoken);
+
+	if(ok) pipe_wake_all(picb);
+	return ok ? 0 : -1;
+}
+
+static int pipe_next_message(pipe_cb* picb)
+{
+	if(! picb->message) return -1;
+
+	pipe_token_acquire(&picb->rtoken);
+	int n = msg_peek(picb);
+	pipe_token_release(&picb->rtoken);
+	return n;
+}
+
+int pipe_set_option(void* pipecb_t, stream_option opt, unsigned int value)
+{
+	pipe_cb* picb = (pipe_cb*) pipecb_t;
+	if(picb == NULL) return -1;
+
+	switch(opt) {
+		case STREAM_RCVBUF:
+		case STREAM_SNDBUF:
+			return pipe_set_capacity(picb, value);
+		case STREAM_RCVLOWAT:
+			if(value > PIPE_MAX_CAPACITY) return -1;
+			picb->rcvlowat = value;
+			break;
+		case STREAM_SNDLOWAT:
+			if(value > PIPE_MAX_CAPACITY) return -1;
+			picb->sndlowat = value;
 			break;
+		case STREAM_MESSAGE:
+			return pipe_set_message_mode(picb, value);
+		default:
+			return -1;
+	}
+	pipe_wake_all(picb);
+	return 0;
+}
 
-		picb->BUFFER[picb->w_position] = buf[written_bytes_counter];
-		picb->w_position = (picb->w_position + 1) % PIPE_BUFFER_SIZE; // next write position.
-		picb->remaining_space--;
+int pipe_get_option(void* pipecb_t, stream_option opt)
+{
+	pipe_cb* picb = (pipe_cb*) pipecb_t;
+	if(picb == NULL) return -1;
+
+	switch(opt) {
+		case STREAM_RCVBUF:
+		case STREAM_SNDBUF:
+			return picb->capacity;
+		case STREAM_RCVLOWAT:
+			return pipe_rcvlowat(picb);
+		case STREAM_SNDLOWAT:
+			return pipe_sndlowat(picb);
+		case STREAM_MESSAGE:
+			return picb->message;
+		case STREAM_NEXTMSG:
+			return pipe_next_message(picb);
+		default:
+			return -1;
 	}
+}
 
-	/*Wake up reader threads, if they are waiting for data to be written. */
-	kernel_broadcast(&picb->has_data);
 
-	return written_bytes_counter;
+/* The total length of a sequence of segments */
+static unsigned int iov_total(const iovec_t* iov, unsigned int iovcnt)
+{
+	unsigned int size = 0;
+	for(unsigned int i = 0; i < iovcnt; i++) size += iov[i].len;
+	return size;
 }
 
-int pipe_read(void* pipecb_t, char* buf , unsigned int size)
+/*
+	Write and read work on sequences of segments, so that a vectored call 
+	is a single ring operation, followed by a single wakeup.
+ */
+int pipe_writev(void* pipecb_t, const iovec_t* iov, unsigned int iovcnt)
 {
 	pipe_cb* picb = (pipe_cb*) pipecb_t ; // cast to pipe control block
 	if(!picb) return -1;  //pipe control block does not exist.
 
-	//check if reader end is closed!
-	if(!picb->reader) return -1;
-
-	int read_bytes_counter; // total bytes read from the pipe.
-
-	//if remaining space is buffer size , then the pipe is empty!We have no bytes to read.
-	/*Sleep until remaining space <buffer size or the writer end close*/
-	while(picb->remaining_space == PIPE_BUFFER_SIZE && picb->writer != NULL)
-		kernel_wait( &picb->has_data , SCHED_PIPE);
+	int written_bytes_counter; // total bytes written on the pipe.
+	unsigned int size = iov_total(iov, iovcnt);
+
+	while(1) {
+		//check if writer end is closed!
+		if(!picb->writer) return -1;
+
+		//if reader end is closed, there is no reason to write on the pipe.
+		if(!picb->reader) return -1;
+
+		/* A message must fit in the buffer as a whole */
+		unsigned int need = picb->message ? size + sizeof(msg_header) : 1;
+		if(need > picb->capacity) {
+			if(size > PIPE_MAX_MESSAGE || !picb->autotune) return -1;
+			pipe_resize(picb, pipe_round_capacity(need));
+			pipe_stats.grows++;
+		}
+
+		/* Lockless writers may fill the buffer concurrently, so we can only 
+		   find out that it is full by trying */
+		pipe_token_acquire(&picb->wtoken);
+		written_bytes_counter = pipe_put(picb, iov, size);
+		pipe_count_write(picb, written_bytes_counter);
+		pipe_token_release(&picb->wtoken);
+		if(written_bytes_counter > 0 || size == 0) break;
+
+		/* An auto-tuned pipe may grow instead */
+		if(picb->autotune && pipe_autogrow(picb)) continue;
+
+		/* A non-blocking writer gives up instead */
+		if(io_nonblocking()) return WOULD_BLOCK;
+
+		/*block in condition variable, until there is enough free space to write or reader end is closed */
+		if(picb->message && need > picb->msg_need) picb->msg_need = need;
+		__atomic_fetch_add(&picb->writers_waiting, 1, __ATOMIC_SEQ_CST);
+		if(picb->capacity - pipe_used(picb) < need && picb->reader != NULL)
+			pipe_wait(&picb->has_space, &picb->write_wait);
+	}
 
-	if(picb->remaining_space == PIPE_BUFFER_SIZE) // means that writer is null
-		return 0; //there are no bytes to read, and writer end is closed.
+	/*Wake up reader threads, if the data reached their watermark */
+	if(pipe_has_waiters(&picb->readers_waiting) && pipe_avail(picb) >= pipe_rcvlowat(picb))
+		pipe_wake_readers(picb);
 
-	int total_bytes_to_read = PIPE_BUFFER_SIZE - picb->remaining_space;
+	return written_bytes_counter;
+}
 
-	for(read_bytes_counter = 0 ; read_bytes_counter < total_bytes_to_read ; read_bytes_counter++){
+int pipe_readv(void* pipecb_t, const iovec_t* iov, unsigned int iovcnt)
+{
+	pipe_cb* picb = (pipe_cb*) pipecb_t ; // cast to pipe control block
+	if(!picb) return -1;  //pipe control block does not exist.
 
-		/*Check if we have read 'size' amount of bytes: */
-		if(read_bytes_counter == size)
+	int read_bytes_counter = 0; // total bytes read from the pipe.
+	unsigned int size = iov_total(iov, iovcnt);
+	int shrink = 0;
+
+	while(1) {
+		//check if reader end is closed!
+		if(!picb->reader) return -1;
+
+		/* Read if there are enough data or the writer end is closed. Lockless 
+		   readers may empty the buffer concurrently, so check under the token. */
+		FCB* writer = picb->writer;
+		pipe_token_acquire(&picb->rtoken);
+		if(pipe_avail(picb) >= pipe_rcvlowat(picb) || writer == NULL) {
+			read_bytes_counter = pipe_get(picb, iov, size, 1);
+			pipe_count_read(picb, read_bytes_counter);
+			shrink = pipe_count_drain(picb);
+			ring_release_drained(picb);
+			pipe_token_release(&picb->rtoken);
 			break;
+		}
+		pipe_token_release(&picb->rtoken);
 
-		buf[read_bytes_counter] = picb->BUFFER[picb->r_position];
-		picb->r_position = (picb->r_position + 1)% PIPE_BUFFER_SIZE; // next read position.
-		picb->remaining_space++;
+		/* A non-blocking reader gives up instead */
+		if(io_nonblocking()) return WOULD_BLOCK;
+
+		/*Sleep until there are enough data in the buffer or the writer end closes */
+		__atomic_fetch_add(&picb->readers_waiting, 1, __ATOMIC_SEQ_CST);
+		if(pipe_avail(picb) < pipe_rcvlowat(picb) && picb->writer != NULL)
+			pipe_wait(&picb->has_data, &picb->read_wait);
 	}
+
+	/* If the writer end is closed and there are no data, this returns 0; 
+	   if the next message does not fit in buf, it returns -1 */
+	if(read_bytes_counter <= 0) return read_bytes_counter;
 	
-	/*wake up all writer threads, if they wait space to be free */
-	kernel_broadcast(&picb->has_space);
+	/*wake up writer threads, if the free space reached their watermark */
+	if(pipe_has_waiters(&picb->writers_waiting) && picb->capacity - pipe_used(picb) >= pipe_wake_space(picb))
+		pipe_wake_writers(picb);
+
+	if(shrink) pipe_autoshrink(picb);
 
 	return read_bytes_counter;
 }
 
+int pipe_write(void* pipecb_t,const char *buf , unsigned int size)
+{
+	iovec_t v = { (void*) buf, size };
+	return pipe_writev(pipecb_t, &v, 1);
+}
+
+int pipe_read(void* pipecb_t, char* buf , unsigned int size)
+{
+	iovec_t v = { buf, size };
+	return pipe_readv(pipecb_t, &v, 1);
+}
+
+
+/*
+	The lockless paths, called without the kernel lock, inside an epoch read
+	section. They only handle the case where the ring operation can proceed
+	without blocking, on an open pipe, and the token of the end is free; 
+	otherwise they return NOLOCK_FALLBACK and the call is repeated by the 
+	kernel-locked path. The lock is taken only to wake up waiters, or to 
+	shrink an auto-tuned pipe.
+ */
+int pipe_write_nolock(void* pipecb_t, const char* buf, unsigned int size, int* finish)
+{
+	pipe_cb* picb = (pipe_cb*) pipecb_t;
+	if(picb == NULL || picb->writer == NULL || picb->reader == NULL || size == 0)
+		return NOLOCK_FALLBACK;
+
+	if(! pipe_token_try(&picb->wtoken))
+		return NOLOCK_FALLBACK;
+	iovec_t v = { (void*) buf, size };
+	unsigned int n = pipe_put(picb, &v, size);
+	pipe_count_write(picb, n);
+	unsigned int wake = (pipe_avail(picb) >= pipe_rcvlowat(picb));
+	pipe_token_release(&picb->wtoken);
+
+	if(n == 0) return NOLOCK_FALLBACK;
+
+	if(wake && pipe_has_waiters(&picb->readers_waiting)) *finish = 1;
+	return n;
+}
+
+int pipe_read_nolock(void* pipecb_t, char* buf, unsigned int size, int* finish)
+{
+	pipe_cb* picb = (pipe_cb*) pipecb_t;
+	if(picb == NULL || picb->reader == NULL || size == 0)
+		return NOLOCK_FALLBACK;
+
+	if(! pipe_token_try(&picb->rtoken))
+		return NOLOCK_FALLBACK;
+	if(pipe_used(picb) < pipe_rcvlowat(picb)) {
+		pipe_token_release(&picb->rtoken);
+		return NOLOCK_FALLBACK;
+	}
+	iovec_t v = { buf, size };
+	int n = pipe_get(picb, &v, size, 0);
+	if(n == 0) {
+		/* The next data is a loan */
+		pipe_token_release(&picb->rtoken);
+		return NOLOCK_FALLBACK;
+	}
+	pipe_count_read(picb, n);
+	unsigned int wake = (picb->capacity - pipe_used(picb) >= pipe_wake_space(picb));
+	int shrink = pipe_count_drain(picb);
+	ring_release_drained(picb);
+	pipe_token_release(&picb->rtoken);
+	if(n < 0) return n;
+
+	if((wake && pipe_has_waiters(&picb->writers_waiting)) || shrink) *finish = 1;
+	return n;
+}
+
+/* 
+	After a lockless write, wake up the readers; after a lockless read, wake
+	up the writers, and shrink the buffer if it is due. Both are harmless 
+	when not needed.
+ */
+void pipe_finish_nolock(void* pipecb_t, int output)
+{
+	pipe_cb* picb = (pipe_cb*) pipecb_t;
+	if(picb == NULL) return;
+
+	if(output) {
+		pipe_wake_readers(picb);
+		return;
+	}
+	pipe_wake_writers(picb);
+	if(picb->autotune && picb->drains >= PIPE_SHRINK_DRAINS && picb->reader != NULL)
+		pipe_autoshrink(picb);
+}
+
+
+/*
+	Splice. The data moves from ring to ring, in at most three contiguous 
+	copies, holding the read token of the input and the write token of 
+	the output. If the output is empty, and the whole input fits in the
+	request, the two buffers are exchanged instead. This needs all four
+	tokens, but it can not deadlock: Splice and the other token holders 
+	that spin run under the kernel lock, and the lockless paths only try 
+	a single token.
+ */
+static unsigned int pipe_swap_buffers(pipe_cb* in, pipe_cb* out, unsigned int len)
+{
+	pipe_token_acquire(&in->wtoken);
+	pipe_token_acquire(&out->rtoken);
+
+	unsigned int n = pipe_used(in);
+	int swap = (n <= len && pipe_used(out) == 0);
+	if(swap) {
+		char* buf = out->BUFFER;
+		out->BUFFER = in->BUFFER;
+		in->BUFFER = buf;
+
+		/* Keep the offsets of the data in the buffer */
+		out->r_position = in->r_position;
+		out->w_position = in->w_position;
+		in->r_position = in->w_position;
+		if(n > out->peak) out->peak = n;
+
+		pipe_stats.swaps++;
+	}
+
+	pipe_token_release(&out->rtoken);
+	pipe_token_release(&in->wtoken);
+	return swap ? n : 0;
+}
+
+static unsigned int ring_move(pipe_cb* in, pipe_cb* out, unsigned int len)
+{
+	unsigned int n = pipe_used(in);
+	if(n > 0 && n <= len && in->capacity == out->capacity && pipe_used(out) == 0 && !pipe_has_loans(out)) {
+		unsigned int swapped = pipe_swap_buffers(in, out, len);
+		if(swapped > 0) return swapped;
+	}
+	if(n > len) n = len;
+
+	unsigned int r = in->r_position;
+	unsigned int w = out->w_position;
+	unsigned int space = out->capacity - (w - __atomic_load_n(&out->r_position, __ATOMIC_ACQUIRE));
+	if(n > space) n = space;
+	if(n > 0) ring_attach(out);
+
+	for(unsigned int done = 0; done < n; ) {
+		unsigned int roff = (r + done) & (in->capacity-1);
+		unsigned int woff = (w + done) & (out->capacity-1);
+		unsigned int chunk = n - done;
+		if(chunk > in->capacity - roff) chunk = in->capacity - roff;
+		if(chunk > out->capacity - woff) chunk = out->capacity - woff;
+		memcpy(out->BUFFER + woff, in->BUFFER + roff, chunk);
+		done += chunk;
+	}
+
+	ring_publish_write(out, w + n);
+	__atomic_store_n(&in->r_position, r + n, __ATOMIC_RELEASE);
+	return n;
+}
+
+int pipe_splice(pipe_cb* in, pipe_cb* out, unsigned int len)
+{
+	if(in == NULL || out == NULL || in == out) return -1;
+	if(in->message || out->message) return -1;
+
+	unsigned int moved = 0;
+	int shrink = 0;
+
+	while(1) {
+		if(in->reader == NULL || out->writer == NULL || out->reader == NULL) 
+			return -1;
+		if(pipe_has_loans(in)) return -1;
+		if(len == 0) return 0;
+
+		/* Wait for data, as in pipe_read */
+		FCB* writer = in->writer;
+		if(pipe_used(in) < pipe_rcvlowat(in) && writer != NULL) {
+			if(io_nonblocking()) return WOULD_BLOCK;
+			__atomic_fetch_add(&in->readers_waiting, 1, __ATOMIC_SEQ_CST);
+			if(pipe_used(in) < pipe_rcvlowat(in) && in->writer != NULL)
+				pipe_wait(&in->has_data, &in->read_wait);
+			continue;
+		}
+		if(pipe_used(in) == 0) return 0;  /* End of data */
+
+		/* Wait for space, as in pipe_write */
+		if(pipe_used(out) == out->capacity) {
+			if(out->autotune && pipe_autogrow(out)) continue;
+			if(io_nonblocking()) return WOULD_BLOCK;
+			__atomic_fetch_add(&out->writers_waiting, 1, __ATOMIC_SEQ_CST);
+			if(pipe_used(out) == out->capacity && out->reader != NULL)
+				pipe_wait(&out->has_space, &out->write_wait);
+			continue;
+		}
+
+		/* Lockless users of the two pipes may have raced with us */
+		pipe_token_acquire(&in->rtoken);
+		pipe_token_acquire(&out->wtoken);
+		moved = ring_move(in, out, len);
+		pipe_count_read(in, moved);
+		pipe_count_write(out, moved);
+		shrink = pipe_count_drain(in);
+		pipe_token_release(&out->wtoken);
+		ring_release_drained(in);
+		pipe_token_release(&in->rtoken);
+		if(moved > 0) break;
+	}
+
+	pipe_stats.spliced += moved;
+
+	if(pipe_has_waiters(&out->readers_waiting) && pipe_used(out) >= pipe_rcvlowat(out))
+		pipe_wake_readers(out);
+	if(pipe_has_waiters(&in->writers_waiting) && in->capacity - pipe_used(in) >= pipe_wake_space(in))
+		pipe_wake_writers(in);
+	if(shrink) pipe_autoshrink(in);
+
+	return moved;
+}
+
+/*
+	Readiness, for Poll. The reader end is ready when a read would not block,
+	and the writer end when the free space reaches SNDLOWAT. A poller arms
+	by registering as a waiter, like a thread about to block, so that the
+	wakeups of the pipe notify it.
+ */
+static unsigned int pipe_read_readiness(pipe_cb* picb)
+{
+	if(picb->reader == NULL) return POLL_HANGUP;
+	if(picb->writer == NULL) return POLL_READABLE | POLL_HANGUP;
+	return (pipe_avail(picb) >= pipe_rcvlowat(picb)) ? POLL_READABLE : 0;
+}
+
+static unsigned int pipe_write_readiness(pipe_cb* picb)
+{
+	if(picb->writer == NULL) return POLL_HANGUP;
+	if(picb->reader == NULL) return POLL_WRITABLE | POLL_HANGUP;
+	return (picb->capacity - pipe_used(picb) >= pipe_sndlowat(picb)) ? POLL_WRITABLE : 0;
+}
+
+unsigned int pipe_reader_poll(void* pipecb_t, unsigned int events, int arm)
+{
+	pipe_cb* picb = (pipe_cb*) pipecb_t;
+	if(picb == NULL) return POLL_HANGUP;
+
+	unsigned int ready = pipe_read_readiness(picb);
+	if(arm && (ready & (events | POLL_HANGUP)) == 0) {
+		__atomic_fetch_add(&picb->readers_waiting, 1, __ATOMIC_SEQ_CST);
+		ready = pipe_read_readiness(picb);
+	}
+	return ready;
+}
+
+unsigned int pipe_writer_poll(void* pipecb_t, unsigned int events, int arm)
+{
+	pipe_cb* picb = (pipe_cb*) pipecb_t;
+	if(picb == NULL) return POLL_HANGUP;
+
+	unsigned int ready = pipe_write_readiness(picb);
+	if(arm && (ready & (events | POLL_HANGUP)) == 0) {
+		__atomic_fetch_add(&picb->writers_waiting, 1, __ATOMIC_SEQ_CST);
+		ready = pipe_write_readiness(picb);
+	}
+	return ready;
+}
+
+pipe_cb* pipe_reader_get_pipe(void* pipecb_t, int output)
+{
+	return output ? NULL : (pipe_cb*) pipecb_t;
+}
+
+pipe_cb* pipe_writer_get_pipe(void* pipecb_t, int output)
+{
+	return output ? (pipe_cb*) pipecb_t : NULL;
+}
+
+
+/* Free a retired pipe */
+static void pipe_reclaim(void* _pipecb)
+{
+	pipe_cb* picb = (pipe_cb*) _pipecb;
+	ring_detach(picb);
+	slab_free(picb);
+}
+
+/* Called when both ends are closed */
+static void pipe_destroy(pipe_cb* picb)
+{
+	pipe_stats.live--;
+	rlist_remove(&picb->live);
+	epoch_retire(picb, pipe_reclaim);
+}
+
 int pipe_writer_close(void* _pipecb)
 {
 
@@ -153,11 +1371,17 @@ int pipe_writer_close(void* _pipecb)
 		return -1;
 
 	/*If writer end close,make the writer attribute null */
+	FCB* writer = picb->writer;
 	picb->writer = NULL;
 
+	/* Readers waiting for their watermark must see the end of data, and 
+	   the pollers of a socket shut down for writing must see a hangup */
+	pipe_wake_all(picb);
+	poll_notify(writer);
+
 	//if reader end is also closed, then the pipe is useless, so free it
 	if(!picb->reader)
-		free(picb);
+		pipe_destroy(picb);
 
 	return 0;
 }
@@ -171,11 +1395,20 @@ int pipe_reader_close(void* _pipecb)
 		return -1;
 
 	/*If reader end close,make the reader attribute null */
+	FCB* reader = picb->reader;
 	picb->reader = NULL;
 
+	/* The loans will not be read */
+	pipe_cancel_loans(picb);
+
+	/* Blocked writers must fail, and the pollers of a socket shut down for
+	   reading must see a hangup */
+	pipe_wake_all(picb);
+	poll_notify(reader);
+
 	//if writer end is also closed, then the pipe is useless, so free it
 	if(!picb->writer)
-		free(picb);
+		pipe_destroy(picb);
 
 	return 0;
 
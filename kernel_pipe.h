@@ -3,19 +3,151 @@
 
 #include "util.h"
 
-#define PIPE_BUFFER_SIZE 8200
+/**
+	@brief The default capacity of a pipe buffer, used by @c Pipe().
+
+	Pipe capacities are powers of two: the read and write positions of a pipe
+	are free-running counters, which are reduced to a buffer offset by masking
+	with @c capacity-1.
+  */
+#define PIPE_BUFFER_SIZE 8192
+
+/** @brief The initial capacity of an auto-tuned pipe. */
+#define PIPE_AUTO_INITIAL 1024
+
+/** @brief The largest capacity an auto-tuned pipe grows to. */
+#define PIPE_AUTO_MAX (64*1024)
+
+/** @brief The number of writer stalls on a full buffer that make an auto-tuned pipe grow. */
+#define PIPE_GROW_STALLS 2
+
+/** @brief The number of reads that empty the buffer, after which an auto-tuned pipe may shrink. */
+#define PIPE_SHRINK_DRAINS 32
+
+/** @brief The max. number of zero-copy sends queued in a pipe; a power of two. */
+#define PIPE_MAX_LOANS 8
+
+_Static_assert((PIPE_BUFFER_SIZE & (PIPE_BUFFER_SIZE-1)) == 0, "PIPE_BUFFER_SIZE must be a power of two");
+_Static_assert((PIPE_MIN_CAPACITY & (PIPE_MIN_CAPACITY-1)) == 0, "PIPE_MIN_CAPACITY must be a power of two");
+_Static_assert((PIPE_MAX_LOANS & (PIPE_MAX_LOANS-1)) == 0, "PIPE_MAX_LOANS must be a power of two");
+
+typedef struct pipe_control_block pipe_cb;
+typedef struct completion_queue completion_queue;
+
+/**
+	@brief A buffer loaned to a pipe by @c SendZeroCopy.
+
+	The loan is read after the bytes written to the ring before it, that
+	is, when the read position reaches @c start. The ring bytes written 
+	after it are stored from @c start onwards, and are read after it.
+	If the completion queue is closed first, the bytes not yet read are
+	copied, and the loan reads the copy.
+  */
+typedef struct pipe_loan {
+	const char* buf;          /**< @brief The sender's buffer, or the copy */
+	unsigned int len;         /**< @brief Its length */
+	unsigned int off;         /**< @brief The bytes of it already read */
+	unsigned int start;       /**< @brief The ring position of the loan in the stream */
+	completion_queue* cq;     /**< @brief Where its completion goes */
+	unsigned long tag;        /**< @brief The tag of its completion */
+	rlnode node;              /**< @brief In the loans of the completion queue */
+	int copied;               /**< @brief Set if @c buf is a copy, freed with the loan */
+} pipe_loan;
+
+/**
+	@brief Create a new pipe control block, connecting the given FCBs.
+
+	This is used by @c sys_Pipe and by @c sys_Accept, for the two pipes of
+	a socket connection. The FCBs are not modified. The capacity is as
+	in @c PipeEx(); the caller must have checked that it is legal.
+  */
+pipe_cb* pipe_create(FCB* reader, FCB* writer, unsigned int capacity);
+
+/**
+	@brief Set a stream option of a pipe.
+
+	This implements @c SetStreamOption for both ends of a pipe, and for the
+	pipes of connected sockets. Returns 0 on success and -1 if the option
+	or the value are illegal.
+  */
+int pipe_set_option(void* pipecb_t, stream_option opt, unsigned int value);
+
+/** @brief Return a stream option of a pipe, or -1 if the option is illegal. */
+int pipe_get_option(void* pipecb_t, stream_option opt);
+
+/** @brief Take a snapshot of the pipe statistics, as a @c KSTAT_PIPES stream. */
+size_t pipe_statistics_snapshot(void** records);
+
+/**
+	@brief Fill the traffic statistics of a pipe into a @c streaminfo record.
+
+	The byte and call counters, the wait times and the fill level of the
+	pipe are stored in @c si; the other fields are left as they are. 
+	Called with the kernel lock held.
+  */
+void pipe_stream_info(pipe_cb* picb, streaminfo* si);
+
+/** 
+	@brief Take a snapshot of the open pipes, as @c streaminfo records.
+
+	This covers the pipes made by @c Pipe and @c PipeEx; the pipes of
+	sockets are reported with their sockets. Called with the kernel lock held.
+  */
+size_t pipe_streams_snapshot(void** records);
 
 int sys_Pipe(pipe_t* pipe);
+int sys_PipeEx(pipe_t* pipe, unsigned int capacity);
 int disable_write(void* pipecb_t,const char *buf , unsigned int n);
 int disable_read(void* pipecb_t, char* buf , unsigned int n);
 void* open_pipe(uint minor);
 int pipe_write(void* pipecb_t,const char *buf , unsigned int size);
 int pipe_read(void* pipecb_t, char* buf , unsigned int size);
+int pipe_writev(void* pipecb_t, const iovec_t* iov, unsigned int iovcnt);
+int pipe_readv(void* pipecb_t, const iovec_t* iov, unsigned int iovcnt);
 int pipe_writer_close(void* _pipecb);
 int pipe_reader_close(void* _pipecb);
+int pipe_write_nolock(void* pipecb_t, const char* buf, unsigned int size, int* finish);
+int pipe_read_nolock(void* pipecb_t, char* buf, unsigned int size, int* finish);
+void pipe_finish_nolock(void* pipecb_t, int output);
+pipe_cb* pipe_reader_get_pipe(void* pipecb_t, int output);
+pipe_cb* pipe_writer_get_pipe(void* pipecb_t, int output);
+
+/**
+	@brief The readiness of the reader end of a pipe, for @c Poll.
+
+	This is the @c Poll method of the reader end, and it is also used
+	for the read direction of connected sockets. The writer end is 
+	polled by @c pipe_writer_poll.
+	@see file_ops
+  */
+unsigned int pipe_reader_poll(void* pipecb_t, unsigned int events, int arm);
+unsigned int pipe_writer_poll(void* pipecb_t, unsigned int events, int arm);
+
+/**
+	@brief Move up to @c len bytes from pipe @c in to pipe @c out.
+
+	This implements @c Splice, blocking as @c pipe_read on @c in and as
+	@c pipe_write on @c out. It is called with the kernel lock held.
+  */
+int pipe_splice(pipe_cb* in, pipe_cb* out, unsigned int len);
+
+/**
+	@brief Queue a zero-copy send of a buffer to a pipe.
 
+	This implements @c SendZeroCopy on a pipe, blocking while the pipe
+	holds @c PIPE_MAX_LOANS loans. It fails if the completion queue has
+	@c COMPLETION_QUEUE_SIZE sends outstanding. The loan holds a reference
+	to the completion queue. It is called with the kernel lock held.
+  */
+int pipe_loan_buffer(pipe_cb* picb, const char* buf, unsigned int len, completion_queue* cq, unsigned long tag);
 
-typedef struct pipe_control_block {
+/** @brief The completion queue of a file id, or NULL. */
+completion_queue* get_completion_queue(Fid_t fid);
+
+Fid_t sys_OpenCompletionQueue();
+
+
+struct pipe_control_block {
 
 	FCB* reader,*writer;
 
@@ -23,11 +155,43 @@ typedef struct pipe_control_block {
 
 	CondVar has_data; /*For blocking reader until data are available */
 
-	int w_position, r_position , remaining_space ; /*write, read position in buffer, and how many bytes are free to write*/
+	/* Free-running write and read positions; the buffer holds w_position - r_position bytes */
+	unsigned int w_position, r_position;
+
+	char wtoken, rtoken; /* held by the thread copying into, resp. out of, the buffer */
+
+	char* BUFFER; /*bounded cyclic byte buffer, from the buffer pool, or NULL if the pipe is idle */
+	unsigned int capacity; /*size of BUFFER, a power of two */
+
+	/* Auto-tuning state */
+	int autotune;            /* 1 if the capacity is auto-tuned */
+	unsigned int stalls;     /* writer stalls on a full buffer, since the last resize */
+	unsigned int drains;     /* reads that emptied the buffer, since the last shrink check */
+	unsigned int peak;       /* the max. fill of the buffer, since the last shrink check */
+
+	/* Wakeup state */
+	unsigned int readers_waiting, writers_waiting;  /* threads blocked in has_data, has_space */
+	unsigned int rcvlowat, sndlowat;                /* the watermarks as set, 0 for the default */
+
+	int message;   /* 1 if the buffer holds length-prefixed messages, 0 for a byte stream */
+	unsigned int msg_need;   /* the space needed by the largest blocked message */
 
-	char BUFFER[PIPE_BUFFER_SIZE]; /*bounded cyclic byte buffer */ 
+	/* Traffic statistics. The read counters are updated by the holder of the read token,
+	   the write counters by the holder of the write token, and the wait times under the
+	   kernel lock. The statistics read them without synchronization. */
+	unsigned long id;                     /* numbers the pipes, since boot */
+	unsigned long bytes_read, reads;      /* data read out of the buffer */
+	unsigned long bytes_written, writes;  /* data written into the buffer */
+	uint64_t read_wait, write_wait;       /* nanoseconds blocked in has_data, has_space */
+	rlnode live;   /* in the list of the pipes made by Pipe, for the statistics */
 
+	/* Zero-copy sends. The loans are a single-producer/single-consumer queue,
+	   like the ring: loans are added by the holder of the write token, and
+	   read and retired by the holder of the read token, under the kernel lock. */
+	pipe_loan loans[PIPE_MAX_LOANS];
+	unsigned int loan_head, loan_tail;   /* the next loan to read, and to add */
+	unsigned int loaned;                 /* the bytes of the loans not yet read */
 
-}pipe_cb;
+};
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,387 @@
+#include <assert.h>
+#include "util.h"
+#include "tinyos.h"
+#include "kernel_cc.h"
+#include "kernel_sched.h"
+#include "kernel_streams.h"
+#include "kernel_poll.h"
+
+
+/*
+	Pollers. A poller sleeps on its own condition variable. It arms a 
+	stream by linking one of its entries into the poll queue of the FCB,
+	and a notification unlinks the entries of the queue and wakes up their
+	pollers. A poller reaches its streams through the fids of its process,
+	so it arms at most MAX_FILEID different FCBs, one entry each. The 
+	entries stay with the poller, to be linked again at the next arming, 
+	and are unlinked when the poller returns.
+
+	The queues are protected by the kernel lock. Interrupt handlers notify
+	without it, so the pollers that wait for interrupts are kept in a list
+	of their own, under a spinlock.
+ */
+typedef struct poller poller;
+
+typedef struct poll_entry {
+	rlnode node;          /* in the poll queue, or alone if not armed */
+	poll_queue* queue;    /* the queue of the FCB, once armed */
+	poller* owner;
+} poll_entry;
+
+struct poller {
+	CondVar cv;           /* the poller sleeps here */
+	int notified;         /* set by a notification since the last arming */
+	unsigned int n;       /* the entries used */
+	poll_entry entry[MAX_FILEID];
+	rlnode irq_node;      /* in irq_pollers, if it waits for interrupts */
+};
+
+/* The pollers waiting for interrupts */
+static rlnode irq_pollers = { .obj = NULL, .prev = &irq_pollers, .next = &irq_pollers };
+static Mutex irq_pollers_lock = MUTEX_INIT;
+
+/* The poller arming streams now, for the Poll methods; under the kernel lock */
+static poller* arming = NULL;
+
+
+void poll_queue_init(poll_queue* q)
+{
+	rlnode_init(&q->entries, NULL);
+}
+
+/* Add the poller to the queue of an FCB, unless it is already there */
+static void poll_arm(poller* p, FCB* fcb)
+{
+	poll_queue* q = &fcb->pollers;
+	poll_entry* e = NULL;
+	for(unsigned int i=0; i<p->n; i++)
+		if(p->entry[i].queue == q) { e = &p->entry[i]; break; }
+
+	if(e == NULL) {
+		assert(p->n < MAX_FILEID);
+		e = &p->entry[p->n++];
+		rlnode_init(&e->node, e);
+		e->queue = q;
+		e->owner = p;
+	}
+	if(e->node.next == &e->node)
+		rlist_push_back(&q->entries, &e->node);
+}
+
+/* Unlink the poller from every queue, before it returns */
+static void poll_disarm(poller* p)
+{
+	for(unsigned int i=0; i<p->n; i++)
+		rlist_remove(&p->entry[i].node);
+
+	if(p->irq_node.next != &p->irq_node) {
+		Mutex_Lock(&irq_pollers_lock);
+		rlist_remove(&p->irq_node);
+		Mutex_Unlock(&irq_pollers_lock);
+	}
+}
+
+
+/*
+	The pollers take the waitset lock of their condition variable with 
+	preemption off (see poll_wait), spinning until they get it. So the lock
+	must never be held by a preempted thread, or the poller could take a 
+	core, spinning for it.
+ */
+void poll_notify(FCB* fcb)
+{
+	if(fcb == NULL || is_rlist_empty(&fcb->pollers.entries)) return;
+
+	int pre = preempt_off;
+	while(! is_rlist_empty(&fcb->pollers.entries)) {
+		poll_entry* e = rlist_pop_front(&fcb->pollers.entries)->obj;
+		e->owner->notified = 1;
+		kernel_signal(&e->owner->cv);
+	}
+	if(pre) preempt_on;
+}
+
+void poll_arm_interrupt()
+{
+	poller* p = arming;
+	if(p == NULL || p->irq_node.next != &p->irq_node) return;
+
+	Mutex_Lock(&irq_pollers_lock);
+	rlist_push_back(&irq_pollers, &p->irq_node);
+	Mutex_Unlock(&irq_pollers_lock);
+}
+
+void poll_notify_interrupt()
+{
+	Mutex_Lock(&irq_pollers_lock);
+	for(rlnode* n = irq_pollers.next; n != &irq_pollers; n = n->next) {
+		poller* p = n->obj;
+		__atomic_store_n(&p->notified, 1, __ATOMIC_RELEASE);
+		Cond_Broadcast(&p->cv);
+	}
+	Mutex_Unlock(&irq_pollers_lock);
+}
+
+
+/*
+	Poll one stream, for the events in p->events, and store the events that
+	occurred in p->revents. Return 1 if some occurred. If a poller is given,
+	the stream is armed for it.
+ */
+static int poll_stream(FCB* fcb, pollfd* p, poller* arm)
+{
+	unsigned int ready = POLL_READABLE | POLL_WRITABLE;
+	if(fcb->streamfunc->Poll) {
+		poller* outer = arming;
+		if(arm) poll_arm(arm, fcb);
+		arming = arm;
+		ready = fcb->streamfunc->Poll(fcb->streamobj, p->events, arm != NULL);
+		arming = outer;
+	}
+	p->revents = ready & (p->events | POLL_HANGUP);
+	return p->revents != 0;
+}
+
+
+/*
+	A scan polls all the streams of a request, and returns the number of
+	ready ones. Once a ready stream is found, there is no need to arm the
+	rest.
+ */
+typedef int (*poll_scan)(void* request, poller* arm);
+
+
+/*
+	Wait until a scan finds ready streams, or the timeout expires. The scan
+	is first made without arming the streams, which is enough when some
+	stream is ready. Preemption stays off, as in serial_read, so that a
+	serial interrupt cannot be lost between the scan and the sleep.
+ */
+static int poll_wait(poll_scan scan, void* request, timeout_t timeout)
+{
+	/* A timeout too long to count in nsec never expires */
+	int forever = (timeout == POLL_FOREVER || timeout > (1ul<<40));
+	uint64_t deadline = forever ? 0 : bios_clock_ns() + timeout*1000000ull;
+	int ready;
+
+	if((ready = scan(request, NULL)) != 0 || timeout == 0)
+		return ready;
+
+	poller p;
+	p.cv = COND_INIT;
+	p.n = 0;
+	rlnode_init(&p.irq_node, &p);
+
+	int pre = preempt_off;
+
+	while(1) {
+		/* Arm the streams, and check again before sleeping */
+		__atomic_store_n(&p.notified, 0, __ATOMIC_RELAXED);
+		if((ready = scan(request, &p)) != 0) break;
+
+		TimerDuration usec = NO_TIMEOUT;
+		if(! forever) {
+			uint64_t now = bios_clock_ns();
+			if(now >= deadline) break;
+			usec = (deadline - now + 999)/1000;
+		}
+
+		if(! __atomic_load_n(&p.notified, __ATOMIC_ACQUIRE))
+			kernel_timedwait(&p.cv, SCHED_IO, usec);
+
+		if((ready = scan(request, NULL)) != 0) break;
+	}
+
+	poll_disarm(&p);
+	if(pre) preempt_on;
+	return ready;
+}
+
+
+/*
+	Poll
+ */
+
+struct poll_array {
+	pollfd* fds;
+	unsigned int n;
+};
+
+static int poll_array_scan(void* request, poller* arm)
+{
+	struct poll_array* req = (struct poll_array*) request;
+	int count = 0;
+
+	for(unsigned int i=0; i<req->n; i++) {
+		pollfd* p = & req->fds[i];
+		p->revents = 0;
+		if(p->fd == NOFILE) continue;
+
+		FCB* fcb = get_fcb(p->fd);
+		if(fcb == NULL)
+			p->revents = POLL_INVALID;
+		else
+			poll_stream(fcb, p, count==0 ? arm : NULL);
+
+		if(p->revents) count++;
+	}
+	return count;
+}
+
+int sys_Poll(pollfd* fds, unsigned int n, timeout_t timeout)
+{
+	if(fds == NULL) return -1;
+
+	struct poll_array req = { fds, n };
+	return poll_wait(poll_array_scan, &req, timeout);
+}
+
+
+/*
+	Poll sets. A poll set holds the events of interest for each fid of the
+	process, together with the FCB at the fid when the stream was added, 
+	and its generation. If the fid does not hold the same FCB, of the same
+	generation, when the set is scanned, the stream has been closed, and it
+	is dropped from the set. The generation tells a stream from a later one
+	that got the same FCB at the same fid. The set holds no reference, since
+	it must not keep its streams open.
+ */
+
+typedef struct poll_set {
+	unsigned int events[MAX_FILEID];   /* the events of interest per fid, 0 if not in the set */
+	FCB* fcb[MAX_FILEID];              /* the stream at each fid in the set */
+	unsigned long gen[MAX_FILEID];     /* the generation of each FCB */
+	unsigned int next;                 /* the fid where the next scan starts, for fairness */
+	int scanning;                      /* set during a scan, against cycles of nested sets */
+} poll_set;
+
+
+/* Scan the set, storing up to max ready streams in ready[] */
+static int poll_set_scan(poll_set* set, pollfd* ready, unsigned int max, poller* arm)
+{
+	unsigned int count = 0;
+	unsigned int start = set->next;
+
+	for(unsigned int k=0; k<MAX_FILEID && count<max; k++) {
+		Fid_t fid = (start + k) % MAX_FILEID;
+		if(set->events[fid] == 0) continue;
+
+		FCB* fcb = get_fcb(fid);
+		if(fcb != set->fcb[fid] || fcb->gen != set->gen[fid]) {
+			set->events[fid] = 0;
+			set->fcb[fid] = NULL;
+			continue;
+		}
+
+		pollfd* p = & ready[count];
+		p->fd = fid;
+		p->events = set->events[fid];
+		if(poll_stream(fcb, p, count==0 ? arm : NULL)) {
+			count++;
+			set->next = (fid + 1) % MAX_FILEID;
+		}
+	}
+	return count;
+}
+
+/* A poll set is readable when a stream in it is ready */
+static unsigned int poll_set_poll(void* this, unsigned int events, int arm)
+{
+	poll_set* set = (poll_set*) this;
+	if(set->scanning) return 0;
+
+	pollfd p;
+	set->scanning = 1;
+	int n = poll_set_scan(set, &p, 1, arm ? arming : NULL);
+	set->scanning = 0;
+	return n ? POLL_READABLE : 0;
+}
+
+static void* poll_set_open(uint minor)
+{
+	return NULL;
+}
+
+static int poll_set_close(void* this)
+{
+	free(this);
+	return 0;
+}
+
+static file_ops poll_set_ops = {
+	.Open = poll_set_open,
+	.Close = poll_set_close,
+	.Poll = poll_set_poll
+};
+
+
+static poll_set* get_poll_set(Fid_t pset)
+{
+	FCB* fcb = get_fcb(pset);
+	if(fcb == NULL || fcb->streamfunc != &poll_set_ops) return NULL;
+	return (poll_set*) fcb->streamobj;
+}
+
+
+Fid_t sys_OpenPollSet()
+{
+	Fid_t fid;
+	FCB* fcb;
+	if(! FCB_reserve(1, &fid, &fcb))
+		return NOFILE;
+
+	poll_set* set = xmalloc(sizeof(poll_set));
+	memset(set, 0, sizeof(poll_set));
+
+	fcb->streamobj = set;
+	fcb->streamfunc = &poll_set_ops;
+
+	return fid;
+}
+
+
+int sys_PollSetControl(Fid_t pset, Fid_t fid, unsigned int events)
+{
+	poll_set* set = get_poll_set(pset);
+	if(set == NULL || fid < 0 || fid >= MAX_FILEID || fid == pset)
+		return -1;
+
+	FCB* fcb = get_fcb(fid);
+	if(events == 0) fcb = NULL;
+	else if(fcb == NULL) return -1;
+
+	set->events[fid] = events;
+	set->fcb[fid] = fcb;
+	set->gen[fid] = fcb ? fcb->gen : 0;
+	return 0;
+}
+
+
+struct poll_set_request {
+	poll_set* set;
+	pollfd* ready;
+	unsigned int max;
+};
+
+static int poll_set_request_scan(void* request, poller* arm)
+{
+	struct poll_set_request* req = (struct poll_set_request*) request;
+	return poll_set_scan(req->set, req->ready, req->max, arm);
+}
+
+int sys_PollSetWait(Fid_t pset, pollfd* ready, unsigned int max, timeout_t timeout)
+{
+	poll_set* set = get_poll_set(pset);
+	if(set == NULL || ready == NULL || max == 0)
+		return -1;
+
+	/* The set must not be closed (by another thread) while we sleep */
+	FCB* fcb = get_fcb(pset);
+	FCB_incref(fcb);
+
+	struct poll_set_request req = { set, ready, max };
+	int retcode = poll_wait(poll_set_request_scan, &req, timeout);
+
+	FCB_decref(fcb);
+	return retcode;
+}
@@ -0,0 +1,81 @@
+#ifndef __KERNEL_POLL_H
+#define __KERNEL_POLL_H
+
+/**
+  @file kernel_poll.h
+  @brief Readiness multiplexing.
+
+  @defgroup poll Polling
+  @ingroup kernel
+  @brief Readiness multiplexing.
+
+  @c Poll and @c PollSetWait ask each stream for its readiness, by the
+  @c Poll method of its @c file_ops. If no stream is ready, they ask again,
+  arming the streams, and sleep. Arming a stream adds the poller to the 
+  poll queue of the stream's FCB. An armed stream calls @c poll_notify()
+  on its FCB when its readiness may have changed; the streams do this 
+  where they already wake up their own blocked threads (e.g., a pipe, when
+  it wakes up its blocked readers), so that the calls cost nothing when 
+  nobody polls.
+
+  Each poller sleeps on its own condition variable. A notification wakes
+  only the pollers in the queue of the FCB, and removes them from it; each
+  re-checks its own streams, arming them again.
+
+  @{
+*/
+
+#include "tinyos.h"
+#include "util.h"
+
+struct file_control_block;
+
+/**
+  @brief The pollers waiting for a stream.
+
+  Every FCB has one, protected by the kernel lock. It holds an entry for
+  each poller that armed the stream and has not been notified since.
+ */
+typedef struct poll_queue {
+  rlnode entries;   /**< @brief The entries of the waiting pollers */
+} poll_queue;
+
+/** @brief Initialize an empty poll queue. */
+void poll_queue_init(poll_queue* q);
+
+/**
+  @brief Wake up the threads polling a stream.
+
+  This is called with the kernel lock held, by armed streams whose
+  readiness may have changed. It wakes up the pollers in the poll queue of
+  @c fcb. If @c fcb is NULL, nothing happens.
+ */
+void poll_notify(struct file_control_block* fcb);
+
+/**
+  @brief Make the current poller wait for interrupts.
+
+  This is called by the @c Poll method of a stream whose readiness is 
+  changed by an interrupt handler (e.g., a terminal), when it is asked to 
+  arm. The handler calls @c poll_notify_interrupt(), which does not have
+  the kernel lock, and so cannot use the poll queues.
+ */
+void poll_arm_interrupt();
+
+/**
+  @brief Wake up the threads waiting in @c Poll for interrupts.
+
+  Unlike @c poll_notify(), this does not need the kernel lock. Pollers
+  run with preemption off, so that an interrupt cannot be lost between
+  their check and their sleep.
+ */
+void poll_notify_interrupt();
+
+int sys_Poll(pollfd* fds, unsigned int n, timeout_t timeout);
+Fid_t sys_OpenPollSet();
+int sys_PollSetControl(Fid_t pset, Fid_t fid, unsigned int events);
+int sys_PollSetWait(Fid_t pset, pollfd* ready, unsigned int max, timeout_t timeout);
+
+/** @} */
+
+#endif
@@ -84,6 +84,10 @@ PCB* acquire_PCB()
 {
   PCB* pcb = NULL;
 
+  /* Maybe some PCBs are retired, but not yet reclaimed */
+  if(pcb_freelist == NULL)
+    epoch_barrier();
+
   if(pcb_freelist != NULL) {
     pcb = pcb_freelist;
     pcb->pstate = ALIVE;
@@ -95,14 +99,26 @@ PCB* acquire_PCB()
 }
 
 /*
+  Return a retired PCB to the free list.
   Must be called with kernel_mutex held
 */
-void release_PCB(PCB* pcb)
+static void reclaim_PCB(void* _pcb)
 {
-  pcb->pstate = FREE;
+  PCB* pcb = (PCB*) _pcb;
   pcb->parent = pcb_freelist;
   pcb_freelist = pcb;
+}
+
+/*
+  Must be called with kernel_mutex held.
+  The PCB is not reused until lockless readers of the process table
+  are done with it.
+*/
+void release_PCB(PCB* pcb)
+{
+  pcb->pstate = FREE;
   process_count--;
+  epoch_retire(pcb, reclaim_PCB);
 }
 
 
@@ -42,14 +42,26 @@ static int yield_counter = 0;
 
 /*
 	This can be used in the preemptive context to
-	obtain the current thread.
+	obtain the current thread. 
+
+	Turning preemption off and on costs two system calls of the host, 
+	so we do not do it. A context switch on a core increments the 
+	core's switch counter before changing current_thread. Thus, if the 
+	core id and the counter are the same before and after we read
+	current_thread, then we were not moved from this core meanwhile,
+	and the value we read is ourselves.
  */
 TCB* cur_thread()
 {
-  int preempt = preempt_off;
-  TCB* cur = CURTHREAD;
-  if(preempt) preempt_on;
-  return cur;
+	while(1) {
+		uint core = __atomic_load_n(&cpu_core_id, __ATOMIC_ACQUIRE);
+		CCB* ccb = &cctx[core];
+		unsigned long sw = __atomic_load_n(&ccb->switches, __ATOMIC_ACQUIRE);
+		TCB* cur = __atomic_load_n(&ccb->current_thread, __ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&cpu_core_id, __ATOMIC_ACQUIRE) == core
+			&& __atomic_load_n(&ccb->switches, __ATOMIC_ACQUIRE) == sw)
+			return cur;
+	}
 }
 
 
@@ -86,7 +98,8 @@ TCB* cur_thread()
   with the exception of idle threads (they don't count).
  */
 volatile unsigned int active_threads = 0;
-Mutex active_threads_spinlock = MUTEX_INIT;
+lock_class active_threads_lock_class = LOCK_CLASS("active_threads");
+Mutex active_threads_spinlock = MUTEX_INIT_CLASS(&active_threads_lock_class);
 
 /* This is specific to Intel Pentium! */
 #define SYSTEM_PAGE_SIZE (1 << 12)
@@ -169,12 +182,15 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
 	tcb->thread_func = func;
 	tcb->wakeup_time = NO_TIMEOUT;
 	tcb->priority = (MAX_QUEUES - 1)/2;
+	tcb->pi_priority = -1;
+	for(int i = 0; i < PI_LOCKS; i++) tcb->pi[i].lock = NULL;
 	rlnode_init(&tcb->sched_node, tcb); /* Intrusive list node */
 
 	tcb->its = QUANTUM;
 	tcb->rts = QUANTUM;
 	tcb->last_cause = SCHED_IDLE;
 	tcb->curr_cause = SCHED_IDLE;
+	tcb->io_flags = 0;
 
 	/* Compute the stack segment address and size */
 	void* sp = ((void*)tcb) + THREAD_TCB_SIZE;
@@ -232,7 +248,52 @@ void release_TCB(TCB* tcb)
 
 rlnode SCHED[MAX_QUEUES]; /* The scheduler's priority queues */
 rlnode TIMEOUT_LIST; /* The list of threads with a timeout */
-Mutex sched_spinlock = MUTEX_INIT; /* spinlock for scheduler queue */
+/* Scheduler statistics, protected by sched_spinlock */
+static struct {
+	unsigned long yields;
+	unsigned long mutex_yields;
+	unsigned long boosts;
+	unsigned long pi_boosts;
+	unsigned long pi_restores;
+} sched_stats;
+
+_Static_assert(MAX_QUEUES == SCHEDINFO_QUEUES, "schedinfo must report every queue");
+
+lock_class sched_lock_class = LOCK_CLASS("sched");
+Mutex sched_spinlock = MUTEX_INIT_CLASS(&sched_lock_class); /* spinlock for scheduler queue */
+
+/*
+  Set the inherited priority of a thread to the highest of its boosts.
+
+  *** MUST BE CALLED WITH sched_spinlock HELD ***
+*/
+static void sched_pi_update(TCB* tcb)
+{
+	tcb->pi_priority = -1;
+	for(int i = 0; i < PI_LOCKS; i++)
+		if(tcb->pi[i].lock != NULL && tcb->pi[i].priority > tcb->pi_priority)
+			tcb->pi_priority = tcb->pi[i].priority;
+}
+
+/*
+  Drop the priority a thread inherited for a lock or, if lock is NULL,
+  every priority it inherited for a Mutex.
+
+  *** MUST BE CALLED WITH sched_spinlock HELD ***
+*/
+static void sched_pi_drop(TCB* tcb, void* lock)
+{
+	if(tcb->pi_priority < 0) return;
+
+	for(int i = 0; i < PI_LOCKS; i++) {
+		pi_boost* b = &tcb->pi[i];
+		if(b->lock != NULL && (lock ? b->lock == lock : b->leased)) {
+			b->lock = NULL;
+			sched_stats.pi_restores++;
+		}
+	}
+	sched_pi_update(tcb);
+}
 
 /* Interrupt handler for ALARM */
 void yield_handler() { yield(SCHED_QUANTUM); }
@@ -273,7 +334,7 @@ static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
 static void sched_queue_add(TCB* tcb)
 {
 	/* Insert at the end of the priority index scheduling list */
-	rlist_push_back(&(SCHED[tcb->priority]), &tcb->sched_node);
+	rlist_push_back(&(SCHED[sched_priority(tcb)]), &tcb->sched_node);
 
 	/* Restart possibly halted cores */
 	cpu_core_restart_one();
@@ -379,6 +440,18 @@ int wakeup(TCB* tcb)
 	return ret;
 }
 
+int sched_others_running()
+{
+	uint self = cpu_core_id;
+	for(uint c = 0; c < cpu_cores(); c++) {
+		if(c == self) continue;
+		CCB* ccb = &cctx[c];
+		if(__atomic_load_n(&ccb->current_thread, __ATOMIC_RELAXED) != &ccb->idle_thread)
+			return 1;
+	}
+	return 0;
+}
+
 /*
   Atomically put the current process to sleep, after unlocking mx.
  */
@@ -399,9 +472,14 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 	if (state != EXITED)
 		sched_register_timeout(tcb, timeout);
 
-	/* Release mx */
-	if (mx != NULL)
+	/* Release mx. Any priority inherited for it is dropped here, since 
+	   Mutex_Unlock cannot call sched_priority_restore() while we hold 
+	   sched_spinlock. Waiters set mx->pi only with sched_spinlock held. */
+	if (mx != NULL) {
+		sched_pi_drop(tcb, mx);
+		mx->pi = 0;
 		Mutex_Unlock(mx);
+	}
 
 	/* Release the schduler spinlock before calling yield() !!! */
 	Mutex_Unlock(&sched_spinlock);
@@ -443,13 +521,19 @@ void yield(enum SCHED_CAUSE cause)
 	current->last_cause = current->curr_cause;
 	current->curr_cause = cause;
 
+	/* A priority inherited for a Mutex lasts until the owner yields */
+	sched_pi_drop(current, NULL);
+
 	/*Increase the yield counter */
 	yield_counter++;
+	sched_stats.yields++;
+	if(cause == SCHED_MUTEX) sched_stats.mutex_yields++;
 
 
 	/* Every TIME_TO_BOOST calls of yield, boost up the priority of all threads to avoid starvation*/
 	if(yield_counter == TIME_TO_BOOST){
 		yield_counter = 0;
+		sched_stats.boosts++;
 		boost_up();
 	}
 
@@ -492,7 +576,9 @@ void yield(enum SCHED_CAUSE cause)
 
 	/* Switch contexts */
 	if (current != next) {
-		CURTHREAD = next;
+		/* The counter must change before CURTHREAD, see cur_thread() */
+		__atomic_fetch_add(&CURCORE.switches, 1, __ATOMIC_RELEASE);
+		__atomic_store_n(&CURTHREAD, next, __ATOMIC_RELEASE);
 		cpu_swap_context(&current->context, &next->context);
 	}
 
@@ -503,6 +589,130 @@ void yield(enum SCHED_CAUSE cause)
 }
 
 
+/*
+	Priority inheritance.
+	---------------------
+
+	The owner of a lock is read without synchronization, therefore it may 
+	be a thread that has already exited and has been released. So, before
+	touching the owner, we check that it is running on some core, or that it
+	is in a scheduler queue. Since threads are released with sched_spinlock
+	held, the owner is then safe to touch until we unlock.
+	
+	A sleeping owner is not boosted. 
+
+	The unlock of a Mutex only reads the flag set here, so an owner that 
+	unlocks while we boost it may keep the boost. Therefore, a boost for a
+	Mutex is leased: it is dropped when the owner yields. A waiter renews 
+	it every time it yields, as long as it is still waiting.
+ */
+
+/* Return the queue of a ready thread, MAX_QUEUES for a running thread, or -1 */
+static int sched_find_thread(TCB* tcb)
+{
+	for(uint c = 0; c < cpu_cores(); c++)
+		if(cctx[c].current_thread == tcb) return MAX_QUEUES;
+
+	for(int i = 0; i < MAX_QUEUES; i++)
+		for(rlnode* n = SCHED[i].next; n != &SCHED[i]; n = n->next)
+			if(n->tcb == tcb) return i;
+
+	return -1;
+}
+
+void sched_priority_inherit(void* lock, void* const* owner_ref, char* flag)
+{
+	int preempt = preempt_off;
+	Mutex_Lock(&sched_spinlock);
+
+	TCB* self = CURTHREAD;
+	TCB* owner = __atomic_load_n(owner_ref, __ATOMIC_SEQ_CST);
+	if(owner == NULL || owner == self) goto done;
+
+	int queue = sched_find_thread(owner);
+	if(queue < 0) goto done;
+
+	int prio = sched_priority(self);
+	if(owner->priority >= prio) goto done;
+
+	/* Find the boost for this lock, or else a free slot, or else the lowest boost */
+	pi_boost* b = NULL;
+	for(int i = 0; i < PI_LOCKS; i++) {
+		pi_boost* s = &owner->pi[i];
+		if(s->lock == lock) { b = s; break; }
+		if(b == NULL || (b->lock != NULL && (s->lock == NULL || s->priority < b->priority)))
+			b = s;
+	}
+	if(b->lock != NULL && b->priority >= prio) goto done;
+
+	int fresh = (b->lock != lock);
+	if(fresh && b->lock != NULL)
+		sched_stats.pi_restores++;
+	b->lock = lock;
+	b->priority = prio;
+	b->leased = (flag != NULL);
+	if(flag) __atomic_store_n(flag, 1, __ATOMIC_SEQ_CST);
+
+	/* The owner may have released the lock meanwhile, without seeing the flag */
+	if(__atomic_load_n(owner_ref, __ATOMIC_SEQ_CST) != owner) {
+		b->lock = NULL;
+		if(! fresh) sched_stats.pi_restores++;
+		sched_pi_update(owner);
+		goto done;
+	}
+	sched_pi_update(owner);
+
+	if(queue < MAX_QUEUES && queue != sched_priority(owner)) {
+		rlist_remove(&owner->sched_node);
+		rlist_push_back(&SCHED[sched_priority(owner)], &owner->sched_node);
+	}
+	if(fresh) sched_stats.pi_boosts++;
+
+done:
+	Mutex_Unlock(&sched_spinlock);
+	if(preempt) preempt_on;
+}
+
+void sched_priority_restore(void* lock)
+{
+	int preempt = preempt_off;
+	Mutex_Lock(&sched_spinlock);
+
+	sched_pi_drop(CURTHREAD, lock);
+
+	Mutex_Unlock(&sched_spinlock);
+	if(preempt) preempt_on;
+}
+
+size_t sched_statistics_snapshot(void** records)
+{
+	schedinfo* info = xmalloc(sizeof(schedinfo));
+
+	int preempt = preempt_off;
+	Mutex_Lock(&sched_spinlock);
+
+	info->yields = sched_stats.yields;
+	info->mutex_yields = sched_stats.mutex_yields;
+	info->boosts = sched_stats.boosts;
+	info->pi_boosts = sched_stats.pi_boosts;
+	info->pi_restores = sched_stats.pi_restores;
+	info->switches = 0;
+	for(uint c = 0; c < cpu_cores(); c++)
+		info->switches += cctx[c].switches;
+	for(int i = 0; i < MAX_QUEUES; i++) {
+		info->ready[i] = 0;
+		for(rlnode* n = SCHED[i].next; n != &SCHED[i]; n = n->next)
+			info->ready[i]++;
+	}
+
+	Mutex_Unlock(&sched_spinlock);
+	if(preempt) preempt_on;
+
+	*records = info;
+	return 1;
+}
+
+
 /*This function must be called every TIME_TO_BOOST calls of yield().
   We increase the priority of all threads and add them to the next higher priority list of scheduler. */
 void boost_up()
@@ -614,6 +824,8 @@ void run_scheduler()
 	curcore->idle_thread.state = RUNNING;
 	curcore->idle_thread.phase = CTX_DIRTY;
 	curcore->idle_thread.wakeup_time = NO_TIMEOUT;
+	curcore->idle_thread.pi_priority = -1;
+	for(int i = 0; i < PI_LOCKS; i++) curcore->idle_thread.pi[i].lock = NULL;
 	rlnode_init(&curcore->idle_thread.sched_node, &curcore->idle_thread);
 
 	curcore->idle_thread.its = QUANTUM;
@@ -621,6 +833,7 @@ void run_scheduler()
 
 	curcore->idle_thread.curr_cause = SCHED_IDLE;
 	curcore->idle_thread.last_cause = SCHED_IDLE;
+	curcore->idle_thread.io_flags = 0;
 
 	/* Initialize interrupt handler */
 	cpu_interrupt_handler(ALARM, yield_handler);
@@ -92,6 +92,20 @@ enum SCHED_CAUSE {
 };
 
 
+/** @brief The number of locks for which a thread keeps an inherited priority */
+#define PI_LOCKS 4
+
+/**
+  @brief A priority inherited for a lock.
+
+  @see sched_priority_inherit
+ */
+typedef struct pi_boost {
+  void* lock;         /**< @brief The lock, or NULL for a free slot */
+  int priority;       /**< @brief The priority of the highest waiter seen */
+  int leased;         /**< @brief Dropped at the owner's next yield (a @c Mutex) */
+} pi_boost;
+
 /**
   @brief The thread control block
 
@@ -111,6 +125,8 @@ typedef struct thread_control_block {
   /*Higher priority is the constant MAX_QUEUES, and the lowest is 0
     so priority is between [0..MAX_QUEUES-1] */
   int priority;       /**@brief The priority of this thread on scheduler's list. */
+  int pi_priority;    /**< @brief The highest priority in @c pi, or -1 */
+  pi_boost pi[PI_LOCKS]; /**< @brief Priorities inherited from the waiters of held locks */
 
 	void (*thread_func)(); /**< @brief The initial function executed by this thread */
 
@@ -123,6 +139,8 @@ typedef struct thread_control_block {
 	enum SCHED_CAUSE curr_cause; /**< @brief The endcause for the current time-slice */
 	enum SCHED_CAUSE last_cause; /**< @brief The endcause for the last time-slice */
 
+	int io_flags; /**< @brief The flags of the stream the thread is doing I/O on; see @c io_nonblocking */
+
 #ifndef NVALGRIND
 	unsigned valgrind_stack_id; /**< @brief Valgrind helper for stacks. 
 
@@ -181,6 +199,8 @@ typedef struct core_control_block {
 	TCB* previous_thread; /**< @brief Points to the thread that previously owned the core */
 	TCB idle_thread; /**< @brief Used by the scheduler to handle the core's idle thread */
 
+	unsigned long switches; /**< @brief Context switches on this core; see @c cur_thread */
+
 } CCB;
 
 /** @brief the array of Core Control Blocks (CCB) for the kernel */
@@ -193,8 +213,9 @@ extern CCB cctx[MAX_CORES];
   This function returns the TCB of the calling thread. Via this function,
   a system call can identify the process executing it, and all other information.
 
-  For performance reasons, it is advised to call this function
-  only once in each system call.
+  The function does not disable preemption. Instead, it reads the current 
+  thread of the current core, and retries if a context switch happened 
+  on the core meanwhile (as counted by @c CCB.switches). 
 
   @returns a pointer to the TCB of the caller.
 */
@@ -278,6 +299,72 @@ int wakeup(TCB* tcb);
    */
 void sleep_releasing(Thread_state newstate, Mutex* mx, enum SCHED_CAUSE cause, TimerDuration timeout);
 
+/**
+  @brief Check if other cores are running threads.
+
+  Returns true if some core, other than the current one, is currently running
+  a thread other than its idle thread. The check is not synchronized with the
+  scheduler, therefore the answer is only a hint. It is used to decide whether
+  it is worth spinning, waiting for another thread to do something.
+
+  @returns 1 if another core is busy, 0 otherwise.
+ */
+int sched_others_running(void);
+
+/**
+  @brief The effective priority of a thread.
+
+  This is the higher of the thread's MLFQ priority and the priority it
+  inherited (if any) from threads waiting for a lock it holds.
+ */
+#define sched_priority(tcb) \
+  ((tcb)->pi_priority > (tcb)->priority ? (tcb)->pi_priority : (tcb)->priority)
+
+/**
+  @brief Let the owner of a lock inherit the priority of the current thread.
+
+  This is called by a thread that is about to wait for a lock. The owner of the 
+  lock is read from @c *owner_ref. If it is a thread that is running or 
+  ready, and its effective priority is lower than the current thread's, then
+  it inherits the current thread's priority, until it calls
+  @c sched_priority_restore(lock). A ready owner is moved to its new queue.
+
+  A thread keeps a priority for each of up to @c PI_LOCKS locks it holds,
+  and runs at the highest of them, so releasing one lock keeps the boosts
+  of the others. If all the slots are taken, the lowest boost is replaced
+  by a higher one.
+
+  If @c flag is not NULL, it is set to tell the owner to call 
+  @c sched_priority_restore(lock) at unlock. This is for a @c Mutex, whose 
+  unlock does not synchronize with this call: an owner that unlocks at the
+  same time may miss the flag. So such a boost is also dropped at the 
+  owner's next yield. Waiters that still wait renew it each time they yield.
+
+  @param lock the lock the current thread waits for (used as a key)
+  @param owner_ref the location holding the owner of the lock (a @c TCB*)
+  @param flag the flag of a @c Mutex, or NULL for a lock whose release 
+     excludes this call
+ */
+void sched_priority_inherit(void* lock, void* const* owner_ref, char* flag);
+
+/**
+  @brief Drop the priority inherited by the current thread for a lock.
+
+  This is called when the current thread releases @c lock. If the thread
+  inherited a priority for this lock, it drops it, keeping any priority 
+  inherited for other locks.
+ */
+void sched_priority_restore(void* lock);
+
+/**
+  @brief Take a snapshot of the scheduler statistics.
+
+  Returns a single @c schedinfo record (allocated by @c xmalloc) in
+  @c *records. This is the snapshot function for @c KSTAT_SCHED streams.
+  @returns 1
+ */
+size_t sched_statistics_snapshot(void** records);
+
 /**
   @brief Give up the CPU.
 
@@ -0,0 +1,326 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include "util.h"
+#include "tinyos.h"
+#include "kernel_cc.h"
+#include "kernel_slab.h"
+
+
+lock_class slab_lock_class = LOCK_CLASS("slab");
+
+/* The list of registered caches */
+static slab_cache* slab_caches = NULL;
+
+
+/*
+	The header at the start of each slab. The objects follow it, rounded up
+	to SLAB_ALIGN bytes. A free object holds the next free object in its
+	first word. The objects past 'carved' have never been allocated, and
+	are not in the free list, so that a new slab is not touched all over.
+ */
+#define SLAB_ALIGN 64
+
+typedef struct slab {
+	rlnode node;          /* in the partial or empty list of the cache */
+	slab_cache* cache;    /* the owner */
+	void* freelist;       /* the free objects, below 'carved' */
+	unsigned int inuse;   /* the objects in use */
+	unsigned int carved;  /* the objects allocated at least once */
+} slab;
+
+#define SLAB_HEADER (((sizeof(slab) + SLAB_ALIGN - 1)/SLAB_ALIGN)*SLAB_ALIGN)
+
+static inline slab* slab_of(void* obj)
+{
+	return (slab*) ((uintptr_t) obj & ~((uintptr_t) SLAB_SIZE - 1));
+}
+
+static inline char* slab_object(slab_cache* cache, slab* s, unsigned int i)
+{
+	return (char*) s + SLAB_HEADER + (size_t) i * cache->objsize;
+}
+
+
+/* Set up a cache at its first allocation, holding its lock */
+static void slab_cache_register(slab_cache* cache)
+{
+	CHECK_CONDITION(cache->objsize <= SLAB_MAX_OBJECT);
+
+	/* Objects are big enough for the free list, and aligned */
+	size_t align = sizeof(void*);
+	if(cache->objsize < align) cache->objsize = align;
+	cache->objsize = (cache->objsize + align - 1) & ~(align - 1);
+	cache->perslab = (SLAB_SIZE - SLAB_HEADER) / cache->objsize;
+
+	rlnode_new(&cache->partial);
+	rlnode_new(&cache->empty);
+	cache->nempty = 0;
+
+	if(cache->percore) {
+		CHECK_CONDITION(cache->objsize >= sizeof(rlnode));
+		cache->cores = aligned_alloc(sizeof(slab_core), MAX_CORES*sizeof(slab_core));
+		if(cache->cores == NULL) FATAL("virtual memory exhausted");
+		memset(cache->cores, 0, MAX_CORES*sizeof(slab_core));
+		for(unsigned int c = 0; c < MAX_CORES; c++) {
+			rlnode_new(&cache->cores[c].free);
+			cache->cores[c].lock = MUTEX_INIT_CLASS(&slab_lock_class);
+		}
+	}
+
+	cache->next = __atomic_load_n(&slab_caches, __ATOMIC_RELAXED);
+	while(! __atomic_compare_exchange_n(&slab_caches, &cache->next, cache,
+		0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	__atomic_store_n(&cache->registered, 1, __ATOMIC_RELEASE);
+}
+
+
+static slab* slab_new(slab_cache* cache)
+{
+	slab* s = aligned_alloc(SLAB_SIZE, SLAB_SIZE);
+	if(s == NULL) FATAL("virtual memory exhausted");
+
+	rlnode_init(&s->node, s);
+	s->cache = cache;
+	s->freelist = NULL;
+	s->inuse = s->carved = 0;
+
+	cache->slabs++;
+	return s;
+}
+
+
+/* Take a free object from the slabs, holding the cache lock */
+static void* slab_take(slab_cache* cache)
+{
+	/* Find a slab with free objects, preferring one in use */
+	if(is_rlist_empty(&cache->partial)) {
+		slab* s;
+		if(! is_rlist_empty(&cache->empty)) {
+			s = rlist_pop_front(&cache->empty)->obj;
+			cache->nempty--;
+		} else
+			s = slab_new(cache);
+		rlist_push_front(&cache->partial, &s->node);
+	}
+	slab* s = cache->partial.next->obj;
+
+	void* obj;
+	if(s->freelist) {
+		obj = s->freelist;
+		s->freelist = *(void**) obj;
+	} else
+		obj = slab_object(cache, s, s->carved++);
+
+	/* A full slab leaves the partial list */
+	if(++s->inuse == cache->perslab) rlist_remove(&s->node);
+
+	cache->inuse++;
+	return obj;
+}
+
+
+/* Return an object to its slab, holding the cache lock */
+static void slab_put(slab_cache* cache, void* obj)
+{
+	slab* s = slab_of(obj);
+
+	*(void**) obj = s->freelist;
+	s->freelist = obj;
+
+	/* A full slab re-enters the partial list */
+	if(s->inuse-- == cache->perslab) rlist_push_back(&cache->partial, &s->node);
+
+	cache->inuse--;
+
+	/* Keep a few empty slabs, and return the rest */
+	if(s->inuse == 0) {
+		rlist_remove(&s->node);
+		if(cache->nempty < SLAB_KEEP_EMPTY) {
+			rlist_push_front(&cache->empty, &s->node);
+			cache->nempty++;
+		} else {
+			cache->slabs--;
+			cache->reclaimed++;
+			free(s);
+		}
+	}
+}
+
+
+/*
+	The per-core lists. A thread uses the list of the core it runs on, 
+	under the lock of the list. The lock is almost never contended, since
+	a thread may only meet another one on the list if it moved to another
+	core, or was preempted, while holding it. An empty list is refilled 
+	with a batch of objects taken from the slabs, and a list that grows 
+	past SLAB_CORE_MAX gives a batch back, so the cache lock is taken once
+	per batch.
+ */
+static void* slab_core_alloc(slab_cache* cache)
+{
+	slab_core* core = &cache->cores[cpu_core_id];
+	Mutex_Lock(&core->lock);
+	if(core->count == 0) {
+		/* Refill, holding the list lock, so that the batch stays here */
+		Mutex_Lock(&cache->lock);
+		for(int i = 0; i < SLAB_CORE_BATCH; i++)
+			rlist_push_back(&core->free, rlnode_init(slab_take(cache), NULL));
+		Mutex_Unlock(&cache->lock);
+		core->count = SLAB_CORE_BATCH;
+	}
+	rlnode* obj = rlist_pop_front(&core->free);
+	core->count--;
+	core->allocs++;
+	Mutex_Unlock(&core->lock);
+	return obj;
+}
+
+static void slab_core_free(slab_cache* cache, void* obj)
+{
+	slab_core* core = &cache->cores[cpu_core_id];
+	Mutex_Lock(&core->lock);
+	rlist_push_front(&core->free, rlnode_init(obj, NULL));
+	core->frees++;
+	if(++core->count > SLAB_CORE_MAX) {
+		Mutex_Lock(&cache->lock);
+		for(int i = 0; i < SLAB_CORE_BATCH; i++)
+			slab_put(cache, rlist_pop_back(&core->free));
+		Mutex_Unlock(&cache->lock);
+		core->count -= SLAB_CORE_BATCH;
+	}
+	Mutex_Unlock(&core->lock);
+}
+
+
+void* slab_alloc(slab_cache* cache)
+{
+	if(cache->percore && __atomic_load_n(&cache->registered, __ATOMIC_ACQUIRE))
+		return slab_core_alloc(cache);
+
+	Mutex_Lock(&cache->lock);
+	if(! cache->registered) slab_cache_register(cache);
+	void* obj = slab_take(cache);
+	cache->allocs++;
+	Mutex_Unlock(&cache->lock);
+	return obj;
+}
+
+
+void slab_free(void* obj)
+{
+	slab_cache* cache = slab_of(obj)->cache;
+
+	if(cache->percore) {
+		slab_core_free(cache, obj);
+		return;
+	}
+
+	Mutex_Lock(&cache->lock);
+	slab_put(cache, obj);
+	cache->frees++;
+	Mutex_Unlock(&cache->lock);
+}
+
+
+/*
+	The buffer pool.
+ */
+
+static slab_cache buffer_caches[] = {
+	SLAB_CACHE("buffer-512", 512),
+	SLAB_CACHE("buffer-1k", 1024),
+	SLAB_CACHE("buffer-2k", 2048),
+	SLAB_CACHE("buffer-4k", 4096),
+	SLAB_CACHE("buffer-8k", 8192),
+	SLAB_CACHE("buffer-16k", 16384)
+};
+
+#define POOL_CLASSES (sizeof(buffer_caches)/sizeof(slab_cache))
+_Static_assert(POOL_MIN_BUFFER << (POOL_CLASSES-1) == POOL_MAX_BUFFER, "a buffer cache is needed for each size");
+
+/* Buffers larger than POOL_MAX_BUFFER, counted atomically */
+static struct {
+	unsigned long inuse, allocs, frees, bytes;
+} large_buffers;
+
+static inline slab_cache* buffer_cache(unsigned int size)
+{
+	unsigned int c = 0;
+	while((POOL_MIN_BUFFER << c) < size) c++;
+	return &buffer_caches[c];
+}
+
+void* buffer_alloc(unsigned int size)
+{
+	if(size <= POOL_MAX_BUFFER)
+		return slab_alloc(buffer_cache(size));
+
+	__atomic_fetch_add(&large_buffers.inuse, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&large_buffers.allocs, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&large_buffers.bytes, size, __ATOMIC_RELAXED);
+	return xmalloc(size);
+}
+
+void buffer_free(void* buf, unsigned int size)
+{
+	if(size <= POOL_MAX_BUFFER) {
+		slab_free(buf);
+		return;
+	}
+
+	__atomic_fetch_sub(&large_buffers.inuse, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&large_buffers.frees, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_sub(&large_buffers.bytes, size, __ATOMIC_RELAXED);
+	free(buf);
+}
+
+
+/*
+	Statistics. There is a record for each registered cache, and one for
+	the large buffers.
+ */
+size_t slab_statistics_snapshot(void** records)
+{
+	slab_cache* head = __atomic_load_n(&slab_caches, __ATOMIC_ACQUIRE);
+	size_t n = 1;
+	for(slab_cache* cache = head; cache != NULL; cache = cache->next) n++;
+
+	slabinfo* info = xmalloc(n * sizeof(slabinfo));
+	memset(info, 0, n * sizeof(slabinfo));
+
+	slabinfo* si = info;
+	for(slab_cache* cache = head; cache != NULL; cache = cache->next, si++) {
+		Mutex_Lock(&cache->lock);
+		strncpy(si->name, cache->name, SLABINFO_NAME_SIZE-1);
+		si->objsize = cache->objsize;
+		si->perslab = cache->perslab;
+		si->slabs = cache->slabs;
+		si->empty = cache->nempty;
+		si->inuse = cache->inuse;
+		si->allocs = cache->allocs;
+		si->frees = cache->frees;
+
+		/* The objects in the per-core lists are free, though not in a slab */
+		if(cache->percore)
+			for(unsigned int c = 0; c < MAX_CORES; c++) {
+				slab_core* core = &cache->cores[c];
+				si->cached += core->count;
+				si->allocs += core->allocs;
+				si->frees += core->frees;
+			}
+		si->inuse = (si->cached < si->inuse) ? si->inuse - si->cached : 0;
+		si->reclaimed = cache->reclaimed;
+		si->memory = cache->slabs * SLAB_SIZE;
+		Mutex_Unlock(&cache->lock);
+	}
+
+	strncpy(si->name, "buffer-large", SLABINFO_NAME_SIZE-1);
+	si->inuse = large_buffers.inuse;
+	si->allocs = large_buffers.allocs;
+	si->frees = large_buffers.frees;
+	si->memory = large_buffers.bytes;
+
+	*records = info;
+	return n;
+}
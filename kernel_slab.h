@@ -0,0 +1,170 @@
+#ifndef __KERNEL_SLAB_H
+#define __KERNEL_SLAB_H
+
+/**
+  @file kernel_slab.h
+  @brief Slab caches and the buffer pool.
+
+  @defgroup slab Slab caches
+  @ingroup kernel
+  @brief Slab caches and the buffer pool.
+
+  A slab cache allocates kernel objects of a fixed size. Objects are carved
+  out of slabs, large blocks of @c SLAB_SIZE bytes that are aligned to their
+  size, so that the slab of an object is found by masking its address. Each
+  slab starts with a header, which keeps a free list of its objects.
+
+  A cache prefers the slabs that are partly in use, so that the objects
+  in use are packed into few slabs. A slab whose objects are all free is
+  kept for reuse, up to @c SLAB_KEEP_EMPTY slabs per cache; further empty
+  slabs are returned to the system.
+
+  The buffer pool is built on a slab cache for each power-of-two buffer
+  size from @c POOL_MIN_BUFFER to @c POOL_MAX_BUFFER. Larger buffers are
+  allocated directly by @c xmalloc.
+
+  A cache made by @c SLAB_CACHE_PERCORE also keeps a list of free objects
+  for each core, so that most allocations and frees take only the lock
+  of their core's list, which is almost never contended. The list is 
+  refilled from the slabs, and drained back to them, @c SLAB_CORE_BATCH 
+  objects at a time.
+  Such caches suit small kernel objects that are allocated and freed 
+  often, e.g., for each connection.
+
+  Slab caches have their own locks, so they may be used without the
+  kernel lock.
+
+  @{
+*/
+
+#include "util.h"
+#include "kernel_cc.h"
+
+/** @brief The size of a slab, a power of two. */
+#define SLAB_SIZE (128*1024)
+
+/** @brief The largest object size of a slab cache. */
+#define SLAB_MAX_OBJECT (SLAB_SIZE/8)
+
+/** @brief The number of empty slabs that a cache keeps for reuse. */
+#define SLAB_KEEP_EMPTY 1
+
+/** @brief The smallest buffer of the buffer pool. */
+#define POOL_MIN_BUFFER 512
+
+/** @brief The largest buffer that the buffer pool allocates from a slab cache. */
+#define POOL_MAX_BUFFER (16*1024)
+
+/** @brief The objects moved at a time between the slabs and a per-core list. */
+#define SLAB_CORE_BATCH 16
+
+/** @brief The most free objects kept in a per-core list. */
+#define SLAB_CORE_MAX (2*SLAB_CORE_BATCH)
+
+_Static_assert(POOL_MAX_BUFFER <= SLAB_MAX_OBJECT, "POOL_MAX_BUFFER must fit in a slab cache");
+
+/** @brief The lock class of the slab cache locks. */
+extern lock_class slab_lock_class;
+
+/**
+  @brief The free objects of a slab cache on one core.
+
+  A free object holds an @c rlnode, which links it in the list. The 
+  counters are read by the statistics without the lock.
+ */
+typedef struct slab_core {
+	Mutex lock;                /**< @brief Protects the list */
+	rlnode free;               /**< @brief The free objects */
+	unsigned int count;        /**< @brief The length of @c free */
+	unsigned long allocs;      /**< @brief Allocations from this list */
+	unsigned long frees;       /**< @brief Frees to this list */
+} __attribute__((aligned(64))) slab_core;
+
+/**
+  @brief A slab cache.
+
+  Slab caches are statically allocated, and initialized by @c SLAB_CACHE.
+  They are registered (for the statistics) the first time an object is
+  allocated from them.
+  @code
+  static slab_cache conn_cache = SLAB_CACHE("conn", sizeof(struct conn));
+  struct conn* c = slab_alloc(&conn_cache);
+  ...
+  slab_free(c);
+  @endcode
+ */
+typedef struct slab_cache {
+	const char* name;          /**< @brief The cache name */
+	size_t objsize;            /**< @brief The object size */
+	Mutex lock;                /**< @brief Protects the slabs and the statistics */
+
+	unsigned int perslab;      /**< @brief The objects per slab */
+	rlnode partial;            /**< @brief Slabs with objects both in use and free */
+	rlnode empty;              /**< @brief Slabs with no objects in use */
+	unsigned int nempty;       /**< @brief The length of @c empty */
+
+	unsigned long slabs;       /**< @brief Slabs currently allocated */
+	unsigned long inuse;       /**< @brief Objects currently in use */
+	unsigned long allocs;      /**< @brief Allocations since boot */
+	unsigned long frees;       /**< @brief Frees since boot */
+	unsigned long reclaimed;   /**< @brief Empty slabs returned to the system since boot */
+
+	int registered;            /**< @brief Set when the cache is registered */
+	struct slab_cache* next;   /**< @brief The list of registered caches */
+
+	int percore;               /**< @brief Set if the cache has per-core lists */
+	slab_core* cores;          /**< @brief The per-core lists, if @c percore is set */
+} slab_cache;
+
+#if defined(LOCK_STATISTICS)
+#define SLAB_LOCK_INIT { .cls = &slab_lock_class }
+#else
+#define SLAB_LOCK_INIT { 0 }
+#endif
+
+/** @brief Static initializer for a slab cache of objects of size @c size. */
+#define SLAB_CACHE(cname, size) \
+	{ .name = (cname), .objsize = (size), .lock = SLAB_LOCK_INIT }
+
+/** @brief Static initializer for a slab cache with per-core free lists. */
+#define SLAB_CACHE_PERCORE(cname, size) \
+	{ .name = (cname), .objsize = (size), .lock = SLAB_LOCK_INIT, .percore = 1 }
+
+/**
+  @brief Allocate an object from a slab cache.
+
+  If the cache has no free objects, a new slab is allocated. As with
+  @c xmalloc, running out of memory is fatal.
+ */
+void* slab_alloc(slab_cache* cache);
+
+/**
+  @brief Return an object to its slab cache.
+
+  The cache is found from the address of the object, so this can be
+  passed to @c epoch_retire.
+ */
+void slab_free(void* obj);
+
+/**
+  @brief Allocate a buffer from the buffer pool.
+
+  @param size the size of the buffer, a power of two no less than
+     @c POOL_MIN_BUFFER
+ */
+void* buffer_alloc(unsigned int size);
+
+/**
+  @brief Return a buffer to the buffer pool.
+
+  @param buf the buffer, returned by @c buffer_alloc
+  @param size the size that the buffer was allocated with
+ */
+void buffer_free(void* buf, unsigned int size);
+
+/** @brief Take a snapshot of the slab statistics, as a @c KSTAT_SLABS stream. */
+size_t slab_statistics_snapshot(void** records);
+
+/** @} */
+
+#endif
@@ -1,13 +1,54 @@
 #include "kernel_socket.h"
+#include "kernel_slab.h"
+
+socket_cb* PORT_MAP[MAX_PORT+1];
+socket_cb* DGRAM_MAP[MAX_PORT+1];
+
+/* Sockets and connection requests come and go with each connection */
+static slab_cache socket_cache = SLAB_CACHE_PERCORE("socket", sizeof(socket_cb));
+static slab_cache request_cache = SLAB_CACHE_PERCORE("conn-request", sizeof(connection_request));
+
+/* The open sockets, and the number of sockets made since boot, protected by the kernel lock */
+static rlnode socket_list = { .obj = NULL, .prev = &socket_list, .next = &socket_list };
+static unsigned long socket_count;
 
 static file_ops socket_file_ops = {
 	.Open = socket_open,
 	.Read = socket_read,
 	.Write = socket_write,
-	.Close = socket_close
-
+	.Close = socket_close,
+	.SetOption = socket_set_option,
+	.GetOption = socket_get_option,
+	.ReadNoLock = socket_read_nolock,
+	.WriteNoLock = socket_write_nolock,
+	.FinishNoLock = socket_finish_nolock,
+	.GetPipe = socket_get_pipe,
+	.Poll = socket_poll,
+	.ReadV = socket_readv,
+	.WriteV = socket_writev
 };
 
+/* Initialize a new unbound socket at an FCB */
+static socket_cb* socket_init(FCB* fcb, port_t port)
+{
+	socket_cb* scb = slab_alloc(&socket_cache);
+
+	// initialize the socket control block's attributes
+	scb->refcount = 0;
+	scb->fcb = fcb;
+	scb->type = SOCKET_UNBOUND;
+	scb->port = port;
+	scb->reuseport = 0;
+	scb->id = ++socket_count;
+	rlist_push_back(&socket_list, rlnode_init(&scb->live, scb));
+
+	//initialize the fcb's attributes
+	fcb->streamobj = scb;
+	fcb->streamfunc = &socket_file_ops;
+
+	return scb;
+}
+
 Fid_t sys_Socket(port_t port)
 {
 	if(port < NOPORT || port > MAX_PORT){
@@ -20,23 +61,63 @@ Fid_t sys_Socket(port_t port)
 	if(! FCB_reserve( 1, &fid, &fcb))
 		return NOFILE; /*No fcbs left */
 	
-	socket_cb* scb = xmalloc(sizeof(socket_cb)); 
-
-	// initialize the socket control block's attributes
-	scb->refcount = 0;
-	scb->fcb = fcb;
-	scb->type = SOCKET_UNBOUND;
-	scb->port = port;
-
-	//initialize the fcb's attributes
-	fcb->streamobj = scb;
-	fcb->streamfunc = &socket_file_ops;
+	socket_init(fcb, port);
 
 	return  fid;
 	
 }
 
-int sys_Listen(Fid_t sock)
+/*
+	Connect two unbound sockets as peers, with a pipe in each direction.
+ */
+static void socket_connect_peers(socket_cb* a, socket_cb* b)
+{
+	// make the peer connections
+	a->peer_s.peer = b;
+	b->peer_s.peer = a;
+
+	// make the two pipes
+	pipe_cb* a_to_b = pipe_create(b->fcb, a->fcb, PIPE_AUTO);
+	pipe_cb* b_to_a = pipe_create(a->fcb, b->fcb, PIPE_AUTO);
+
+	a->peer_s.read_pipe = b_to_a;
+	a->peer_s.write_pipe = a_to_b;
+	b->peer_s.read_pipe = a_to_b;
+	b->peer_s.write_pipe = b_to_a;
+
+	// the control channels, for SendFid
+	socket_cb* ends[2] = { a, b };
+	for(int i = 0; i < 2; i++) {
+		ends[i]->peer_s.fid_head = ends[i]->peer_s.fid_count = 0;
+		ends[i]->peer_s.fid_ready = COND_INIT;
+		ends[i]->peer_s.shut = 0;
+	}
+
+	// change the types of both sockets to SOCKET_PEER, after the pipes are set, for the lockless readers
+	__atomic_store_n(&a->type, SOCKET_PEER, __ATOMIC_RELEASE);
+	__atomic_store_n(&b->type, SOCKET_PEER, __ATOMIC_RELEASE);
+}
+
+
+/*
+	A pair of connected sockets, made directly, without a port or a 
+	listener.
+ */
+int sys_SocketPair(Fid_t out[2])
+{
+	if(out == NULL)
+		return -1;
+
+	FCB* fcb[2];
+	if(! FCB_reserve(2, out, fcb))
+		return -1;
+
+	socket_connect_peers(socket_init(fcb[0], NOPORT), socket_init(fcb[1], NOPORT));
+	return 0;
+}
+
+
+int sys_ListenEx(Fid_t sock, unsigned int backlog)
 {	
 	// check if the file id is not legal
 	if(sock < 0 || sock > MAX_FILEID-1)
@@ -44,8 +125,8 @@ int sys_Listen(Fid_t sock)
 
 	FCB* socket_listener_fcb = get_fcb(sock); // get the fcb
 
-	// if the fcb does not exist
-	if(!socket_listener_fcb)
+	// if the fcb does not exist, or it is not a socket
+	if(!socket_listener_fcb || socket_listener_fcb->streamfunc != &socket_file_ops)
 		return -1;
 
 	// cast to socket control block
@@ -63,8 +144,9 @@ int sys_Listen(Fid_t sock)
 	if(listener_scb->type != SOCKET_UNBOUND)
 		return -1;
 
-	// if the port bound to the socket is occupied by another listener
-	if(PORT_MAP[listener_scb->port] != NULL)
+	// if the port bound to the socket is occupied by another listener, both must allow sharing it
+	socket_cb* group = PORT_MAP[listener_scb->port];
+	if(group != NULL && !(group->reuseport && listener_scb->reuseport))
 		return -1;
 
 	// initialize the socket listener
@@ -75,133 +157,268 @@ int sys_Listen(Fid_t sock)
 
 	listener_scb->listener_s.req_available = COND_INIT; // initialize the condition variable of the listener
 
-	PORT_MAP[listener_scb->port] = listener_scb; // insert the listener to the port map array
+	listener_scb->listener_s.pending = 0;
+	listener_scb->listener_s.backlog = backlog;
+	listener_scb->listener_s.closed = 0;
+
+	// insert the listener to the port map array, or to the group of listeners on the port
+	rlnode_init(&listener_scb->listener_s.group, listener_scb);
+	if(group != NULL)
+		rlist_push_back(&group->listener_s.group, &listener_scb->listener_s.group);
+	else
+		__atomic_store_n(&PORT_MAP[listener_scb->port], listener_scb, __ATOMIC_RELEASE);
 
 
 	return 0;
 }
 
+int sys_Listen(Fid_t sock)
+{
+	return sys_ListenEx(sock, LISTEN_BACKLOG_UNLIMITED);
+}
 
-Fid_t sys_Accept(Fid_t lsock)
+
+/* The listener socket at a file id, or NULL */
+static socket_cb* get_listener(Fid_t lsock, FCB** fcb)
 {
 	// check if the file id is not legal
 	if(lsock < 0 || lsock > MAX_FILEID-1)
-		return NOFILE;
+		return NULL;
 	
-	FCB* socket_listener_fcb = get_fcb(lsock); // get the fcb of the listener
+	*fcb = get_fcb(lsock); // get the fcb of the listener
 
-	// if the fcb does not exist
-	if(!socket_listener_fcb)
-		return NOFILE;
+	// if the fcb does not exist, or it is not a socket
+	if(*fcb == NULL || (*fcb)->streamfunc != &socket_file_ops)
+		return NULL;
 
 	// cast to socket control block
-	socket_cb* listener_scb = (socket_cb*)socket_listener_fcb->streamobj;
+	socket_cb* listener_scb = (socket_cb*)(*fcb)->streamobj;
 
-	// check if listener is null
-	if(!listener_scb)
-		return NOFILE;
-
-	int port = listener_scb->port ;
+	if(listener_scb == NULL || listener_scb->type != SOCKET_LISTENER || listener_scb->listener_s.closed)
+		return NULL;
 
-	if(listener_scb->type != SOCKET_LISTENER || PORT_MAP[port] != listener_scb)
-		return NOFILE;
-
-	int i = 0;
+	return listener_scb;
+}
 
-	for(; i< MAX_FILEID; i++)
-	{
-		if(!(CURPROC->FIDT[i]))
-			break;
-	}
+/* The number of free file ids of the current process */
+static unsigned int free_fids()
+{
+	unsigned int n = 0;
+	for(int i = 0; i < MAX_FILEID; i++)
+		if(!(CURPROC->FIDT[i])) n++;
+	return n;
+}
 
-	if(i == MAX_FILEID)
-		return NOFILE;
+/*
+	Wait until the queue of a listener is not empty. Returns 0 if it is not,
+	NOFILE if the listener was closed while we were sleeping, and WOULD_BLOCK
+	if the listener is non-blocking and the queue is empty.
+ */
+static int listener_wait(socket_cb* listener_scb, FCB* listener_fcb)
+{
+	// a non-blocking listener does not wait for a request
+	if(is_rlist_empty(&(listener_scb->listener_s.queue)) && (listener_fcb->flags & FCB_NONBLOCK))
+		return WOULD_BLOCK;
 
 	// increase the listener's refcount as we are using it
 	listener_scb->refcount += 1;
 
 	// if the request queue is empty make the listener sleep on the req_available condition variable until a request is sent
 	//if the listener socket closes when listener is sleeping, wake up
-	while(is_rlist_empty(&(listener_scb->listener_s.queue)) && PORT_MAP[port] != NULL)
+	while(is_rlist_empty(&(listener_scb->listener_s.queue)) && !listener_scb->listener_s.closed)
 	{
 		kernel_wait(&(listener_scb->listener_s.req_available), SCHED_IO);
 	}
 
-	// check if the port is still valid as the socket may have been closed while we were sleeping
-	if(PORT_MAP[port] == NULL)
-		return NOFILE;
+	// decrease the listener's refcount
+	listener_scb->refcount -= 1;
 
+	// check if the listener is still open, as it may have been closed while we were sleeping
+	return listener_scb->listener_s.closed ? NOFILE : 0;
+}
+
+/*
+	Admit the next request in the queue of a listener, connecting its client
+	to a new peer socket at the given FCB. Returns 0 if the request is 
+	refused instead, since its client is no longer an unbound socket.
+ */
+static int listener_admit(socket_cb* listener_scb, FCB* client_peer_fcb)
+{
 	connection_request* request_admitted = rlist_pop_front(&(listener_scb->listener_s.queue))->connection_request;
+	listener_scb->listener_s.pending--;
 
 	// get the socket who made the request
 	socket_cb* client_socket = request_admitted->peer;
 
-	// check if the client is an unbound socket
+	// check if the client is an unbound socket; if not, the request is refused
 	if(client_socket->type != SOCKET_UNBOUND){
-		return NOFILE;
+		kernel_signal(&(request_admitted->connected_cv));
+		return 0;
 	}
 
 	// create a peer socket for the client to communicate with
-	Fid_t client_peer = sys_Socket(client_socket->port);
+	socket_cb* client_peer_scb = socket_init(client_peer_fcb, client_socket->port);
 
-	if(!client_peer)
+	request_admitted->admitted = 1; // make the request admitted
+
+	socket_connect_peers(client_socket, client_peer_scb);
+
+    // signal the client, because the connection has been established.
+    kernel_signal(&(request_admitted->connected_cv));
+
+    return 1;
+}
+
+
+Fid_t sys_Accept(Fid_t lsock)
+{
+	FCB* socket_listener_fcb;
+	socket_cb* listener_scb = get_listener(lsock, &socket_listener_fcb);
+	if(!listener_scb)
 		return NOFILE;
 
-	request_admitted->admitted = 1; // make the request admitted
-	client_socket->type = SOCKET_PEER; // change the requesting socket's type to SOCKET_PEER
+	// fail at once if there is no file id for the new connection
+	if(free_fids() == 0)
+		return NOFILE;
 
-	FCB* client_peer_fcb = get_fcb(client_peer); // get the fcb of the client's peer
+	int rc = listener_wait(listener_scb, socket_listener_fcb);
+	if(rc != 0)
+		return rc;
 
-	socket_cb* client_peer_scb = (socket_cb*)client_peer_fcb->streamobj; // get the scb of the client's peer
+	Fid_t client_peer;
+	FCB* client_peer_fcb;
+	if(! FCB_reserve(1, &client_peer, &client_peer_fcb))
+		return NOFILE;
 
-	client_peer_scb->type = SOCKET_PEER; // change the type of the client's peer to SOCKET_PEER
+	if(! listener_admit(listener_scb, client_peer_fcb)) {
+		FCB_unreserve(1, &client_peer, &client_peer_fcb);
+		return NOFILE;
+	}
 
-	// make the peer connections
-	client_socket->peer_s.peer = client_peer_scb; 
-	client_peer_scb->peer_s.peer = client_socket;
+	return client_peer;
+}
 
-	// make the two pipes
-	pipe_cb* pipe_cb1 = xmalloc(sizeof(pipe_cb));
-	pipe_cb* pipe_cb2 = xmalloc(sizeof(pipe_cb));
-
-	//initialize the first pipe
-	pipe_cb1->has_space = COND_INIT;
-    pipe_cb1->has_data = COND_INIT;
-    pipe_cb1->w_position = 0;
-    pipe_cb1->r_position = 0; 
-    pipe_cb1->remaining_space = PIPE_BUFFER_SIZE;
-    pipe_cb1->reader = client_peer_fcb;
-    pipe_cb1->writer = client_socket->fcb;
-
-    //initialize the second pipe
-	pipe_cb2->has_space = COND_INIT;
-    pipe_cb2->has_data = COND_INIT;
-    pipe_cb2->w_position = 0;
-    pipe_cb2->r_position = 0; 
-    pipe_cb2->remaining_space = PIPE_BUFFER_SIZE;
-    pipe_cb2->reader = client_socket->fcb;
-    pipe_cb2->writer = client_peer_fcb;
-
-    // make the client's pipe connections
-    client_socket->peer_s.read_pipe = pipe_cb2;
-    client_socket->peer_s.write_pipe = pipe_cb1;
-
-    // make the client's peer pipe connections
-    client_peer_scb->peer_s.read_pipe = pipe_cb1;
-    client_peer_scb->peer_s.write_pipe = pipe_cb2;
 
-    // signal the client, because the connection has been established.
-    kernel_signal(&(request_admitted->connected_cv));
+/*
+	Accept a batch of requests, with a single wait and a single reservation 
+	of file ids. The refused requests leave gaps in the reservation, which
+	are closed up in out[].
+ */
+int sys_AcceptMany(Fid_t lsock, Fid_t* out, unsigned int n)
+{
+	if(out == NULL || n == 0)
+		return -1;
 
-    // decrease the listener's refcount
-    listener_scb->refcount -= 1;
+	FCB* socket_listener_fcb;
+	socket_cb* listener_scb = get_listener(lsock, &socket_listener_fcb);
+	if(!listener_scb)
+		return -1;
 
-    return client_peer;
+	unsigned int avail = free_fids();
+	if(avail == 0)
+		return -1;
+
+	int rc = listener_wait(listener_scb, socket_listener_fcb);
+	if(rc == WOULD_BLOCK)
+		return WOULD_BLOCK;
+	if(rc != 0)
+		return -1;
 
+	unsigned int k = n;
+	if(k > listener_scb->listener_s.pending) k = listener_scb->listener_s.pending;
+	if(k > avail) k = avail;
+
+	FCB* fcb[MAX_FILEID];
+	if(! FCB_reserve(k, out, fcb))
+		return -1;
+
+	unsigned int accepted = 0;
+	for(unsigned int i = 0; i < k; i++) {
+		if(listener_admit(listener_scb, fcb[i]))
+			out[accepted++] = out[i];
+		else
+			FCB_unreserve(1, &out[i], &fcb[i]);
+	}
+
+	return accepted ? (int) accepted : -1;
 }
 
 
-int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
+/*
+	Listener groups. The listeners that share a port form a ring, and 
+	PORT_MAP holds one of them. A new request goes to the listener with 
+	the fewest pending requests, among those whose backlog is not full. 
+	The scan starts from PORT_MAP, which then moves past the chosen 
+	listener, so that ties are served round-robin.
+ */
+static inline int listener_full(socket_cb* l)
+{
+	return l->listener_s.backlog != LISTEN_BACKLOG_UNLIMITED 
+		&& l->listener_s.pending >= l->listener_s.backlog;
+}
+
+static socket_cb* port_choose_listener(port_t port)
+{
+	socket_cb* head = PORT_MAP[port];
+	socket_cb* best = NULL;
+
+	rlnode* n = &head->listener_s.group;
+	do {
+		socket_cb* l = n->obj;
+		if(!listener_full(l) && (best == NULL || l->listener_s.pending < best->listener_s.pending))
+			best = l;
+		n = n->next;
+	} while(n != &head->listener_s.group);
+
+	if(best != NULL)
+		__atomic_store_n(&PORT_MAP[port], (socket_cb*) best->listener_s.group.next->obj, __ATOMIC_RELEASE);
+	return best;
+}
+
+/* 
+	Queue a request at the chosen listener of a port, and wake it up. 
+	Returns 0 if the backlogs of all the listeners are full.
+ */
+static int port_queue_request(port_t port, connection_request* req)
+{
+	socket_cb* listener = port_choose_listener(port);
+	if(listener == NULL) return 0;
+	req->listener = listener;
+	rlist_push_back(&listener->listener_s.queue, &req->queue_node);
+	listener->listener_s.pending++;
+
+	//signal the listener as a new request is available, and any pollers
+	kernel_signal(&listener->listener_s.req_available);
+	poll_notify(listener->fcb);
+	return 1;
+}
+
+/*
+	Remove a closed listener from its port. Its pending requests move to 
+	the rest of the group; if there is none, or it has no room, they are
+	refused at once.
+ */
+static void listener_unbind(socket_cb* scb)
+{
+	listener_socket* ls = &scb->listener_s;
+	socket_cb* next = is_rlist_empty(&ls->group) ? NULL : ls->group.next->obj;
+
+	ls->closed = 1;
+	if(PORT_MAP[scb->port] == scb)
+		__atomic_store_n(&PORT_MAP[scb->port], next, __ATOMIC_RELEASE);
+	rlist_remove(&ls->group);
+
+	while(! is_rlist_empty(&ls->queue)) {
+		connection_request* req = rlist_pop_front(&ls->queue)->connection_request;
+		if(next == NULL || !port_queue_request(scb->port, req))
+			kernel_signal(&req->connected_cv);
+	}
+	ls->pending = 0;
+}
+
+
+/* The body of Connect, called with the kernel lock held */
+static int socket_connect(Fid_t sock, port_t port, timeout_t timeout)
 {	
 
 	//if file id is not legal return -1
@@ -210,6 +427,9 @@ int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 
 	FCB* client_fcb = get_fcb(sock);
 
+	if(!client_fcb || client_fcb->streamfunc != &socket_file_ops)
+		return -1;
+
 	//check if the port is legal
 	if(port <= NOPORT || port > MAX_PORT){
 		return -1;
@@ -227,14 +447,11 @@ int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 		return -1;
 	}
 
-	//pointer to the listener
-	socket_cb* listener_scb = PORT_MAP[port];
-
 	//increase refcount
 	client_scb->refcount++;
 
 	//Build Request
-	connection_request* new_request = xmalloc(sizeof(connection_request));
+	connection_request* new_request = slab_alloc(&request_cache);
 
 	//initiallize variables
 	new_request->admitted = 0;
@@ -242,14 +459,16 @@ int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 	new_request->connected_cv = COND_INIT;
 	rlnode_init(&(new_request->queue_node),new_request);
 
-	//add the new request to the listeners queue
-	rlist_push_back(&(listener_scb->listener_s.queue),&(new_request->queue_node));
-
-	//signal the listener as a new request is available
-	kernel_signal(&(listener_scb->listener_s.req_available));
+	//add the new request to the queue of a listener on the port; if the backlog is full, it is refused
+	if(!port_queue_request(port, new_request)) {
+		client_scb->refcount--;
+		slab_free(new_request);
+		return -1;
+	}
 
-	//while request is not admitted, the client will block for a specified ammount of time
-	while(new_request->admitted == 0){
+	//while request is not admitted, the client will block for a specified ammount of time,
+	//unless the request leaves the queue without being admitted (when it is refused)
+	while(new_request->admitted == 0 && !is_rlist_empty(&new_request->queue_node)){
 
 		//store the return value of kernel_timedwait
 		int return_value = kernel_timedwait(&(new_request->connected_cv), SCHED_PIPE, timeout);
@@ -263,20 +482,56 @@ int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 
 	//decrease the refcount
 	client_scb->refcount--;
-	//remove the request from the listener's queue
-	rlist_remove(&(new_request->queue_node));
-
-	//if the request was admitted, then the connect was successfull
-	if(new_request->admitted){
-		return 0;
+	//remove the request from the listener's queue, if it is still there
+	if(!is_rlist_empty(&new_request->queue_node)) {
+		new_request->listener->listener_s.pending--;
+		rlist_remove(&(new_request->queue_node));
 	}
 
+	//if the request was admitted, then the connect was successfull
+	int admitted = new_request->admitted;
+	slab_free(new_request);
 
-	return -1;	// if we reach here the request was not admitted!
+	return admitted ? 0 : -1;	// if the request was not admitted, this is -1
 	
 }
 
 
+int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
+{
+	//check if the port is legal
+	if(port <= NOPORT || port > MAX_PORT)
+		return -1;
+
+	/* Fail fast, without the kernel lock, if there is no listener. 
+	   The listener may be closed concurrently, but it will not be freed 
+	   before we exit the read section. */
+	epoch_t e = epoch_enter();
+	socket_cb* listener = __atomic_load_n(&PORT_MAP[port], __ATOMIC_ACQUIRE);
+	int listening = (listener != NULL && listener->type == SOCKET_LISTENER);
+	epoch_exit(e);
+
+	if(!listening)
+		return -1;
+
+	kernel_lock();
+	int ret = socket_connect(sock, port, timeout);
+	kernel_unlock();
+	return ret;
+}
+
+
+/* 
+	Clear the pipe of a direction, returning it. Lockless readers may still
+	see the old pipe, but it is not reclaimed before their read section ends.
+ */
+static pipe_cb* socket_forget_pipe(pipe_cb** pipe)
+{
+	pipe_cb* p = *pipe;
+	__atomic_store_n(pipe, NULL, __ATOMIC_RELEASE);
+	return p;
+}
+
 int sys_ShutDown(Fid_t sock, shutdown_mode how)
 {	
 
@@ -286,37 +541,269 @@ int sys_ShutDown(Fid_t sock, shutdown_mode how)
 
 	FCB* socket_fcb = get_fcb(sock);
 
-	// if the fcb does not exist
-	if(!socket_fcb)
+	// if the fcb does not exist, or it is not a socket
+	if(!socket_fcb || socket_fcb->streamfunc != &socket_file_ops)
 		return -1;
 
 	// cast to socket control block
 	socket_cb* socket_scb = (socket_cb*)socket_fcb->streamobj;
 
-	//check if the cause is to shutdown the reader
-	if(how == SHUTDOWN_READ)
-		return pipe_reader_close(socket_scb->peer_s.read_pipe);
-	
+	// only a connected socket has directions to shut down
+	if(socket_scb->type != SOCKET_PEER)
+		return -1;
 
-	//check if the cause is to shutdown the writer
-	if(how == SHUTDOWN_WRITE)
-		return pipe_writer_close(socket_scb->peer_s.write_pipe);
-	
+	if(how < SHUTDOWN_READ || how > SHUTDOWN_BOTH)
+		return -1;
+
+	// a direction is shut down once, and forgets its pipe, which the peer may free
+	int rc = 0;
+	peer_socket* ps = &socket_scb->peer_s;
+	if((how & SHUTDOWN_READ) && !(ps->shut & SHUTDOWN_READ)) {
+		ps->shut |= SHUTDOWN_READ;
+		if(pipe_reader_close(socket_forget_pipe(&ps->read_pipe)) != 0) rc = -1;
+	}
+	if((how & SHUTDOWN_WRITE) && !(ps->shut & SHUTDOWN_WRITE)) {
+		ps->shut |= SHUTDOWN_WRITE;
+		if(pipe_writer_close(socket_forget_pipe(&ps->write_pipe)) != 0) rc = -1;
+		// no more files will be sent either
+		if(ps->peer) kernel_broadcast(&ps->peer->peer_s.fid_ready);
+	}
+	return rc;
+}
 
-	//check if the cause is to shutdown both reader and writer
-	if(how == SHUTDOWN_BOTH){
+/*
+	Datagram sockets. The receiver of a port holds a ring of fixed-size
+	message slots, so that sending a message is a single copy into the 
+	ring, with no allocation and no state per sender.
+ */
 
-		//store the return values
-		int close_writer_return = pipe_writer_close(socket_scb->peer_s.write_pipe);
-		int close_reader_return = pipe_reader_close(socket_scb->peer_s.read_pipe);
+/* The socket of a file id, or NULL */
+static socket_cb* get_socket(Fid_t sock, FCB** fcb)
+{
+	if(sock < 0 || sock > MAX_FILEID-1)
+		return NULL;
+	FCB* f = get_fcb(sock);
+	if(!f || f->streamfunc != &socket_file_ops)
+		return NULL;
+	if(fcb) *fcb = f;
+	return (socket_cb*) f->streamobj;
+}
 
-		//check if both pipes closed successfully
-		if(close_writer_return == 0 && close_reader_return == 0)
-			return 0;	
-		
+static inline int dgram_full(dgram_socket* d)
+{
+	return d->tail - d->head > d->mask;
+}
+
+int sys_Bind(Fid_t sock, unsigned int queue, dgram_policy policy)
+{
+	socket_cb* scb = get_socket(sock, NULL);
+	if(!scb || scb->type != SOCKET_UNBOUND || scb->port == NOPORT)
+		return -1;
+	if(DGRAM_MAP[scb->port] != NULL)
+		return -1;
+	if(queue > DGRAM_MAX_QUEUE || (policy != DGRAM_BLOCK && policy != DGRAM_DROP))
+		return -1;
+
+	if(queue == 0) queue = DGRAM_DEFAULT_QUEUE;
+	unsigned int size = 1;
+	while(size < queue) size <<= 1;
+
+	dgram_socket* d = &scb->dgram_s;
+	d->ring = xmalloc(size * sizeof(dgram_message));
+	d->mask = size - 1;
+	d->head = d->tail = 0;
+	d->policy = policy;
+	d->dropped = 0;
+	d->readable = COND_INIT;
+	d->writable = COND_INIT;
+	d->closed = 0;
+
+	// the lockless paths check the type, so it changes last
+	__atomic_store_n(&scb->type, SOCKET_DGRAM, __ATOMIC_RELEASE);
+	DGRAM_MAP[scb->port] = scb;
+	return 0;
+}
+
+static int dgram_send(socket_cb* scb, socket_cb* rcv, const char* buf, unsigned int len, int nonblock)
+{
+	dgram_socket* d = &rcv->dgram_s;
+
+	// the caller holds the FCB, so our own socket cannot be closed while we sleep
+	while(dgram_full(d)) {
+		if(d->policy == DGRAM_DROP) {
+			d->dropped++;
+			return len;
+		}
+		if(nonblock)
+			return WOULD_BLOCK;
+
+		// the receiver is kept alive while we sleep, in case it is closed
+		rcv->refcount++;
+		kernel_wait(&d->writable, SCHED_IO);
+		rcv->refcount--;
+
+		if(d->closed) {
+			if(rcv->refcount == 0) epoch_retire(rcv, slab_free);
+			return -1;
+		}
 	}
 
-	return -1;	// if we reach here something went wrong !
+	dgram_message* msg = &d->ring[d->tail & d->mask];
+	msg->from = scb->port;
+	msg->len = len;
+	memcpy(msg->data, buf, len);
+	d->tail++;
+
+	kernel_signal(&d->readable);
+	poll_notify(rcv->fcb);
+	return len;
+}
+
+int sys_SendTo(Fid_t sock, port_t port, const char* buf, unsigned int len)
+{
+	FCB* fcb;
+	socket_cb* scb = get_socket(sock, &fcb);
+	if(!scb || (scb->type != SOCKET_UNBOUND && scb->type != SOCKET_DGRAM))
+		return -1;
+	if(port <= NOPORT || port > MAX_PORT || len > DGRAM_MAX_MESSAGE || (buf == NULL && len > 0))
+		return -1;
+
+	socket_cb* rcv = DGRAM_MAP[port];
+	if(rcv == NULL)
+		return -1;
+
+	FCB_incref(fcb);
+	int rc = dgram_send(scb, rcv, buf, len, fcb->flags & FCB_NONBLOCK);
+	FCB_decref(fcb);
+	return rc;
+}
+
+/* Receive a message, for RecvFrom and Read */
+static int dgram_recv(socket_cb* scb, char* buf, unsigned int len, port_t* from, int nonblock)
+{
+	dgram_socket* d = &scb->dgram_s;
+
+	// the caller holds the FCB, so the socket cannot be closed while we sleep
+	while(d->head == d->tail) {
+		if(nonblock)
+			return WOULD_BLOCK;
+		kernel_wait(&d->readable, SCHED_IO);
+	}
+
+	dgram_message* msg = &d->ring[d->head & d->mask];
+	unsigned int n = (len < msg->len) ? len : msg->len;
+	memcpy(buf, msg->data, n);
+	if(from) *from = msg->from;
+	d->head++;
+
+	kernel_signal(&d->writable);
+	return n;
+}
+
+int sys_RecvFrom(Fid_t sock, char* buf, unsigned int len, port_t* from)
+{
+	FCB* fcb;
+	socket_cb* scb = get_socket(sock, &fcb);
+	if(!scb || scb->type != SOCKET_DGRAM || (buf == NULL && len > 0))
+		return -1;
+
+	FCB_incref(fcb);
+	int rc = dgram_recv(scb, buf, len, from, fcb->flags & FCB_NONBLOCK);
+	FCB_decref(fcb);
+	return rc;
+}
+
+
+/*
+	Passing files. Each connected socket has a queue of the FCBs sent to
+	it by its peer, each holding a reference, which is given to the 
+	receiving process with its new fid. The queue is separate from the 
+	data pipes, so that a file does not wait behind unread data.
+
+	A socket with files queued at it cannot be sent. Else two sockets 
+	could hold each other in their queues, and keep each other open after
+	their last fid is closed. A cycle can only be closed by sending a 
+	socket whose queue leads back to the receiver, so the check suffices.
+ */
+
+/* Whether a stream holds references to other FCBs */
+static int holds_files(FCB* fcb)
+{
+	if(fcb->streamfunc != &socket_file_ops) return 0;
+	socket_cb* scb = (socket_cb*) fcb->streamobj;
+	return scb->type == SOCKET_PEER && scb->peer_s.fid_count > 0;
+}
+
+int sys_SendFid(Fid_t sock, Fid_t fid)
+{
+	FCB* fcb;
+	socket_cb* scb = get_socket(sock, &fcb);
+	if(!scb || scb->type != SOCKET_PEER)
+		return -1;
+
+	socket_cb* peer = scb->peer_s.peer;
+	if(peer == NULL || (scb->peer_s.shut & SHUTDOWN_WRITE) || (peer->peer_s.shut & SHUTDOWN_READ))
+		return -1;
+
+	FCB* file = (fid >= 0 && fid < MAX_FILEID) ? get_fcb(fid) : NULL;
+	if(file == NULL || file == fcb || file == peer->fcb || holds_files(file))
+		return -1;
+
+	peer_socket* ps = &peer->peer_s;
+	if(ps->fid_count == SOCKET_MAX_FIDS)
+		return -1;
+
+	FCB_incref(file);
+	ps->fids[(ps->fid_head + ps->fid_count) % SOCKET_MAX_FIDS] = file;
+	ps->fid_count++;
+	kernel_signal(&ps->fid_ready);
+	poll_notify(peer->fcb);
+	return 0;
+}
+
+Fid_t sys_RecvFid(Fid_t sock)
+{
+	FCB* fcb;
+	socket_cb* scb = get_socket(sock, &fcb);
+	if(!scb || scb->type != SOCKET_PEER)
+		return NOFILE;
+
+	peer_socket* ps = &scb->peer_s;
+	Fid_t fid = NOFILE;
+
+	FCB_incref(fcb);
+	while(ps->fid_count == 0) {
+		// nothing more will be sent
+		if(ps->peer == NULL || (ps->peer->peer_s.shut & SHUTDOWN_WRITE))
+			goto done;
+		if(fcb->flags & FCB_NONBLOCK) {
+			fid = WOULD_BLOCK;
+			goto done;
+		}
+		kernel_wait(&ps->fid_ready, SCHED_IO);
+	}
+
+	// the queued reference moves to the new fid
+	fid = FCB_install(ps->fids[ps->fid_head]);
+	if(fid != NOFILE) {
+		ps->fid_head = (ps->fid_head + 1) % SOCKET_MAX_FIDS;
+		ps->fid_count--;
+	}
+
+done:
+	FCB_decref(fcb);
+	return fid;
+}
+
+/* Close a datagram socket; the blocked senders fail */
+static void dgram_close(socket_cb* scb)
+{
+	dgram_socket* d = &scb->dgram_s;
+	DGRAM_MAP[scb->port] = NULL;
+	d->closed = 1;
+	kernel_broadcast(&d->writable);
+	free(d->ring);
+	d->ring = NULL;
 }
 
 int socket_write(void* socketcb_t,const char *buf , unsigned int size)
@@ -348,10 +835,159 @@ int socket_read(void* socketcb_t, char* buf , unsigned int size)
 	{
 		return pipe_read(scb->peer_s.read_pipe, buf, size);
 	}
+
+	// a datagram socket reads the next message
+	if(scb->type == SOCKET_DGRAM)
+		return dgram_recv(scb, buf, size, NULL, cur_thread()->io_flags & FCB_NONBLOCK);
 	
 	return -1; // if we reach here something went wrong !
 }
 
+/* The vectored paths, for connected sockets only */
+int socket_writev(void* socketcb_t, const iovec_t* iov, unsigned int iovcnt)
+{
+	socket_cb* scb = (socket_cb*)socketcb_t;
+	if(scb == NULL || scb->type != SOCKET_PEER || scb->peer_s.write_pipe == NULL)
+		return -1;
+	return pipe_writev(scb->peer_s.write_pipe, iov, iovcnt);
+}
+
+int socket_readv(void* socketcb_t, const iovec_t* iov, unsigned int iovcnt)
+{
+	socket_cb* scb = (socket_cb*)socketcb_t;
+	if(scb == NULL || scb->type != SOCKET_PEER || scb->peer_s.read_pipe == NULL)
+		return -1;
+	return pipe_readv(scb->peer_s.read_pipe, iov, iovcnt);
+}
+
+/* The lockless paths, for connected sockets only */
+int socket_write_nolock(void* socketcb_t, const char *buf, unsigned int size, int* finish)
+{
+	socket_cb* scb = (socket_cb*)socketcb_t;
+	if(scb == NULL || __atomic_load_n(&scb->type, __ATOMIC_ACQUIRE) != SOCKET_PEER)
+		return NOLOCK_FALLBACK;
+	return pipe_write_nolock(__atomic_load_n(&scb->peer_s.write_pipe, __ATOMIC_ACQUIRE), buf, size, finish);
+}
+
+int socket_read_nolock(void* socketcb_t, char *buf, unsigned int size, int* finish)
+{
+	socket_cb* scb = (socket_cb*)socketcb_t;
+	if(scb == NULL || __atomic_load_n(&scb->type, __ATOMIC_ACQUIRE) != SOCKET_PEER)
+		return NOLOCK_FALLBACK;
+	return pipe_read_nolock(__atomic_load_n(&scb->peer_s.read_pipe, __ATOMIC_ACQUIRE), buf, size, finish);
+}
+
+void socket_finish_nolock(void* socketcb_t, int output)
+{
+	socket_cb* scb = (socket_cb*)socketcb_t;
+	if(scb != NULL && scb->type == SOCKET_PEER)
+		pipe_finish_nolock(socket_get_pipe(scb, output), output);
+}
+
+/* The pipes of a peer socket, for Splice and SendZeroCopy; a direction that is shut down has none */
+pipe_cb* socket_get_pipe(void* socketcb_t, int output)
+{
+	socket_cb* scb = (socket_cb*)socketcb_t;
+	if(scb == NULL || scb->type != SOCKET_PEER) return NULL;
+	return output ? scb->peer_s.write_pipe : scb->peer_s.read_pipe;
+}
+
+/*
+	Readiness, for Poll. A listener is readable when it has pending 
+	requests; Connect notifies the pollers. A peer socket combines its two 
+	pipes. A datagram socket is readable when its queue holds a message. 
+	An unbound socket has nothing to wait for, so it reports a hangup.
+ */
+unsigned int socket_poll(void* socketcb_t, unsigned int events, int arm)
+{
+	socket_cb* scb = (socket_cb*)socketcb_t;
+	if(scb == NULL) return POLL_HANGUP;
+
+	switch(scb->type) {
+		case SOCKET_LISTENER:
+			return is_rlist_empty(&scb->listener_s.queue) ? 0 : POLL_READABLE;
+		case SOCKET_PEER: {
+			unsigned int ready = 0;
+			if((events & POLL_READABLE) || !(events & POLL_WRITABLE))
+				ready |= pipe_reader_poll(scb->peer_s.read_pipe, events, arm);
+			if(events & POLL_WRITABLE)
+				ready |= pipe_writer_poll(scb->peer_s.write_pipe, events, arm);
+			// a file to receive, from SendFid, is also readable
+			if((events & POLL_READABLE) && scb->peer_s.fid_count > 0)
+				ready |= POLL_READABLE;
+			return ready;
+		}
+		case SOCKET_DGRAM: {
+			// sending never waits for this socket's own queue
+			unsigned int ready = POLL_WRITABLE;
+			if(scb->dgram_s.head != scb->dgram_s.tail) ready |= POLL_READABLE;
+			return ready;
+		}
+		default:
+			return POLL_HANGUP;
+	}
+}
+
+/* The pipe that holds an option of a peer socket, or NULL */
+static pipe_cb* socket_option_pipe(socket_cb* scb, stream_option opt)
+{
+	if(scb == NULL || scb->type != SOCKET_PEER) return NULL;
+
+	switch(opt) {
+		case STREAM_RCVBUF:
+		case STREAM_RCVLOWAT:
+		case STREAM_MESSAGE:
+		case STREAM_NEXTMSG:
+			return scb->peer_s.read_pipe;
+		case STREAM_SNDBUF:
+		case STREAM_SNDLOWAT:
+			return scb->peer_s.write_pipe;
+		default: return NULL;
+	}
+}
+
+int socket_set_option(void* socketcb_t, stream_option opt, unsigned int value)
+{
+	/* Port sharing is chosen before Listen */
+	if(opt == STREAM_REUSEPORT) {
+		socket_cb* scb = (socket_cb*) socketcb_t;
+		if(scb == NULL || scb->type != SOCKET_UNBOUND || value > 1) return -1;
+		scb->reuseport = value;
+		return 0;
+	}
+
+	pipe_cb* pipe = socket_option_pipe((socket_cb*) socketcb_t, opt);
+	if(pipe == NULL) return -1;
+
+	/* Message mode applies to both directions */
+	if(opt == STREAM_MESSAGE) {
+		socket_cb* scb = (socket_cb*) socketcb_t;
+		int old = pipe_get_option(scb->peer_s.write_pipe, STREAM_MESSAGE);
+		if(pipe_set_option(scb->peer_s.write_pipe, opt, value) == -1) return -1;
+		if(pipe_set_option(pipe, opt, value) == -1) {
+			pipe_set_option(scb->peer_s.write_pipe, opt, old);
+			return -1;
+		}
+		return 0;
+	}
+	return pipe_set_option(pipe, opt, value);
+}
+
+int socket_get_option(void* socketcb_t, stream_option opt)
+{
+	if(opt == STREAM_REUSEPORT)
+		return (socketcb_t == NULL) ? -1 : ((socket_cb*) socketcb_t)->reuseport;
+
+	if(opt == STREAM_DROPS) {
+		socket_cb* scb = (socket_cb*) socketcb_t;
+		if(scb == NULL || scb->type != SOCKET_DGRAM) return -1;
+		return (int) scb->dgram_s.dropped;
+	}
+
+	pipe_cb* pipe = socket_option_pipe((socket_cb*) socketcb_t, opt);
+	return (pipe == NULL) ? -1 : pipe_get_option(pipe, opt);
+}
+
 int socket_close(void* _socketcb)
 {	
 	socket_cb* socket_scb = (socket_cb*) _socketcb;
@@ -360,32 +996,125 @@ int socket_close(void* _socketcb)
 		return -1;
 	}
 
+	rlist_remove(&socket_scb->live);
+
 	if(socket_scb->type == SOCKET_PEER){
 		
-		if(socket_scb->peer_s.peer){
-			pipe_writer_close(socket_scb->peer_s.write_pipe);
-			pipe_reader_close(socket_scb->peer_s.read_pipe);
-			socket_cb* peer= socket_scb->peer_s.peer;
+		peer_socket* ps = &socket_scb->peer_s;
+
+		// close the pipe ends that are not shut down yet
+		if(!(ps->shut & SHUTDOWN_WRITE))
+			pipe_writer_close(socket_forget_pipe(&ps->write_pipe));
+		if(!(ps->shut & SHUTDOWN_READ))
+			pipe_reader_close(socket_forget_pipe(&ps->read_pipe));
+		ps->shut = SHUTDOWN_BOTH;
+
+		if(ps->peer){
+			socket_cb* peer= ps->peer;
 			peer->peer_s.peer = NULL;
+			kernel_broadcast(&peer->peer_s.fid_ready);
+		}
+
+		// the files that were sent here, and never received, are closed
+		while(ps->fid_count > 0) {
+			FCB* f = ps->fids[ps->fid_head];
+			ps->fid_head = (ps->fid_head + 1) % SOCKET_MAX_FIDS;
+			ps->fid_count--;
+			FCB_decref(f);
 		}
-		if(socket_scb->refcount == 0) free(socket_scb);
+		if(socket_scb->refcount == 0) epoch_retire(socket_scb, slab_free);
 		return 0;
 	}
 
 	else if(socket_scb->type == SOCKET_LISTENER){
-		PORT_MAP[socket_scb->port] = NULL;
-		//if listener is sleeping in his condVar while waiting for a request, wake him up.
-		kernel_signal(&(socket_scb->listener_s.req_available));
-		if(socket_scb->refcount == 0) free(socket_scb);
+		listener_unbind(socket_scb);
+		//if threads are sleeping in Accept while waiting for a request, wake them up.
+		kernel_broadcast(&(socket_scb->listener_s.req_available));
+		if(socket_scb->refcount == 0) epoch_retire(socket_scb, slab_free);
+		return 0;
+	}
+
+	else if(socket_scb->type == SOCKET_DGRAM){
+		dgram_close(socket_scb);
+		if(socket_scb->refcount == 0) epoch_retire(socket_scb, slab_free);
 		return 0;
 	}
 
 	else{//SOCKET_UNBOUND type
-		free(socket_scb);
+		epoch_retire(socket_scb, slab_free);
 		return 0;
 	}
 }
 
+/*
+	Statistics. A connected socket reports the reads of its read pipe and 
+	the writes of its write pipe, while the direction is not shut down;
+	after that, the pipe may be gone.
+ */
+static streaminfo_kind socket_kind[] = {
+	[SOCKET_LISTENER] = STREAMINFO_LISTENER,
+	[SOCKET_UNBOUND] = STREAMINFO_UNBOUND,
+	[SOCKET_PEER] = STREAMINFO_PEER,
+	[SOCKET_DGRAM] = STREAMINFO_DGRAM
+};
+
+static void socket_stream_info(socket_cb* scb, streaminfo* si)
+{
+	si->kind = socket_kind[scb->type];
+	si->id = scb->id;
+	si->port = scb->port;
+
+	switch(scb->type) {
+		case SOCKET_LISTENER:
+			si->pending = scb->listener_s.pending;
+			si->backlog = scb->listener_s.backlog;
+			break;
+		case SOCKET_PEER: {
+			peer_socket* ps = &scb->peer_s;
+			if(ps->peer) si->peer = ps->peer->id;
+			if(ps->read_pipe) {
+				streaminfo rd = { 0 };
+				pipe_stream_info(ps->read_pipe, &rd);
+				si->bytes_read = rd.bytes_read;
+				si->reads = rd.reads;
+				si->read_wait_ns = rd.read_wait_ns;
+				si->rxqueued = rd.rxqueued;
+				si->rcvbuf = rd.rcvbuf;
+			}
+			if(ps->write_pipe) {
+				streaminfo wr = { 0 };
+				pipe_stream_info(ps->write_pipe, &wr);
+				si->bytes_written = wr.bytes_written;
+				si->writes = wr.writes;
+				si->write_wait_ns = wr.write_wait_ns;
+				si->txqueued = wr.rxqueued;
+				si->sndbuf = wr.rcvbuf;
+			}
+			break;
+		}
+		case SOCKET_DGRAM:
+			si->rxqueued = scb->dgram_s.tail - scb->dgram_s.head;
+			si->rcvbuf = scb->dgram_s.mask + 1;
+			break;
+		default:
+			break;
+	}
+}
+
+size_t socket_streams_snapshot(void** records)
+{
+	size_t n = rlist_len(&socket_list);
+	streaminfo* info = xmalloc((n ? n : 1) * sizeof(streaminfo));
+	memset(info, 0, (n ? n : 1) * sizeof(streaminfo));
+
+	streaminfo* si = info;
+	for(rlnode* p = socket_list.next; p != &socket_list; p = p->next, si++)
+		socket_stream_info(p->obj, si);
+
+	*records = info;
+	return n;
+}
+
 /*We don't use open to create the socket.Instead we use sys_Socket! */
 void* socket_open(uint minor)
 {
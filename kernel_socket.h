@@ -8,19 +8,40 @@
 #include "kernel_streams.h"
 #include "kernel_proc.h"
 #include "kernel_cc.h"
+#include "kernel_poll.h"
 
 typedef struct socket_control_block socket_cb;
 
-socket_cb* PORT_MAP[MAX_PORT]; // the array that houses all the ports
+extern socket_cb* PORT_MAP[MAX_PORT+1]; // the array that houses all the ports
+
+extern socket_cb* DGRAM_MAP[MAX_PORT+1]; // the datagram sockets, by port
 
 Fid_t sys_Socket(port_t port);
 
 int sys_Listen(Fid_t sock);
 
+int sys_ListenEx(Fid_t sock, unsigned int backlog);
+
+Fid_t sys_Accept(Fid_t lsock);
+
+int sys_AcceptMany(Fid_t lsock, Fid_t* out, unsigned int n);
+
+int sys_SocketPair(Fid_t out[2]);
+
 int sys_Connect(Fid_t sock, port_t port, timeout_t timeout);
 
 int sys_ShutDown(Fid_t sock, shutdown_mode how);
 
+int sys_Bind(Fid_t sock, unsigned int queue, dgram_policy policy);
+
+int sys_SendTo(Fid_t sock, port_t port, const char* buf, unsigned int len);
+
+int sys_RecvFrom(Fid_t sock, char* buf, unsigned int len, port_t* from);
+
+int sys_SendFid(Fid_t sock, Fid_t fid);
+
+Fid_t sys_RecvFid(Fid_t sock);
+
 void* socket_open(uint minor);
 
 int socket_write(void* socketcb_t,const char *buf , unsigned int size);
@@ -29,18 +50,48 @@ int socket_read(void* socketcb_t, char* buf , unsigned int size);
 
 int socket_close(void* _socketcb);
 
+int socket_write_nolock(void* socketcb_t, const char *buf, unsigned int size, int* finish);
+
+int socket_read_nolock(void* socketcb_t, char *buf, unsigned int size, int* finish);
+
+void socket_finish_nolock(void* socketcb_t, int output);
+
+int socket_writev(void* socketcb_t, const iovec_t* iov, unsigned int iovcnt);
+
+int socket_readv(void* socketcb_t, const iovec_t* iov, unsigned int iovcnt);
+
+int socket_set_option(void* socketcb_t, stream_option opt, unsigned int value);
+
+int socket_get_option(void* socketcb_t, stream_option opt);
+
+pipe_cb* socket_get_pipe(void* socketcb_t, int output);
+
+unsigned int socket_poll(void* socketcb_t, unsigned int events, int arm);
+
+/** 
+	@brief Take a snapshot of the open sockets, as @c streaminfo records.
+
+	Called with the kernel lock held.
+  */
+size_t socket_streams_snapshot(void** records);
+
 
 typedef enum 
 {
 	SOCKET_LISTENER, 
 	SOCKET_UNBOUND,
-	SOCKET_PEER
+	SOCKET_PEER,
+	SOCKET_DGRAM
 }socket_type;
 
 typedef struct listener_socket
 {
 	rlnode queue; // the queue of all requested sockets
 	CondVar req_available; // the condition
+	unsigned int pending; // the length of the queue
+	unsigned int backlog; // the max. length of the queue, or LISTEN_BACKLOG_UNLIMITED
+	rlnode group; // the ring of the listeners sharing the port
+	int closed; // set when the listener is closed, for the threads blocked in Accept
 	
 }listener_socket;
 
@@ -53,15 +104,40 @@ typedef struct unbound_socket
 typedef struct peer_socket
 {
 	socket_cb* peer;	// pointer to the other connected socket
-	pipe_cb* write_pipe;
-	pipe_cb* read_pipe;
+	pipe_cb* write_pipe; // NULL once the direction is shut down
+	pipe_cb* read_pipe;  // NULL once the direction is shut down
+	FCB* fids[SOCKET_MAX_FIDS]; // the files sent to this socket by SendFid, not yet received
+	unsigned int fid_head, fid_count; // the next file to receive, and the number queued
+	CondVar fid_ready; // RecvFid waits for a file here
+	int shut; // the directions shut down, as shutdown_mode bits
 
 }peer_socket;
 
+typedef struct dgram_message
+{
+	port_t from; // the port of the sender
+	unsigned int len;
+	char data[DGRAM_MAX_MESSAGE];
+}dgram_message;
+
+typedef struct dgram_socket
+{
+	dgram_message* ring; // the message queue, of a power-of-two size
+	unsigned int mask; // the queue size minus 1
+	unsigned int head, tail; // the next message to receive, and to send
+	dgram_policy policy; // what a sender does on a full queue
+	unsigned long dropped; // the messages dropped on a full queue
+	CondVar readable; // the receivers wait for a message here
+	CondVar writable; // the blocked senders wait for room here
+	int closed; // set when the socket is closed, for the blocked senders
+
+}dgram_socket;
+
 typedef struct connection_request
 {
 	int admitted; // 0 if not admitted 1 otherwise
 	socket_cb* peer; // pointer to the socket that has admitted a request
+	socket_cb* listener; // the listener whose queue holds the request
 	CondVar connected_cv; // edw koimatai o client
 	rlnode queue_node;
 }connection_request;
@@ -76,11 +152,18 @@ typedef struct socket_control_block
 
 	port_t port; // the port to be used
 
+	int reuseport; // 1 if the socket may share its port with other listeners
+
+	unsigned long id; // numbers the sockets, since boot, for the statistics
+
+	rlnode live; // in the list of open sockets, for the statistics
+
 	union
 	{
 		listener_socket listener_s;
 		unbound_socket unbound_s;
 		peer_socket peer_s;
+		dgram_socket dgram_s;
 	};
 
 }socket_cb;
@@ -0,0 +1,114 @@
+
+#include "util.h"
+#include "tinyos.h"
+#include "kernel_streams.h"
+#include "kernel_cc.h"
+#include "kernel_sched.h"
+#include "kernel_pipe.h"
+#include "kernel_slab.h"
+#include "kernel_socket.h"
+#include "kernel_stats.h"
+
+
+/* The pipes, followed by the sockets */
+static size_t stream_statistics_snapshot(void** records)
+{
+	void *pipes, *sockets;
+	size_t np = pipe_streams_snapshot(&pipes);
+	size_t ns = socket_streams_snapshot(&sockets);
+
+	streaminfo* info = xmalloc((np + ns + 1) * sizeof(streaminfo));
+	memcpy(info, pipes, np * sizeof(streaminfo));
+	memcpy(info + np, sockets, ns * sizeof(streaminfo));
+	free(pipes);
+	free(sockets);
+
+	*records = info;
+	return np + ns;
+}
+
+
+/* The statistics types known to OpenKernelStats */
+static struct {
+	size_t recsize;             /* The size of each record */
+	kstat_snapshot snapshot;    /* The snapshot function */
+} kstat_table[KSTAT_MAX] = {
+	[KSTAT_LOCKS] = { sizeof(lockinfo), lock_statistics_snapshot },
+	[KSTAT_SCHED] = { sizeof(schedinfo), sched_statistics_snapshot },
+	[KSTAT_PIPES] = { sizeof(pipeinfo), pipe_statistics_snapshot },
+	[KSTAT_SLABS] = { sizeof(slabinfo), slab_statistics_snapshot },
+	[KSTAT_STREAMS] = { sizeof(streaminfo), stream_statistics_snapshot }
+};
+
+
+/* The stream object of a statistics stream */
+typedef struct kstat_control_block {
+	size_t recsize;     /* The size of each record */
+	size_t count;       /* The number of records in the snapshot */
+	size_t cursor;      /* The next record to read */
+	char* records;      /* The snapshot */
+} kstatCB;
+
+
+static void* kstat_open_null(uint minor)
+{
+	return NULL;
+}
+
+static int kstat_read(void* kstatcb_t, char* buf, unsigned int size)
+{
+	kstatCB* kcb = (kstatCB*) kstatcb_t;
+	if(kcb == NULL) return -1;
+
+	/* EOF */
+	if(kcb->cursor >= kcb->count) return 0;
+
+	unsigned int n = (size < kcb->recsize) ? size : kcb->recsize;
+	memcpy(buf, kcb->records + kcb->cursor*kcb->recsize, n);
+	kcb->cursor++;
+	return n;
+}
+
+static int kstat_write_null(void* kstatcb_t, const char* buf, unsigned int size)
+{
+	return -1;
+}
+
+static int kstat_close(void* kstatcb_t)
+{
+	kstatCB* kcb = (kstatCB*) kstatcb_t;
+	if(kcb == NULL) return -1;
+
+	free(kcb->records);
+	free(kcb);
+	return 0;
+}
+
+static file_ops kstat_ops = {
+	.Open  = kstat_open_null,
+	.Read  = kstat_read,
+	.Write = kstat_write_null,
+	.Close = kstat_close
+};
+
+
+Fid_t sys_OpenKernelStats(kstat_type type)
+{
+	if(type < 0 || type >= KSTAT_MAX) return NOFILE;
+
+	Fid_t fid;
+	FCB* fcb;
+	if(! FCB_reserve(1, &fid, &fcb))
+		return NOFILE;
+
+	kstatCB* kcb = xmalloc(sizeof(kstatCB));
+	kcb->recsize = kstat_table[type].recsize;
+	kcb->cursor = 0;
+	kcb->count = kstat_table[type].snapshot((void**) &kcb->records);
+
+	fcb->streamobj = kcb;
+	fcb->streamfunc = &kstat_ops;
+
+	return fid;
+}
+
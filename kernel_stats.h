@@ -0,0 +1,33 @@
+#ifndef __KERNEL_STATS_H
+#define __KERNEL_STATS_H
+
+/**
+  @file kernel_stats.h
+  @brief Kernel statistics streams.
+
+  @defgroup kstats Kernel statistics
+  @ingroup kernel
+  @brief Kernel statistics streams.
+
+  A kernel statistics stream is opened by @c OpenKernelStats(). At open,
+  a snapshot of the requested kernel statistics is taken, as an array of
+  fixed-size records. Each call to @c Read() on the stream returns the next
+  record, and 0 when all records have been read.
+
+  @{
+*/
+
+#include "tinyos.h"
+
+/**
+  @brief A snapshot function for some statistics type.
+
+  The function must allocate (by @c xmalloc) an array of records, 
+  store its address in @c *records and return the number of records.
+  If there are no records, it may return 0 without allocating anything.
+ */
+typedef size_t (*kstat_snapshot)(void** records);
+
+/** @} */
+
+#endif
@@ -1,10 +1,12 @@
 
+#include <limits.h>
 #include "util.h"
 #include "tinyos.h"
 #include "kernel_cc.h"
 #include "kernel_streams.h"
 #include "kernel_sched.h"
 #include "kernel_proc.h"
+#include "kernel_pipe.h"
 
 #define MAX_FILES MAX_PROC
 
@@ -19,6 +21,7 @@ void initialize_files()
 
     FT[i].refcount = 0;
     rlnode_init(& FT[i].freelist_node, &FT[i]);
+    poll_queue_init(& FT[i].pollers);
     rlist_push_back(&FCB_freelist, & FT[i].freelist_node);
   }
 }
@@ -26,9 +29,18 @@ void initialize_files()
 
 FCB* acquire_FCB()
 {
+  /* Maybe some FCBs are retired, but not yet reclaimed */
+  if(is_rlist_empty(& FCB_freelist))
+    epoch_barrier();
+
   if(! is_rlist_empty(& FCB_freelist)) {
     FCB* fcb = rlist_pop_front(& FCB_freelist)->fcb;
     fcb->refcount = 0;
+    fcb->flags = 0;
+    fcb->gen++;
+    /* Lockless readers must not see the previous stream */
+    fcb->streamfunc = NULL;
+    fcb->streamobj = NULL;
     return fcb;
   }
   else
@@ -40,6 +52,15 @@ void release_FCB(FCB* fcb)
   rlist_push_back(& FCB_freelist, & fcb->freelist_node);
 }
 
+/* 
+  FCBs that have been visible in a file table are retired, since
+  lockless readers may still be looking at them.
+ */
+static void reclaim_FCB(void* fcb)
+{
+  release_FCB((FCB*) fcb);
+}
+
 
 void FCB_incref(FCB* fcb)
 {
@@ -53,7 +74,7 @@ int FCB_decref(FCB* fcb)
   fcb->refcount --;
   if(fcb->refcount==0) {
     int retval = fcb->streamfunc->Close(fcb->streamobj);
-    release_FCB(fcb);
+    epoch_retire(fcb, reclaim_FCB);
     return retval;
   }
   else
@@ -104,11 +125,23 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
     for(size_t i=0; i<num ; i++) {
 	assert(cur->FIDT[fid[i]]==fcb[i]);
 	cur->FIDT[fid[i]] = NULL;
-	release_FCB(fcb[i]);
+	epoch_retire(fcb[i], reclaim_FCB);
     }
 }
 
 
+Fid_t FCB_install(FCB* fcb)
+{
+    PCB* cur = CURPROC;
+    for(Fid_t f=0; f<MAX_FILEID; f++)
+	if(cur->FIDT[f]==NULL) {
+	    __atomic_store_n(&cur->FIDT[f], fcb, __ATOMIC_RELEASE);
+	    return f;
+	}
+    return NOFILE;
+}
+
+
 
 
 
@@ -128,7 +161,8 @@ FCB* get_fcb(Fid_t fid)
 }
 
 
-int sys_Read(Fid_t fd, char *buf, unsigned int size)
+/* The body of Read, called with the kernel lock held */
+static int stream_read(Fid_t fd, char *buf, unsigned int size)
 {
   int retcode = -1;
   int (*devread)(void*,char*,uint);
@@ -146,8 +180,11 @@ int sys_Read(Fid_t fd, char *buf, unsigned int size)
        while we are using it! */
     FCB_incref(fcb);
   
-    if(devread)
+    if(devread) {
+      cur_thread()->io_flags = fcb->flags;
       retcode = devread(sobj, buf, size);
+      cur_thread()->io_flags = 0;
+    }
 
     /* Need to decrease the reference to FCB */
     FCB_decref(fcb);
@@ -160,7 +197,8 @@ int sys_Read(Fid_t fd, char *buf, unsigned int size)
 }
 
 
-int sys_Write(Fid_t fd, const char *buf, unsigned int size)
+/* The body of Write, called with the kernel lock held */
+static int stream_write(Fid_t fd, const char *buf, unsigned int size)
 {
   int retcode = -1;
   int (*devwrite)(void*, const char*, uint) = NULL;
@@ -180,8 +218,11 @@ int sys_Write(Fid_t fd, const char *buf, unsigned int size)
     FCB_incref(fcb);
   
 
-    if(devwrite)
+    if(devwrite) {
+      cur_thread()->io_flags = fcb->flags;
       retcode = devwrite(sobj, buf, size);
+      cur_thread()->io_flags = 0;
+    }
 
     /* Need to decrease the reference to FCB */
     FCB_decref(fcb);
@@ -193,6 +234,145 @@ int sys_Write(Fid_t fd, const char *buf, unsigned int size)
 }
 
 
+/*
+  Read and Write are called without the kernel lock. They first try the
+  lockless method of the stream, if it has one, and if this does not
+  succeed, they take the kernel lock and call the regular method.
+  The kernel lock is never taken inside the read section, since a thread
+  holding it may wait in epoch_barrier for the section to end. So work
+  left by the lockless method is finished after the section, on the 
+  stream that the fid refers to by then.
+ */
+static FCB* get_fcb_nolock(Fid_t fd)
+{
+  if(fd < 0 || fd >= MAX_FILEID) return NULL;
+  return __atomic_load_n(& CURPROC->FIDT[fd], __ATOMIC_ACQUIRE);
+}
+
+static void stream_finish_nolock(Fid_t fd, int output)
+{
+  kernel_lock();
+  FCB* fcb = get_fcb(fd);
+  if(fcb && fcb->streamfunc->FinishNoLock)
+    fcb->streamfunc->FinishNoLock(fcb->streamobj, output);
+  kernel_unlock();
+}
+
+int sys_Read(Fid_t fd, char *buf, unsigned int size)
+{
+  int retcode = NOLOCK_FALLBACK;
+  int finish = 0;
+
+  epoch_t e = epoch_enter();
+  FCB* fcb = get_fcb_nolock(fd);
+  if(fcb && fcb->streamfunc && fcb->streamfunc->ReadNoLock)
+    retcode = fcb->streamfunc->ReadNoLock(fcb->streamobj, buf, size, &finish);
+  epoch_exit(e);
+
+  if(finish)
+    stream_finish_nolock(fd, 0);
+
+  if(retcode == NOLOCK_FALLBACK) {
+    kernel_lock();
+    retcode = stream_read(fd, buf, size);
+    kernel_unlock();
+  }
+  return retcode;
+}
+
+int sys_Write(Fid_t fd, const char *buf, unsigned int size)
+{
+  int retcode = NOLOCK_FALLBACK;
+  int finish = 0;
+
+  epoch_t e = epoch_enter();
+  FCB* fcb = get_fcb_nolock(fd);
+  if(fcb && fcb->streamfunc && fcb->streamfunc->WriteNoLock)
+    retcode = fcb->streamfunc->WriteNoLock(fcb->streamobj, buf, size, &finish);
+  epoch_exit(e);
+
+  if(finish)
+    stream_finish_nolock(fd, 1);
+
+  if(retcode == NOLOCK_FALLBACK) {
+    kernel_lock();
+    retcode = stream_write(fd, buf, size);
+    kernel_unlock();
+  }
+  return retcode;
+}
+
+
+
+/*
+	ReadV and WriteV run under the kernel lock. A stream without vectored 
+	methods is accessed segment by segment. Once some data have moved, the
+	rest of the segments are accessed in non-blocking mode, since the call 
+	may return fewer bytes than requested, but should not block for them.
+ */
+static int iov_check(const iovec_t* iov, unsigned int iovcnt)
+{
+	if(iovcnt > MAX_IOV || (iov == NULL && iovcnt > 0)) return -1;
+
+	unsigned long total = 0;
+	for(unsigned int i = 0; i < iovcnt; i++) {
+		total += iov[i].len;
+		if(total > INT_MAX) return -1;
+	}
+	return 0;
+}
+
+static int stream_transfer_v(FCB* fcb, const iovec_t* iov, unsigned int iovcnt, int output)
+{
+	file_ops* ops = fcb->streamfunc;
+	if(output ? ops->Write == NULL : ops->Read == NULL) return -1;
+
+	int total = 0;
+	for(unsigned int i = 0; i < iovcnt; i++) {
+		if(iov[i].len == 0) continue;
+		int rc = output ? ops->Write(fcb->streamobj, iov[i].base, iov[i].len)
+			: ops->Read(fcb->streamobj, iov[i].base, iov[i].len);
+		if(rc <= 0) {
+			if(total == 0) total = rc;
+			break;
+		}
+		total += rc;
+		if((unsigned int) rc < iov[i].len) break;
+		cur_thread()->io_flags |= FCB_NONBLOCK;
+	}
+	return total;
+}
+
+static int stream_iov(Fid_t fd, const iovec_t* iov, unsigned int iovcnt, int output)
+{
+	FCB* fcb = get_fcb(fd);
+	if(fcb == NULL || iov_check(iov, iovcnt) == -1) return -1;
+
+	int (*devv)(void*, const iovec_t*, uint) = 
+		output ? fcb->streamfunc->WriteV : fcb->streamfunc->ReadV;
+
+	FCB_incref(fcb);
+	cur_thread()->io_flags = fcb->flags;
+	int retcode = devv ? devv(fcb->streamobj, iov, iovcnt) 
+		: stream_transfer_v(fcb, iov, iovcnt, output);
+	cur_thread()->io_flags = 0;
+	FCB_decref(fcb);
+
+	return retcode;
+}
+
+int sys_ReadV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt)
+{
+	return stream_iov(fd, iov, iovcnt, 0);
+}
+
+int sys_WriteV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt)
+{
+	return stream_iov(fd, iov, iovcnt, 1);
+}
+
+
+
 int sys_Close(int fd)
 {
   int retcode = (fd>=0 && fd<MAX_FILEID) ? 0 : -1;  /* Closing a closed fd is legal! */
@@ -201,6 +381,7 @@ int sys_Close(int fd)
 
   if(fcb) {
     CURPROC->FIDT[fd] = NULL;
+    poll_notify(fcb);    /* its pollers must see that the fid is closed */
     retcode = FCB_decref(fcb);    
   }
 
@@ -228,8 +409,10 @@ int sys_Dup2(int oldfd, int newfd)
     retcode = -1;
   }
   else if(old!=new) {
-    if(new)
+    if(new) {
+      poll_notify(new);
       FCB_decref(new);
+    }
     FCB_incref(old);
     CURPROC->FIDT[newfd] = old;
   }
@@ -238,6 +421,110 @@ int sys_Dup2(int oldfd, int newfd)
 }
 
 
+int io_nonblocking()
+{
+  return cur_thread()->io_flags & FCB_NONBLOCK;
+}
+
+
+int sys_SetNonBlocking(Fid_t fid, int on)
+{
+  FCB* fcb = get_fcb(fid);
+  if(fcb==NULL) return -1;
+
+  if(on)
+    fcb->flags |= FCB_NONBLOCK;
+  else
+    fcb->flags &= ~FCB_NONBLOCK;
+  return 0;
+}
+
+
+/*
+  Stream options are handled by the optional SetOption/GetOption
+  methods of the stream. These do not block, so there is no need
+  to hold a reference to the FCB.
+ */
+int sys_SetStreamOption(Fid_t fid, stream_option opt, unsigned int value)
+{
+  FCB* fcb = get_fcb(fid);
+
+  if(fcb==NULL || fcb->streamfunc->SetOption==NULL)
+    return -1;
+
+  return fcb->streamfunc->SetOption(fcb->streamobj, opt, value);
+}
+
+
+int sys_GetStreamOption(Fid_t fid, stream_option opt)
+{
+  FCB* fcb = get_fcb(fid);
+
+  if(fcb==NULL || fcb->streamfunc->GetOption==NULL)
+    return -1;
+
+  return fcb->streamfunc->GetOption(fcb->streamobj, opt);
+}
+
+
+/*
+  Splice moves data between the pipes behind the two streams. Like 
+  Read and Write, it holds references to the FCBs while it may block.
+ */
+int sys_Splice(Fid_t in, Fid_t out, unsigned int len)
+{
+  FCB* infcb = get_fcb(in);
+  FCB* outfcb = get_fcb(out);
+
+  if(infcb==NULL || outfcb==NULL 
+    || infcb->streamfunc->GetPipe==NULL || outfcb->streamfunc->GetPipe==NULL)
+    return -1;
+
+  pipe_cb* inpipe = infcb->streamfunc->GetPipe(infcb->streamobj, 0);
+  pipe_cb* outpipe = outfcb->streamfunc->GetPipe(outfcb->streamobj, 1);
+
+  FCB_incref(infcb);
+  FCB_incref(outfcb);
+
+  /* Splice does not block if either stream is non-blocking */
+  cur_thread()->io_flags = infcb->flags | outfcb->flags;
+  int retcode = pipe_splice(inpipe, outpipe, len);
+  cur_thread()->io_flags = 0;
+
+  FCB_decref(outfcb);
+  FCB_decref(infcb);
+
+  return retcode;
+}
+
+
+/*
+  A zero-copy send goes to the pipe behind the stream, like the output
+  of Splice.
+ */
+int sys_SendZeroCopy(Fid_t fid, const char* buf, unsigned int len, Fid_t cq, unsigned long tag)
+{
+  FCB* fcb = get_fcb(fid);
+  completion_queue* q = get_completion_queue(cq);
+
+  if(fcb==NULL || q==NULL || fcb->streamfunc->GetPipe==NULL)
+    return -1;
+
+  pipe_cb* pipe = fcb->streamfunc->GetPipe(fcb->streamobj, 1);
+  if(pipe==NULL)
+    return -1;
+
+  FCB_incref(fcb);
+
+  cur_thread()->io_flags = fcb->flags;
+  int retcode = pipe_loan_buffer(pipe, buf, len, q, tag);
+  cur_thread()->io_flags = 0;
+
+  FCB_decref(fcb);
+
+  return retcode;
+}
+
 
 unsigned int sys_GetTerminalDevices()
 {
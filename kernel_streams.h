@@ -3,6 +3,7 @@
 
 #include "tinyos.h"
 #include "kernel_dev.h"
+#include "kernel_poll.h"
 
 /**
 	@file kernel_streams.h
@@ -43,9 +44,16 @@ typedef struct file_control_block
   uint refcount;  			/**< @brief Reference counter. */
   void* streamobj;			/**< @brief The stream object (e.g., a device) */
   file_ops* streamfunc;		/**< @brief The stream implementation methods */
+  int flags;				/**< @brief Stream flags, e.g., @c FCB_NONBLOCK */
   rlnode freelist_node;		/**< @brief Intrusive list node */
+  poll_queue pollers;		/**< @brief The threads polling the stream */
+  unsigned long gen;		/**< @brief Counts the streams the FCB has held */
 } FCB;
 
+/** @brief FCB flag: I/O calls on the stream return @c WOULD_BLOCK instead of blocking. */
+#define FCB_NONBLOCK 1
+
+
 
 
 /** 
@@ -118,6 +126,19 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb);
 void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
 
 
+/** @brief Install an FCB at a free fid of the current process.
+
+   The FCB is installed at the lowest free fid, taking over a reference
+   to it that the caller already holds (e.g., by @ref FCB_incref). This
+   is used to give a process a stream that is open elsewhere.
+
+   @param fcb the FCB to install
+   @returns the fid, or @c NOFILE if the file table is full, in which
+      case the reference still belongs to the caller.
+*/
+Fid_t FCB_install(FCB* fcb);
+
+
 /** @brief Translate an fid to an FCB.
 
 	This routine will return NULL if the fid is not legal.
@@ -127,6 +148,16 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
  */
 FCB* get_fcb(Fid_t fid);
 
+
+/** @brief Check if the current I/O call must not block.
+
+	The stream methods do not see the FCB they are called for. Instead,
+	while a system call performs I/O on an FCB, the flags of the FCB are 
+	stored in the current thread. A stream method that would block checks
+	this first, and returns @c WOULD_BLOCK if it returns true.
+ */
+int io_nonblocking();
+
 /** @} */
 
 #endif
@@ -41,6 +41,13 @@ void NAME SIG \
 	POST_CALL\
 }\
 
+/* with return, without the kernel lock */
+#define SYSCALL_NOLOCK(NAME, RET, SIG, ARGS)\
+RET NAME SIG \
+{\
+	return sys_##NAME ARGS;\
+}\
+
 
 SYSCALLS
 
@@ -4,31 +4,59 @@
 #include "bios.h"
 #include "tinyos.h"
 
+/*
+  The list of system calls. System calls declared by SYSCALL_NOLOCK 
+  are called without the kernel lock; they either touch no shared
+  state, or they take the kernel lock (or an epoch read section) 
+  themselves.
+ */
 #define SYSCALLS \
 SYSCALL(Exec, int, (Task task, int argl, void* args), (task, argl, args))\
 SYSCALLV(Exit, (int exitval), (exitval))\
-SYSCALL(GetPid, int, (void), ())\
-SYSCALL(GetPPid, int, (void), ())\
+SYSCALL_NOLOCK(GetPid, int, (void), ())\
+SYSCALL_NOLOCK(GetPPid, int, (void), ())\
 SYSCALL(WaitChild, Pid_t, (Pid_t proc, int* exitval), (proc, exitval))\
 SYSCALL(CreateThread, Tid_t, (Task task, int argl, void* args), (task, argl, args))\
-SYSCALL(ThreadSelf, Tid_t, (void), ())\
+SYSCALL_NOLOCK(ThreadSelf, Tid_t, (void), ())\
 SYSCALL(ThreadJoin, int, (Tid_t tid, int* exitval), (tid, exitval))\
 SYSCALL(ThreadDetach, int, (Tid_t tid), (tid))\
 SYSCALLV(ThreadExit, (int exitval), (exitval))\
-SYSCALL(GetTerminalDevices, unsigned int, (), ())\
+SYSCALL_NOLOCK(GetTerminalDevices, unsigned int, (), ())\
 SYSCALL(OpenTerminal, Fid_t, (unsigned int termno), (termno))\
 SYSCALL(OpenNull, Fid_t, (), ())\
-SYSCALL(Read,int,(Fid_t fd, char *buf, unsigned int size), (fd,buf,size))\
-SYSCALL(Write,int,(Fid_t fd, const char *buf, unsigned int size), (fd,buf,size))\
+SYSCALL_NOLOCK(Read,int,(Fid_t fd, char *buf, unsigned int size), (fd,buf,size))\
+SYSCALL_NOLOCK(Write,int,(Fid_t fd, const char *buf, unsigned int size), (fd,buf,size))\
+SYSCALL(ReadV, int, (Fid_t fd, const iovec_t* iov, unsigned int iovcnt), (fd, iov, iovcnt))\
+SYSCALL(WriteV, int, (Fid_t fd, const iovec_t* iov, unsigned int iovcnt), (fd, iov, iovcnt))\
 SYSCALL(Close,int,(Fid_t fd),(fd))\
 SYSCALL(Dup2,int, (Fid_t oldfd, Fid_t newfd), (oldfd,newfd))\
 SYSCALL(Pipe, int, (pipe_t* pipe), (pipe))\
+SYSCALL(PipeEx, int, (pipe_t* pipe, unsigned int capacity), (pipe, capacity))\
+SYSCALL(SetStreamOption, int, (Fid_t fid, stream_option opt, unsigned int value), (fid, opt, value))\
+SYSCALL(GetStreamOption, int, (Fid_t fid, stream_option opt), (fid, opt))\
+SYSCALL(SetNonBlocking, int, (Fid_t fid, int on), (fid, on))\
+SYSCALL(Splice, int, (Fid_t in, Fid_t out, unsigned int len), (in, out, len))\
+SYSCALL(OpenCompletionQueue, Fid_t, (), ())\
+SYSCALL(SendZeroCopy, int, (Fid_t fid, const char* buf, unsigned int len, Fid_t cq, unsigned long tag), (fid, buf, len, cq, tag))\
 SYSCALL(Socket, Fid_t, (port_t port), (port))\
 SYSCALL(Listen, int, (Fid_t sock), (sock))\
 SYSCALL(Accept, Fid_t, (Fid_t lsock), (lsock))\
-SYSCALL(Connect, int, (Fid_t sock, port_t port, timeout_t timeout), (sock, port, timeout))\
+SYSCALL(ListenEx, int, (Fid_t sock, unsigned int backlog), (sock, backlog))\
+SYSCALL(AcceptMany, int, (Fid_t lsock, Fid_t* out, unsigned int n), (lsock, out, n))\
+SYSCALL(SocketPair, int, (Fid_t out[2]), (out))\
+SYSCALL_NOLOCK(Connect, int, (Fid_t sock, port_t port, timeout_t timeout), (sock, port, timeout))\
 SYSCALL(ShutDown, int, (Fid_t sock, shutdown_mode how), (sock, how))\
+SYSCALL(Bind, int, (Fid_t sock, unsigned int queue, dgram_policy policy), (sock, queue, policy))\
+SYSCALL(SendTo, int, (Fid_t sock, port_t port, const char* buf, unsigned int len), (sock, port, buf, len))\
+SYSCALL(RecvFrom, int, (Fid_t sock, char* buf, unsigned int len, port_t* from), (sock, buf, len, from))\
+SYSCALL(SendFid, int, (Fid_t sock, Fid_t fid), (sock, fid))\
+SYSCALL(RecvFid, Fid_t, (Fid_t sock), (sock))\
+SYSCALL(Poll, int, (pollfd* fds, unsigned int n, timeout_t timeout), (fds, n, timeout))\
+SYSCALL(OpenPollSet, Fid_t, (), ())\
+SYSCALL(PollSetControl, int, (Fid_t pset, Fid_t fid, unsigned int events), (pset, fid, events))\
+SYSCALL(PollSetWait, int, (Fid_t pset, pollfd* ready, unsigned int max, timeout_t timeout), (pset, ready, max, timeout))\
 SYSCALL(OpenInfo, Fid_t, (), ())\
+SYSCALL(OpenKernelStats, Fid_t, (kstat_type type), (type))\
 
 
 
@@ -39,9 +67,14 @@ RET sys_ ## NAME SIG;
 #define SYSCALLV(NAME, SIG, ARGS)\
 void sys_ ## NAME SIG;
 
+/* with return, without the kernel lock */
+#define SYSCALL_NOLOCK(NAME, RET, SIG, ARGS)\
+RET sys_ ## NAME SIG;
+
 SYSCALLS
 
 #undef SYSCALL
 #undef SYSCALLV
+#undef SYSCALL_NOLOCK
 
 #endif
\ No newline at end of file
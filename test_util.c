@@ -128,9 +128,11 @@ BARE_TEST(test_list_queue,
 	while(! is_rlist_empty(&L)) {
 		rlnode* p = rlist_pop_back(&L);
 		ASSERT(I==p);
+		ASSERT(p->next==p && p->prev==p);
 		I++;
 	}
 
+	ASSERT(I==n+10);
 	ASSERT(is_rlist_empty(&L));
 
 	I = rlist_pop_back(&L);   /* The list is empty, but the pop_back method does not mind! */
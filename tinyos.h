@@ -72,11 +72,34 @@ typedef uintptr_t Tid_t;
     mutexes are suitable for use in user-space, as well as in the implementation 
     of the kernel.
 
+    A mutex records the thread that locked it. When a thread has to wait
+    for a mutex in the preemptive domain, the owner inherits the priority 
+    of the waiter, until it unlocks the mutex.
+
+    When tinyos is built with @c LOCK_STATISTICS defined (see the
+    @c LOCK_STATS option of the Makefile), each mutex can also carry a 
+    lock class, under which its contention statistics are accounted.
+
     @see Mutex_Lock
     @see Mutex_Unlock
     @see MUTEX_INIT
 */
-typedef char Mutex;
+#if defined(LOCK_STATISTICS)
+struct lock_class;
+typedef struct {
+  char lock;                /**< The lock byte */
+  char pi;                  /**< Set when the owner inherited a waiter's priority */
+  void* owner;              /**< The thread holding the lock, or NULL */
+  struct lock_class* cls;   /**< The lock class, or NULL for unclassified locks */
+  uint64_t acquired;        /**< The time of the current acquisition, in nsec */
+} Mutex;
+#else
+typedef struct {
+  char lock;                /**< The lock byte */
+  char pi;                  /**< Set when the owner inherited a waiter's priority */
+  void* owner;              /**< The thread holding the lock, or NULL */
+} Mutex;
+#endif
 
 /**
   @brief This macro is used to initialize mutexes. 
@@ -86,7 +109,28 @@ typedef char Mutex;
    Mutex my_mutex = MUTEX_INIT;
   @endcode
  */
-#define MUTEX_INIT 0
+#if defined(LOCK_STATISTICS)
+#define MUTEX_INIT ((Mutex){ 0, 0, NULL, NULL, 0 })
+#else
+#define MUTEX_INIT ((Mutex){ 0, 0, NULL })
+#endif
+
+/**
+  @brief Initialize a mutex that belongs to a lock class.
+
+  This is the same as @c MUTEX_INIT, except that in a @c LOCK_STATISTICS
+  build, the contention statistics of the mutex are accounted under lock
+  class @c cls (a pointer to a @c lock_class). In normal builds, the
+  argument is ignored.
+  @code
+   Mutex sched_spinlock = MUTEX_INIT_CLASS(&sched_lock_class);
+  @endcode
+ */
+#if defined(LOCK_STATISTICS)
+#define MUTEX_INIT_CLASS(cls) ((Mutex){ 0, 0, NULL, (cls), 0 })
+#else
+#define MUTEX_INIT_CLASS(cls) MUTEX_INIT
+#endif
 
 
 /** @brief Lock a mutex.
@@ -123,6 +167,8 @@ void Mutex_Unlock(Mutex*);
 typedef struct {
   void *waitset;        /**< The set of waiting threads */
   Mutex waitset_lock;   /**< A mutex to protect `waitset` */
+  unsigned int spin_budget; /**< Polls a waiter spins before sleeping (adaptive) */
+  unsigned int spin_parks;  /**< Waits that slept without spinning, since the last spin */
 } CondVar;
 
 
@@ -133,7 +179,12 @@ typedef struct {
   CondVar my_cv = COND_INIT;
   @endcode
  */
-#define COND_INIT ((CondVar){ NULL, MUTEX_INIT })
+#if defined(LOCK_STATISTICS)
+extern struct lock_class cv_waitset_lock_class;
+#define COND_INIT ((CondVar){ NULL, { 0, 0, NULL, &cv_waitset_lock_class, 0 }, 0, 0 })
+#else
+#define COND_INIT ((CondVar){ NULL, { 0, 0, NULL }, 0, 0 })
+#endif
 
 
 /** @brief Wait on a condition variable. 
@@ -427,7 +478,8 @@ Fid_t OpenNull();
   @param fd  the file ID of the stream to read from
   @param buf pointer to a byte buffer to receive the read data
   @param size maximum size of @c buf
-  @return the number of bytes copied, 0 if we have reached EOF, or -1, indicating some error.
+  @return the number of bytes copied, 0 if we have reached EOF, @c WOULD_BLOCK if 
+        the stream is non-blocking and has no data, or -1, indicating some error.
         Possible errors are:
          - The file descriptor is invalid.
          - There was a I/O runtime problem.
@@ -450,7 +502,8 @@ int Read(Fid_t fd, char *buf, unsigned int size);
   @param buf pointer to a byte buffer to receive the read data
   @param size maximum size of @c buf
   @return As its function result, the @c Write function should return the 
-   number of bytes copied from @c buf, or -1 on error. 
+   number of bytes copied from @c buf, @c WOULD_BLOCK if the stream is 
+   non-blocking and has no space, or -1 on error. 
    Possible errors are:
    - The file id is invalid.
    - There was a I/O runtime problem.
@@ -458,6 +511,51 @@ int Read(Fid_t fd, char *buf, unsigned int size);
 int Write(Fid_t fd, const char* buf, unsigned int size);
 
 
+/** @brief A buffer segment, for @c ReadV and @c WriteV. */
+typedef struct iovec_s {
+  void* base;          /**< @brief The start of the segment. */
+  unsigned int len;    /**< @brief The length of the segment in bytes. */
+} iovec_t;
+
+/** @brief The max. number of segments passed to @c ReadV and @c WriteV. */
+#define MAX_IOV 64
+
+/** @brief Read bytes from a stream into a sequence of buffers.
+
+  This is like @c Read, except that the data fill the @c iovcnt segments of
+  @c iov in order, each one before the next. The whole call is a single
+  read: it blocks as a @c Read of the total length would, and on pipes and
+  sockets it wakes up blocked writers at most once. In message mode, one
+  message is scattered over the segments, and the call fails if it does
+  not fit in their total length.
+
+  @param fd the file ID of the stream to read from
+  @param iov the array of segments
+  @param iovcnt the number of segments, at most @c MAX_IOV
+  @return the total number of bytes copied, or as for @c Read. It is also
+     an error if @c iovcnt is larger than @c MAX_IOV, or the total length
+     of the segments does not fit in an @c int.
+ */
+int ReadV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt);
+
+/** @brief Write bytes to a stream from a sequence of buffers.
+
+  This is like @c Write, except that the data are gathered from the
+  @c iovcnt segments of @c iov in order. The whole call is a single write:
+  e.g., a header and a payload in two segments are written together, and
+  on pipes and sockets blocked readers are woken up at most once. In
+  message mode, the segments are written as one message.
+
+  @param fd the file ID of the stream to write to
+  @param iov the array of segments
+  @param iovcnt the number of segments, at most @c MAX_IOV
+  @return the total number of bytes copied, or as for @c Write. It is also
+     an error if @c iovcnt is larger than @c MAX_IOV, or the total length
+     of the segments does not fit in an @c int.
+ */
+int WriteV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt);
+
+
 /** @brief Close a file id.
    
 
@@ -489,6 +587,28 @@ int Close(Fid_t fd);
  */
 int Dup2(Fid_t oldfd, Fid_t newfd);
 
+
+/** @brief The result of an I/O call on a non-blocking stream, that would have blocked. */
+#define WOULD_BLOCK (-2)
+
+/** @brief Set or clear the non-blocking mode of a stream.
+
+  On a non-blocking stream, calls that would block return @c WOULD_BLOCK 
+  instead. These are @c Read on a stream that has no data, @c Write on a 
+  stream that has no space, @c Accept on a listening socket that has no 
+  pending connection, and @c Splice, if either of its streams is non-blocking.
+  Calls that can make progress behave as in blocking mode; e.g., a @c Read 
+  returns the available data, and a @c Read at the end of data returns 0.
+
+  The mode is a property of the stream, shared by all the file ids that 
+  refer to it (see @c Dup2). New streams are blocking.
+
+  @param fid the file id of the stream
+  @param on 1 for non-blocking mode, 0 for blocking mode
+  @returns 0 on success, or -1 if the file id is invalid.
+ */
+int SetNonBlocking(Fid_t fid, int on);
+
 /*******************************************
  *
  * Pipes
@@ -531,6 +651,210 @@ typedef struct pipe_s {
 */
 int Pipe(pipe_t* pipe);
 
+
+/** @brief The smallest pipe capacity, in bytes. */
+#define PIPE_MIN_CAPACITY (512)
+
+/** @brief The largest pipe capacity, in bytes. */
+#define PIPE_MAX_CAPACITY (1<<20)
+
+/**
+	@brief A pipe capacity value that selects automatic sizing.
+
+	An auto-tuned pipe starts with a small buffer. The buffer is doubled
+	when writers repeatedly find it full, and halved when readers keep
+	draining it while it stays mostly empty.
+*/
+#define PIPE_AUTO (0)
+
+/**
+	@brief Construct and return a pipe with a given buffer capacity.
+
+	This call is like @c Pipe(), but the capacity of the pipe buffer is
+	given by the caller. The capacity is rounded up to a power of two,
+	between @c PIPE_MIN_CAPACITY and @c PIPE_MAX_CAPACITY. If @c capacity is
+	@c PIPE_AUTO, the pipe is auto-tuned.
+
+	@param pipe a pointer to a pipe_t structure for storing the file ids.
+	@param capacity the requested buffer capacity in bytes, or @c PIPE_AUTO
+	@returns 0 on success, or -1 on error. Possible reasons for error:
+		- the capacity is larger than @c PIPE_MAX_CAPACITY
+		- the available file ids for the process are exhausted.
+	@see SetStreamOption
+*/
+int PipeEx(pipe_t* pipe, unsigned int capacity);
+
+
+/**
+	@brief Stream options, accessed by @c SetStreamOption and @c GetStreamOption.
+*/
+typedef enum {
+	STREAM_RCVBUF,	/**< @brief The capacity of the buffer read through the stream */
+	STREAM_SNDBUF,	/**< @brief The capacity of the buffer written through the stream */
+	STREAM_RCVLOWAT,	/**< @brief The bytes a blocking @c Read waits for (default 1) */
+	STREAM_SNDLOWAT,	/**< @brief The free space that wakes up blocked writers (default: a quarter of the capacity) */
+	STREAM_MESSAGE,	/**< @brief 1 if the stream preserves message boundaries, 0 for a byte stream (the default) */
+	STREAM_NEXTMSG,	/**< @brief The size of the next message to read, or 0 if there is none (read-only) */
+	STREAM_REUSEPORT,	/**< @brief 1 if a socket may share its port with other listeners (set before @c Listen) */
+	STREAM_DROPS	/**< @brief The messages dropped by a full datagram socket (read-only) @see Bind */
+} stream_option;
+
+/**
+	@brief Set an option of a stream.
+
+	This is the analog of @c setsockopt. Currently, the options are the
+	buffer capacities of pipes and connected sockets. On either end of a 
+	pipe, both options refer to the pipe buffer. On a connected socket,
+	they refer to the buffers of the two directions of the connection.
+	Buffer capacities are rounded as in @c PipeEx, and @c PIPE_AUTO
+	turns on auto-tuning. A buffer is never shrunk below the data it 
+	currently holds.
+
+	The watermarks control wakeups. A @c Read on an empty buffer blocks until
+	@c STREAM_RCVLOWAT bytes are available, or the write end is closed. A 
+	@c Write on a full buffer blocks until @c STREAM_SNDLOWAT bytes are free.
+	A value of 0 restores the default. Both are limited to half the 
+	buffer capacity.
+
+	In message mode (@c STREAM_MESSAGE set to 1), each @c Write is one
+	message, written as a whole or not at all: it blocks until the whole
+	message fits, and fails if it can never fit in the buffer (unless the
+	buffer is auto-tuned, in which case it grows). Each @c Read returns 
+	exactly one message. If the message is larger than the @c Read buffer,
+	the @c Read fails and the message stays in place; its size is given 
+	by @c GetStreamOption(fid, STREAM_NEXTMSG). The mode can only be 
+	changed while the buffer is empty. On a connected socket, it applies 
+	to both directions of the connection. Message mode buffers cannot be
+	used with @c Splice.
+
+	@c STREAM_REUSEPORT applies to sockets, and can only be set before
+	@c Listen. When it is set on all of them, several sockets can listen on
+	the same port (see @c Listen).
+
+	@param fid the file id of the stream
+	@param opt the option to set
+	@param value the new value of the option
+	@returns 0 on success, or -1 on error. Possible reasons for error:
+		- the file id is invalid
+		- the stream does not support the option
+		- the value is illegal for the option
+*/
+int SetStreamOption(Fid_t fid, stream_option opt, unsigned int value);
+
+/**
+	@brief Get an option of a stream.
+
+	For buffer capacities, the current capacity is returned, even if
+	the buffer is auto-tuned.
+
+	@param fid the file id of the stream
+	@param opt the option to get
+	@returns the value of the option, or -1 on error. Possible reasons for error:
+		- the file id is invalid
+		- the stream does not support the option
+*/
+int GetStreamOption(Fid_t fid, stream_option opt);
+
+/**
+	@brief Move data from one stream to another, inside the kernel.
+
+	This call is equivalent to a @c Read of up to @c len bytes from @c in,
+	followed by a @c Write of the data to @c out, but the data is moved
+	directly between the kernel buffers, without a copy to user space.
+	Stream @c in must be the read end of a pipe or a connected socket, and
+	@c out must be the write end of a pipe or a connected socket.
+
+	The call blocks like @c Read until there is data in @c in, and then
+	like @c Write until there is space in @c out. It returns the number of
+	bytes moved, which may be fewer than @c len, or 0 if the write end of
+	@c in is closed and its buffer is empty. When the whole contents of
+	@c in move into an empty buffer of the same capacity, the two buffers
+	are exchanged instead of copied.
+
+	@param in the file id to read from
+	@param out the file id to write to
+	@param len the maximum number of bytes to move
+	@returns the number of bytes moved, or -1 on error. Possible reasons for error:
+		- either file id is invalid, or not a pipe end or connected socket
+		- @c in and @c out refer to the same buffer
+		- the read end of @c out is closed
+*/
+int Splice(Fid_t in, Fid_t out, unsigned int len);
+
+/** @brief The max. number of zero-copy sends outstanding on a completion queue. */
+#define COMPLETION_QUEUE_SIZE (64)
+
+/**
+	@brief The completion of a zero-copy send.
+
+	A completion queue returns one record of this type for each 
+	@c SendZeroCopy, once the kernel no longer uses the buffer of the send.
+
+	@see SendZeroCopy
+ */
+typedef struct zc_completion
+{
+	unsigned long tag;   /**< @brief The tag passed to @c SendZeroCopy */
+	unsigned int len;    /**< @brief The length of the send */
+	int status;          /**< @brief 0 if the whole buffer was read, -1 if the read end closed first */
+} zc_completion;
+
+/**
+	@brief Open a completion queue, for zero-copy sends.
+
+	A completion queue is a read-only stream of @c zc_completion records.
+	A @c Read returns as many whole records as fit in its buffer, blocking 
+	until there is at least one; a buffer smaller than a record is an 
+	error. The queue is readable for @c Poll when it holds a record.
+
+	At most @c COMPLETION_QUEUE_SIZE sends may be outstanding on a queue,
+	counting both the sends in progress and the records not yet read.
+
+	@returns a file id on success, or NOFILE if the available file ids 
+	   for the process are exhausted.
+	@see SendZeroCopy
+ */
+Fid_t OpenCompletionQueue();
+
+/**
+	@brief Send a buffer without copying it into the kernel.
+
+	This is like a @c Write of the @c len bytes at @c buf to @c fid, the
+	write end of a pipe or a connected socket, except that the kernel does
+	not copy the data into the stream buffer. Instead, it holds on to 
+	@c buf, and the readers of the stream copy the data straight out of 
+	it. The data is read in order with the data of the other writes, and 
+	a read may return data from several sends and writes.
+
+	The buffer is loaned to the kernel: it must not be modified or freed
+	until a completion record with @c tag is read from @c cq. Its status 
+	is 0 if the whole buffer was read, or -1 if the read end of the stream
+	was closed before. If @c cq is closed first (e.g., because the sender
+	exits), the kernel copies the part of the buffer not yet read, and
+	gives the buffer back.
+
+	The call returns as soon as the send is queued. It blocks only while
+	the stream already holds several sends that are not fully read; on a 
+	non-blocking stream, it returns @c WOULD_BLOCK instead. Zero-copy 
+	sends cannot be used on a stream in message mode, and a pipe with 
+	sends queued cannot be the input of @c Splice.
+
+	@param fid the stream to write to
+	@param buf the data to send
+	@param len the number of bytes to send, at least 1
+	@param cq the completion queue to notify
+	@param tag a value that identifies the send in its completion record
+	@returns 0 on success, or -1 on error. Possible reasons for error:
+		- @c fid is invalid, or not a pipe write end or connected socket
+		- @c cq is not a completion queue
+		- @c buf is NULL, or @c len is 0
+		- @c cq has @c COMPLETION_QUEUE_SIZE sends outstanding
+		- the stream is in message mode
+		- the read end of the stream is closed
+	@see OpenCompletionQueue
+ */
+int SendZeroCopy(Fid_t fid, const char* buf, unsigned int len, Fid_t cq, unsigned long tag);
+
 /*******************************************
  *
  * Sockets (local)
@@ -581,19 +905,48 @@ Fid_t Socket(port_t port);
 
 	The socket must be bound to a port, as a result of calling @c Socket.
 	On each port there must be a unique listening socket (although any number
-	of non-listening sockets are allowed).
+	of non-listening sockets are allowed), unless all the listening sockets
+	of the port have @c STREAM_REUSEPORT set. Such sockets form a group,
+	where each listener has its own queue of connection requests. Each new
+	request goes to the listener of the group with the fewest pending 
+	requests, and ties are broken round-robin. Thus, a thread per listener 
+	can accept connections on the same port, without sharing a queue. When 
+	a listener of the group is closed, its pending requests move to the rest
+	of the group.
 
 	@param sock the socket to initialize as a listening socket
 	@returns 0 on success, -1 on error. Possible reasons for error:
 		- the file id is not legal
 		- the socket is not bound to a port
-		- the port bound to the socket is occupied by another listener
+		- the port bound to the socket is occupied by another listener, and
+		  @c STREAM_REUSEPORT is not set on both
 		- the socket has already been initialized
 	@see Socket
  */
 int Listen(Fid_t sock);
 
 
+/** @brief A backlog for @c ListenEx that puts no limit on the pending requests. */
+#define LISTEN_BACKLOG_UNLIMITED (0)
+
+/**
+	@brief Initialize a socket as a listening socket, with a bounded backlog.
+
+	This is the same as @c Listen, except that at most @c backlog connection
+	requests can be pending (i.e., waiting for @c Accept) at the socket.
+	When the backlogs of all the listeners on the port are full, @c Connect 
+	fails at once, instead of waiting for its timeout. @c Listen is the same 
+	as @c ListenEx with a backlog of @c LISTEN_BACKLOG_UNLIMITED.
+
+	@param sock the socket to initialize as a listening socket
+	@param backlog the max. number of pending requests, or 
+	    @c LISTEN_BACKLOG_UNLIMITED
+	@returns 0 on success, -1 on error, for the reasons given in @c Listen.
+	@see Listen
+ */
+int ListenEx(Fid_t sock, unsigned int backlog);
+
+
 /**
 	@brief Wait for a connection.
 
@@ -607,8 +960,9 @@ int Listen(Fid_t sock);
 	and then some thread takes over the connection for communication with the client.
 
 	@param sock the socket to initialize as a listening socket
-	@returns a new socket file id on success, @c NOFILE on error. Possible reasons 
-	    for error:
+	@returns a new socket file id on success, @c WOULD_BLOCK if @c lsock is
+	    non-blocking and there is no pending connection, or @c NOFILE on error. 
+	    Possible reasons for error:
 		- the file id is not legal
 		- the file id is not initialized by @c Listen()
 		- the available file ids for the process are exhausted
@@ -620,6 +974,52 @@ int Listen(Fid_t sock);
 Fid_t Accept(Fid_t lsock);
 
 
+/**
+	@brief Wait for connections, and accept many at once.
+
+	This call blocks like @c Accept until there is a pending connection
+	request at listening socket @c lsock. Then, it accepts up to @c n of 
+	the pending requests, storing the file ids of the new connections in 
+	@c out[0] to @c out[k-1], where @c k is the returned count. The requests 
+	are accepted with a single kernel entry, which saves the overhead of
+	one @c Accept per connection when many requests arrive together.
+
+	Fewer than @c n requests are accepted when fewer are pending, or when 
+	the file ids of the process run out.
+
+	@param lsock the listening socket
+	@param out the array where the new file ids are stored
+	@param n the max. number of requests to accept
+	@returns the number of accepted connections (at least 1), @c WOULD_BLOCK
+	    if @c lsock is non-blocking and there is no pending connection, or -1 
+	    on error. Possible reasons for error are those of @c Accept, and:
+	    - @c out is NULL, or @c n is 0
+	@see Accept
+ */
+int AcceptMany(Fid_t lsock, Fid_t* out, unsigned int n);
+
+
+
+/**
+	@brief Create a pair of connected sockets.
+
+	This call creates two sockets, connected to each other as if one had 
+	connected to a listener and the other had been returned by @c Accept. 
+	The pair is made directly, so no port is used, no listener is needed, 
+	and there is no connection handshake. This is the cheap way to make a 
+	two-way channel, e.g., between the threads of a process.
+
+	The new sockets are not bound to a port; they behave like any other 
+	connected sockets, e.g., for @c ShutDown and the stream options.
+
+	@param out the array where the file ids of the two sockets are stored
+	@returns 0 on success and -1 on error. Possible reasons for error:
+	    - @c out is NULL
+	    - the process has fewer than two free file ids
+	@see Connect
+ */
+int SocketPair(Fid_t out[2]);
+
 
 /**
 	@brief Create a connection to a listener at a specific port.
@@ -694,6 +1094,272 @@ typedef enum {
 int ShutDown(Fid_t sock, shutdown_mode how);
 
 
+/** @brief The largest message of a datagram socket. */
+#define DGRAM_MAX_MESSAGE 512
+
+/** @brief The queue length of a datagram socket, when @c Bind is passed 0. */
+#define DGRAM_DEFAULT_QUEUE 64
+
+/** @brief The largest queue length of a datagram socket. */
+#define DGRAM_MAX_QUEUE 4096
+
+/**
+   @brief What happens to a message sent to a full datagram socket.
+
+   @see Bind
+*/
+typedef enum {
+  DGRAM_BLOCK,   /**< The sender blocks until there is room. */
+  DGRAM_DROP     /**< The message is dropped, and counted in @c STREAM_DROPS. */
+} dgram_policy;
+
+
+/**
+   @brief Make a socket receive datagrams at its port.
+
+   A datagram socket receives the messages sent to its port by @c SendTo,
+   from any socket, without connections. The messages wait in a queue of
+   @c queue messages (rounded up to a power of two), in the order they 
+   were sent. When the queue is full, a sender either blocks until there 
+   is room (@c DGRAM_BLOCK), or its message is dropped (@c DGRAM_DROP). 
+   A dropped message is not an error for the sender; the drops are counted,
+   and @c GetStreamOption(sock, STREAM_DROPS) returns their number.
+
+   Datagram ports are separate from the ports of listeners, so a port
+   may have both a listener and a datagram socket, but only one datagram 
+   socket.
+
+   @param sock an unbound socket, made by @c Socket with a port
+   @param queue the queue length, or 0 for @c DGRAM_DEFAULT_QUEUE
+   @param policy the behaviour of a full queue
+   @returns 0 on success and -1 on error. Possible reasons for error:
+       - @c sock is not an unbound socket, or its port is @c NOPORT
+       - another socket receives datagrams at the port
+       - @c queue is greater than @c DGRAM_MAX_QUEUE
+       - @c policy is not legal
+   @see SendTo
+   @see RecvFrom
+*/
+int Bind(Fid_t sock, unsigned int queue, dgram_policy policy);
+
+
+/**
+   @brief Send a datagram to a port.
+
+   The message of @c len bytes from @c buf is queued at the datagram socket
+   of @c port, as a single message. The receiver learns the port of 
+   @c sock (which may be @c NOPORT) as the sender. A full queue blocks the
+   call or drops the message, as chosen by @c Bind; a non-blocking @c sock
+   returns @c WOULD_BLOCK instead of blocking.
+
+   @param sock an unbound or a datagram socket
+   @param port the port of the receiver
+   @param buf the message
+   @param len the message size, at most @c DGRAM_MAX_MESSAGE
+   @returns @c len on success (also when the message is dropped), 
+       @c WOULD_BLOCK, or -1 on error. Possible reasons for error:
+       - @c sock is not an unbound or datagram socket
+       - @c port is illegal, or has no datagram socket
+       - @c len is greater than @c DGRAM_MAX_MESSAGE
+       - the receiver was closed while the sender was blocked
+   @see Bind
+*/
+int SendTo(Fid_t sock, port_t port, const char* buf, unsigned int len);
+
+
+/**
+   @brief Receive a datagram.
+
+   Take the next message from the queue of datagram socket @c sock, 
+   blocking while it is empty (unless @c sock is non-blocking). Up to 
+   @c len bytes of the message are copied to @c buf; the rest of a longer 
+   message is discarded. A @c Read on a datagram socket is the same as 
+   @c RecvFrom with a NULL @c from.
+
+   @param sock a datagram socket
+   @param buf the buffer for the message
+   @param len the size of @c buf
+   @param from if not NULL, the port of the sender is stored here
+   @returns the number of bytes copied, @c WOULD_BLOCK, or -1 on error. 
+       Possible reasons for error:
+       - @c sock is not a datagram socket
+   @see Bind
+*/
+int RecvFrom(Fid_t sock, char* buf, unsigned int len, port_t* from);
+
+
+/** @brief The most files that may wait at a connected socket to be received by @c RecvFid. */
+#define SOCKET_MAX_FIDS (MAX_FILEID)
+
+/**
+   @brief Send an open file over a connected socket.
+
+   The stream of @c fid is queued at the peer of @c sock, on a control
+   channel that is separate from the data of the connection. The peer
+   receives it with @c RecvFid, as a new file id of its own process,
+   which refers to the same stream (as if by @c Dup2, but across 
+   processes). The queued stream counts as open, so @c fid may be 
+   closed right after the call. 
+
+   For example, an acceptor process can hand each accepted connection 
+   to one of a few worker processes, already running, each connected
+   to it with a socket, instead of spawning a process per connection.
+
+   A queued stream that is never received is closed when the peer 
+   is closed.
+
+   @param sock a connected socket
+   @param fid the file to send
+   @returns 0 on success and -1 on error. Possible reasons for error:
+       - @c sock is not a connected socket, or it is shut down for writing, 
+         or its peer is closed or shut down for reading
+       - @c fid is not an open file id
+       - @c fid is @c sock, or the peer of @c sock (these would keep 
+         each other open)
+       - @c fid is a socket with files queued at it, not yet received
+         (two such sockets could keep each other open)
+       - @c SOCKET_MAX_FIDS files are already waiting at the peer
+   @see RecvFid
+*/
+int SendFid(Fid_t sock, Fid_t fid);
+
+
+/**
+   @brief Receive an open file from a connected socket.
+
+   Take the next stream sent by the peer of @c sock with @c SendFid,
+   and install it at a free file id of the process. The call blocks
+   while there is none (unless @c sock is non-blocking). A socket with
+   a stream to receive is @c POLL_READABLE.
+
+   @param sock a connected socket
+   @returns the new file id, @c WOULD_BLOCK, or @c NOFILE on error.
+       Possible reasons for error:
+       - @c sock is not a connected socket
+       - the peer was closed, or shut down for writing, and no more 
+         streams are queued
+       - the process has no free file id (the stream stays queued)
+   @see SendFid
+*/
+Fid_t RecvFid(Fid_t sock);
+
+
+
+/*******************************************
+ *
+ * Readiness multiplexing
+ *
+ *******************************************/
+
+/**
+  @brief Poll events.
+
+  These flags are used in the @c events and @c revents fields of @c pollfd.
+  @c POLL_HANGUP and @c POLL_INVALID are reported even if not requested.
+
+  @see Poll
+ */
+typedef enum {
+  POLL_READABLE = 1,   /**< @brief A @c Read (or an @c Accept, on a listening socket) would not block. */
+  POLL_WRITABLE = 2,   /**< @brief A @c Write would not block. */
+  POLL_HANGUP = 4,     /**< @brief The other end of the stream is closed. */
+  POLL_INVALID = 8     /**< @brief The file id is not open. */
+} poll_event;
+
+/**
+  @brief An entry of a @c Poll request.
+
+  @see Poll
+ */
+typedef struct poll_fd {
+  Fid_t fd;               /**< @brief The stream to poll, or @c NOFILE to skip the entry. */
+  unsigned int events;    /**< @brief The events of interest, a mask of @c poll_event. */
+  unsigned int revents;   /**< @brief The events that occurred, set by @c Poll. */
+} pollfd;
+
+/** @brief A timeout for @c Poll and @c PollSetWait that never expires. */
+#define POLL_FOREVER ((timeout_t)-1)
+
+/**
+  @brief Wait until some of a set of streams is ready for I/O.
+
+  For each of the @c n entries of array @c fds, this call checks whether
+  the events of interest have occurred on stream @c fds[i].fd, and stores
+  the events that have occurred in @c fds[i].revents. If no entry has any
+  events, the call blocks until one does, or the timeout expires.
+
+  A stream is ready for reading if a @c Read would not block: for pipes
+  and sockets, if the buffer holds at least @c STREAM_RCVLOWAT bytes (or
+  a whole message in message mode), or if the other end is closed; for
+  terminals, if a key has been pressed. A stream is ready for writing if
+  the free space of the buffer is at least @c STREAM_SNDLOWAT. A listening
+  socket is ready for reading when it has a pending connection. Streams
+  that do not support polling (e.g., the null device) are always ready.
+
+  Readiness is a hint: if another thread gets to the stream first, the
+  call may still block, so that readiness is best combined with
+  @c SetNonBlocking.
+
+  @param fds the array of entries
+  @param n the number of entries
+  @param timeout the timeout in msec, 0 to return at once, or @c POLL_FOREVER
+  @returns the number of entries with non-zero @c revents, 0 if the timeout
+     expired, or -1 if @c fds is NULL.
+  @see SetNonBlocking
+ */
+int Poll(pollfd* fds, unsigned int n, timeout_t timeout);
+
+/**
+  @brief Open a poll set.
+
+  A poll set is a persistent set of streams, with an event mask for each,
+  that is waited on by @c PollSetWait. Unlike @c Poll, the set does not
+  need to be passed to each call. The streams are added and removed by
+  @c PollSetControl; a stream is also removed when its file id is closed.
+  The poll set is destroyed by @c Close. The poll set is itself ready for
+  reading when some stream in it is ready, so poll sets can be nested.
+
+  A poll set refers to streams by their file ids in the calling process.
+
+  @returns the file id of the poll set, or @c NOFILE on error. Possible
+     reasons for error:
+     - the process has no free file ids.
+ */
+Fid_t OpenPollSet();
+
+/**
+  @brief Add, change or remove a stream of a poll set.
+
+  @param pset the file id of the poll set
+  @param fid the file id of the stream
+  @param events the events of interest (a mask of @c poll_event), or 0
+     to remove the stream from the set
+  @returns 0 on success, or -1 on error. Possible reasons for error:
+     - @c pset is not a poll set.
+     - @c fid is not open, or it is @c pset.
+ */
+int PollSetControl(Fid_t pset, Fid_t fid, unsigned int events);
+
+/**
+  @brief Wait until some of the streams of a poll set are ready.
+
+  This is the analog of @c Poll for a poll set. Up to @c max ready streams
+  are stored in array @c ready, with their file ids in @c fd, their events
+  of interest in @c events and the events that occurred in @c revents. When
+  more than @c max streams are ready, successive calls return them in turn.
+
+  @param pset the file id of the poll set
+  @param ready the array where ready streams are stored
+  @param max the size of @c ready
+  @param timeout the timeout in msec, 0 to return at once, or @c POLL_FOREVER
+  @returns the number of entries stored, 0 if the timeout expired, or -1 on
+     error. Possible reasons for error:
+     - @c pset is not a poll set.
+     - @c ready is NULL, or @c max is 0.
+ */
+int PollSetWait(Fid_t pset, pollfd* ready, unsigned int max, timeout_t timeout);
+
+
 
 /*******************************************
  *
@@ -768,6 +1434,194 @@ typedef struct procinfoCB{
 Fid_t OpenInfo();
 
 
+/**
+  @brief The kinds of kernel statistics that can be read.
+
+  Each kind of statistics is returned by @c OpenKernelStats as
+  a stream of fixed-size records of a kind-specific type.
+
+  @see OpenKernelStats
+ */
+typedef enum {
+  KSTAT_LOCKS,    /**< @brief Lock contention statistics, as @c lockinfo records */
+  KSTAT_SCHED,    /**< @brief Scheduler statistics, as a single @c schedinfo record */
+  KSTAT_PIPES,    /**< @brief Pipe buffer statistics, as a single @c pipeinfo record */
+  KSTAT_SLABS,    /**< @brief Kernel memory pool statistics, as @c slabinfo records */
+  KSTAT_STREAMS,  /**< @brief Per-pipe and per-socket statistics, as @c streaminfo records */
+  KSTAT_MAX       /**< @brief placeholder for the number of statistics kinds */
+} kstat_type;
+
+
+/** @brief The max. size of a lock class name in a @c lockinfo record. */
+#define LOCKINFO_NAME_SIZE (32)
+
+/** 
+  @brief The number of buckets in the hold-time histogram of a lock class.
+
+  Bucket @c i counts the acquisitions held for less than @c 256*4^i nanoseconds
+  (and at least as long as the previous bucket's bound). The last bucket 
+  counts every longer hold.
+ */
+#define LOCKINFO_HOLD_BUCKETS (8)
+
+/**
+  @brief Contention statistics for a lock class.
+
+  These records are returned by a @c KSTAT_LOCKS stream. The statistics are 
+  only collected when the kernel is built with @c LOCK_STATISTICS defined.
+  Else, the stream is empty.
+
+  @see OpenKernelStats
+ */
+typedef struct lockinfo
+{
+  char name[LOCKINFO_NAME_SIZE];  /**< @brief The name of the lock class */
+  unsigned long acquisitions;     /**< @brief Number of @c Mutex_Lock calls */
+  unsigned long contended;        /**< @brief Acquisitions that found the lock held */
+  unsigned long spins;            /**< @brief Total spin iterations while waiting */
+  unsigned long yields;           /**< @brief Calls to @c yield(SCHED_MUTEX) while waiting */
+  unsigned long hold_hist[LOCKINFO_HOLD_BUCKETS]; /**< @brief Hold-time histogram */
+} lockinfo;
+
+
+/** @brief The number of scheduler priority queues reported in a @c schedinfo record. */
+#define SCHEDINFO_QUEUES (16)
+
+/**
+  @brief Scheduler statistics.
+
+  A @c KSTAT_SCHED stream returns a single record of this type. The counters
+  are cumulative, since boot.
+
+  @see OpenKernelStats
+ */
+typedef struct schedinfo
+{
+  unsigned long yields;         /**< @brief Calls to the scheduler */
+  unsigned long switches;       /**< @brief Context switches, on all cores */
+  unsigned long mutex_yields;   /**< @brief Yields by threads waiting for a @c Mutex */
+  unsigned long boosts;         /**< @brief Periodic priority boosts of all threads */
+  unsigned long pi_boosts;      /**< @brief Lock owners that inherited a waiter's priority */
+  unsigned long pi_restores;    /**< @brief Inherited priorities dropped at unlock, or at a yield of a @c Mutex owner */
+  unsigned int ready[SCHEDINFO_QUEUES]; /**< @brief Ready threads in each priority queue */
+} schedinfo;
+
+
+/**
+  @brief Pipe buffer statistics.
+
+  A @c KSTAT_PIPES stream returns a single record of this type. It covers
+  all pipes, including the two pipes of each socket connection. A pipe
+  takes a buffer from the buffer pool when data is written to it, and
+  returns it when the data is drained, so idle pipes hold no buffer.
+
+  @see OpenKernelStats
+ */
+typedef struct pipeinfo
+{
+  unsigned long created;     /**< @brief Pipes created since boot */
+  unsigned long live;        /**< @brief Pipes currently open */
+  unsigned long buffered;    /**< @brief Total capacity of the buffers held by pipes */
+  unsigned long resizes;     /**< @brief Capacity changes by @c SetStreamOption */
+  unsigned long grows;       /**< @brief Automatic capacity increases */
+  unsigned long shrinks;     /**< @brief Automatic capacity decreases */
+  unsigned long spliced;     /**< @brief Bytes moved by @c Splice */
+  unsigned long swaps;       /**< @brief Buffers exchanged, instead of copied, by @c Splice */
+  unsigned long loaned;      /**< @brief Bytes sent by @c SendZeroCopy */
+  unsigned long loans_copied; /**< @brief Zero-copy sends copied, since their completion queue closed first */
+} pipeinfo;
+
+
+/** @brief The max. size of a pool name in a @c slabinfo record. */
+#define SLABINFO_NAME_SIZE (32)
+
+/**
+  @brief Kernel memory pool statistics.
+
+  A @c KSTAT_SLABS stream returns one record of this type for each slab
+  cache of the kernel, including the caches of the pipe buffer pool 
+  (named @c buffer-512 to @c buffer-16k). The last record, named 
+  @c buffer-large, counts the pipe buffers too large for a cache, which 
+  are allocated directly; its slab fields are 0.
+
+  @see OpenKernelStats
+ */
+typedef struct slabinfo
+{
+  char name[SLABINFO_NAME_SIZE];  /**< @brief The pool name */
+  unsigned long objsize;     /**< @brief The object size */
+  unsigned long perslab;     /**< @brief The objects per slab */
+  unsigned long slabs;       /**< @brief Slabs currently allocated */
+  unsigned long empty;       /**< @brief Slabs with no objects in use, kept for reuse */
+  unsigned long inuse;       /**< @brief Objects currently in use */
+  unsigned long cached;      /**< @brief Free objects held in the per-core lists of the cache */
+  unsigned long allocs;      /**< @brief Allocations since boot */
+  unsigned long frees;       /**< @brief Frees since boot */
+  unsigned long reclaimed;   /**< @brief Empty slabs returned to the system since boot */
+  unsigned long memory;      /**< @brief Bytes currently held by the pool */
+} slabinfo;
+
+
+/** @brief The kinds of stream described by a @c streaminfo record. */
+typedef enum {
+  STREAMINFO_PIPE,       /**< @brief A pipe, made by @c Pipe or @c PipeEx */
+  STREAMINFO_UNBOUND,    /**< @brief A socket that is neither listening nor connected */
+  STREAMINFO_LISTENER,   /**< @brief A listening socket */
+  STREAMINFO_PEER,       /**< @brief A connected socket */
+  STREAMINFO_DGRAM       /**< @brief A datagram socket */
+} streaminfo_kind;
+
+/**
+  @brief Traffic and wait statistics of a pipe or a socket.
+
+  A @c KSTAT_STREAMS stream returns one record of this type for each open
+  pipe, followed by one for each open socket. Pipes count the bytes 
+  written to their write end and read from their read end. Connected 
+  sockets count the bytes they sent and received; a direction that is
+  shut down no longer reports its counters. The wait times are the time 
+  that threads spent blocked, waiting for data to read or for space to 
+  write.
+
+  @see OpenKernelStats
+ */
+typedef struct streaminfo
+{
+  streaminfo_kind kind;        /**< @brief The kind of stream */
+  unsigned long id;            /**< @brief A number that identifies the stream, among those of its kind */
+  unsigned long peer;          /**< @brief The @c id of the peer of a connected socket, else 0 */
+  port_t port;                 /**< @brief The port of a socket, else @c NOPORT */
+  unsigned long bytes_read;    /**< @brief Bytes read */
+  unsigned long bytes_written; /**< @brief Bytes written */
+  unsigned long reads;         /**< @brief Read calls that returned data */
+  unsigned long writes;        /**< @brief Write calls that stored data */
+  unsigned long read_wait_ns;  /**< @brief Time blocked waiting for data, in nanoseconds */
+  unsigned long write_wait_ns; /**< @brief Time blocked waiting for space, in nanoseconds */
+  unsigned int rxqueued;       /**< @brief Bytes buffered, not yet read; messages queued, for a datagram socket */
+  unsigned int txqueued;       /**< @brief Bytes sent by a connected socket, not yet read by its peer */
+  unsigned int rcvbuf;         /**< @brief The capacity of the buffer that is read */
+  unsigned int sndbuf;         /**< @brief The capacity of the buffer that a connected socket writes */
+  unsigned int pending;        /**< @brief Connection requests in the accept queue of a listener */
+  unsigned int backlog;        /**< @brief The max. length of the accept queue of a listener, or @c LISTEN_BACKLOG_UNLIMITED */
+} streaminfo;
+
+
+/**
+  @brief Open a kernel statistics stream.
+
+  This is a read-only stream that returns a sequence of fixed-size records,
+  whose type depends on @c type (e.g., @c lockinfo for @c KSTAT_LOCKS). 
+  Each call to @c Read returns the next record. The records are a snapshot
+  of the statistics, taken when the stream was opened. 
+
+  @param type the kind of statistics to read
+  @returns a file id on success, or NOFILE on error. Possible reasons
+    for error are:
+    - the type is illegal
+    - the available file ids for the process are exhausted.
+ */
+Fid_t OpenKernelStats(kstat_type type);
+
+
 
 
 /*******************************************
@@ -0,0 +1,74 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "tinyoslib.h"
+#include "bench.h"
+
+
+/*
+ 	A standalone program to run the tinyos benchmarks, without a terminal.
+ 	Results are printed on the standard output of the host.
+ */
+
+struct { const char* name; Program prog; const char* help; }
+BENCHMARKS[] =
+{
+	{"pipe", PipeBench, "pipe [<minsize> [<maxsize> [<capacity> [<rcvlowat>]]]]: pipe throughput over a range of write sizes"},
+	{"relay", RelayBench, "relay [<minsize> [<maxsize>]]: relay throughput between two pipes, copying vs. Splice"},
+	{"msg", MsgBench, "msg [<minsize> [<maxsize> [<capacity>]]]: messages per second through a pipe, stream (one write, split, writev) vs. message mode"},
+	{"conn", ConnBench, "conn [<conns> [<clients> [<reqs>]]]: connections served by one polling thread vs. a thread per connection"},
+	{"chan", ChanBench, "chan [<chans>]: channel setup time, Connect/Accept vs. SocketPair"},
+	{"ping", PingBench, "ping [<size> [<conns> [<rounds>]]]: socket round trip latency percentiles"},
+	{"stream", StreamBench, "stream [<size> [<conns> [<mbytes>]]]: socket bulk throughput"},
+	{"setup", SetupBench, "setup [<size> [<conns> [<count>]]]: socket connection setup rate and latency"},
+	{"fanin", FanInBench, "fanin [<size> [<conns> [<mbytes>]]]: many connections streaming to one polling server"},
+	{"zcopy", ZeroCopyBench, "zcopy [<size> [<count>]]: large responses over a socket, sent by Write vs. SendZeroCopy"},
+
+	{NULL, NULL, NULL}
+};
+
+
+static Program bench_prog;
+static size_t bench_argc;
+static const char** bench_argv;
+
+/*
+ * This is the initial task, which runs the selected benchmark as a process.
+ */
+int boot_bench(int argl, void* args)
+{
+	Execute(bench_prog, bench_argc, bench_argv);
+	while( WaitChild(NOPROC, NULL)!=NOPROC ); /* Wait for all children */
+	return 0;
+}
+
+/****************************************************/
+
+void usage(const char* pname)
+{
+	printf("usage:\n  %s <ncores> <benchmark> [<args...>]\n\n  where <benchmark> is one of\n", pname);
+	for(int i=0; BENCHMARKS[i].name; i++)
+		printf("    %s\n", BENCHMARKS[i].help);
+	exit(1);
+}
+
+
+int main(int argc, const char** argv)
+{
+	if(argc<3) usage(argv[0]);
+
+	unsigned int ncores = atoi(argv[1]);
+
+	for(int i=0; BENCHMARKS[i].name; i++)
+		if(strcmp(BENCHMARKS[i].name, argv[2])==0)
+			bench_prog = BENCHMARKS[i].prog;
+	if(bench_prog==NULL) usage(argv[0]);
+
+	bench_argc = argc-2;
+	bench_argv = argv+2;
+
+	boot(ncores, 0, boot_bench, 0, NULL);
+
+	return 0;
+}
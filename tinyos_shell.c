@@ -10,6 +10,7 @@
 
 #include "tinyoslib.h"
 #include "symposium.h"
+#include "bench.h"
 #include "bios.h"
 #include "util.h"
 
@@ -21,6 +22,7 @@ int Repeat(size_t,const char**);
 int Hanoi(size_t,const char**);
 int HelpMessage(size_t,const char**);
 int SystemInfo(size_t,const char**);
+int StreamStats(size_t,const char**);
 int Capitalize(size_t,const char**);
 int LowerCase(size_t,const char**);
 int LineEnum(size_t,const char**);
@@ -30,6 +32,7 @@ int Symposium_proc(size_t,const char**);
 int Symposium_thr(size_t,const char**);
 int RemoteServer(size_t,const char**);
 int RemoteClient(size_t,const char**);
+int RemoteLoad(size_t,const char**);
 int Echo(size_t,const char**);
 
 
@@ -39,6 +42,7 @@ COMMANDS[]  =
 	{"help", HelpMessage, 0, "A help message."},
 	{"ls", ListPrograms, 0, "List available programs programs."},
 	{"sysinfo", SystemInfo, 0, "Print some basic info about the current system."},
+	{"sstat", StreamStats, 0, "sstat [pipes|sockets]: print the traffic and wait statistics of the open pipes and sockets."},
 	{"runterm", RunTerm, 2, "runterm <term> <prog>  <args...> : execute '<prog> <args...>' on terminal <term>."},
 	{"sh", Shell, 0, "Run a shell."},
 	{"repeat", Repeat, 2, "repeat <n> <prog> <args...>: execute '<prog> <args...>' <n> times."},
@@ -51,9 +55,20 @@ COMMANDS[]  =
 	{"symposium", Symposium_proc, 2, "Dining Philosophers(processes): symposium  <philosophers> <bites>"},
 	{"symp_thr", Symposium_thr, 2, "Dining Philosophers(threads): symp_thr  <philosophers> <bites>"},
 	{"hanoi", Hanoi, 1, "The towers of Hanoi."},
-	{"rserver", RemoteServer, 0, "A server for remote execution."},
+	{"rserver", RemoteServer, 0, "A server for remote execution: rserver [<workers>]. With <workers>, a pool of threads serves all connections by polling."},
 	{"rcli", RemoteClient, 1, "Remote client: rcli <cmd> [<args...>]."},
+	{"rload", RemoteLoad, 0, "Load generator for rserver: rload [<clients> [<requests> [<cmd> [<args...>]]]]."},
 	{"echo", Echo, 0, "echo [<args...>], send the <args...> to stdout"},
+	{"pipebench", PipeBench, 0, "pipebench [<minsize> [<maxsize> [<capacity> [<rcvlowat>]]]]: measure pipe throughput over a range of write sizes"},
+	{"relaybench", RelayBench, 0, "relaybench [<minsize> [<maxsize>]]: compare relaying between pipes by copying and by Splice"},
+	{"msgbench", MsgBench, 0, "msgbench [<minsize> [<maxsize> [<capacity>]]]: compare messages per second in stream and message mode pipes"},
+	{"connbench", ConnBench, 0, "connbench [<conns> [<clients> [<reqs>]]]: compare serving connections by one polling thread and by a thread per connection"},
+	{"chanbench", ChanBench, 0, "chanbench [<chans>]: compare making connected socket pairs by Connect/Accept and by SocketPair"},
+	{"pingbench", PingBench, 0, "pingbench [<size> [<conns> [<rounds>]]]: measure socket round trip latency percentiles"},
+	{"streambench", StreamBench, 0, "streambench [<size> [<conns> [<mbytes>]]]: measure socket bulk throughput"},
+	{"setupbench", SetupBench, 0, "setupbench [<size> [<conns> [<count>]]]: measure socket connection setup rate and latency"},
+	{"faninbench", FanInBench, 0, "faninbench [<size> [<conns> [<mbytes>]]]: measure many connections streaming to one polling server"},
+	{"zcbench", ZeroCopyBench, 0, "zcbench [<size> [<count>]]: compare sending large responses over a socket by Write and by SendZeroCopy"},
 
 	{NULL, NULL, 0, NULL}
 };
@@ -203,6 +218,55 @@ int SystemInfo(size_t argc, const char** argv)
 }
 
 
+int StreamStats(size_t argc, const char** argv)
+{
+	static const char* kinds[] = {
+		[STREAMINFO_PIPE] = "pipe",
+		[STREAMINFO_UNBOUND] = "unbound",
+		[STREAMINFO_LISTENER] = "listen",
+		[STREAMINFO_PEER] = "peer",
+		[STREAMINFO_DGRAM] = "dgram"
+	};
+
+	int pipes = 1, sockets = 1;
+	if(argc > 1) {
+		pipes = (strcmp(argv[1], "pipes") == 0);
+		sockets = (strcmp(argv[1], "sockets") == 0);
+		if(!pipes && !sockets) {
+			printf("usage: sstat [pipes|sockets]\n");
+			return 1;
+		}
+	}
+
+	Fid_t fid = OpenKernelStats(KSTAT_STREAMS);
+	if(fid == NOFILE) {
+		printf("sstat: cannot open the statistics\n");
+		return 1;
+	}
+
+	/* Wait times are in microseconds. A listener shows its accept queue as RXQ. */
+	printf("%-7s %5s %5s %4s %10s %10s %8s %8s %10s %10s %6s %6s %6s %6s\n",
+		"KIND", "ID", "PEER", "PORT", "RBYTES", "WBYTES", "READS", "WRITES",
+		"RWAIT", "WWAIT", "RXQ", "TXQ", "RCVBUF", "SNDBUF");
+
+	streaminfo si;
+	while(Read(fid, (char*) &si, sizeof(si)) == sizeof(si)) {
+		if(si.kind == STREAMINFO_PIPE ? !pipes : !sockets) continue;
+		if(si.kind == STREAMINFO_LISTENER) {
+			si.rxqueued = si.pending;
+			si.rcvbuf = si.backlog;
+		}
+		printf("%-7s %5lu %5lu %4d %10lu %10lu %8lu %8lu %10lu %10lu %6u %6u %6u %6u\n",
+			kinds[si.kind], si.id, si.peer, si.port,
+			si.bytes_read, si.bytes_written, si.reads, si.writes,
+			si.read_wait_ns/1000, si.write_wait_ns/1000,
+			si.rxqueued, si.txqueued, si.rcvbuf, si.sndbuf);
+	}
+	Close(fid);
+	return 0;
+}
+
+
 int HelpMessage(size_t argc, const char** argv)
 {
 	printf("This is a simple shell for tinyos.\n\
@@ -401,6 +465,66 @@ int ListPrograms(size_t argc, const char** argv)
 
 #define REMOTE_SERVER_DEFAULT_PORT 20
 
+/*
+  The server serves each connection in one of two modes. By default, 
+  a listener thread accepts the connections, and starts a thread for 
+  each of them. With workers, a fixed pool of worker threads serve all
+  the connections: each worker waits on its own poll set, which holds 
+  the (non-blocking) listener and the connections the worker accepted, 
+  and reads the requests as their data arrives. Once a request is read, 
+  the worker starts its process and moves on; a reaper thread waits for
+  the processes to finish. 
+
+  In the worker mode, each worker logs into its own buffer, a ring of 
+  the last RSRV_LOG_RING records, which it writes without locking. The
+  records are numbered from a shared counter, and the buffers are 
+  merged by number when the log is printed.
+ */
+#define RSRV_MAX_WORKERS 8
+#define RSRV_MAX_REQUEST 2048
+#define RSRV_LOG_RING 256
+#define RSRV_LOG_LINE 80
+/* The poll timeout of a worker, in msec, to notice quitting */
+#define RSRV_TICK 100
+
+/* A log buffer, with a single writer */
+struct rsrv_log
+{
+	unsigned long head;   /* records written so far, published with release */
+	struct rsrv_logrec {
+		size_t num;
+		char message[RSRV_LOG_LINE];
+	} rec[RSRV_LOG_RING];
+};
+
+/* A connection whose request is being read by a worker */
+struct rsrv_conn
+{
+	Fid_t sock;
+	size_t ID;
+	int argl;             /* the request header: the length of args */
+	unsigned int got;     /* the bytes of header and args received so far */
+	char args[RSRV_MAX_REQUEST];
+};
+
+struct rsrv_worker
+{
+	Tid_t tid;
+	Fid_t pset;
+	struct rsrv_conn* conn[MAX_FILEID];   /* the connections, by fid */
+	size_t served;
+	struct rsrv_log log;
+	void* __globals;
+};
+
+/* A running request process, for the reaper */
+struct rsrv_child
+{
+	rlnode node;
+	Pid_t pid;
+	size_t ID;
+};
+
 /*
   The server's "global variables".
  */
@@ -414,6 +538,14 @@ struct __rs_globals
 	Tid_t listener;
 	Fid_t listener_socket;
 
+	/* the worker mode */
+	unsigned int nworkers;
+	struct rsrv_worker* workers;
+	Tid_t reaper;
+	struct rsrv_log* reaper_log;
+	rlnode children;
+	CondVar child_started;
+
 	/* Statistics */
 	size_t active_conn;
 	size_t total_conn;
@@ -439,8 +571,12 @@ static void log_message(void* __globals, const char* msg, ...)
 static void log_init(void* __globals);
 static void log_print(void* __globals);
 static void log_truncate(void* __globals);
+static void wlog_message(void* __globals, struct rsrv_log* log, const char* msg, ...)
+	__attribute__((format(printf,3,4)));
 
 static int rsrv_listener_thread(int port, void* __globals);
+static int rsrv_start_workers(void* __globals);
+static void rsrv_stop_workers(void* __globals);
 
 /* the thread that accepts new connections */
 static int rsrv_listener_thread(int port, void* __globals)
@@ -485,11 +621,18 @@ int RemoteServer(size_t argc, const char** argv)
 	GS(active_conn) = 0;
 	GS(total_conn) = 0;
 	GS(conn_id_counter) = 0;
+	GS(nworkers) = (argc > 1 && atoi(argv[1]) > 0) ? atoi(argv[1]) : 0;
+	if(GS(nworkers) > RSRV_MAX_WORKERS) GS(nworkers) = RSRV_MAX_WORKERS;
 
 	log_init(__globals);
 
-	/* Start a thread to listen on */
-	GS(listener) = CreateThread(rsrv_listener_thread, GS(port), __globals);
+	if(GS(nworkers)) {
+		/* Start the workers and the reaper */
+		if(rsrv_start_workers(__globals) == -1) return -1;
+	} else {
+		/* Start a thread to listen on */
+		GS(listener) = CreateThread(rsrv_listener_thread, GS(port), __globals);
+	}
 	
 	/* Enter the server console */
 	char* linebuff = NULL;
@@ -513,10 +656,14 @@ int RemoteServer(size_t argc, const char** argv)
 
 		if(strcmp(linebuff, "q\n")==0) {
 			/* Quit */
-			GS(quit) = 1;
+			__atomic_store_n(&GS(quit), 1, __ATOMIC_RELEASE);
 			printf("Quitting\n");
-			Close(GS(listener_socket));
-			ThreadJoin(GS(listener), NULL);
+			if(GS(nworkers)) {
+				rsrv_stop_workers(__globals);
+			} else {
+				Close(GS(listener_socket));
+				ThreadJoin(GS(listener), NULL);
+			}
 
 			Mutex_Lock(&GS(mx));
 			while(GS(active_conn)>0) {
@@ -525,6 +672,13 @@ int RemoteServer(size_t argc, const char** argv)
 			}
 			Mutex_Unlock(&GS(mx));
 			
+			if(GS(nworkers)) {
+				/* The reaper quits when there are no processes left */
+				Mutex_Lock(&GS(mx));
+				Cond_Broadcast(&GS(child_started));
+				Mutex_Unlock(&GS(mx));
+				ThreadJoin(GS(reaper), NULL);
+			}
 			
 			log_truncate(__globals);
 			break;
@@ -532,6 +686,8 @@ int RemoteServer(size_t argc, const char** argv)
 			/* Show statistics */
 			printf("Connections: active=%4zd total=%4zd\n", 
 				GS(active_conn), GS(total_conn));
+			for(unsigned int w = 0; w < GS(nworkers); w++)
+				printf("Worker %u: served=%4zd\n", w, GS(workers)[w].served);
 		} else if(strcmp(linebuff, "h\n")==0) {
 			printf("Commands: \n"
 			       "q: quit the server\n"
@@ -577,27 +733,92 @@ static void log_message(void* __globals, const char* msg, ...)
 	/* Append the record */
 	logrec *rec = (logrec*) buffer;
 	Mutex_Lock(& GS(mx));
-	rlnode_new(& rec->node)->num = ++GS(logcount);
+	rlnode_new(& rec->node)->num = __atomic_add_fetch(&GS(logcount), 1, __ATOMIC_RELAXED);
 	rlist_push_back(& GS(log), & rec->node);
 	Mutex_Unlock(& GS(mx));
 }
 
+/* log a message into a log buffer, without locking; only its owner may call this */
+static void wlog_message(void* __globals, struct rsrv_log* log, const char* msg, ...)
+{
+	struct rsrv_logrec* rec = & log->rec[log->head % RSRV_LOG_RING];
+
+	rec->num = __atomic_add_fetch(&GS(logcount), 1, __ATOMIC_RELAXED);
+	va_list ap;
+	va_start (ap, msg);
+	vsnprintf (rec->message, RSRV_LOG_LINE, msg, ap);
+	va_end (ap);
+
+	__atomic_store_n(&log->head, log->head+1, __ATOMIC_RELEASE);
+}
+
 /* init the log */
 static void log_init(void* __globals)
 {
 	rlnode_init(& GS(log), NULL);
 	GS(logcount)=0;
+	GS(workers) = NULL;
+	GS(reaper_log) = NULL;
+}
+
+/* 
+  Copy the records of a log buffer, as its writer goes on. The records
+  that the writer may have overwritten during the copy are dropped.
+ */
+static size_t log_copy(struct rsrv_log* log, struct rsrv_logrec* out)
+{
+	unsigned long head = __atomic_load_n(&log->head, __ATOMIC_ACQUIRE);
+	unsigned long from = (head > RSRV_LOG_RING) ? head - RSRV_LOG_RING : 0;
+	for(unsigned long i = from; i < head; i++)
+		out[i-from] = log->rec[i % RSRV_LOG_RING];
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	unsigned long now = __atomic_load_n(&log->head, __ATOMIC_RELAXED);
+	/* the writer may also be in the middle of record 'now' */
+	unsigned long lost = (now + 1 > from + RSRV_LOG_RING) ? now + 1 - from - RSRV_LOG_RING : 0;
+	if(lost > head - from) lost = head - from;
+	memmove(out, out + lost, (head - from - lost) * sizeof(struct rsrv_logrec));
+	return head - from - lost;
+}
+
+static int logrec_cmp(const void* a, const void* b)
+{
+	size_t x = ((const struct rsrv_logrec*) a)->num, y = ((const struct rsrv_logrec*) b)->num;
+	return (x > y) - (x < y);
 }
 
 /* Print the log to the console */
 static void log_print(void* __globals)
 {
 	Mutex_Lock(& GS(mx));
-	for(rlnode* ptr = GS(log).next; ptr != &GS(log); ptr=ptr->next) {
+	if(GS(nworkers) == 0) {
+		for(rlnode* ptr = GS(log).next; ptr != &GS(log); ptr=ptr->next) {
+			logrec *rec = (logrec*)ptr;
+			printf("%6d: %s\n", rec->node.num, rec->message);
+		}
+		Mutex_Unlock(& GS(mx));
+		return;
+	}
+
+	/* Merge the log buffers of the workers and the reaper, with the shared log */
+	size_t max = rlist_len(& GS(log)) + (GS(nworkers)+1) * RSRV_LOG_RING;
+	struct rsrv_logrec* recs = malloc(max * sizeof(struct rsrv_logrec));
+	size_t n = 0;
+	for(rlnode* ptr = GS(log).next; ptr != &GS(log); ptr=ptr->next, n++) {
 		logrec *rec = (logrec*)ptr;
-		printf("%6d: %s\n", rec->node.num, rec->message);
+		recs[n].num = rec->node.num;
+		snprintf(recs[n].message, RSRV_LOG_LINE, "%s", rec->message);
 	}
 	Mutex_Unlock(& GS(mx));
+
+	for(unsigned int w = 0; w < GS(nworkers); w++)
+		n += log_copy(& GS(workers)[w].log, recs + n);
+	n += log_copy(GS(reaper_log), recs + n);
+
+	qsort(recs, n, sizeof(struct rsrv_logrec), logrec_cmp);
+	for(size_t i = 0; i < n; i++)
+		printf("%6zu: %s\n", recs[i].num, recs[i].message);
+	free(recs);
 }
 
 	
@@ -616,6 +837,13 @@ static void log_truncate(void* __globals)
 		rlnode *rec = rlist_pop_front(&list);
 		free(rec);
 	}
+
+	/* The log buffers of the worker mode */
+	free(GS(workers));
+	free(GS(reaper_log));
+	GS(workers) = NULL;
+	GS(reaper_log) = NULL;
+	GS(nworkers) = 0;
 }
 
 
@@ -642,7 +870,10 @@ static int rsrv_process(size_t argc, const char** argv)
 	assert(sock!=0 && sock!=1);	
 	Dup2(sock, 0);
 	Dup2(sock, 1);
-	Close(sock);
+
+	/* The other streams of the server are not ours */
+	for(Fid_t fid = 2; fid < MAX_FILEID; fid++)
+		Close(fid);
 
 	/* (a) find the command */
 	int c = getprog(2);
@@ -716,6 +947,225 @@ finish:
 	return 0;
 }
 
+/*
+  The worker mode.
+ */
+
+/* Close a connection whose request was not read */
+static void rsrv_conn_abort(struct rsrv_worker* w, struct rsrv_conn* c)
+{
+	void* __globals = w->__globals;
+	wlog_message(__globals, &w->log, "Client[%6zu]: error in receiving request, aborting", c->ID);
+	w->conn[c->sock] = NULL;
+	Close(c->sock);
+	free(c);
+
+	/* A fid was freed, so accept again */
+	PollSetControl(w->pset, GS(listener_socket), POLL_READABLE);
+
+	Mutex_Lock(&GS(mx));
+	GS(active_conn)--;
+	Cond_Broadcast(& GS(conn_done));
+	Mutex_Unlock(&GS(mx));
+}
+
+/* Start the process of a request that was read */
+static void rsrv_conn_execute(struct rsrv_worker* w, struct rsrv_conn* c)
+{
+	void* __globals = w->__globals;
+
+	/* The process gets the connection in blocking mode */
+	w->conn[c->sock] = NULL;
+	PollSetControl(w->pset, c->sock, 0);
+	SetNonBlocking(c->sock, 0);
+
+	size_t argc = argscount(c->argl, c->args);
+	const char* argv[argc+2];
+	argv[0] = "rsrv_process";
+	char sock_value[32];
+	sprintf(sock_value, "%d", c->sock);
+	argv[1] = sock_value;
+	argvunpack(argc, argv+2, c->argl, c->args);
+
+	/* Hold the lock until the child is recorded, for the reaper */
+	struct rsrv_child* child = malloc(sizeof(struct rsrv_child));
+	child->ID = c->ID;
+	Mutex_Lock(&GS(mx));
+	child->pid = Execute(rsrv_process, argc+2, argv);
+	if(child->pid != NOPROC) {
+		rlist_push_back(&GS(children), rlnode_init(&child->node, child));
+		Cond_Signal(&GS(child_started));
+	}
+	Mutex_Unlock(&GS(mx));
+	Close(c->sock);
+	PollSetControl(w->pset, GS(listener_socket), POLL_READABLE);
+
+	if(child->pid == NOPROC) {
+		free(child);
+		wlog_message(__globals, &w->log, "Client[%6zu]: cannot start a process", c->ID);
+		Mutex_Lock(&GS(mx));
+		GS(active_conn)--;
+		Cond_Broadcast(& GS(conn_done));
+		Mutex_Unlock(&GS(mx));
+	} else
+		w->served++;
+	free(c);
+}
+
+/* Read what has arrived of a request. The protocol is that of rsrv_client. */
+static void rsrv_conn_read(struct rsrv_worker* w, struct rsrv_conn* c)
+{
+	const unsigned int hdr = sizeof(c->argl);
+	while(1) {
+		char* dst = (c->got < hdr) ? (char*)&c->argl + c->got : c->args + (c->got - hdr);
+		unsigned int want = (c->got < hdr) ? hdr - c->got : hdr + c->argl - c->got;
+
+		int rc = Read(c->sock, dst, want);
+		if(rc == WOULD_BLOCK) return;
+		if(rc <= 0) {
+			rsrv_conn_abort(w, c);
+			return;
+		}
+		c->got += rc;
+
+		if(c->got == hdr && (c->argl <= 0 || c->argl > RSRV_MAX_REQUEST)) {
+			rsrv_conn_abort(w, c);
+			return;
+		}
+		if(c->got == hdr + c->argl) {
+			rsrv_conn_execute(w, c);
+			return;
+		}
+	}
+}
+
+/* Accept the pending connections */
+static void rsrv_accept(struct rsrv_worker* w)
+{
+	void* __globals = w->__globals;
+	Fid_t sock[MAX_FILEID];
+	int n = AcceptMany(GS(listener_socket), sock, MAX_FILEID);
+
+	/* Out of fids: stop accepting, until the next tick */
+	if(n == -1) PollSetControl(w->pset, GS(listener_socket), 0);
+
+	for(int i = 0; i < n; i++) {
+		struct rsrv_conn* c = malloc(sizeof(struct rsrv_conn));
+		c->sock = sock[i];
+		c->ID = __atomic_add_fetch(&GS(conn_id_counter), 1, __ATOMIC_RELAXED);
+		c->argl = 0;
+		c->got = 0;
+		w->conn[c->sock] = c;
+
+		Mutex_Lock(&GS(mx));
+		GS(active_conn)++;
+		GS(total_conn)++;
+		Mutex_Unlock(&GS(mx));
+
+		wlog_message(__globals, &w->log, "Client[%6zu]: started", c->ID);
+		SetNonBlocking(c->sock, 1);
+		PollSetControl(w->pset, c->sock, POLL_READABLE);
+	}
+}
+
+/* A worker thread */
+static int rsrv_worker_thread(int argl, void* args)
+{
+	struct rsrv_worker* w = args;
+	void* __globals = w->__globals;
+	pollfd ready[MAX_FILEID];
+
+	while(! __atomic_load_n(&GS(quit), __ATOMIC_ACQUIRE)) {
+		int n = PollSetWait(w->pset, ready, MAX_FILEID, RSRV_TICK);
+		if(n == 0) PollSetControl(w->pset, GS(listener_socket), POLL_READABLE);
+
+		for(int i = 0; i < n; i++) {
+			Fid_t fd = ready[i].fd;
+			if(fd == GS(listener_socket))
+				rsrv_accept(w);
+			else if(w->conn[fd])
+				rsrv_conn_read(w, w->conn[fd]);
+		}
+	}
+
+	/* Drop the requests that were not read */
+	for(Fid_t fd = 0; fd < MAX_FILEID; fd++)
+		if(w->conn[fd]) rsrv_conn_abort(w, w->conn[fd]);
+	return 0;
+}
+
+/* The reaper thread waits for the processes of the requests */
+static int rsrv_reaper_thread(int argl, void* __globals)
+{
+	while(1) {
+		Mutex_Lock(&GS(mx));
+		while(is_rlist_empty(&GS(children)) && ! GS(quit))
+			Cond_Wait(&GS(mx), &GS(child_started));
+		int done = is_rlist_empty(&GS(children));
+		Mutex_Unlock(&GS(mx));
+		if(done) return 0;
+
+		int exitstatus;
+		Pid_t pid = WaitChild(NOPROC, &exitstatus);
+
+		struct rsrv_child* child = NULL;
+		Mutex_Lock(&GS(mx));
+		for(rlnode* ptr = GS(children).next; ptr != &GS(children); ptr = ptr->next)
+			if(((struct rsrv_child*) ptr->obj)->pid == pid) {
+				child = ptr->obj;
+				rlist_remove(ptr);
+				break;
+			}
+		GS(active_conn)--;
+		Cond_Broadcast(& GS(conn_done));
+		Mutex_Unlock(&GS(mx));
+
+		if(child) {
+			wlog_message(__globals, GS(reaper_log), "Client[%6zu]: finished with status %d",
+				child->ID, exitstatus);
+			free(child);
+		}
+	}
+}
+
+static int rsrv_start_workers(void* __globals)
+{
+	Fid_t lsock = Socket(GS(port));
+	if(Listen(lsock) == -1) {
+		printf("Cannot listen to the given port: %d\n", GS(port));
+		Close(lsock);
+		return -1;
+	}
+	SetNonBlocking(lsock, 1);
+	GS(listener_socket) = lsock;
+
+	rlnode_new(&GS(children));
+	GS(child_started) = COND_INIT;
+	GS(reaper_log) = calloc(1, sizeof(struct rsrv_log));
+	GS(reaper) = CreateThread(rsrv_reaper_thread, 0, __globals);
+
+	GS(workers) = calloc(GS(nworkers), sizeof(struct rsrv_worker));
+	for(unsigned int i = 0; i < GS(nworkers); i++) {
+		struct rsrv_worker* w = & GS(workers)[i];
+		w->__globals = __globals;
+		w->pset = OpenPollSet();
+		PollSetControl(w->pset, lsock, POLL_READABLE);
+		w->tid = CreateThread(rsrv_worker_thread, i, w);
+	}
+	return 0;
+}
+
+static void rsrv_stop_workers(void* __globals)
+{
+	for(unsigned int i = 0; i < GS(nworkers); i++) {
+		ThreadJoin(GS(workers)[i].tid, NULL);
+		Close(GS(workers)[i].pset);
+	}
+	Close(GS(listener_socket));
+}
+
+
+
 /*********************
    the client program
 ************************/
@@ -773,6 +1223,113 @@ int RemoteClient(size_t argc, const char** argv)
 
 
 
+/*
+  The load generator. Client threads make requests to the remote server,
+  one after the other, each on a new connection, and time them from
+  Connect to the end of the output.
+ */
+#define RLOAD_TIMEOUT 1000000
+#define RLOAD_RETRIES 100
+
+struct rload_client {
+	unsigned int requests;
+	int argl;
+	const char* args;
+	uint64_t* samples;
+	unsigned int failed;
+};
+
+static int rload_write(Fid_t sock, const void* buf, size_t len)
+{
+	for(size_t count = 0; count < len; ) {
+		int rc = Write(sock, buf+count, len-count);
+		if(rc<1) return 0;
+		count += rc;
+	}
+	return 1;
+}
+
+static int rload_request(struct rload_client* rc)
+{
+	Fid_t sock = Socket(NOPORT);
+	if(sock == NOFILE) return 0;
+
+	int retries = 0, ok = 1;
+	while(Connect(sock, REMOTE_SERVER_DEFAULT_PORT, RLOAD_TIMEOUT) == -1)
+		if(++retries == RLOAD_RETRIES) { ok = 0; break; }
+
+	ok = ok && rload_write(sock, &rc->argl, sizeof(rc->argl))
+		&& rload_write(sock, rc->args, rc->argl);
+	if(ok) {
+		ShutDown(sock, SHUTDOWN_WRITE);
+		char buf[256];
+		int n;
+		while((n = Read(sock, buf, sizeof(buf))) > 0);
+		ok = (n == 0);
+	}
+	Close(sock);
+	return ok;
+}
+
+static int rload_client_thread(int argl, void* args)
+{
+	struct rload_client* rc = args;
+	for(unsigned int r = 0; r < rc->requests; r++) {
+		uint64_t start = bios_clock_ns();
+		if(! rload_request(rc)) rc->failed++;
+		rc->samples[r] = bios_clock_ns() - start;
+	}
+	return 0;
+}
+
+static int rload_cmp(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+	return (x > y) - (x < y);
+}
+
+int RemoteLoad(size_t argc, const char** argv)
+{
+	unsigned int clients = (argc > 1 && atoi(argv[1]) > 0) ? atoi(argv[1]) : 4;
+	unsigned int requests = (argc > 2 && atoi(argv[2]) > 0) ? atoi(argv[2]) : 100;
+	if(clients > MAX_FILEID-3) clients = MAX_FILEID-3;
+
+	/* The command, by default 'echo hello' */
+	static const char* dflt[] = { "echo", "hello" };
+	size_t cargc = (argc > 3) ? argc-3 : 2;
+	const char** cargv = (argc > 3) ? argv+3 : dflt;
+	int cargl = argvlen(cargc, cargv);
+	char cargs[cargl];
+	argvpack(cargs, cargc, cargv);
+
+	struct rload_client rc[clients];
+	Tid_t tid[clients];
+	uint64_t* samples = malloc((size_t) clients * requests * sizeof(uint64_t));
+
+	uint64_t start = bios_clock_ns();
+	for(unsigned int c = 0; c < clients; c++) {
+		rc[c] = (struct rload_client) { requests, cargl, cargs, samples + (size_t) c * requests, 0 };
+		tid[c] = CreateThread(rload_client_thread, 0, &rc[c]);
+	}
+	unsigned int failed = 0;
+	for(unsigned int c = 0; c < clients; c++) {
+		ThreadJoin(tid[c], NULL);
+		failed += rc[c].failed;
+	}
+	uint64_t elapsed = bios_clock_ns() - start;
+
+	size_t n = (size_t) clients * requests;
+	qsort(samples, n, sizeof(uint64_t), rload_cmp);
+	double reqps = (elapsed > 0) ? (double) n * 1e9 / (double) elapsed : 0.0;
+	printf("rload clients=%u reqs=%zu failed=%u ns=%llu reqps=%.0f p50=%llu p99=%llu max=%llu\n",
+		clients, n, failed, (unsigned long long) elapsed, reqps,
+		(unsigned long long) samples[n/2], (unsigned long long) samples[(n*99)/100],
+		(unsigned long long) samples[n-1]);
+	free(samples);
+	return failed ? 1 : 0;
+}
+
+
 /*************************************
 
 	A very simple shell for tinyos 
@@ -662,6 +662,57 @@ BOOT_TEST(test_read_kbd_big,
 }
 
 
+BOOT_TEST(test_read_kbd_nonblocking,
+	"Test that a non-blocking read from the keyboard returns WOULD_BLOCK when there is no input.",
+	.minimum_terminals = 1
+	)
+{
+	Fid_t fterm = OpenTerminal(0);
+	ASSERT(fterm!=NOFILE);
+	ASSERT(SetNonBlocking(fterm, 1)==0);
+
+	char buffer[6] = {0};
+	ASSERT(Read(fterm, buffer, 5)==WOULD_BLOCK);
+
+	sendme(0, "Hello");
+	int rc, count = 0;
+	while(count < 5) {
+		rc = Read(fterm, buffer+count, 5-count);
+		ASSERT(rc > 0 || rc == WOULD_BLOCK);
+		if(rc > 0) count += rc;
+	}
+	ASSERT(strcmp(buffer, "Hello")==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_poll_kbd,
+	"Test that Poll waits for keyboard input, and that the input is then read in order.",
+	.minimum_terminals = 1
+	)
+{
+	Fid_t fterm = OpenTerminal(0);
+	ASSERT(fterm!=NOFILE);
+
+	pollfd p = { .fd = fterm, .events = POLL_READABLE };
+	ASSERT(Poll(&p, 1, 0)==0);
+
+	sendme(0, "Hello");
+	ASSERT(Poll(&p, 1, POLL_FOREVER)==1);
+	ASSERT(p.revents==POLL_READABLE);
+
+	char buffer[6] = {0};
+	int count = 0;
+	while(count < 5) {
+		int rc = Read(fterm, buffer+count, 5-count);
+		ASSERT(rc > 0);
+		count += rc;
+	}
+	ASSERT(strcmp(buffer, "Hello")==0);
+	return 0;
+}
+
+
 BOOT_TEST(test_dup2_copies_file,
 	"This test copies that Dup2 copies the file to another file descriptor.",
 	.minimum_terminals = 1
@@ -784,6 +835,120 @@ BOOT_TEST(test_null_device,
 }
 
 
+BOOT_TEST(test_released_objects_are_reused,
+	"Test that PCBs and FCBs are reused after they are released, many times over."
+	)
+{
+	for(int i=0; i<MAX_PROC+16; i++) {
+		Pid_t pid = Exec(void_child, 0, NULL);
+		ASSERT(pid!=NOPROC);
+		ASSERT(WaitChild(pid, NULL)==pid);
+	}
+
+	for(int i=0; i<3*MAX_PROC; i++) {
+		pipe_t p;
+		ASSERT(Pipe(&p)==0);
+		ASSERT(Close(p.read)==0);
+		ASSERT(Close(p.write)==0);
+	}
+	return 0;
+}
+
+
+BOOT_TEST(test_kernel_stats,
+	"Test that OpenKernelStats returns a stream of fixed-size records."
+	)
+{
+	ASSERT(OpenKernelStats(KSTAT_MAX)==NOFILE);
+	ASSERT(OpenKernelStats(-1)==NOFILE);
+
+	Fid_t fid = OpenKernelStats(KSTAT_LOCKS);
+	ASSERT(fid!=NOFILE);
+
+	lockinfo info;
+	int rc;
+	while((rc = Read(fid, (char*)&info, sizeof(info))) > 0) {
+		ASSERT(rc == sizeof(info));
+		ASSERT(info.contended <= info.acquisitions);
+	}
+	ASSERT(rc == 0);
+	ASSERT(Write(fid, (char*)&info, sizeof(info)) == -1);
+	ASSERT(Close(fid)==0);
+
+	/* The scheduler statistics are a single record */
+	schedinfo si;
+	fid = OpenKernelStats(KSTAT_SCHED);
+	ASSERT(fid!=NOFILE);
+	ASSERT(Read(fid, (char*)&si, sizeof(si)) == sizeof(si));
+	ASSERT(si.yields > 0);
+	ASSERT(si.pi_restores <= si.pi_boosts);
+	ASSERT(Read(fid, (char*)&si, sizeof(si)) == 0);
+	ASSERT(Close(fid)==0);
+
+	return 0;
+}
+
+
+static void get_schedinfo(schedinfo* si)
+{
+	Fid_t fid = OpenKernelStats(KSTAT_SCHED);
+	ASSERT(fid!=NOFILE);
+	ASSERT(Read(fid, (char*)si, sizeof(schedinfo))==sizeof(schedinfo));
+	Close(fid);
+}
+
+static Mutex pi_mutex = MUTEX_INIT;
+static int pi_held, pi_waiting;
+static schedinfo pi_base, pi_during;
+
+/* Sink to a low priority, then hold the mutex until it is inherited */
+static int pi_low_owner(int argl, void* args)
+{
+	uint64_t t = bios_clock_ns();
+	while(bios_clock_ns() - t < 300000000ull);
+
+	Mutex_Lock(&pi_mutex);
+	__atomic_store_n(&pi_held, 1, __ATOMIC_SEQ_CST);
+	while(! __atomic_load_n(&pi_waiting, __ATOMIC_SEQ_CST));
+
+	t = bios_clock_ns();
+	do get_schedinfo(&pi_during);
+	while(pi_during.pi_boosts == pi_base.pi_boosts && bios_clock_ns() - t < 5000000000ull);
+	Mutex_Unlock(&pi_mutex);
+	return 0;
+}
+
+BOOT_TEST(test_priority_inheritance,
+	"Test that the owner of a mutex inherits the priority of a waiter, and drops it at unlock."
+	)
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	schedinfo after;
+
+	Tid_t t = CreateThread(pi_low_owner, 0, NULL);
+
+	/* Sleep, keeping a high priority, until the owner holds the mutex */
+	Mutex_Lock(&mx);
+	while(! __atomic_load_n(&pi_held, __ATOMIC_SEQ_CST))
+		Cond_TimedWait(&mx, &cv, 10);
+	Mutex_Unlock(&mx);
+
+	get_schedinfo(&pi_base);
+	__atomic_store_n(&pi_waiting, 1, __ATOMIC_SEQ_CST);
+	Mutex_Lock(&pi_mutex);
+	Mutex_Unlock(&pi_mutex);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	get_schedinfo(&after);
+
+	/* A boost is counted only when a lower owner takes the waiter's priority.
+	   It is dropped at unlock, or earlier if the owner yields. */
+	ASSERT(pi_during.pi_boosts > pi_base.pi_boosts);
+	ASSERT(after.pi_restores - pi_base.pi_restores >= pi_during.pi_boosts - pi_base.pi_boosts);
+	return 0;
+}
+
+
 
 /***********************************************************************************8
 *************************************************/
@@ -921,6 +1086,9 @@ TEST_SUITE(basic_tests,
 	&test_cond_timedwait_signal,
 	&test_cond_timedwait_broadcast,
 	&test_null_device,
+	&test_kernel_stats,
+	&test_priority_inheritance,
+	&test_released_objects_are_reused,
 	&test_get_terminals,
 	&test_open_terminals,
 	&test_dup2_error_on_nonfile,
@@ -931,6 +1099,8 @@ TEST_SUITE(basic_tests,
 	&test_close_terminals,
 	&test_read_kbd,
 	&test_read_kbd_big,
+	&test_read_kbd_nonblocking,
+	&test_poll_kbd,
 	&test_read_error_on_bad_fid,
 	&test_read_from_many_terminals,
 	&test_write_con,
@@ -1632,214 +1802,1248 @@ BOOT_TEST(test_pipe_multi_producer,
 }
 
 
-TEST_SUITE(pipe_tests,
-	"A suite of tests for pipes. We are focusing on correctness, not performance."
+BOOT_TEST(test_pipe_data_wraps_around,
+	"Test that data is read from the pipe in the order it was written, as the buffer wraps around."
 	)
 {
-	&test_pipe_open,
-	&test_pipe_fails_on_exhausted_fid,
-	&test_pipe_close_reader,
-	&test_pipe_close_writer,
-	&test_pipe_single_producer,
-	&test_pipe_multi_producer,
-	NULL
-};
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
 
+	char wbuf[5000], rbuf[5000];
+	unsigned char next_w = 0, next_r = 0;
 
+	for(int round=0; round<10; round++) {
+		for(int i=0; i<5000; i++) wbuf[i] = next_w++;
+		ASSERT(Write(pipe.write, wbuf, 5000)==5000);
 
+		int got = 0;
+		while(got < 5000) {
+			int n = (5000-got < 777) ? 5000-got : 777;
+			ASSERT(Read(pipe.read, rbuf+got, n)==n);
+			got += n;
+		}
+		for(int i=0; i<5000; i++)
+			ASSERT((unsigned char)rbuf[i] == next_r++);
+	}
 
-/*********************************************
- *
- *
- *
- *  Socket tests
- *
- *
- *
- *********************************************/
+	Close(pipe.write);
+	ASSERT(Read(pipe.read, rbuf, 1)==0);
+	Close(pipe.read);
+	return 0;
+}
 
-struct connect_sockets
-{
-	Fid_t sock1, lsock, *sock2;
-	port_t port;
-};
 
-static int connect_sockets_connect_process(int argl, void* args) {
-	struct connect_sockets* A = args;
-	ASSERT(Connect(A->sock1, A->port, 1000)==0);
+static int sequence_writer(int argl, void* args)
+{
+	Fid_t fid = *(Fid_t*)args;
+	char buf[1000];
+	unsigned char next = 0;
+	for(int i=0; i<4000; i++) {
+		unsigned int n = 1 + (i*37) % sizeof(buf);
+		for(unsigned int j=0; j<n; j++) buf[j] = next++;
+		for(unsigned int done=0; done<n; ) {
+			int rc = Write(fid, buf+done, n-done);
+			ASSERT(rc > 0);
+			done += rc;
+		}
+	}
+	Close(fid);
 	return 0;
 }
 
-void connect_sockets(Fid_t sock1, Fid_t lsock, Fid_t* sock2, port_t port)
+BOOT_TEST(test_pipe_concurrent_order,
+	"Test that a reader and a writer thread running concurrently see the data in order."
+	)
 {
-	struct connect_sockets A = { 
-		.sock1=sock1, .lsock=lsock, .sock2=sock2, .port=port
-	};
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
 
-	/* Spawn a child to connect sock1 to port (where lsock must be listening) */
-	Pid_t pid = Exec(connect_sockets_connect_process, sizeof(A), &A);
-	ASSERT(pid != NOPROC);
+	Tid_t t = CreateThread(sequence_writer, sizeof(Fid_t), &pipe.write);
 
-	/* accept the child's connection here */
-	*sock2 = Accept(lsock);
-	ASSERT(*sock2 != NOFILE);
+	char buf[777];
+	unsigned char next = 0;
+	int rc;
+	while((rc = Read(pipe.read, buf, sizeof(buf))) > 0)
+		for(int i=0; i<rc; i++)
+			ASSERT((unsigned char)buf[i] == next++);
+	ASSERT(rc == 0);
 
-	/* Clean up child */
-	ASSERT(WaitChild(pid, NULL)==pid);
+	ThreadJoin(t, NULL);
+	Close(pipe.read);
+	return 0;
 }
 
 
-void check_transfer(Fid_t from, Fid_t to)
+BOOT_TEST(test_pipe_capacity,
+	"Test that PipeEx and SetStreamOption control the capacity of a pipe."
+	)
 {
-	char buffer[12] = {[0]=0};
-	int rc;
-	ASSERT((rc=Write(from,"Hello world", 12))==12);
-	ASSERT((rc=Read(to, buffer, 12))==12);
-	ASSERT((rc=strcmp("Hello world", buffer))==0);
+	pipe_t pipe;
+	static char buffer[4096];
+
+	ASSERT(PipeEx(&pipe, PIPE_MAX_CAPACITY+1)==-1);
+
+	ASSERT(Pipe(&pipe)==0);
+	int cap = GetStreamOption(pipe.read, STREAM_RCVBUF);
+	ASSERT(cap >= 4096 && cap <= 16384);
+	Close(pipe.read); Close(pipe.write);
+
+	/* Capacities are rounded up */
+	ASSERT(PipeEx(&pipe, 1000)==0);
+	ASSERT(GetStreamOption(pipe.read, STREAM_RCVBUF)==1024);
+	ASSERT(GetStreamOption(pipe.write, STREAM_SNDBUF)==1024);
+	ASSERT(Write(pipe.write, buffer, 2000)==1024);
+
+	/* Buffered data is never dropped */
+	ASSERT(SetStreamOption(pipe.write, STREAM_SNDBUF, 100)==0);
+	ASSERT(GetStreamOption(pipe.read, STREAM_RCVBUF)==1024);
+	ASSERT(SetStreamOption(pipe.write, STREAM_SNDBUF, 4000)==0);
+	ASSERT(GetStreamOption(pipe.read, STREAM_RCVBUF)==4096);
+	ASSERT(Write(pipe.write, buffer, 4096)==3072);
+	ASSERT(Read(pipe.read, buffer, 4096)==4096);
+
+	ASSERT(SetStreamOption(pipe.read, STREAM_RCVBUF, 100)==0);
+	ASSERT(GetStreamOption(pipe.read, STREAM_RCVBUF)==PIPE_MIN_CAPACITY);
+	ASSERT(SetStreamOption(pipe.read, STREAM_RCVBUF, PIPE_MAX_CAPACITY+1)==-1);
+	Close(pipe.read); Close(pipe.write);
+
+	/* Other streams have no buffer options */
+	Fid_t fid = OpenNull();
+	ASSERT(GetStreamOption(fid, STREAM_RCVBUF)==-1);
+	ASSERT(SetStreamOption(fid, STREAM_RCVBUF, 1024)==-1);
+	ASSERT(GetStreamOption(MAX_FILEID, STREAM_RCVBUF)==-1);
+	Close(fid);
+
+	return 0;
 }
 
 
-BOOT_TEST(test_socket_constructor_many_per_port,
-	"Test that Socket succeeds opening many sockets on the same port"
-	)
+static int trickle_writer(int argl, void* args)
 {
-	for(Fid_t f=0; f<MAX_FILEID; f++) {
-		ASSERT(Socket(100)!=NOFILE);
-	}
+	Fid_t fid = *(Fid_t*)args;
+	for(int i=0; i<30; i++)
+		ASSERT(Write(fid, "0123456789", 10)==10);
+	Close(fid);
 	return 0;
 }
 
-BOOT_TEST(test_socket_constructor_out_of_fids,
-	"Test that the socket constructor fails on running out of Fids"
+BOOT_TEST(test_pipe_watermarks,
+	"Test that a reader blocks until the receive watermark is reached, and the watermark defaults and limits."
 	)
 {
-	for(int i=0;i<MAX_FILEID;i++)
-		ASSERT(Socket(100)!=NOFILE);
-	for(int i=0;i<MAX_FILEID;i++)
-		ASSERT(Socket(100)==NOFILE);	
+	pipe_t pipe;
+	char buffer[300];
+
+	ASSERT(PipeEx(&pipe, 1024)==0);
+	ASSERT(GetStreamOption(pipe.read, STREAM_RCVLOWAT)==1);
+	ASSERT(GetStreamOption(pipe.write, STREAM_SNDLOWAT)==256);
+	ASSERT(SetStreamOption(pipe.write, STREAM_SNDLOWAT, 100000)==0);
+	ASSERT(GetStreamOption(pipe.write, STREAM_SNDLOWAT)==512);
+	ASSERT(SetStreamOption(pipe.write, STREAM_SNDLOWAT, 0)==0);
+	ASSERT(GetStreamOption(pipe.write, STREAM_SNDLOWAT)==256);
+
+	ASSERT(SetStreamOption(pipe.read, STREAM_RCVLOWAT, 100)==0);
+	ASSERT(GetStreamOption(pipe.read, STREAM_RCVLOWAT)==100);
+
+	Tid_t t = CreateThread(trickle_writer, sizeof(Fid_t), &pipe.write);
+
+	/* Every read but the last gets at least the watermark */
+	int rc, total = 0;
+	while((rc = Read(pipe.read, buffer, sizeof(buffer))) > 0) {
+		total += rc;
+		ASSERT(rc >= 100 || total == 300);
+	}
+	ASSERT(rc == 0 && total == 300);
+
+	ThreadJoin(t, NULL);
+	Close(pipe.read);
 	return 0;
 }
 
-BOOT_TEST(test_socket_constructor_illegal_port,
-	"Test that the socket constructor fails on illegal port"
-	)
-{
-	ASSERT(Socket(NOPORT)!=NOFILE);
-	ASSERT(Socket(1)!=NOFILE);
-	ASSERT(Socket(MAX_PORT)!=NOFILE);
 
-	ASSERT(Socket(NOPORT-1)==NOFILE);
-	ASSERT(Socket(MAX_PORT+1)==NOFILE);	
-	ASSERT(Socket(MAX_PORT+10)==NOFILE);
-	return 0;	
+static void get_pipeinfo(pipeinfo* pi)
+{
+	Fid_t fid = OpenKernelStats(KSTAT_PIPES);
+	ASSERT(fid!=NOFILE);
+	ASSERT(Read(fid, (char*)pi, sizeof(pipeinfo))==sizeof(pipeinfo));
+	Close(fid);
 }
 
-BOOT_TEST(test_listen_success,
-	"Test that Listen succeeds on an unbound socket"
-	)
+static int autotune_writer(int argl, void* args)
 {
-	ASSERT(Listen(Socket(100))==0);
+	static char buffer[16384];
+	Fid_t fid = *(Fid_t*)args;
+	for(int i=0; i<64; i++)
+		ASSERT(Write(fid, buffer, sizeof(buffer))>0);
+	Close(fid);
 	return 0;
 }
 
-BOOT_TEST(test_listen_fails_on_bad_fid,
-	"Test that Listen fails on an invalid fid"
+BOOT_TEST(test_pipe_autotune,
+	"Test that an auto-tuned pipe grows under backpressure and shrinks when idle."
 	)
 {
-	ASSERT(Listen(7)==-1);
-	ASSERT(Listen(OpenNull())==-1);
-	ASSERT(Listen(NOFILE)==-1);
-	ASSERT(Listen(MAX_FILEID)==-1);	
+	pipe_t pipe;
+	pipeinfo before, after;
+	char buffer[64];
+
+	get_pipeinfo(&before);
+	ASSERT(PipeEx(&pipe, PIPE_AUTO)==0);
+	int cap0 = GetStreamOption(pipe.read, STREAM_RCVBUF);
+
+	/* A slow reader makes the writer stall */
+	Tid_t t = CreateThread(autotune_writer, sizeof(Fid_t), &pipe.write);
+	int rc;
+	while((rc = Read(pipe.read, buffer, sizeof(buffer))) > 0);
+	ASSERT(rc==0);
+	ThreadJoin(t, NULL);
+
+	int cap1 = GetStreamOption(pipe.read, STREAM_RCVBUF);
+	ASSERT(cap1 > cap0);
+	get_pipeinfo(&after);
+	ASSERT(after.grows > before.grows);
+	ASSERT(after.created == before.created+1);
+	ASSERT(after.live == before.live+1);
+	Close(pipe.read);
+
+	/* A pipe that stays nearly empty shrinks */
+	ASSERT(PipeEx(&pipe, 16384)==0);
+	ASSERT(SetStreamOption(pipe.write, STREAM_SNDBUF, PIPE_AUTO)==0);
+	for(int i=0; i<2048; i++) {
+		ASSERT(Write(pipe.write, buffer, 10)==10);
+		ASSERT(Read(pipe.read, buffer, 10)==10);
+	}
+	ASSERT(GetStreamOption(pipe.read, STREAM_RCVBUF) < 16384);
+	get_pipeinfo(&before);
+	ASSERT(before.shrinks > after.shrinks);
+	Close(pipe.read); Close(pipe.write);
+
+	get_pipeinfo(&after);
+	ASSERT(after.live == before.live-1);
+
 	return 0;
 }
 
-BOOT_TEST(test_listen_fails_on_NOPORT,
-	"Test that Listen fails on a socket defined on NOPORT"
-	)
+
+/* Find the statistics of a kernel memory pool */
+static int get_slabinfo(const char* name, slabinfo* si)
 {
-	ASSERT(Listen(Socket(NOPORT))==-1);
-	return 0;
+	Fid_t fid = OpenKernelStats(KSTAT_SLABS);
+	ASSERT(fid!=NOFILE);
+	int found = 0;
+	while(!found && Read(fid, (char*)si, sizeof(slabinfo))==sizeof(slabinfo))
+		found = (strcmp(si->name, name)==0);
+	Close(fid);
+	return found;
 }
 
-BOOT_TEST(test_listen_fails_on_occupied_port,
-	"Test that Listen fails on an occupied port"
+BOOT_TEST(test_pipe_buffer_pool,
+	"Test that a pipe holds a buffer from the pool only while it holds data."
 	)
 {
-	Fid_t f = Socket(100);
-	ASSERT(Listen(f)==0);
-	ASSERT(Listen(Socket(100))==-1);
-	Close(f);
-	ASSERT(Listen(Socket(100))==0);	
+	pipe_t pipe;
+	pipeinfo before, after;
+	slabinfo sbefore, safter;
+	char buffer[100];
+
+	get_pipeinfo(&before);
+	ASSERT(PipeEx(&pipe, 4096)==0);
+	get_pipeinfo(&after);
+	ASSERT(after.buffered == before.buffered);
+
+	/* The first write takes a buffer */
+	ASSERT(Write(pipe.write, buffer, 100)==100);
+	ASSERT(Write(pipe.write, buffer, 100)==100);
+	get_pipeinfo(&after);
+	ASSERT(after.buffered == before.buffered + 4096);
+	ASSERT(get_slabinfo("buffer-4k", &sbefore));
+	ASSERT(sbefore.objsize == 4096 && sbefore.inuse > 0 && sbefore.slabs > 0);
+
+	/* A read that leaves data keeps it, and a read that drains the pipe returns it */
+	ASSERT(Read(pipe.read, buffer, 50)==50);
+	get_pipeinfo(&after);
+	ASSERT(after.buffered == before.buffered + 4096);
+	ASSERT(Read(pipe.read, buffer, 100)==100);
+	ASSERT(Read(pipe.read, buffer, 100)==50);
+	get_pipeinfo(&after);
+	ASSERT(after.buffered == before.buffered);
+	ASSERT(get_slabinfo("buffer-4k", &safter));
+	ASSERT(safter.inuse == sbefore.inuse-1);
+	ASSERT(safter.frees == sbefore.frees+1);
+
+	/* Capacities past the slab caches come from the large pool */
+	ASSERT(SetStreamOption(pipe.write, STREAM_SNDBUF, 65536)==0);
+	ASSERT(Write(pipe.write, buffer, 100)==100);
+	ASSERT(get_slabinfo("buffer-large", &sbefore));
+	ASSERT(sbefore.inuse > 0 && sbefore.memory >= 65536);
+	get_pipeinfo(&after);
+	ASSERT(after.buffered == before.buffered + 65536);
+
+	/* Closing the pipe returns the buffer */
+	Close(pipe.read); Close(pipe.write);
+	ASSERT(get_slabinfo("buffer-large", &safter));
+	ASSERT(safter.frees == sbefore.frees+1);
+	get_pipeinfo(&after);
+	ASSERT(after.buffered == before.buffered);
+
 	return 0;
 }
 
-BOOT_TEST(test_listen_fails_on_initialized_socket,
-	"Test that Listen fails on a socket that has been previously initialized by Listen"
+
+BOOT_TEST(test_pipe_splice,
+	"Test that Splice moves data between pipes in order, and its error cases."
 	)
 {
-	Fid_t lsock = Socket(100);
-	ASSERT(Listen(lsock)==0);	
-	ASSERT(Listen(lsock)==-1);	
-	Fid_t sock[2];
-	sock[0] = Socket(200);
-	connect_sockets(sock[0], lsock, sock+1, 100);
-	ASSERT(Listen(sock[0])==-1);
-	ASSERT(Listen(sock[1])==-1);
+	pipe_t p1, p2;
+	pipeinfo before, after;
+	char buf[8192];
+	unsigned char next_w = 0, next_r = 0;
+
+	ASSERT(Pipe(&p1)==0);
+	ASSERT(Pipe(&p2)==0);
+
+	/* Illegal streams */
+	Fid_t null = OpenNull();
+	ASSERT(Splice(null, p2.write, 10)==-1);
+	ASSERT(Splice(p1.read, null, 10)==-1);
+	ASSERT(Splice(p1.write, p2.write, 10)==-1);
+	ASSERT(Splice(p1.read, p2.read, 10)==-1);
+	ASSERT(Splice(p1.read, p1.write, 10)==-1);
+	ASSERT(Splice(MAX_FILEID, p2.write, 10)==-1);
+	Close(null);
+
+	/* The whole buffer moves into an empty pipe of the same capacity */
+	get_pipeinfo(&before);
+	for(int i=0; i<5000; i++) buf[i] = next_w++;
+	ASSERT(Write(p1.write, buf, 5000)==5000);
+	ASSERT(Splice(p1.read, p2.write, 8192)==5000);
+	get_pipeinfo(&after);
+	ASSERT(after.swaps == before.swaps+1);
+	ASSERT(after.spliced == before.spliced+5000);
+
+	/* Partial moves are copied */
+	for(int i=0; i<3000; i++) buf[i] = next_w++;
+	ASSERT(Write(p1.write, buf, 3000)==3000);
+	ASSERT(Splice(p1.read, p2.write, 1000)==1000);
+	ASSERT(Splice(p1.read, p2.write, 8192)==2000);
+
+	int rc, got = 0;
+	while(got < 8000) {
+		ASSERT((rc = Read(p2.read, buf, sizeof(buf))) > 0);
+		for(int i=0; i<rc; i++)
+			ASSERT((unsigned char)buf[i] == next_r++);
+		got += rc;
+	}
+	ASSERT(got == 8000);
+
+	/* End of data, and a closed output */
+	Close(p1.write);
+	ASSERT(Splice(p1.read, p2.write, 10)==0);
+	Close(p1.read);
+	Close(p2.read);
+	ASSERT(Pipe(&p1)==0);
+	ASSERT(Write(p1.write, buf, 10)==10);
+	ASSERT(Splice(p1.read, p2.write, 10)==-1);
+
+	Close(p1.read); Close(p1.write); Close(p2.write);
 	return 0;
 }
 
 
-BOOT_TEST(test_accept_succeds,
-	"Test that accept succeeds on a legal connection"
-	)
+static unsigned int message_size(int i) { return 1 + (i*37) % 500; }
+
+static int message_writer(int argl, void* args)
 {
-	Fid_t lsock = Socket(100);
-	ASSERT(Listen(lsock)==0);
-	Fid_t cli = Socket(NOPORT);
-	Fid_t srv;
-	connect_sockets(cli, lsock, &srv, 100);
+	Fid_t fid = *(Fid_t*)args;
+	char buf[500];
+	for(int i=0; i<2000; i++) {
+		memset(buf, i, message_size(i));
+		ASSERT(Write(fid, buf, message_size(i))==message_size(i));
+	}
+	Close(fid);
 	return 0;
 }
 
-BOOT_TEST(test_accept_fails_on_bad_fid,
-	"Test that Accept fails on an invalid fid"
+BOOT_TEST(test_pipe_nonblocking,
+	"Test that non-blocking pipe ends return WOULD_BLOCK instead of blocking."
 	)
 {
-	ASSERT(Accept(7)==-1);
-	ASSERT(Accept(OpenNull())==-1);
-	ASSERT(Accept(NOFILE)==-1);
-	ASSERT(Accept(MAX_FILEID)==-1);
-	
+	pipe_t pipe, pipe2;
+	char buf[1024];
+
+	ASSERT(SetNonBlocking(MAX_FILEID, 1)==-1);
+	ASSERT(SetNonBlocking(3, 1)==-1);
+
+	ASSERT(PipeEx(&pipe, 1024)==0);
+	ASSERT(Pipe(&pipe2)==0);
+	ASSERT(SetNonBlocking(pipe.read, 1)==0);
+	ASSERT(SetNonBlocking(pipe.write, 1)==0);
+
+	ASSERT(Read(pipe.read, buf, sizeof(buf))==WOULD_BLOCK);
+	ASSERT(Splice(pipe.read, pipe2.write, sizeof(buf))==WOULD_BLOCK);
+	ASSERT(Write(pipe.write, buf, 10)==10);
+	ASSERT(Read(pipe.read, buf, sizeof(buf))==10);
+
+	/* Fill the buffer */
+	int rc, total = 0;
+	while((rc = Write(pipe.write, buf, 100)) > 0) total += rc;
+	ASSERT(rc == WOULD_BLOCK && total == 1024);
+	ASSERT(Read(pipe.read, buf, 100)==100);
+	ASSERT(Write(pipe.write, buf, 1000)==100);
+
+	/* The end of data is reported as in blocking mode */
+	Close(pipe.write);
+	total = 0;
+	while((rc = Read(pipe.read, buf, sizeof(buf))) > 0) total += rc;
+	ASSERT(rc == 0 && total == 1024);
+
+	/* Blocking mode can be restored */
+	ASSERT(SetNonBlocking(pipe2.read, 1)==0);
+	ASSERT(SetNonBlocking(pipe2.read, 0)==0);
+	ASSERT(Write(pipe2.write, buf, 10)==10);
+	ASSERT(Read(pipe2.read, buf, sizeof(buf))==10);
+
+	Close(pipe.read); Close(pipe2.read); Close(pipe2.write);
 	return 0;
 }
 
-BOOT_TEST(test_accept_fails_on_unbound_socket,
-	"Test that Accept fails on an uninitialized socket"
+
+BOOT_TEST(test_pipe_message_mode,
+	"Test that a pipe in message mode preserves the boundaries of the messages written."
 	)
 {
-	ASSERT(Accept(Socket(100))==-1);
+	pipe_t pipe;
+	char buf[2000];
+
+	ASSERT(PipeEx(&pipe, 1024)==0);
+	ASSERT(GetStreamOption(pipe.read, STREAM_MESSAGE)==0);
+	ASSERT(GetStreamOption(pipe.read, STREAM_NEXTMSG)==-1);
+
+	/* The mode changes only on an empty pipe */
+	ASSERT(Write(pipe.write, "abc", 3)==3);
+	ASSERT(SetStreamOption(pipe.write, STREAM_MESSAGE, 1)==-1);
+	ASSERT(Read(pipe.read, buf, 3)==3);
+	ASSERT(SetStreamOption(pipe.write, STREAM_MESSAGE, 2)==-1);
+	ASSERT(SetStreamOption(pipe.write, STREAM_MESSAGE, 1)==0);
+	ASSERT(GetStreamOption(pipe.read, STREAM_MESSAGE)==1);
+	ASSERT(GetStreamOption(pipe.read, STREAM_NEXTMSG)==0);
+
+	/* Each read returns one message, or fails if the buffer is too small */
+	ASSERT(Write(pipe.write, "0123456789", 10)==10);
+	ASSERT(Write(pipe.write, "x", 1)==1);
+	ASSERT(Write(pipe.write, buf, 0)==0);
+	ASSERT(GetStreamOption(pipe.read, STREAM_NEXTMSG)==10);
+	ASSERT(Read(pipe.read, buf, 5)==-1);
+	ASSERT(GetStreamOption(pipe.read, STREAM_NEXTMSG)==10);
+	ASSERT(Read(pipe.read, buf, sizeof(buf))==10);
+	ASSERT(memcmp(buf, "0123456789", 10)==0);
+	ASSERT(Read(pipe.read, buf, sizeof(buf))==1 && buf[0]=='x');
+	ASSERT(GetStreamOption(pipe.read, STREAM_NEXTMSG)==0);
+
+	/* A message must fit in the buffer */
+	ASSERT(Write(pipe.write, buf, 1024)==-1);
+	ASSERT(Write(pipe.write, buf, 1024-sizeof(unsigned int))==1024-sizeof(unsigned int));
+	ASSERT(Read(pipe.read, buf, sizeof(buf))==1024-sizeof(unsigned int));
+
+	/* Concurrent traffic, wrapping around the buffer */
+	Tid_t t = CreateThread(message_writer, sizeof(Fid_t), &pipe.write);
+	int rc, i = 0;
+	while((rc = Read(pipe.read, buf, sizeof(buf))) > 0) {
+		ASSERT(rc == message_size(i));
+		for(int j=0; j<rc; j++) ASSERT(buf[j] == (char) i);
+		i++;
+	}
+	ASSERT(rc == 0 && i == 2000);
+
+	ThreadJoin(t, NULL);
+	Close(pipe.read);
 	return 0;
 }
 
-BOOT_TEST(test_accept_fails_on_connected_socket,
-	"Test that Accept fails on a connected socket"
-	)
+
+static int poll_writer(int argl, void* args)
 {
-	Fid_t lsock = Socket(100);
-	ASSERT(Listen(lsock)==0);
-	Fid_t cli = Socket(NOPORT);
-	Fid_t srv;
-	connect_sockets(cli, lsock, &srv, 100);
-	ASSERT(Accept(srv)==-1);		
+	Fid_t fid = *(Fid_t*)args;
+	ASSERT(Write(fid, "x", 1)==1);
 	return 0;
 }
 
-BOOT_TEST(test_accept_reusable,
-	"Test that Accept can be called on the same socket many times to create different connections."
+BOOT_TEST(test_pipe_poll,
+	"Test that Poll reports the readiness of pipe ends, and waits for it."
 	)
 {
-	Fid_t lsock = Socket(100);
-	ASSERT(lsock!=NOFILE);
+	pipe_t pipe;
+	char buf[1024];
+
+	ASSERT(PipeEx(&pipe, 1024)==0);
+	ASSERT(Poll(NULL, 0, 0)==-1);
+
+	pollfd fds[3] = {
+		{ .fd = pipe.read, .events = POLL_READABLE },
+		{ .fd = pipe.write, .events = POLL_WRITABLE },
+		{ .fd = NOFILE, .events = POLL_READABLE }
+	};
+
+	/* Only the write end is ready */
+	ASSERT(Poll(fds, 3, 0)==1);
+	ASSERT(fds[0].revents==0 && fds[1].revents==POLL_WRITABLE && fds[2].revents==0);
+	ASSERT(Poll(fds, 1, 20)==0);
+
+	/* On a full buffer, only the read end is ready */
+	ASSERT(Write(pipe.write, buf, 1024)==1024);
+	ASSERT(Poll(fds, 3, 0)==1);
+	ASSERT(fds[0].revents==POLL_READABLE && fds[1].revents==0);
+	ASSERT(Read(pipe.read, buf, 1024)==1024);
+
+	/* A write by another thread wakes up the poller */
+	Tid_t t = CreateThread(poll_writer, sizeof(Fid_t), &pipe.write);
+	ASSERT(Poll(fds, 1, POLL_FOREVER)==1);
+	ASSERT(fds[0].revents==POLL_READABLE);
+	ASSERT(Read(pipe.read, buf, 1024)==1);
+	ThreadJoin(t, NULL);
+
+	/* Closing the write end is a hangup, and closed fids are invalid */
+	Close(pipe.write);
+	ASSERT(Poll(fds, 2, POLL_FOREVER)==2);
+	ASSERT(fds[0].revents==(POLL_READABLE|POLL_HANGUP) && fds[1].revents==POLL_INVALID);
+	ASSERT(Read(pipe.read, buf, 1024)==0);
+
+	Close(pipe.read);
+	return 0;
+}
+
+
+/* Poll a stream that stays silent until it hangs up */
+static int many_poller(int argl, void* args)
+{
+	pollfd p = { .fd = *(Fid_t*)args, .events = POLL_READABLE };
+	ASSERT(Poll(&p, 1, POLL_FOREVER)==1);
+	ASSERT(p.revents & POLL_HANGUP);
+	return 0;
+}
+
+/* Echo bytes from one pipe to another, until the end of data */
+static int poll_echo(int argl, void* args)
+{
+	Fid_t* fid = (Fid_t*)args;
+	char c;
+	while(Read(fid[0], &c, 1)==1)
+		ASSERT(Write(fid[1], &c, 1)==1);
+	Close(fid[1]);
+	return 0;
+}
+
+BOOT_TEST(test_poll_many_pollers,
+	"Test that the events of a stream wake up only its own pollers, and "
+	"that many pollers cannot starve a thread that is preempted while it wakes them up."
+	)
+{
+#define POLLERS 16
+#define ROUNDS 2000
+	pipe_t silent, ping, pong;
+	Tid_t t[POLLERS];
+
+	ASSERT(Pipe(&silent)==0);
+	ASSERT(Pipe(&ping)==0);
+	ASSERT(Pipe(&pong)==0);
+	for(int i=0; i<POLLERS; i++)
+		t[i] = CreateThread(many_poller, sizeof(Fid_t), &silent.read);
+
+	/* Every blocked read of the ping-pong ends in a wakeup */
+	Fid_t echo[2] = { ping.read, pong.write };
+	Tid_t e = CreateThread(poll_echo, sizeof(echo), echo);
+	char c;
+	schedinfo before, after;
+	get_schedinfo(&before);
+	for(int i=0; i<ROUNDS; i++) {
+		ASSERT(Write(ping.write, "x", 1)==1);
+		ASSERT(Read(pong.read, &c, 1)==1 && c=='x');
+	}
+	get_schedinfo(&after);
+
+	/* A round switches between us and the echo thread; the pollers sleep on */
+	ASSERT(after.switches - before.switches < 4*ROUNDS);
+	Close(ping.write);
+	ASSERT(ThreadJoin(e, NULL)==0);
+	ASSERT(Read(pong.read, &c, 1)==0);
+
+	Close(silent.write);
+	for(int i=0; i<POLLERS; i++)
+		ASSERT(ThreadJoin(t[i], NULL)==0);
+
+	Close(silent.read);
+	Close(ping.read);
+	Close(pong.read);
+	return 0;
+#undef POLLERS
+#undef ROUNDS
+}
+
+
+/* Poll a stream until its fid is closed under us */
+static int close_poller(int argl, void* args)
+{
+	pollfd p = { .fd = *(Fid_t*)args, .events = POLL_READABLE };
+	ASSERT(Poll(&p, 1, POLL_FOREVER)==1);
+	ASSERT(p.revents==POLL_INVALID);
+	return 0;
+}
+
+BOOT_TEST(test_poll_close_wakeup,
+	"Test that closing a fid wakes up the threads polling it, while its stream stays open at another fid."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+
+	/* The stream stays open at another fid */
+	Fid_t alias = MAX_FILEID-1;
+	ASSERT(Dup2(pipe.read, alias)==0);
+	Tid_t t = CreateThread(close_poller, sizeof(Fid_t), &pipe.read);
+
+	/* Let the poller block */
+	pollfd p = { .fd = pipe.read, .events = POLL_READABLE };
+	ASSERT(Poll(&p, 1, 50)==0);
+
+	ASSERT(Close(pipe.read)==0);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	Close(alias);
+	Close(pipe.write);
+	return 0;
+}
+
+
+BOOT_TEST(test_pipe_vectored_io,
+	"Test that ReadV and WriteV scatter and gather data over segments, on pipes and on streams without vectored methods."
+	)
+{
+	pipe_t pipe;
+	char hdr[4], body[16], buf[32];
+
+	ASSERT(PipeEx(&pipe, 1024)==0);
+
+	iovec_t out[3] = { { "abcd", 4 }, { "", 0 }, { "0123456789", 10 } };
+	iovec_t in[2] = { { hdr, sizeof(hdr) }, { body, sizeof(body) } };
+
+	/* Illegal segment arrays */
+	ASSERT(WriteV(pipe.write, NULL, 1)==-1);
+	ASSERT(WriteV(pipe.write, out, MAX_IOV+1)==-1);
+	ASSERT(WriteV(pipe.read, out, 3)==-1);
+	ASSERT(ReadV(MAX_FILEID, in, 2)==-1);
+
+	/* A byte stream gathers and scatters in order */
+	ASSERT(WriteV(pipe.write, out, 3)==14);
+	ASSERT(ReadV(pipe.read, in, 2)==14);
+	ASSERT(memcmp(hdr, "abcd", 4)==0 && memcmp(body, "0123456789", 10)==0);
+
+	/* In message mode, the segments make one message */
+	ASSERT(SetStreamOption(pipe.write, STREAM_MESSAGE, 1)==0);
+	ASSERT(WriteV(pipe.write, out, 3)==14);
+	ASSERT(Write(pipe.write, "x", 1)==1);
+	ASSERT(GetStreamOption(pipe.read, STREAM_NEXTMSG)==14);
+	in[1].len = 8;
+	ASSERT(ReadV(pipe.read, in, 2)==-1);
+	ASSERT(Read(pipe.read, buf, sizeof(buf))==14);
+	ASSERT(memcmp(buf, "abcd0123456789", 14)==0);
+	ASSERT(ReadV(pipe.read, in, 2)==1 && hdr[0]=='x');
+	in[1].len = sizeof(body);
+
+	/* The null device has no vectored methods */
+	Fid_t null = OpenNull();
+	ASSERT(null!=NOFILE);
+	memset(hdr, 1, sizeof(hdr));
+	memset(body, 1, sizeof(body));
+	ASSERT(ReadV(null, in, 2)==20);
+	for(int i=0; i<4; i++) ASSERT(hdr[i]==0);
+	for(int i=0; i<16; i++) ASSERT(body[i]==0);
+	ASSERT(WriteV(null, out, 3)==14);
+
+	Close(null); Close(pipe.read); Close(pipe.write);
+	return 0;
+}
+
+
+/* Read exactly n bytes, over as many reads as it takes */
+static int read_fully(Fid_t fid, char* buf, unsigned int n)
+{
+	unsigned int got = 0;
+	while(got < n) {
+		int rc = Read(fid, buf+got, n-got);
+		if(rc <= 0) return got;
+		got += rc;
+	}
+	return got;
+}
+
+static int zc_reader_thread(int argl, void* args)
+{
+	char buf[10];
+	ASSERT(read_fully(argl, buf, 10)==10);
+	ASSERT(buf[0]=='A' && buf[9]=='J');
+	return 0;
+}
+
+#define ZC_STREAM_SIZE 200000
+static char zc_stream[ZC_STREAM_SIZE];
+
+/* Send the stream in pieces, alternating writes and zero-copy sends */
+static int zc_mixed_writer(int argl, void* args)
+{
+	Fid_t cq = *(Fid_t*)args;
+	zc_completion comp[COMPLETION_QUEUE_SIZE];
+	unsigned int pos = 0, piece = 1, outstanding = 0;
+
+	for(int i=0; pos < ZC_STREAM_SIZE; i++) {
+		unsigned int n = (ZC_STREAM_SIZE - pos < piece) ? ZC_STREAM_SIZE - pos : piece;
+		if(i % 2) {
+			if(outstanding == COMPLETION_QUEUE_SIZE) {
+				int rc = Read(cq, (char*)comp, sizeof(comp));
+				ASSERT(rc > 0);
+				outstanding -= rc / sizeof(zc_completion);
+			}
+			ASSERT(SendZeroCopy(argl, zc_stream+pos, n, cq, pos)==0);
+			outstanding++;
+			pos += n;
+		} else {
+			int rc = Write(argl, zc_stream+pos, n);
+			ASSERT(rc > 0);
+			pos += rc;
+		}
+		piece = (piece * 7 + 3) % 3000 + 1;
+	}
+	ASSERT(Close(argl)==0);
+	while(outstanding > 0) {
+		int rc = Read(cq, (char*)comp, sizeof(comp));
+		ASSERT(rc > 0);
+		for(int k=0; k < rc/(int)sizeof(zc_completion); k++) ASSERT(comp[k].status==0);
+		outstanding -= rc / sizeof(zc_completion);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_zero_copy_send,
+	"Test that SendZeroCopy sends a loaned buffer in order with the writes, and reports its completion."
+	)
+{
+	pipe_t pipe;
+	char buf[200];
+	char data[100];
+	zc_completion comp[COMPLETION_QUEUE_SIZE];
+	pipeinfo before, after;
+	for(int i=0; i<100; i++) data[i] = 'A' + i%26;
+
+	Fid_t cq = OpenCompletionQueue();
+	ASSERT(cq!=NOFILE);
+	ASSERT(PipeEx(&pipe, 1024)==0);
+
+	/* Errors */
+	ASSERT(SendZeroCopy(pipe.read, data, 4, cq, 0)==-1);
+	ASSERT(SendZeroCopy(pipe.write, data, 4, pipe.read, 0)==-1);
+	ASSERT(SendZeroCopy(pipe.write, NULL, 4, cq, 0)==-1);
+	ASSERT(SendZeroCopy(pipe.write, data, 0, cq, 0)==-1);
+	ASSERT(SendZeroCopy(MAX_FILEID, data, 4, cq, 0)==-1);
+	ASSERT(Read(cq, buf, sizeof(zc_completion)-1)==-1);
+	ASSERT(Write(cq, buf, 1)==-1);
+
+	/* The loan is read in order with the writes, and then it completes */
+	get_pipeinfo(&before);
+	ASSERT(Write(pipe.write, "ab", 2)==2);
+	ASSERT(SendZeroCopy(pipe.write, "CDEF", 4, cq, 7)==0);
+	ASSERT(Write(pipe.write, "gh", 2)==2);
+	get_pipeinfo(&after);
+	ASSERT(after.loaned == before.loaned + 4);
+	ASSERT(SetNonBlocking(cq, 1)==0);
+	ASSERT(Read(cq, (char*)comp, sizeof(comp))==WOULD_BLOCK);
+	pollfd pfd = { .fd = cq, .events = POLL_READABLE };
+	ASSERT(Poll(&pfd, 1, 0)==0);
+	ASSERT(read_fully(pipe.read, buf, 8)==8);
+	ASSERT(memcmp(buf, "abCDEFgh", 8)==0);
+	ASSERT(Poll(&pfd, 1, 0)==1);
+	ASSERT(Read(cq, (char*)comp, sizeof(comp))==sizeof(zc_completion));
+	ASSERT(comp[0].tag==7 && comp[0].len==4 && comp[0].status==0);
+
+	/* A loan read in parts completes after its last byte */
+	ASSERT(SendZeroCopy(pipe.write, data, 100, cq, 8)==0);
+	ASSERT(read_fully(pipe.read, buf, 30)==30);
+	ASSERT(Read(cq, (char*)comp, sizeof(comp))==WOULD_BLOCK);
+	ASSERT(read_fully(pipe.read, buf+30, 70)==70);
+	ASSERT(memcmp(buf, data, 100)==0);
+	ASSERT(Read(cq, (char*)comp, sizeof(comp))==sizeof(zc_completion) && comp[0].tag==8);
+
+	/* A resize keeps the loan in its place */
+	ASSERT(Write(pipe.write, "12", 2)==2);
+	ASSERT(SendZeroCopy(pipe.write, "34", 2, cq, 9)==0);
+	ASSERT(Write(pipe.write, "56", 2)==2);
+	ASSERT(SetStreamOption(pipe.write, STREAM_SNDBUF, 4096)==0);
+	ASSERT(read_fully(pipe.read, buf, 6)==6 && memcmp(buf, "123456", 6)==0);
+	ASSERT(Read(cq, (char*)comp, sizeof(comp))==sizeof(zc_completion) && comp[0].tag==9);
+
+	/* A pipe with loans is not a Splice input, nor can it change its mode */
+	pipe_t other;
+	ASSERT(Pipe(&other)==0);
+	ASSERT(SendZeroCopy(pipe.write, "xy", 2, cq, 10)==0);
+	ASSERT(Splice(pipe.read, other.write, 10)==-1);
+	ASSERT(SetStreamOption(pipe.write, STREAM_MESSAGE, 1)==-1);
+	ASSERT(read_fully(pipe.read, buf, 2)==2 && memcmp(buf, "xy", 2)==0);
+	ASSERT(Read(cq, (char*)comp, sizeof(comp))==sizeof(zc_completion) && comp[0].tag==10);
+	ASSERT(SetStreamOption(other.write, STREAM_MESSAGE, 1)==0);
+	ASSERT(SendZeroCopy(other.write, "xy", 2, cq, 0)==-1);
+	Close(other.read); Close(other.write);
+
+	/* A non-blocking sender does not wait for a place in a full pipe */
+	ASSERT(SetNonBlocking(pipe.write, 1)==0);
+	int sent = 0;
+	while(SendZeroCopy(pipe.write, data, 10, cq, sent)==0) sent++;
+	ASSERT(sent > 0 && sent < COMPLETION_QUEUE_SIZE);
+	ASSERT(SendZeroCopy(pipe.write, data, 10, cq, 0)==WOULD_BLOCK);
+	ASSERT(read_fully(pipe.read, buf, 10*sent)==10*sent);
+	ASSERT(Read(cq, (char*)comp, sizeof(comp))==sent*(int)sizeof(zc_completion));
+	for(int i=0; i<sent; i++) ASSERT(comp[i].tag==(unsigned long)i && comp[i].status==0);
+
+	/* The completion queue bounds the outstanding sends, including the records not read */
+	int outstanding = 0;
+	while(outstanding < COMPLETION_QUEUE_SIZE) {
+		ASSERT(SendZeroCopy(pipe.write, data, 1, cq, outstanding)==0);
+		ASSERT(Read(pipe.read, buf, 1)==1);
+		outstanding++;
+	}
+	ASSERT(SendZeroCopy(pipe.write, data, 1, cq, 0)==-1);
+	ASSERT(Read(cq, (char*)comp, sizeof(comp))==sizeof(comp));
+
+	/* A loan that is never read completes with an error, when the read end closes */
+	ASSERT(SendZeroCopy(pipe.write, data, 10, cq, 11)==0);
+	ASSERT(Close(pipe.read)==0);
+	ASSERT(Read(cq, (char*)comp, sizeof(comp))==sizeof(zc_completion));
+	ASSERT(comp[0].tag==11 && comp[0].status==-1);
+	ASSERT(SendZeroCopy(pipe.write, data, 10, cq, 0)==-1);
+	Close(pipe.write);
+
+	/* A connected socket sends a loan to its peer; a blocked reader is woken */
+	Fid_t sock[2];
+	ASSERT(SocketPair(sock)==0);
+	ASSERT(SetNonBlocking(cq, 0)==0);
+	Tid_t t = CreateThread(zc_reader_thread, sock[1], NULL);
+	ASSERT(SendZeroCopy(sock[0], data, 10, cq, 12)==0);
+	ASSERT(Read(cq, (char*)comp, sizeof(comp))==sizeof(zc_completion));
+	ASSERT(comp[0].tag==12 && comp[0].status==0);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	ASSERT(ShutDown(sock[0], SHUTDOWN_WRITE)==0);
+	ASSERT(SendZeroCopy(sock[0], data, 10, cq, 0)==-1);
+
+	/* Concurrent writes and loans arrive in order */
+	for(int i=0; i<ZC_STREAM_SIZE; i++) zc_stream[i] = i % 251;
+	ASSERT(PipeEx(&pipe, PIPE_AUTO)==0);
+	t = CreateThread(zc_mixed_writer, pipe.write, &cq);
+	unsigned int got = 0;
+	int rc;
+	char rbuf[1500];
+	while((rc = Read(pipe.read, rbuf, 1 + got % sizeof(rbuf))) > 0) {
+		ASSERT(got + rc <= ZC_STREAM_SIZE);
+		ASSERT(memcmp(rbuf, zc_stream+got, rc)==0);
+		got += rc;
+	}
+	ASSERT(rc==0 && got==ZC_STREAM_SIZE);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	Close(pipe.read);
+
+	/* Closing the queue with sends in flight is safe */
+	ASSERT(SendZeroCopy(sock[1], data, 10, cq, 13)==0);
+	ASSERT(Close(cq)==0);
+	ASSERT(read_fully(sock[0], buf, 10)==10);
+	Close(sock[0]); Close(sock[1]);
+	return 0;
+}
+
+
+#define ZC_EXIT_SIZE 3000
+static char zc_exit_buf[ZC_EXIT_SIZE];
+
+/* Send from a buffer in two loans, and exit with the loans outstanding */
+static int zc_exiting_sender(int argl, void* args)
+{
+	Fid_t* fid = (Fid_t*)args;
+	char c;
+	Fid_t cq = OpenCompletionQueue();
+	ASSERT(cq!=NOFILE);
+	ASSERT(Write(fid[0], "head", 4)==4);
+	ASSERT(SendZeroCopy(fid[0], zc_exit_buf, 1000, cq, 1)==0);
+	ASSERT(SendZeroCopy(fid[0], zc_exit_buf+1000, ZC_EXIT_SIZE-1000, cq, 2)==0);
+	ASSERT(Write(fid[0], "tail", 4)==4);
+	ASSERT(Read(fid[1], &c, 1)==1);
+	return 0;
+}
+
+BOOT_TEST(test_zero_copy_sender_exits,
+	"Test that the data of zero-copy sends survives the exit of the sender, "
+	"whose buffers may then be reused."
+	)
+{
+	pipe_t data, sync;
+	static char buf[ZC_EXIT_SIZE+8];
+	pipeinfo before, after;
+	for(int i=0; i<ZC_EXIT_SIZE; i++) zc_exit_buf[i] = 'a' + i%26;
+
+	ASSERT(Pipe(&data)==0);
+	ASSERT(Pipe(&sync)==0);
+	Fid_t fid[2] = { data.write, sync.read };
+	get_pipeinfo(&before);
+	Pid_t pid = Exec(zc_exiting_sender, sizeof(fid), fid);
+	ASSERT(pid!=NOPROC);
+	Close(data.write);
+	Close(sync.read);
+
+	/* Read into the first loan, then let the sender exit */
+	ASSERT(read_fully(data.read, buf, 504)==504);
+	ASSERT(Write(sync.write, "x", 1)==1);
+	ASSERT(WaitChild(pid, NULL)==pid);
+	get_pipeinfo(&after);
+	ASSERT(after.loans_copied == before.loans_copied + 2);
+
+	/* The sender's buffer is reused, but the stream is intact */
+	memset(zc_exit_buf, 0, ZC_EXIT_SIZE);
+	ASSERT(read_fully(data.read, buf+504, ZC_EXIT_SIZE+8-504)==ZC_EXIT_SIZE+8-504);
+	ASSERT(memcmp(buf, "head", 4)==0 && memcmp(buf+4+ZC_EXIT_SIZE, "tail", 4)==0);
+	for(int i=0; i<ZC_EXIT_SIZE; i++) ASSERT(buf[4+i] == 'a' + i%26);
+	ASSERT(Read(data.read, buf, sizeof(buf))==0);
+
+	Close(data.read);
+	Close(sync.write);
+	return 0;
+}
+
+
+TEST_SUITE(pipe_tests,
+	"A suite of tests for pipes. We are focusing on correctness, not performance."
+	)
+{
+	&test_pipe_open,
+	&test_pipe_fails_on_exhausted_fid,
+	&test_pipe_close_reader,
+	&test_pipe_close_writer,
+	&test_pipe_single_producer,
+	&test_pipe_multi_producer,
+	&test_pipe_data_wraps_around,
+	&test_pipe_concurrent_order,
+	&test_pipe_capacity,
+	&test_pipe_autotune,
+	&test_pipe_buffer_pool,
+	&test_pipe_watermarks,
+	&test_pipe_splice,
+	&test_pipe_message_mode,
+	&test_pipe_nonblocking,
+	&test_pipe_poll,
+	&test_poll_many_pollers,
+	&test_poll_close_wakeup,
+	&test_pipe_vectored_io,
+	&test_zero_copy_send,
+	&test_zero_copy_sender_exits,
+	NULL
+};
+
+
+
+
+/*********************************************
+ *
+ *
+ *
+ *  Socket tests
+ *
+ *
+ *
+ *********************************************/
+
+struct connect_sockets
+{
+	Fid_t sock1, lsock, *sock2;
+	port_t port;
+};
+
+static int connect_sockets_connect_process(int argl, void* args) {
+	struct connect_sockets* A = args;
+	ASSERT(Connect(A->sock1, A->port, 1000)==0);
+	return 0;
+}
+
+void connect_sockets(Fid_t sock1, Fid_t lsock, Fid_t* sock2, port_t port)
+{
+	struct connect_sockets A = { 
+		.sock1=sock1, .lsock=lsock, .sock2=sock2, .port=port
+	};
+
+	/* Spawn a child to connect sock1 to port (where lsock must be listening) */
+	Pid_t pid = Exec(connect_sockets_connect_process, sizeof(A), &A);
+	ASSERT(pid != NOPROC);
+
+	/* accept the child's connection here */
+	*sock2 = Accept(lsock);
+	ASSERT(*sock2 != NOFILE);
+
+	/* Clean up child */
+	ASSERT(WaitChild(pid, NULL)==pid);
+}
+
+
+void check_transfer(Fid_t from, Fid_t to)
+{
+	char buffer[12] = {[0]=0};
+	int rc;
+	ASSERT((rc=Write(from,"Hello world", 12))==12);
+	ASSERT((rc=Read(to, buffer, 12))==12);
+	ASSERT((rc=strcmp("Hello world", buffer))==0);
+}
+
+
+BOOT_TEST(test_socket_constructor_many_per_port,
+	"Test that Socket succeeds opening many sockets on the same port"
+	)
+{
+	for(Fid_t f=0; f<MAX_FILEID; f++) {
+		ASSERT(Socket(100)!=NOFILE);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_socket_constructor_out_of_fids,
+	"Test that the socket constructor fails on running out of Fids"
+	)
+{
+	for(int i=0;i<MAX_FILEID;i++)
+		ASSERT(Socket(100)!=NOFILE);
+	for(int i=0;i<MAX_FILEID;i++)
+		ASSERT(Socket(100)==NOFILE);	
+	return 0;
+}
+
+BOOT_TEST(test_socket_constructor_illegal_port,
+	"Test that the socket constructor fails on illegal port"
+	)
+{
+	ASSERT(Socket(NOPORT)!=NOFILE);
+	ASSERT(Socket(1)!=NOFILE);
+	ASSERT(Socket(MAX_PORT)!=NOFILE);
+
+	ASSERT(Socket(NOPORT-1)==NOFILE);
+	ASSERT(Socket(MAX_PORT+1)==NOFILE);	
+	ASSERT(Socket(MAX_PORT+10)==NOFILE);
+	return 0;	
+}
+
+BOOT_TEST(test_listen_success,
+	"Test that Listen succeeds on an unbound socket"
+	)
+{
+	ASSERT(Listen(Socket(100))==0);
+	return 0;
+}
+
+BOOT_TEST(test_listen_fails_on_bad_fid,
+	"Test that Listen fails on an invalid fid"
+	)
+{
+	ASSERT(Listen(7)==-1);
+	ASSERT(Listen(OpenNull())==-1);
+	ASSERT(Listen(NOFILE)==-1);
+	ASSERT(Listen(MAX_FILEID)==-1);	
+	return 0;
+}
+
+BOOT_TEST(test_listen_fails_on_NOPORT,
+	"Test that Listen fails on a socket defined on NOPORT"
+	)
+{
+	ASSERT(Listen(Socket(NOPORT))==-1);
+	return 0;
+}
+
+BOOT_TEST(test_listen_fails_on_occupied_port,
+	"Test that Listen fails on an occupied port"
+	)
+{
+	Fid_t f = Socket(100);
+	ASSERT(Listen(f)==0);
+	ASSERT(Listen(Socket(100))==-1);
+	Close(f);
+	ASSERT(Listen(Socket(100))==0);	
+	return 0;
+}
+
+static int reuseport_connect_thread(int argl, void* args)
+{
+	ASSERT(Connect(argl, 100, 100000)==0);
+	return 0;
+}
+
+BOOT_TEST(test_listen_reuseport,
+	"Test that listeners with STREAM_REUSEPORT share a port, and split its requests."
+	)
+{
+	Fid_t lsock[3], cli[3], srv;
+
+	for(int i=0; i<3; i++) {
+		lsock[i] = Socket(100);   ASSERT(lsock[i]!=NOFILE);
+		cli[i] = Socket(NOPORT);  ASSERT(cli[i]!=NOFILE);
+	}
+	ASSERT(SetStreamOption(lsock[0], STREAM_REUSEPORT, 2)==-1);
+	ASSERT(SetStreamOption(lsock[0], STREAM_REUSEPORT, 1)==0);
+	ASSERT(SetStreamOption(lsock[1], STREAM_REUSEPORT, 1)==0);
+	ASSERT(GetStreamOption(lsock[0], STREAM_REUSEPORT)==1);
+	ASSERT(GetStreamOption(lsock[2], STREAM_REUSEPORT)==0);
+
+	/* All the listeners of a port must allow sharing it */
+	ASSERT(Listen(lsock[0])==0);
+	ASSERT(Listen(lsock[2])==-1);
+	ASSERT(Listen(lsock[1])==0);
+	ASSERT(SetStreamOption(lsock[1], STREAM_REUSEPORT, 0)==-1);
+
+	/* Two requests go to different listeners */
+	Tid_t t[2];
+	for(int i=0; i<2; i++)
+		t[i] = CreateThread(reuseport_connect_thread, cli[i], NULL);
+	pollfd p[2] = { { lsock[0], POLL_READABLE, 0 }, { lsock[1], POLL_READABLE, 0 } };
+	while(Poll(p, 2, POLL_FOREVER) < 2);
+
+	/* Closing a listener moves its pending request to the other one */
+	Close(lsock[0]);
+	for(int i=0; i<2; i++) {
+		srv = Accept(lsock[1]);
+		ASSERT(srv!=NOFILE);
+		Close(srv);
+	}
+	for(int i=0; i<2; i++)
+		ASSERT(ThreadJoin(t[i], NULL)==0);
+
+	/* The last listener frees the port */
+	Close(lsock[1]);
+	ASSERT(Connect(cli[2], 100, 100)==-1);
+	ASSERT(Listen(lsock[2])==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_listen_backlog_accept_many,
+	"Test that ListenEx refuses requests past the backlog, and that AcceptMany accepts many requests."
+	)
+{
+	Fid_t lsock, cli[4], srv[4];
+	pipe_t idle;
+	Tid_t t[3];
+
+	lsock = Socket(100);  ASSERT(lsock!=NOFILE);
+	for(int i=0; i<4; i++) { cli[i] = Socket(NOPORT); ASSERT(cli[i]!=NOFILE); }
+	ASSERT(ListenEx(lsock, 1)==0);
+	ASSERT(ListenEx(lsock, 1)==-1);
+
+	/* Bad arguments */
+	ASSERT(AcceptMany(lsock, NULL, 4)==-1);
+	ASSERT(AcceptMany(lsock, srv, 0)==-1);
+	ASSERT(AcceptMany(cli[0], srv, 4)==-1);
+	ASSERT(AcceptMany(MAX_FILEID, srv, 4)==-1);
+	ASSERT(SetNonBlocking(lsock, 1)==0);
+	ASSERT(AcceptMany(lsock, srv, 4)==WOULD_BLOCK);
+	ASSERT(SetNonBlocking(lsock, 0)==0);
+
+	/* With a full backlog, Connect fails at once */
+	t[0] = CreateThread(reuseport_connect_thread, cli[0], NULL);
+	pollfd p = { lsock, POLL_READABLE, 0 };
+	ASSERT(Poll(&p, 1, POLL_FOREVER)==1);
+	ASSERT(Connect(cli[1], 100, 100000)==-1);
+	ASSERT(AcceptMany(lsock, srv, 4)==1);
+	ASSERT(ThreadJoin(t[0], NULL)==0);
+	check_transfer(cli[0], srv[0]);
+	Close(srv[0]);
+
+	/* A batch of requests is accepted by one or more calls */
+	Close(lsock);
+	lsock = Socket(100);  ASSERT(lsock!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+	ASSERT(Pipe(&idle)==0);
+	for(int i=0; i<3; i++)
+		t[i] = CreateThread(reuseport_connect_thread, cli[i+1], NULL);
+	pollfd wait = { idle.read, POLL_READABLE, 0 };
+	Poll(&wait, 1, 50);
+
+	int rc, total = 0;
+	while(total < 3) {
+		ASSERT((rc = AcceptMany(lsock, srv+total, 4))>=1);
+		total += rc;
+		ASSERT(total <= 3);
+	}
+	for(int i=0; i<3; i++) {
+		ASSERT(ThreadJoin(t[i], NULL)==0);
+		check_transfer(srv[i], cli[i+1]);
+	}
+	return 0;
+}
+
+
+BOOT_TEST(test_listen_fails_on_initialized_socket,
+	"Test that Listen fails on a socket that has been previously initialized by Listen"
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);	
+	ASSERT(Listen(lsock)==-1);	
+	Fid_t sock[2];
+	sock[0] = Socket(200);
+	connect_sockets(sock[0], lsock, sock+1, 100);
+	ASSERT(Listen(sock[0])==-1);
+	ASSERT(Listen(sock[1])==-1);
+	return 0;
+}
+
+
+BOOT_TEST(test_accept_succeds,
+	"Test that accept succeeds on a legal connection"
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);
+	Fid_t cli = Socket(NOPORT);
+	Fid_t srv;
+	connect_sockets(cli, lsock, &srv, 100);
+	return 0;
+}
+
+BOOT_TEST(test_accept_fails_on_bad_fid,
+	"Test that Accept fails on an invalid fid"
+	)
+{
+	ASSERT(Accept(7)==-1);
+	ASSERT(Accept(OpenNull())==-1);
+	ASSERT(Accept(NOFILE)==-1);
+	ASSERT(Accept(MAX_FILEID)==-1);
+	
+	return 0;
+}
+
+BOOT_TEST(test_accept_fails_on_unbound_socket,
+	"Test that Accept fails on an uninitialized socket"
+	)
+{
+	ASSERT(Accept(Socket(100))==-1);
+	return 0;
+}
+
+BOOT_TEST(test_accept_fails_on_connected_socket,
+	"Test that Accept fails on a connected socket"
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);
+	Fid_t cli = Socket(NOPORT);
+	Fid_t srv;
+	connect_sockets(cli, lsock, &srv, 100);
+	ASSERT(Accept(srv)==-1);		
+	return 0;
+}
+
+BOOT_TEST(test_accept_reusable,
+	"Test that Accept can be called on the same socket many times to create different connections."
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(lsock!=NOFILE);
 	ASSERT(Listen(lsock)==0);
 	uint n = MAX_FILEID/2 - 1;
 	Fid_t cli[n], srv[n];
@@ -2003,6 +3207,296 @@ BOOT_TEST(test_connect_fails_on_timeout,
 
 
 
+BOOT_TEST(test_socket_pair,
+	"Test that SocketPair makes two connected sockets, without a port."
+	)
+{
+	Fid_t sock[2];
+	ASSERT(SocketPair(NULL)==-1);
+	ASSERT(SocketPair(sock)==0);
+	ASSERT(sock[0]!=NOFILE && sock[1]!=NOFILE && sock[0]!=sock[1]);
+
+	for(uint i=0; i< 1024; i++) {
+		check_transfer(sock[0], sock[1]);
+		check_transfer(sock[1], sock[0]);		
+	}
+
+	/* They are connected, so they cannot listen or connect */
+	ASSERT(Listen(sock[0])==-1);
+	ASSERT(Connect(sock[1], 100, 100)==-1);
+
+	/* Shutdown works as for any connected socket */
+	ASSERT(ShutDown(sock[0], SHUTDOWN_WRITE)==0);
+	char c;
+	ASSERT(Read(sock[1], &c, 1)==0);
+	ASSERT(Close(sock[0])==0);
+	ASSERT(Write(sock[1], "x", 1)==-1);
+	ASSERT(Close(sock[1])==0);
+
+	/* It needs two file ids */
+	for(int i=0;i<MAX_FILEID-1;i++)
+		ASSERT(Socket(NOPORT)!=NOFILE);
+	ASSERT(SocketPair(sock)==-1);
+	ASSERT(Socket(NOPORT)!=NOFILE);
+
+	return 0;
+}
+
+
+/* A worker process, receiving a file over the socket in args, and answering on it */
+static int fid_worker(int argl, void* args)
+{
+	Fid_t ctl = *(Fid_t*)args;
+	Fid_t f = RecvFid(ctl);
+	ASSERT(f!=NOFILE && f!=ctl);
+	ASSERT(Write(f, "ok", 2)==2);
+	return 0;
+}
+
+BOOT_TEST(test_socket_send_fid,
+	"Test that SendFid and RecvFid pass open files over a connected socket, also to another process."
+	)
+{
+	Fid_t sock[2];
+	pipe_t p;
+	char buf[4];
+	ASSERT(SocketPair(sock)==0);
+
+	/* Errors */
+	ASSERT(SendFid(sock[0], sock[0])==-1);
+	ASSERT(SendFid(sock[0], sock[1])==-1);
+	ASSERT(SendFid(sock[0], MAX_FILEID)==-1);
+	ASSERT(SendFid(sock[0], 12)==-1);
+	Fid_t unbound = Socket(NOPORT);
+	ASSERT(SendFid(unbound, sock[0])==-1);
+	ASSERT(RecvFid(unbound)==NOFILE);
+	ASSERT(SetNonBlocking(sock[1], 1)==0);
+	ASSERT(RecvFid(sock[1])==WOULD_BLOCK);
+	ASSERT(SetNonBlocking(sock[1], 0)==0);
+
+	/* A received file is the same stream, and it keeps it open */
+	ASSERT(Pipe(&p)==0);
+	ASSERT(SendFid(sock[0], p.write)==0);
+	ASSERT(Close(p.write)==0);
+	pollfd pfd = { .fd = sock[1], .events = POLL_READABLE };
+	ASSERT(Poll(&pfd, 1, 0)==1 && (pfd.revents & POLL_READABLE));
+	Fid_t w = RecvFid(sock[1]);
+	ASSERT(w!=NOFILE);
+	ASSERT(Write(w, "hi", 2)==2);
+	ASSERT(Read(p.read, buf, 2)==2 && memcmp(buf, "hi", 2)==0);
+	ASSERT(Close(w)==0);
+	ASSERT(Read(p.read, buf, 2)==0);
+	ASSERT(Close(p.read)==0);
+
+	/* The queue is bounded */
+	for(int i=0; i<SOCKET_MAX_FIDS; i++)
+		ASSERT(SendFid(sock[0], unbound)==0);
+	ASSERT(SendFid(sock[0], unbound)==-1);
+	for(int i=0; i<SOCKET_MAX_FIDS-4; i++) {
+		Fid_t f = RecvFid(sock[1]);
+		ASSERT(f!=NOFILE);
+		ASSERT(Close(f)==0);
+	}
+
+	/* A file is received by a process that is already running */
+	Pid_t pid = Exec(fid_worker, sizeof(Fid_t), &sock[1]);
+	ASSERT(pid!=NOPROC);
+	ASSERT(Pipe(&p)==0);
+	for(int i=0; i<4; i++) {
+		Fid_t f = RecvFid(sock[1]);
+		ASSERT(f!=NOFILE);
+		ASSERT(Close(f)==0);
+	}
+	ASSERT(SendFid(sock[0], p.write)==0);
+	ASSERT(Close(p.write)==0);
+	ASSERT(Read(p.read, buf, 2)==2 && memcmp(buf, "ok", 2)==0);
+	ASSERT(WaitChild(pid, NULL)==pid);
+	ASSERT(Read(p.read, buf, 2)==0);
+	ASSERT(Close(p.read)==0);
+
+	/* Files that are never received are closed with the socket */
+	ASSERT(Pipe(&p)==0);
+	ASSERT(SendFid(sock[0], p.write)==0);
+	ASSERT(Close(p.write)==0);
+	ASSERT(Close(sock[1])==0);
+	ASSERT(Read(p.read, buf, 2)==0);
+
+	/* With the peer closed, nothing more can be received */
+	ASSERT(SendFid(sock[0], p.read)==-1);
+	ASSERT(RecvFid(sock[0])==NOFILE);
+	ASSERT(Close(sock[0])==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_socket_send_fid_cycle,
+	"Test that SendFid refuses a socket with files queued at it, so that sockets cannot keep each other open."
+	)
+{
+	Fid_t a[2], b[2], c[2];
+	slabinfo before, after;
+
+	ASSERT(SocketPair(a)==0);
+	ASSERT(SocketPair(b)==0);
+	ASSERT(SocketPair(c)==0);
+	ASSERT(get_slabinfo("socket", &before));
+
+	/* Each end would hold the other */
+	ASSERT(SendFid(a[0], b[1])==0);
+	ASSERT(SendFid(b[0], a[1])==-1);
+
+	/* A longer cycle */
+	ASSERT(SendFid(b[0], c[1])==0);
+	ASSERT(SendFid(c[0], a[1])==-1);
+	ASSERT(SendFid(c[0], b[1])==-1);
+
+	/* Once its files are received, a socket can be sent */
+	Fid_t f = RecvFid(a[1]);
+	ASSERT(f!=NOFILE);
+	ASSERT(SendFid(c[0], a[1])==0);
+	ASSERT(Close(f)==0);
+
+	/* Closing all the fids frees all the sockets */
+	for(int i=0; i<2; i++) {
+		ASSERT(Close(a[i])==0);
+		ASSERT(Close(b[i])==0);
+		ASSERT(Close(c[i])==0);
+	}
+	ASSERT(get_slabinfo("socket", &after));
+	ASSERT(after.inuse == before.inuse-6);
+	return 0;
+}
+
+
+/* Find the record of a stream, by kind and id; id 0 finds the latest stream of the kind */
+static int get_streaminfo(streaminfo_kind kind, unsigned long id, streaminfo* si)
+{
+	Fid_t fid = OpenKernelStats(KSTAT_STREAMS);
+	ASSERT(fid!=NOFILE);
+	streaminfo rec;
+	int found = 0;
+	while(Read(fid, (char*)&rec, sizeof(rec))==sizeof(rec))
+		if(rec.kind==kind && (id ? rec.id==id : (!found || rec.id > si->id))) {
+			*si = rec;
+			found = 1;
+		}
+	Close(fid);
+	return found;
+}
+
+static int stats_reader_thread(int argl, void* args)
+{
+	char buf[10];
+	ASSERT(Read(argl, buf, 10)==10);
+	return 0;
+}
+
+BOOT_TEST(test_stream_statistics,
+	"Test that the KSTAT_STREAMS records count the traffic and the waits of pipes and sockets."
+	)
+{
+	streaminfo a, b, si;
+	char buf[300];
+	memset(buf, 'x', sizeof(buf));
+
+	/* A pipe counts the calls that move data, and its fill level */
+	pipe_t p;
+	ASSERT(PipeEx(&p, 4096)==0);
+	ASSERT(get_streaminfo(STREAMINFO_PIPE, 0, &si));
+	unsigned long pid = si.id;
+	ASSERT(si.bytes_written==0 && si.reads==0 && si.rcvbuf==4096 && si.port==NOPORT);
+	ASSERT(Write(p.write, buf, 100)==100);
+	ASSERT(Write(p.write, buf, 200)==200);
+	ASSERT(Read(p.read, buf, 50)==50);
+	ASSERT(get_streaminfo(STREAMINFO_PIPE, pid, &si));
+	ASSERT(si.bytes_written==300 && si.writes==2);
+	ASSERT(si.bytes_read==50 && si.reads==1);
+	ASSERT(si.rxqueued==250);
+	ASSERT(si.read_wait_ns==0 && si.write_wait_ns==0);
+
+	/* A blocked reader counts its wait */
+	ASSERT(Read(p.read, buf, 250)==250);
+	Tid_t t = CreateThread(stats_reader_thread, p.read, NULL);
+	sleep_thread(1);
+	ASSERT(Write(p.write, buf, 10)==10);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	ASSERT(get_streaminfo(STREAMINFO_PIPE, pid, &si));
+	ASSERT(si.read_wait_ns > 0 && si.reads==3);
+	ASSERT(Close(p.read)==0 && Close(p.write)==0);
+	ASSERT(! get_streaminfo(STREAMINFO_PIPE, pid, &si));
+
+	/* Connected sockets count what they send and receive */
+	Fid_t sock[2];
+	ASSERT(SocketPair(sock)==0);
+	ASSERT(get_streaminfo(STREAMINFO_PEER, 0, &a));
+	ASSERT(get_streaminfo(STREAMINFO_PEER, a.peer, &b));
+	ASSERT(b.peer==a.id);
+	ASSERT(Write(sock[0], buf, 100)==100);
+	ASSERT(Write(sock[1], buf, 30)==30);
+	ASSERT(get_streaminfo(STREAMINFO_PEER, a.id, &a));
+	ASSERT(get_streaminfo(STREAMINFO_PEER, b.id, &b));
+	if(a.bytes_written != 100) { si = a; a = b; b = si; }
+	ASSERT(a.bytes_written==100 && a.writes==1 && a.txqueued==100 && a.rxqueued==30);
+	ASSERT(b.bytes_written==30 && b.writes==1 && b.txqueued==30 && b.rxqueued==100);
+	ASSERT(Read(sock[1], buf, 100)==100);
+	ASSERT(get_streaminfo(STREAMINFO_PEER, b.id, &b));
+	ASSERT(b.bytes_read==100 && b.reads==1 && b.rxqueued==0);
+	ASSERT(Close(sock[0])==0 && Close(sock[1])==0);
+	ASSERT(! get_streaminfo(STREAMINFO_PEER, a.id, &a));
+
+	/* A listener reports its accept queue */
+	Fid_t lsock = Socket(100);
+	ASSERT(ListenEx(lsock, 4)==0);
+	ASSERT(get_streaminfo(STREAMINFO_LISTENER, 0, &si));
+	ASSERT(si.port==100 && si.pending==0 && si.backlog==4);
+	Fid_t cli = Socket(NOPORT);
+	t = CreateThread(reuseport_connect_thread, cli, NULL);
+	pollfd pfd = { .fd = lsock, .events = POLL_READABLE };
+	ASSERT(Poll(&pfd, 1, POLL_FOREVER)==1);
+	ASSERT(get_streaminfo(STREAMINFO_LISTENER, si.id, &si));
+	ASSERT(si.pending==1);
+	Fid_t srv = Accept(lsock);
+	ASSERT(srv!=NOFILE);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	ASSERT(get_streaminfo(STREAMINFO_LISTENER, si.id, &si));
+	ASSERT(si.pending==0);
+
+	Close(srv);
+	Close(cli);
+	Close(lsock);
+	return 0;
+}
+
+
+BOOT_TEST(test_socket_slab_caches,
+	"Test that sockets and their pipes come from slab caches with per-core lists."
+	)
+{
+	slabinfo sock_before, sock_after, pipe_before, pipe_after;
+	Fid_t sock[2];
+
+	/* Make sure that the caches are in use */
+	ASSERT(SocketPair(sock)==0);
+	ASSERT(Close(sock[0])==0 && Close(sock[1])==0);
+
+	ASSERT(get_slabinfo("socket", &sock_before));
+	ASSERT(get_slabinfo("pipe", &pipe_before));
+	ASSERT(SocketPair(sock)==0);
+	ASSERT(get_slabinfo("socket", &sock_after));
+	ASSERT(get_slabinfo("pipe", &pipe_after));
+
+	ASSERT(sock_after.allocs == sock_before.allocs+2);
+	ASSERT(sock_after.inuse == sock_before.inuse+2);
+	ASSERT(pipe_after.allocs == pipe_before.allocs+2);
+	ASSERT(pipe_after.inuse == pipe_before.inuse+2);
+	ASSERT(sock_after.cached <= sock_after.slabs*sock_after.perslab);
+	ASSERT(sock_after.inuse + sock_after.cached <= sock_after.slabs*sock_after.perslab);
+
+	ASSERT(Close(sock[0])==0 && Close(sock[1])==0);
+	return 0;
+}
+
+
 BOOT_TEST(test_socket_small_transfer,
 	"Open a socket and put just a little data in it, in both directions, for many times."
 	)
@@ -2026,6 +3520,132 @@ BOOT_TEST(test_socket_small_transfer,
 }
 
 
+BOOT_TEST(test_socket_buffer_options,
+	"Test that the buffer capacities of a connected socket can be set."
+	)
+{
+	Fid_t sock[2], lsock;
+
+	lsock = Socket(100);   ASSERT(lsock!=NOFILE);
+	sock[0] = Socket(NOPORT); ASSERT(sock[0]!=NOFILE);
+	ASSERT(GetStreamOption(sock[0], STREAM_SNDBUF)==-1);
+
+	ASSERT(Listen(lsock)==0);
+	ASSERT(SetStreamOption(lsock, STREAM_RCVBUF, 4096)==-1);
+
+	connect_sockets(sock[0], lsock, sock+1, 100);
+	ASSERT(GetStreamOption(sock[0], STREAM_SNDBUF) > 0);
+
+	/* The send buffer of one peer is the receive buffer of the other */
+	ASSERT(SetStreamOption(sock[0], STREAM_SNDBUF, 32768)==0);
+	ASSERT(GetStreamOption(sock[1], STREAM_RCVBUF)==32768);
+	ASSERT(SetStreamOption(sock[1], STREAM_SNDBUF, 2048)==0);
+	ASSERT(GetStreamOption(sock[0], STREAM_RCVBUF)==2048);
+	ASSERT(GetStreamOption(sock[0], STREAM_SNDBUF)==32768);
+
+	check_transfer(sock[0], sock[1]);
+	check_transfer(sock[1], sock[0]);
+
+	return 0;
+}
+
+
+BOOT_TEST(test_socket_nonblocking,
+	"Test that non-blocking sockets return WOULD_BLOCK on Accept and Read."
+	)
+{
+	Fid_t sock[2], lsock;
+	char buf[16];
+
+	lsock = Socket(100);   ASSERT(lsock!=NOFILE);
+	sock[0] = Socket(NOPORT); ASSERT(sock[0]!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+
+	ASSERT(SetNonBlocking(lsock, 1)==0);
+	ASSERT(Accept(lsock)==WOULD_BLOCK);
+	ASSERT(SetNonBlocking(lsock, 0)==0);
+	connect_sockets(sock[0], lsock, sock+1, 100);
+
+	ASSERT(SetNonBlocking(sock[1], 1)==0);
+	ASSERT(Read(sock[1], buf, sizeof(buf))==WOULD_BLOCK);
+	check_transfer(sock[0], sock[1]);
+	check_transfer(sock[1], sock[0]);
+	ASSERT(Read(sock[1], buf, sizeof(buf))==WOULD_BLOCK);
+
+	ASSERT(ShutDown(sock[0], SHUTDOWN_WRITE)==0);
+	ASSERT(Read(sock[1], buf, sizeof(buf))==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_socket_message_mode,
+	"Test that message mode applies to both directions of a connection."
+	)
+{
+	Fid_t sock[2], lsock;
+	char buf[64];
+
+	lsock = Socket(100);   ASSERT(lsock!=NOFILE);
+	sock[0] = Socket(NOPORT); ASSERT(sock[0]!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+	ASSERT(SetStreamOption(lsock, STREAM_MESSAGE, 1)==-1);
+	connect_sockets(sock[0], lsock, sock+1, 100);
+
+	ASSERT(SetStreamOption(sock[0], STREAM_MESSAGE, 1)==0);
+	ASSERT(GetStreamOption(sock[1], STREAM_MESSAGE)==1);
+
+	for(int k=0; k<2; k++) {
+		ASSERT(Write(sock[k], "Hello", 5)==5);
+		ASSERT(Write(sock[k], "world", 5)==5);
+		ASSERT(GetStreamOption(sock[1-k], STREAM_NEXTMSG)==5);
+		ASSERT(Read(sock[1-k], buf, sizeof(buf))==5 && memcmp(buf, "Hello", 5)==0);
+		ASSERT(Read(sock[1-k], buf, sizeof(buf))==5 && memcmp(buf, "world", 5)==0);
+	}
+	return 0;
+}
+
+
+static int sequence_reader(int argl, void* args)
+{
+	Fid_t fid = *(Fid_t*)args;
+	char buf[777];
+	unsigned char next = 0;
+	int rc;
+	while((rc = Read(fid, buf, sizeof(buf))) > 0)
+		for(int i=0; i<rc; i++)
+			ASSERT((unsigned char)buf[i] == next++);
+	ASSERT(rc == 0);
+	return 0;
+}
+
+BOOT_TEST(test_socket_splice_relay,
+	"Test that Splice relays a stream from one connection to another."
+	)
+{
+	Fid_t sock[4], lsock;
+
+	lsock = Socket(100);   ASSERT(lsock!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+	sock[0] = Socket(NOPORT); ASSERT(sock[0]!=NOFILE);
+	connect_sockets(sock[0], lsock, sock+1, 100);
+	sock[2] = Socket(NOPORT); ASSERT(sock[2]!=NOFILE);
+	connect_sockets(sock[2], lsock, sock+3, 100);
+
+	/* sock[0] -> sock[1] -> relay -> sock[2] -> sock[3] */
+	Tid_t w = CreateThread(sequence_writer, sizeof(Fid_t), &sock[0]);
+	Tid_t r = CreateThread(sequence_reader, sizeof(Fid_t), &sock[3]);
+
+	int rc;
+	while((rc = Splice(sock[1], sock[2], 100000)) > 0);
+	ASSERT(rc == 0);
+	ASSERT(ShutDown(sock[2], SHUTDOWN_WRITE)==0);
+
+	ThreadJoin(w, NULL);
+	ThreadJoin(r, NULL);
+	return 0;
+}
+
+
 BOOT_TEST(test_socket_single_producer,
 	"Test blocking in the socket by a single producer single consumer sending 10Mbytes of data."
 	)
@@ -2188,6 +3808,267 @@ BOOT_TEST(test_shudown_write,
 }
 
 
+BOOT_TEST(test_io_after_shutdown,
+	"Test that a socket fails I/O in the directions it has shut down, after "
+	"the peer is gone and its pipes have been freed and reused."
+	)
+{
+	shutdown_mode modes[3] = { SHUTDOWN_READ, SHUTDOWN_WRITE, SHUTDOWN_BOTH };
+	char buf[16];
+	iovec_t iov = { buf, sizeof(buf) };
+
+	for(int m=0; m<3; m++) {
+		Fid_t sock[2], other[2];
+		ASSERT(SocketPair(sock)==0);
+		ASSERT(ShutDown(sock[0], modes[m])==0);
+		ASSERT(ShutDown(sock[0], modes[m])==0);
+
+		/* Free the pipes of the pair, and let new traffic take them over */
+		ASSERT(Close(sock[1])==0);
+		for(int i=0; i<8; i++) {
+			ASSERT(SocketPair(other)==0);
+			ASSERT(Write(other[1], "secret", 6)==6);
+			ASSERT(Write(other[0], "secret", 6)==6);
+			if(i < 7) { Close(other[0]); Close(other[1]); }
+		}
+
+		pollfd p = { .fd = sock[0], .events = POLL_READABLE|POLL_WRITABLE };
+		ASSERT(Poll(&p, 1, 0)==1);
+		if(modes[m] & SHUTDOWN_READ) {
+			ASSERT(Read(sock[0], buf, sizeof(buf))==-1);
+			ASSERT(ReadV(sock[0], &iov, 1)==-1);
+			ASSERT(GetStreamOption(sock[0], STREAM_RCVBUF)==-1);
+			ASSERT(!(p.revents & POLL_READABLE));
+		}
+		if(modes[m] & SHUTDOWN_WRITE) {
+			ASSERT(Write(sock[0], "x", 1)==-1);
+			ASSERT(WriteV(sock[0], &iov, 1)==-1);
+			ASSERT(GetStreamOption(sock[0], STREAM_SNDBUF)==-1);
+			ASSERT(SetStreamOption(sock[0], STREAM_SNDBUF, 4096)==-1);
+			ASSERT(!(p.revents & POLL_WRITABLE));
+		}
+		ASSERT(p.revents & POLL_HANGUP);
+		ASSERT(SetStreamOption(sock[0], STREAM_MESSAGE, 1)==-1);
+
+		/* The new pair is untouched */
+		ASSERT(Read(other[0], buf, sizeof(buf))==6 && memcmp(buf, "secret", 6)==0);
+		ASSERT(Read(other[1], buf, sizeof(buf))==6 && memcmp(buf, "secret", 6)==0);
+		Close(other[0]); Close(other[1]);
+		Close(sock[0]);
+	}
+	return 0;
+}
+
+
+
+
+BOOT_TEST(test_socket_poll_set,
+	"Test that a poll set reports pending connections, data and hangups on sockets."
+	)
+{
+	Fid_t sock[2], lsock, pset;
+	pollfd ready[4];
+	char buf[16];
+
+	lsock = Socket(100);   ASSERT(lsock!=NOFILE);
+	sock[0] = Socket(NOPORT); ASSERT(sock[0]!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+
+	pset = OpenPollSet();  ASSERT(pset!=NOFILE);
+	ASSERT(PollSetControl(lsock, sock[0], POLL_READABLE)==-1);
+	ASSERT(PollSetControl(pset, pset, POLL_READABLE)==-1);
+	ASSERT(PollSetControl(pset, MAX_FILEID-1, POLL_READABLE)==-1);
+	ASSERT(PollSetWait(pset, NULL, 4, 0)==-1);
+	ASSERT(PollSetControl(pset, lsock, POLL_READABLE)==0);
+	ASSERT(PollSetWait(pset, ready, 4, 0)==0);
+
+	/* A connection request wakes up the poller */
+	struct connect_sockets A = { .sock1=sock[0], .port=100 };
+	Pid_t pid = Exec(connect_sockets_connect_process, sizeof(A), &A);
+	ASSERT(pid != NOPROC);
+	ASSERT(PollSetWait(pset, ready, 4, POLL_FOREVER)==1);
+	ASSERT(ready[0].fd==lsock && ready[0].revents==POLL_READABLE);
+	sock[1] = Accept(lsock);
+	ASSERT(sock[1]!=NOFILE);
+	ASSERT(WaitChild(pid, NULL)==pid);
+	ASSERT(PollSetWait(pset, ready, 4, 0)==0);
+
+	/* Data and free space */
+	ASSERT(PollSetControl(pset, sock[1], POLL_READABLE)==0);
+	ASSERT(PollSetWait(pset, ready, 4, 0)==0);
+	ASSERT(Write(sock[0], "Hello", 5)==5);
+	ASSERT(PollSetWait(pset, ready, 4, 0)==1);
+	ASSERT(ready[0].fd==sock[1] && ready[0].revents==POLL_READABLE);
+	ASSERT(Read(sock[1], buf, sizeof(buf))==5);
+	ASSERT(PollSetControl(pset, sock[1], POLL_READABLE|POLL_WRITABLE)==0);
+	ASSERT(PollSetWait(pset, ready, 4, 0)==1);
+	ASSERT(ready[0].fd==sock[1] && ready[0].revents==POLL_WRITABLE);
+
+	/* Removal */
+	ASSERT(PollSetControl(pset, sock[1], 0)==0);
+	ASSERT(PollSetWait(pset, ready, 4, 0)==0);
+
+	/* The poll set can itself be polled */
+	pollfd p = { .fd = pset, .events = POLL_READABLE };
+	ASSERT(Poll(&p, 1, 0)==0);
+
+	/* Closing the peer is a hangup */
+	ASSERT(PollSetControl(pset, sock[1], POLL_READABLE)==0);
+	Close(sock[0]);
+	ASSERT(Poll(&p, 1, 0)==1 && p.revents==POLL_READABLE);
+	ASSERT(PollSetWait(pset, ready, 4, 0)==1);
+	ASSERT(ready[0].fd==sock[1] && ready[0].revents==(POLL_READABLE|POLL_HANGUP));
+
+	/* A closed stream leaves the set, and a later stream at its fid is not watched */
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+	ASSERT(Dup2(pipe.read, sock[1])==0);
+	ASSERT(Close(pipe.read)==0);
+	ASSERT(Write(pipe.write, "x", 1)==1);
+	ASSERT(PollSetWait(pset, ready, 4, 0)==0);
+	Close(sock[1]);
+	Close(pipe.write);
+	ASSERT(Close(pset)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_dgram_socket,
+	"Test that datagram sockets receive messages from any socket, with the port of the sender."
+	)
+{
+	char buf[DGRAM_MAX_MESSAGE+1];
+	port_t from;
+
+	Fid_t rcv = Socket(200);  ASSERT(rcv!=NOFILE);
+	ASSERT(Bind(rcv, DGRAM_MAX_QUEUE+1, DGRAM_BLOCK)==-1);
+	ASSERT(Bind(rcv, 0, 5)==-1);
+	ASSERT(Bind(rcv, 0, DGRAM_BLOCK)==0);
+	ASSERT(Bind(rcv, 0, DGRAM_BLOCK)==-1);
+
+	/* One datagram socket per port; a listener may share it */
+	Fid_t other = Socket(200);
+	ASSERT(Bind(other, 0, DGRAM_BLOCK)==-1);
+	ASSERT(Listen(other)==0);
+	ASSERT(Bind(Socket(NOPORT), 0, DGRAM_BLOCK)==-1);
+
+	/* Not a connection-oriented socket */
+	ASSERT(Listen(rcv)==-1);
+	ASSERT(Connect(rcv, 200, 100)==-1);
+	ASSERT(ShutDown(rcv, SHUTDOWN_BOTH)==-1);
+	ASSERT(Write(rcv, "x", 1)==-1);
+
+	Fid_t s1 = Socket(NOPORT);
+	Fid_t s2 = Socket(7);
+	ASSERT(SendTo(s1, 200, "hello", 5)==5);
+	ASSERT(SendTo(s2, 200, "world!", 6)==6);
+	ASSERT(SendTo(rcv, 200, "", 0)==0);
+	ASSERT(SendTo(s1, 201, "hello", 5)==-1);
+	ASSERT(SendTo(s1, NOPORT, "hello", 5)==-1);
+	ASSERT(SendTo(s1, 200, buf, DGRAM_MAX_MESSAGE+1)==-1);
+	ASSERT(SendTo(other, 200, "hello", 5)==-1);
+
+	/* In order; a short buffer truncates the message */
+	ASSERT(RecvFrom(rcv, buf, sizeof(buf), &from)==5);
+	ASSERT(memcmp(buf, "hello", 5)==0 && from==NOPORT);
+	ASSERT(RecvFrom(rcv, buf, 3, &from)==3);
+	ASSERT(memcmp(buf, "wor", 3)==0 && from==7);
+	ASSERT(RecvFrom(rcv, buf, sizeof(buf), &from)==0 && from==200);
+	ASSERT(RecvFrom(s1, buf, sizeof(buf), &from)==-1);
+
+	/* Read takes a message too */
+	pollfd p = { .fd=rcv, .events=POLL_READABLE };
+	ASSERT(Poll(&p, 1, 0)==0);
+	ASSERT(SendTo(s1, 200, "again", 5)==5);
+	ASSERT(Poll(&p, 1, 0)==1 && p.revents==POLL_READABLE);
+	ASSERT(Read(rcv, buf, sizeof(buf))==5);
+
+	ASSERT(SetNonBlocking(rcv, 1)==0);
+	ASSERT(RecvFrom(rcv, buf, sizeof(buf), NULL)==WOULD_BLOCK);
+	ASSERT(Read(rcv, buf, sizeof(buf))==WOULD_BLOCK);
+
+	/* Closing frees the port */
+	ASSERT(Close(rcv)==0);
+	ASSERT(SendTo(s1, 200, "hello", 5)==-1);
+	rcv = Socket(200);
+	ASSERT(Bind(rcv, 0, DGRAM_DROP)==0);
+	ASSERT(SendTo(s1, 200, "hello", 5)==5);
+
+	return 0;
+}
+
+
+static int dgram_sender_thread(int argl, void* args)
+{
+	Fid_t sock = *(Fid_t*) args;
+	for(int i = 0; i < argl; i++)
+		if(SendTo(sock, 301, (char*) &i, sizeof(i)) != sizeof(i))
+			return -1;
+	return 0;
+}
+
+BOOT_TEST(test_dgram_full_queue,
+	"Test that a full datagram queue drops messages or blocks the senders, as bound."
+	)
+{
+	int msg;
+
+	/* A queue of 3 is rounded up to 4; the rest are dropped */
+	Fid_t drop = Socket(300);
+	Fid_t snd = Socket(NOPORT);
+	ASSERT(Bind(drop, 3, DGRAM_DROP)==0);
+	ASSERT(GetStreamOption(snd, STREAM_DROPS)==-1);
+	ASSERT(GetStreamOption(drop, STREAM_DROPS)==0);
+	for(int i = 0; i < 6; i++)
+		ASSERT(SendTo(snd, 300, (char*) &i, sizeof(i))==sizeof(i));
+	ASSERT(GetStreamOption(drop, STREAM_DROPS)==2);
+	ASSERT(SetStreamOption(drop, STREAM_DROPS, 0)==-1);
+	for(int i = 0; i < 4; i++) {
+		ASSERT(RecvFrom(drop, (char*) &msg, sizeof(msg), NULL)==sizeof(msg));
+		ASSERT(msg==i);
+	}
+
+	/* A blocking queue of 1 */
+	Fid_t block = Socket(301);
+	ASSERT(Bind(block, 1, DGRAM_BLOCK)==0);
+	ASSERT(SetNonBlocking(snd, 1)==0);
+	ASSERT(SendTo(snd, 301, "x", 1)==1);
+	ASSERT(SendTo(snd, 301, "x", 1)==WOULD_BLOCK);
+	ASSERT(RecvFrom(block, (char*) &msg, sizeof(msg), NULL)==1);
+	ASSERT(SetNonBlocking(snd, 0)==0);
+
+	Tid_t t = CreateThread(dgram_sender_thread, 100, &snd);
+	for(int i = 0; i < 100; i++) {
+		ASSERT(RecvFrom(block, (char*) &msg, sizeof(msg), NULL)==sizeof(msg));
+		ASSERT(msg==i);
+	}
+	int status;
+	ASSERT(ThreadJoin(t, &status)==0 && status==0);
+	ASSERT(GetStreamOption(block, STREAM_DROPS)==0);
+
+	/* A sender blocked on a full queue fails when the receiver closes */
+	t = CreateThread(dgram_sender_thread, 100, &snd);
+	ASSERT(RecvFrom(block, (char*) &msg, sizeof(msg), NULL)==sizeof(msg));
+	ASSERT(Close(block)==0);
+	ASSERT(ThreadJoin(t, &status)==0 && status==-1);
+
+	/* A blocked sender finishes, even if its own socket is closed meanwhile */
+	block = Socket(301);
+	ASSERT(Bind(block, 1, DGRAM_BLOCK)==0);
+	Fid_t snd2 = Socket(302);
+	t = CreateThread(dgram_sender_thread, 2, &snd2);
+	sleep_thread(1);
+	ASSERT(Close(snd2)==0);
+	port_t from;
+	for(int i = 0; i < 2; i++) {
+		ASSERT(RecvFrom(block, (char*) &msg, sizeof(msg), &from)==sizeof(msg));
+		ASSERT(msg==i && from==302);
+	}
+	ASSERT(ThreadJoin(t, &status)==0 && status==0);
+	ASSERT(Close(block)==0);
+
+	return 0;
+}
 
 
 TEST_SUITE(socket_tests,
@@ -2202,6 +4083,8 @@ TEST_SUITE(socket_tests,
 	&test_listen_fails_on_bad_fid,
 	&test_listen_fails_on_NOPORT,
 	&test_listen_fails_on_occupied_port,
+	&test_listen_reuseport,
+	&test_listen_backlog_accept_many,
 	&test_listen_fails_on_initialized_socket,
 
 	&test_accept_succeds,
@@ -2218,12 +4101,25 @@ TEST_SUITE(socket_tests,
 	&test_connect_fails_on_non_listened_port,
 	&test_connect_fails_on_timeout,
 
+	&test_socket_pair,
+	&test_socket_slab_caches,
+	&test_socket_send_fid,
+	&test_socket_send_fid_cycle,
+	&test_stream_statistics,
 	&test_socket_small_transfer,
+	&test_socket_buffer_options,
+	&test_socket_splice_relay,
+	&test_socket_message_mode,
+	&test_socket_nonblocking,
+	&test_socket_poll_set,
 	&test_socket_single_producer,
 	&test_socket_multi_producer,
+	&test_dgram_socket,
+	&test_dgram_full_queue,
 
 	&test_shudown_read,
 	&test_shudown_write,
+	&test_io_after_shutdown,
 
 	NULL
 };